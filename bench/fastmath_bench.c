@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <ast.h>
+#include <parser.h>
+#include <jit.h>
+
+
+//==============================================================================
+//
+// Definitions
+//
+//==============================================================================
+
+#define ITERATIONS 200
+
+#define ROWS 65536
+
+// Each kernel is defined twice, once as written and once with `def fast`.
+// The series has nothing to fuse, so it shows what the other rules do on
+// their own.
+static const char *kernels[][2] = {
+    {"horner", "(x) ((((((x * 3 - 2) * x + 5) * x - 7) * x + 11) * x - 13) * x + 17) * x - 19"},
+    {"distance", "(x, y) x * x + y * y - 2 * x * y"},
+    {"series", "(n) var s in (for i = 1, n + 1 - i in s = s + 1 / (i * i)) + s"},
+};
+
+
+//==============================================================================
+//
+// Utility
+//
+//==============================================================================
+
+// Returns the current monotonic time in seconds.
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Parses a program and adds its definitions to the lazy JIT.
+int load(kal_jit *jit, const char *source)
+{
+    unsigned int i, count;
+    kal_ast_node **nodes;
+    int rc = kal_parse_program(source, strlen(source), jit->context->arena, &nodes, &count);
+    for(i=0; rc == 0 && i<count; i++) {
+        rc = kal_jit_add(jit, nodes[i]);
+    }
+    free(nodes);
+    return rc;
+}
+
+// Runs a batch function over the rows and returns the seconds per run.
+double run(kal_jit_batch_fn fn, const double *const *columns, size_t rows,
+           double *out)
+{
+    unsigned int i;
+    double t0 = now();
+    for(i=0; i<ITERATIONS; i++) {
+        kal_jit_eval_batch(fn, columns, rows, out);
+    }
+    return (now() - t0) / ITERATIONS;
+}
+
+
+//==============================================================================
+//
+// Benchmark
+//
+//==============================================================================
+
+int main()
+{
+    unsigned int i, j;
+    char source[512], name[64];
+
+    kal_jit *jit = kal_jit_create(KAL_JIT_LAZY);
+    jit->context->opt_level = 3;
+    for(j=0; j<sizeof(kernels)/sizeof(kernels[0]); j++) {
+        snprintf(source, sizeof(source), "def %s%s; def fast %s_fast%s;",
+            kernels[j][0], kernels[j][1], kernels[j][0], kernels[j][1]);
+        if(load(jit, source) != 0) {
+            fprintf(stderr, "Unable to load %s\n", kernels[j][0]);
+            return 1;
+        }
+    }
+
+    double *x = malloc(sizeof(double) * ROWS);
+    double *y = malloc(sizeof(double) * ROWS);
+    double *strict_out = malloc(sizeof(double) * ROWS);
+    double *fast_out = malloc(sizeof(double) * ROWS);
+    for(i=0; i<ROWS; i++) {
+        x[i] = (double)(i % 1000) / 1000 - 0.5;
+        y[i] = (double)(i % 777) / 777;
+    }
+    const double *columns[] = {x, y};
+
+    // The series loop is much slower per row so it gets fewer, larger ones.
+    double *n = malloc(sizeof(double) * ROWS);
+    for(i=0; i<ROWS; i++) {
+        n[i] = 100 + i % 100;
+    }
+    const double *series_columns[] = {n};
+
+    printf("fastmath_bench: %d iterations, %d rows, %u lanes\n", ITERATIONS, ROWS, jit->batch_lanes);
+    for(j=0; j<sizeof(kernels)/sizeof(kernels[0]); j++) {
+        const double *const *args = (strcmp(kernels[j][0], "series") == 0 ? series_columns : columns);
+        size_t rows = (args == series_columns ? ROWS / 16 : ROWS);
+
+        kal_jit_batch_fn strict = kal_jit_batch(jit, kernels[j][0]);
+        snprintf(name, sizeof(name), "%s_fast", kernels[j][0]);
+        kal_jit_batch_fn fast = kal_jit_batch(jit, name);
+        if(strict == NULL || fast == NULL) {
+            fprintf(stderr, "Unable to compile %s\n", kernels[j][0]);
+            return 1;
+        }
+
+        double strict_time = run(strict, args, rows, strict_out);
+        double fast_time = run(fast, args, rows, fast_out);
+
+        // Fused and reordered operations round differently, so only check
+        // that the answers are close.
+        double error = 0;
+        for(i=0; i<rows; i++) {
+            double diff = fabs(strict_out[i] - fast_out[i]) / fmax(1, fabs(strict_out[i]));
+            error = fmax(error, diff);
+        }
+        if(error > 1e-9) {
+            fprintf(stderr, "Result mismatch for %s: relative error %g\n", kernels[j][0], error);
+            return 1;
+        }
+
+        printf("  %-10s strict %10.1f us  fast %10.1f us  speedup %5.2fx  error %.1e\n",
+            kernels[j][0], strict_time * 1e6, fast_time * 1e6, strict_time / fast_time, error);
+    }
+
+    free(x);
+    free(y);
+    free(n);
+    free(strict_out);
+    free(fast_out);
+    kal_jit_free(jit);
+    return 0;
+}
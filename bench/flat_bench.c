@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <ast.h>
+#include <flat.h>
+#include <codegen.h>
+#include <llvm-c/Core.h>
+
+
+//==============================================================================
+//
+// Definitions
+//
+//==============================================================================
+
+#define FUNCTION_COUNT 2000
+#define EXPR_DEPTH 8
+
+
+//==============================================================================
+//
+// Utility
+//
+//==============================================================================
+
+// Returns the current monotonic time in seconds.
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Builds a random expression over the arguments `a` and `b` which may call
+// any previously defined function.
+kal_ast_node *random_expr(int depth, int function)
+{
+    if(depth == 0) {
+        switch(rand() % 3) {
+            case 0: return kal_ast_number_create(NULL, rand() % 100);
+            case 1: return kal_ast_variable_create(NULL, kal_symbol_intern("a"));
+            default: return kal_ast_variable_create(NULL, kal_symbol_intern("b"));
+        }
+    }
+
+    int choice = rand() % 8;
+    if(choice == 0 && function > 0) {
+        char name[32];
+        kal_ast_node *args[2];
+        args[0] = random_expr(depth - 1, function);
+        args[1] = random_expr(depth - 1, function);
+        snprintf(name, sizeof(name), "f%d", rand() % function);
+        return kal_ast_call_create(NULL, kal_symbol_intern(name), args, 2);
+    }
+    else if(choice == 1) {
+        return kal_ast_if_expr_create(NULL, random_expr(depth - 1, function),
+            random_expr(depth - 1, function), random_expr(depth - 1, function));
+    }
+    else {
+        return kal_ast_binary_expr_create(NULL, rand() % 4,
+            random_expr(depth - 1, function), random_expr(depth - 1, function));
+    }
+}
+
+// Calculates the number of heap bytes used by a tree.
+size_t tree_size(kal_ast_node *node)
+{
+    unsigned int i;
+    size_t size = sizeof(kal_ast_node);
+
+    switch(node->type) {
+        case KAL_AST_TYPE_BINARY_EXPR: {
+            return size + tree_size(node->binary_expr.lhs) + tree_size(node->binary_expr.rhs);
+        }
+        case KAL_AST_TYPE_CALL: {
+            size += sizeof(kal_ast_node*) * node->call.arg_count;
+            for(i=0; i<node->call.arg_count; i++) {
+                size += tree_size(node->call.args[i]);
+            }
+            return size;
+        }
+        case KAL_AST_TYPE_PROTOTYPE: {
+            return size + sizeof(kal_symbol) * node->prototype.arg_count;
+        }
+        case KAL_AST_TYPE_FUNCTION: {
+            return size + tree_size(node->function.prototype) + tree_size(node->function.body);
+        }
+        case KAL_AST_TYPE_IF_EXPR: {
+            return size + tree_size(node->if_expr.condition) +
+                tree_size(node->if_expr.true_expr) + tree_size(node->if_expr.false_expr);
+        }
+        default: {
+            return size;
+        }
+    }
+}
+
+
+//==============================================================================
+//
+// Benchmark
+//
+//==============================================================================
+
+int main()
+{
+    int i;
+    char name[32];
+    kal_symbol args[2];
+    kal_ast_node **functions = malloc(sizeof(kal_ast_node*) * FUNCTION_COUNT);
+    
+    srand(1);
+    args[0] = kal_symbol_intern("a");
+    args[1] = kal_symbol_intern("b");
+
+    // Generate a synthetic program.
+    size_t tree_bytes = 0;
+    for(i=0; i<FUNCTION_COUNT; i++) {
+        snprintf(name, sizeof(name), "f%d", i);
+        kal_ast_node *prototype = kal_ast_prototype_create(NULL, kal_symbol_intern(name), args, 2);
+        functions[i] = kal_ast_function_create(NULL, prototype, random_expr(EXPR_DEPTH, i));
+        tree_bytes += tree_size(functions[i]);
+    }
+
+    // Encode the program as a flat AST.
+    kal_ast_flat *flat = kal_ast_flat_create();
+    for(i=0; i<FUNCTION_COUNT; i++) {
+        kal_ast_flat_append(flat, functions[i]);
+    }
+    size_t flat_bytes = kal_ast_flat_size(flat);
+    unsigned int node_count = flat->node_count;
+
+    // Codegen the tree.
+    kal_context *context = kal_context_create("tree");
+    double t0 = now();
+    for(i=0; i<FUNCTION_COUNT; i++) {
+        kal_codegen(context, functions[i]);
+    }
+    double tree_time = now() - t0;
+    kal_context_free(context);
+
+    // Codegen the flat AST.
+    context = kal_context_create("flat");
+    t0 = now();
+    for(i=0; i<FUNCTION_COUNT; i++) {
+        kal_codegen_flat(context, flat, i);
+    }
+    double flat_time = now() - t0;
+    kal_context_free(context);
+
+    // Free the tree.
+    t0 = now();
+    for(i=0; i<FUNCTION_COUNT; i++) {
+        kal_ast_node_free(functions[i]);
+    }
+    double tree_free_time = now() - t0;
+
+    t0 = now();
+    kal_ast_flat_free(flat);
+    double flat_free_time = now() - t0;
+
+    printf("flat_bench: %d functions, %u nodes\n", FUNCTION_COUNT, node_count);
+    printf("  tree: %10zu bytes  codegen %8.3f ms  free %8.3f ms\n", tree_bytes, tree_time * 1000, tree_free_time * 1000);
+    printf("  flat: %10zu bytes  codegen %8.3f ms  free %8.3f ms\n", flat_bytes, flat_time * 1000, flat_free_time * 1000);
+
+    free(functions);
+    return 0;
+}
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ast.h>
+#include <parser.h>
+#include <jit.h>
+#include <vm.h>
+
+
+//==============================================================================
+//
+// Definitions
+//
+//==============================================================================
+
+#define ITERATIONS 200
+
+// The definitions loaded before each expression is run.
+#define PRELUDE "def add(x, y) x + y; def fib(x) if x then (if x - 1 then fib(x-1) + fib(x-2) else 1) else 0;"
+
+// Short top-level expressions of the kind typed at the REPL.
+static const char *expressions[] = {
+    "1 + 2 * 3",
+    "add(add(1, 2), add(3, 4)) * 2",
+    "if add(1, 0) then 10 else 20",
+    "fib(15)",
+};
+
+
+//==============================================================================
+//
+// Utility
+//
+//==============================================================================
+
+// Returns the current monotonic time in seconds.
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Parses a program and runs it on the VM.
+void run_vm(kal_vm *vm, kal_ast_arena *arena, const char *source, double *result)
+{
+    unsigned int i, count;
+    kal_ast_node **nodes;
+    kal_ast_arena_reset(arena);
+    kal_parse_program(source, strlen(source), arena, &nodes, &count);
+    for(i=0; i<count; i++) {
+        if(nodes[i]->type == KAL_AST_TYPE_FUNCTION || nodes[i]->type == KAL_AST_TYPE_PROTOTYPE) {
+            kal_vm_add(vm, nodes[i]);
+        }
+        else {
+            kal_vm_eval(vm, nodes[i], result);
+        }
+    }
+    free(nodes);
+}
+
+// Parses a program and runs it on the lazy JIT.
+void run_jit(kal_jit *jit, const char *source, double *result)
+{
+    unsigned int i, count;
+    kal_ast_node **nodes;
+    kal_ast_arena_reset(jit->context->arena);
+    kal_parse_program(source, strlen(source), jit->context->arena, &nodes, &count);
+    for(i=0; i<count; i++) {
+        if(nodes[i]->type == KAL_AST_TYPE_FUNCTION || nodes[i]->type == KAL_AST_TYPE_PROTOTYPE) {
+            kal_jit_add(jit, nodes[i]);
+        }
+        else {
+            kal_jit_eval(jit, nodes[i], result);
+        }
+    }
+    free(nodes);
+}
+
+
+//==============================================================================
+//
+// Benchmark
+//
+//==============================================================================
+
+int main()
+{
+    unsigned int i, j;
+    double vm_result = 0, jit_result = 0;
+
+    // Start up an engine, load the prelude and run one expression.
+    double t0 = now();
+    for(i=0; i<ITERATIONS; i++) {
+        kal_ast_arena *arena = kal_ast_arena_create();
+        kal_vm *vm = kal_vm_create();
+        run_vm(vm, arena, PRELUDE, &vm_result);
+        run_vm(vm, arena, expressions[0], &vm_result);
+        kal_vm_free(vm);
+        kal_ast_arena_free(arena);
+    }
+    double vm_startup = (now() - t0) / ITERATIONS;
+
+    t0 = now();
+    for(i=0; i<ITERATIONS; i++) {
+        kal_jit *jit = kal_jit_create(KAL_JIT_LAZY);
+        run_jit(jit, PRELUDE, &jit_result);
+        run_jit(jit, expressions[0], &jit_result);
+        kal_jit_free(jit);
+    }
+    double jit_startup = (now() - t0) / ITERATIONS;
+
+    printf("vm_bench: %d iterations\n", ITERATIONS);
+    printf("  %-32s vm %10.1f us  jit %10.1f us\n", "startup + first expression", vm_startup * 1e6, jit_startup * 1e6);
+
+    // Run each expression on a warm engine. Every run parses, compiles and
+    // executes the expression from scratch.
+    kal_ast_arena *arena = kal_ast_arena_create();
+    kal_vm *vm = kal_vm_create();
+    kal_jit *jit = kal_jit_create(KAL_JIT_LAZY);
+    run_vm(vm, arena, PRELUDE, &vm_result);
+    run_jit(jit, PRELUDE, &jit_result);
+
+    for(j=0; j<sizeof(expressions)/sizeof(expressions[0]); j++) {
+        t0 = now();
+        for(i=0; i<ITERATIONS; i++) {
+            run_vm(vm, arena, expressions[j], &vm_result);
+        }
+        double vm_time = (now() - t0) / ITERATIONS;
+
+        t0 = now();
+        for(i=0; i<ITERATIONS; i++) {
+            run_jit(jit, expressions[j], &jit_result);
+        }
+        double jit_time = (now() - t0) / ITERATIONS;
+
+        if(vm_result != jit_result) {
+            fprintf(stderr, "Result mismatch for %s: %f != %f\n", expressions[j], vm_result, jit_result);
+            return 1;
+        }
+        printf("  %-32s vm %10.1f us  jit %10.1f us\n", expressions[j], vm_time * 1e6, jit_time * 1e6);
+    }
+
+    kal_jit_free(jit);
+    kal_vm_free(vm);
+    kal_ast_arena_free(arena);
+    return 0;
+}
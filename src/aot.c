@@ -0,0 +1,603 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <llvm-c/Core.h>
+#include <llvm-c/Target.h>
+#include <llvm-c/TargetMachine.h>
+#include <llvm-c/BitWriter.h>
+#include <llvm-c/Linker.h>
+
+#include "aot.h"
+#include "codegen.h"
+#include "compile.h"
+
+extern char **environ;
+
+
+//==============================================================================
+//
+// Definitions
+//
+//==============================================================================
+
+// The CPU that every version of a function is built for. Each version adds
+// features to it.
+#define KAL_AOT_VERSION_CPU "x86-64"
+
+// Bits of __cpu_model.__cpu_features[0], which libgcc and compiler-rt fill
+// in from cpuid once the OS is known to save the registers involved.
+#define KAL_AOT_CPU_AVX2    (1 << 10)
+#define KAL_AOT_CPU_FMA     (1 << 14)
+#define KAL_AOT_CPU_AVX512F (1 << 15)
+
+// The suffix of the baseline version of a multiversioned function.
+#define KAL_AOT_DEFAULT_SUFFIX ".default"
+
+// The versions that multiversioned output has on top of the baseline, from
+// worst to best. The best one the host supports is used.
+static const kal_aot_version kal_aot_versions[KAL_AOT_VERSION_COUNT] = {
+    {".avx2", "+avx,+avx2,+fma", KAL_AOT_CPU_AVX2 | KAL_AOT_CPU_FMA},
+    {".avx512", "+avx,+avx2,+fma,+avx512f", KAL_AOT_CPU_AVX2 | KAL_AOT_CPU_FMA | KAL_AOT_CPU_AVX512F},
+};
+
+
+//==============================================================================
+//
+// Functions
+//
+//==============================================================================
+
+//--------------------------------------
+// Compilation
+//--------------------------------------
+
+// Generates and optimizes code for every definition and extern in a list of
+// top-level items. Large batches are compiled in parallel.
+//
+// context - The context to compile into.
+// nodes   - The top-level items.
+// count   - The number of items.
+//
+// Returns 0 if everything compiled, otherwise returns -1.
+static int kal_aot_compile_definitions(kal_context *context,
+                                       kal_ast_node **nodes, unsigned int count)
+{
+    unsigned int i;
+    unsigned int function_count = 0;
+    int rc = 0;
+
+    for(i=0; i<count; i++) {
+        if(nodes[i]->type == KAL_AST_TYPE_FUNCTION) {
+            function_count++;
+        }
+    }
+
+    if(function_count >= KAL_COMPILE_PARALLEL_MIN) {
+        return kal_compile_parallel(context, nodes, count, 0);
+    }
+
+    LLVMPassManagerRef pass_manager = kal_compile_pass_manager_create(context, context->module);
+    for(i=0; i<count; i++) {
+        if(nodes[i]->type != KAL_AST_TYPE_FUNCTION && nodes[i]->type != KAL_AST_TYPE_PROTOTYPE) {
+            continue;
+        }
+
+        LLVMValueRef func = kal_codegen(context, nodes[i]);
+        if(func == NULL) {
+            fprintf(stderr, "Unable to codegen for node\n");
+            rc = -1;
+        }
+        else if(nodes[i]->type == KAL_AST_TYPE_FUNCTION) {
+            LLVMRunFunctionPassManager(pass_manager, func);
+        }
+    }
+    LLVMFinalizeFunctionPassManager(pass_manager);
+    LLVMDisposePassManager(pass_manager);
+
+    return rc;
+}
+
+// Generates and optimizes code for every definition and extern in a list of
+// top-level items. Top-level expressions have nothing to run them in a
+// library so they are skipped.
+//
+// context - The context to compile into.
+// nodes   - The top-level items.
+// count   - The number of items.
+//
+// Returns 0 if everything compiled, otherwise returns -1.
+int kal_aot_compile(kal_context *context, kal_ast_node **nodes,
+                    unsigned int count)
+{
+    unsigned int i;
+    unsigned int expr_count = 0;
+
+    for(i=0; i<count; i++) {
+        if(nodes[i]->type != KAL_AST_TYPE_FUNCTION && nodes[i]->type != KAL_AST_TYPE_PROTOTYPE) {
+            expr_count++;
+        }
+    }
+    if(expr_count > 0) {
+        fprintf(stderr, "Skipping top-level expressions: %u\n", expr_count);
+    }
+
+    return kal_aot_compile_definitions(context, nodes, count);
+}
+
+
+
+// Creates a target machine for ahead-of-time output. Code is generated for
+// the host's architecture but not its exact CPU so that the output runs on
+// any machine of the same kind. Code is position independent so it can go
+// into shared libraries.
+//
+// context - The context whose optimization level is used.
+//
+// Returns a new target machine or NULL if the host isn't supported.
+LLVMTargetMachineRef kal_aot_create_target_machine(kal_context *context)
+{
+    char *msg = NULL;
+    LLVMTargetRef target;
+
+    LLVMInitializeNativeTarget();
+    LLVMInitializeNativeAsmPrinter();
+
+    char *triple = LLVMGetDefaultTargetTriple();
+    if(LLVMGetTargetFromTriple(triple, &target, &msg) != 0) {
+        fprintf(stderr, "%s\n", msg);
+        LLVMDisposeMessage(msg);
+        LLVMDisposeMessage(triple);
+        return NULL;
+    }
+
+    LLVMTargetMachineRef machine = LLVMCreateTargetMachine(target, triple, "", "",
+        kal_compile_codegen_level(context), LLVMRelocPIC, LLVMCodeModelDefault);
+    LLVMDisposeMessage(triple);
+
+    return machine;
+}
+
+// Runs the module pipeline for the context's optimization level over
+// everything that has been compiled. This is done once all the inputs are
+// in the module so that definitions can be inlined across files.
+//
+// context - The context holding the compiled module.
+//
+// Returns 0 if successful, otherwise returns -1.
+int kal_aot_optimize(kal_context *context)
+{
+    LLVMTargetMachineRef machine = kal_aot_create_target_machine(context);
+    if(machine == NULL) {
+        return -1;
+    }
+    kal_compile_optimize_module(context, context->module, machine);
+    LLVMDisposeTargetMachine(machine);
+    return 0;
+}
+
+
+//--------------------------------------
+// Multiversioning
+//--------------------------------------
+
+// Creates a context for each version of the output. Definitions are
+// compiled into them as well as the main context and the results are
+// linked together by kal_aot_versions_link(). They share the main context's
+// LLVM context and settings. The main context becomes the baseline that
+// hosts without any version's features fall back to, so its target is
+// replaced with the generic KAL_AOT_VERSION_CPU.
+//
+// context - The main context. Nothing should have been compiled into it
+//           yet.
+//
+// Returns KAL_AOT_VERSION_COUNT new contexts or NULL if the host's
+// architecture doesn't have versions.
+kal_context **kal_aot_versions_create(kal_context *context)
+{
+    unsigned int i;
+
+    char *triple = LLVMGetDefaultTargetTriple();
+    bool x86_64 = (strncmp(triple, "x86_64", 6) == 0);
+    LLVMDisposeMessage(triple);
+    if(!x86_64) {
+        fprintf(stderr, "Multiversioning needs an x86-64 target\n");
+        return NULL;
+    }
+
+    kal_target_free(context->target);
+    context->target = kal_target_create(KAL_AOT_VERSION_CPU, NULL);
+
+    kal_context **versions = malloc(sizeof(kal_context*) * KAL_AOT_VERSION_COUNT);
+    for(i=0; i<KAL_AOT_VERSION_COUNT; i++) {
+        versions[i] = kal_context_create_in(context->llvm, kal_aot_versions[i].suffix + 1);
+        versions[i]->opt_level = context->opt_level;
+        versions[i]->size_level = context->size_level;
+        versions[i]->memo = context->memo;
+        versions[i]->fast_math = context->fast_math;
+        versions[i]->profile = context->profile;
+        versions[i]->target = kal_target_create(KAL_AOT_VERSION_CPU, kal_aot_versions[i].features);
+    }
+    return versions;
+}
+
+// Frees the contexts of each version.
+//
+// versions - The contexts.
+void kal_aot_versions_free(kal_context **versions)
+{
+    unsigned int i;
+    if(!versions) return;
+    for(i=0; i<KAL_AOT_VERSION_COUNT; i++) {
+        kal_context_free(versions[i]);
+    }
+    free(versions);
+}
+
+// Generates code for every definition and extern in a list of top-level
+// items in each version.
+//
+// versions - The contexts of each version.
+// nodes    - The top-level items.
+// count    - The number of items.
+//
+// Returns 0 if everything compiled, otherwise returns -1.
+int kal_aot_versions_compile(kal_context **versions, kal_ast_node **nodes,
+                             unsigned int count)
+{
+    unsigned int i;
+    for(i=0; i<KAL_AOT_VERSION_COUNT; i++) {
+        if(kal_aot_compile_definitions(versions[i], nodes, count) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Checks whether a module value is a function that the output exports.
+//
+// func - The function.
+//
+// Returns true if the function is defined and visible outside the module.
+static bool kal_aot_is_exported(LLVMValueRef func)
+{
+    return LLVMCountBasicBlocks(func) > 0 && LLVMGetLinkage(func) == LLVMExternalLinkage;
+}
+
+// Adds a suffix to a value's name.
+//
+// value  - The value.
+// suffix - The suffix.
+static void kal_aot_add_suffix(LLVMValueRef value, const char *suffix)
+{
+    size_t length;
+    const char *value_name = LLVMGetValueName2(value, &length);
+    char *name = malloc(length + strlen(suffix) + 1);
+    memcpy(name, value_name, length);
+    strcpy(name + length, suffix);
+    LLVMSetValueName2(value, name, strlen(name));
+    free(name);
+}
+
+// Creates a resolver that the loader calls to pick the version of an
+// exported function that the host supports. It returns the best version
+// whose features are all there, or the baseline.
+//
+// context - The main context.
+// func    - The baseline version.
+// name    - The function's exported name.
+//
+// Returns the resolver.
+static LLVMValueRef kal_aot_create_resolver(kal_context *context,
+                                            LLVMValueRef func, const char *name)
+{
+    unsigned int i;
+    LLVMModuleRef module = context->module;
+    LLVMBuilderRef builder = context->builder;
+    LLVMTypeRef int_type = LLVMInt32TypeInContext(context->llvm);
+    LLVMTypeRef func_ptr_type = LLVMPointerType(LLVMGlobalGetValueType(func), 0);
+
+    // The runtime's CPU model is filled in by a constructor, which might not
+    // have run yet when resolvers are called.
+    LLVMValueRef init = LLVMGetNamedFunction(module, "__cpu_indicator_init");
+    if(init == NULL) {
+        init = LLVMAddFunction(module, "__cpu_indicator_init", LLVMFunctionType(int_type, NULL, 0, 0));
+    }
+    LLVMValueRef cpu_model = LLVMGetNamedGlobal(module, "__cpu_model");
+    if(cpu_model == NULL) {
+        LLVMTypeRef fields[] = {int_type, int_type, int_type, LLVMArrayType(int_type, 1)};
+        cpu_model = LLVMAddGlobal(module, LLVMStructTypeInContext(context->llvm, fields, 4, 0), "__cpu_model");
+    }
+
+    char *resolver_name = malloc(strlen(name) + strlen(".resolver") + 1);
+    strcpy(resolver_name, name);
+    strcat(resolver_name, ".resolver");
+    LLVMValueRef resolver = LLVMAddFunction(module, resolver_name,
+        LLVMFunctionType(func_ptr_type, NULL, 0, 0));
+    LLVMSetLinkage(resolver, LLVMInternalLinkage);
+    free(resolver_name);
+
+    LLVMPositionBuilderAtEnd(builder, LLVMAppendBasicBlockInContext(context->llvm, resolver, "entry"));
+    LLVMBuildCall(builder, init, NULL, 0, "");
+    LLVMValueRef indices[] = {LLVMConstInt(int_type, 0, 0), LLVMConstInt(int_type, 3, 0), LLVMConstInt(int_type, 0, 0)};
+    LLVMValueRef features = LLVMBuildLoad(builder,
+        LLVMBuildInBoundsGEP(builder, cpu_model, indices, 3, ""), "features");
+
+    LLVMValueRef result = func;
+    char *version_name = malloc(strlen(name) + 32);
+    for(i=0; i<KAL_AOT_VERSION_COUNT; i++) {
+        sprintf(version_name, "%s%s", name, kal_aot_versions[i].suffix);
+        LLVMValueRef version = LLVMGetNamedFunction(module, version_name);
+        if(version == NULL) {
+            continue;
+        }
+        LLVMSetLinkage(version, LLVMInternalLinkage);
+        LLVMValueRef mask = LLVMConstInt(int_type, kal_aot_versions[i].cpu_features, 0);
+        LLVMValueRef supported = LLVMBuildICmp(builder, LLVMIntEQ,
+            LLVMBuildAnd(builder, features, mask, ""), mask, "");
+        result = LLVMBuildSelect(builder, supported, version, result, "");
+    }
+    LLVMBuildRet(builder, result);
+    free(version_name);
+
+    return resolver;
+}
+
+// Links the functions compiled for each version into the main context's
+// module and puts an ifunc in place of every exported function. The loader
+// calls the ifunc's resolver once to pick the version that the host
+// supports, so a single output runs everywhere and still uses the widest
+// vectors each host has.
+//
+// Each version of a function is named after it with the version's suffix,
+// and the baseline gets KAL_AOT_DEFAULT_SUFFIX. Calls between functions go
+// straight to the same version of the callee. Memo tables are shared by
+// every version.
+//
+// context  - The main context.
+// versions - The contexts of each version.
+//
+// Returns 0 if successful, otherwise returns -1.
+int kal_aot_versions_link(kal_context *context, kal_context **versions)
+{
+    unsigned int i, count = 0;
+    LLVMValueRef func, global;
+
+    // Find the exported functions before the versions are added.
+    unsigned int capacity = 0;
+    LLVMValueRef *funcs = NULL;
+    for(func = LLVMGetFirstFunction(context->module); func != NULL; func = LLVMGetNextFunction(func)) {
+        if(kal_aot_is_exported(func)) {
+            if(count == capacity) {
+                capacity = (capacity > 0 ? capacity * 2 : 16);
+                funcs = realloc(funcs, sizeof(LLVMValueRef) * capacity);
+            }
+            funcs[count++] = func;
+        }
+    }
+
+    // Versions stay external until their resolvers use them since the
+    // linker drops internal functions that nothing refers to.
+    for(i=0; i<KAL_AOT_VERSION_COUNT; i++) {
+        LLVMModuleRef module = versions[i]->module;
+        for(func = LLVMGetFirstFunction(module); func != NULL; func = LLVMGetNextFunction(func)) {
+            if(kal_aot_is_exported(func)) {
+                kal_aot_add_suffix(func, kal_aot_versions[i].suffix);
+            }
+        }
+        for(global = LLVMGetFirstGlobal(module); global != NULL; global = LLVMGetNextGlobal(global)) {
+            if(LLVMGetInitializer(global) != NULL) {
+                LLVMSetLinkage(global, LLVMLinkOnceODRLinkage);
+            }
+        }
+
+        // Linking destroys the version's module.
+        versions[i]->module = NULL;
+        if(LLVMLinkModules2(context->module, module) != 0) {
+            fprintf(stderr, "Unable to link %s functions\n", kal_aot_versions[i].suffix + 1);
+            free(funcs);
+            return -1;
+        }
+    }
+
+    for(i=0; i<count; i++) {
+        size_t length;
+        const char *func_name = LLVMGetValueName2(funcs[i], &length);
+        char *name = malloc(length + 1);
+        memcpy(name, func_name, length);
+        name[length] = '\0';
+
+        LLVMValueRef resolver = kal_aot_create_resolver(context, funcs[i], name);
+        kal_aot_add_suffix(funcs[i], KAL_AOT_DEFAULT_SUFFIX);
+        LLVMSetLinkage(funcs[i], LLVMInternalLinkage);
+        LLVMAddGlobalIFunc(context->module, name, length, LLVMGlobalGetValueType(funcs[i]), 0, resolver);
+        free(name);
+    }
+    free(funcs);
+
+    return 0;
+}
+
+
+//--------------------------------------
+// Output
+//--------------------------------------
+
+// Writes the context's module to a native object file.
+//
+// context - The context holding the compiled module.
+// path    - The object file to write.
+//
+// Returns 0 if successful, otherwise returns -1.
+int kal_aot_emit_object(kal_context *context, const char *path)
+{
+    char *msg = NULL;
+
+    LLVMTargetMachineRef machine = kal_aot_create_target_machine(context);
+    if(machine == NULL) {
+        return -1;
+    }
+
+    char *triple = LLVMGetTargetMachineTriple(machine);
+    LLVMTargetDataRef data_layout = LLVMCreateTargetDataLayout(machine);
+    LLVMSetTarget(context->module, triple);
+    LLVMSetModuleDataLayout(context->module, data_layout);
+    LLVMDisposeMessage(triple);
+    LLVMDisposeTargetData(data_layout);
+
+    int rc = 0;
+    if(LLVMTargetMachineEmitToFile(machine, context->module, (char*)path, LLVMObjectFile, &msg) != 0) {
+        fprintf(stderr, "%s\n", msg);
+        LLVMDisposeMessage(msg);
+        rc = -1;
+    }
+    LLVMDisposeTargetMachine(machine);
+
+    return rc;
+}
+
+// Writes the context's module as a bitcode library that the lazy engine
+// can import. Nothing is generated for a target, so the library works on
+// any host and each function is compiled for the host it's imported on.
+//
+// context - The context holding the compiled module.
+// path    - The bitcode file to write.
+//
+// Returns 0 if successful, otherwise returns -1.
+int kal_aot_emit_bitcode(kal_context *context, const char *path)
+{
+    if(LLVMWriteBitcodeToFile(context->module, path) != 0) {
+        fprintf(stderr, "Unable to write bitcode: %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// Writes the C declaration of a function. Each one takes and returns
+// doubles.
+//
+// file - The file to write to.
+// name - The name the function is exported as.
+// func - The function, whose parameter names are used.
+static void kal_aot_emit_declaration(FILE *file, const char *name,
+                                     LLVMValueRef func)
+{
+    unsigned int i;
+    size_t length;
+
+    fprintf(file, "double %s(", name);
+    unsigned int param_count = LLVMCountParams(func);
+    for(i=0; i<param_count; i++) {
+        const char *param_name = LLVMGetValueName2(LLVMGetParam(func, i), &length);
+        fprintf(file, "%sdouble", (i > 0 ? ", " : ""));
+        if(length > 0) {
+            fprintf(file, " %s", param_name);
+        }
+    }
+    fprintf(file, "%s);\n", (param_count == 0 ? "void" : ""));
+}
+
+// Writes a C header declaring every function defined in the context's
+// module, including multiversioned ones.
+//
+// context - The context holding the compiled module.
+// path    - The header file to write.
+//
+// Returns 0 if successful, otherwise returns -1.
+int kal_aot_emit_header(kal_context *context, const char *path)
+{
+    unsigned int i;
+    size_t length;
+
+    FILE *file = fopen(path, "w");
+    if(file == NULL) {
+        fprintf(stderr, "Unable to write header: %s\n", path);
+        return -1;
+    }
+
+    // Build the include guard from the file name.
+    const char *name = strrchr(path, '/');
+    name = (name != NULL ? name + 1 : path);
+    char *guard = malloc(strlen(name) + 2);
+    for(i=0, length=0; name[i] != '\0'; i++) {
+        if(length == 0 && isdigit((unsigned char)name[i])) {
+            guard[length++] = '_';
+        }
+        guard[length++] = (isalnum((unsigned char)name[i]) ? toupper((unsigned char)name[i]) : '_');
+    }
+    guard[length] = '\0';
+
+    fprintf(file, "#ifndef %s\n#define %s\n\n", guard, guard);
+    fprintf(file, "#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n");
+
+    LLVMValueRef func;
+    for(func = LLVMGetFirstFunction(context->module); func != NULL; func = LLVMGetNextFunction(func)) {
+        const char *func_name = LLVMGetValueName2(func, &length);
+        if(LLVMCountBasicBlocks(func) == 0 || length == 0 ||
+           LLVMGetLinkage(func) != LLVMExternalLinkage)
+        {
+            continue;
+        }
+
+        kal_aot_emit_declaration(file, func_name, func);
+    }
+
+    // The baseline of a multiversioned function has the parameter names.
+    LLVMValueRef ifunc;
+    for(ifunc = LLVMGetFirstGlobalIFunc(context->module); ifunc != NULL; ifunc = LLVMGetNextGlobalIFunc(ifunc)) {
+        const char *ifunc_name = LLVMGetValueName2(ifunc, &length);
+        char *default_name = malloc(length + strlen(KAL_AOT_DEFAULT_SUFFIX) + 1);
+        memcpy(default_name, ifunc_name, length);
+        strcpy(default_name + length, KAL_AOT_DEFAULT_SUFFIX);
+        LLVMValueRef func = LLVMGetNamedFunction(context->module, default_name);
+        if(func != NULL) {
+            kal_aot_emit_declaration(file, ifunc_name, func);
+        }
+        free(default_name);
+    }
+
+    fprintf(file, "\n#ifdef __cplusplus\n}\n#endif\n\n#endif\n");
+    free(guard);
+
+    if(fclose(file) != 0) {
+        fprintf(stderr, "Unable to write header: %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// Links an object file into a shared library with the system C compiler,
+// which is taken from $CC if it is set. The library is linked against libm
+// so that externs such as cos resolve wherever it is loaded.
+//
+// object_path - The object file.
+// path        - The shared library to write.
+//
+// Returns 0 if successful, otherwise returns -1.
+int kal_aot_link_shared(const char *object_path, const char *path)
+{
+    pid_t pid;
+    int status;
+
+    const char *cc = getenv("CC");
+    if(cc == NULL || cc[0] == '\0') {
+        cc = "cc";
+    }
+
+    char *argv[] = {(char*)cc, "-shared", "-o", (char*)path, (char*)object_path, "-lm", NULL};
+    if(posix_spawnp(&pid, cc, NULL, NULL, argv, environ) != 0) {
+        fprintf(stderr, "Unable to run %s\n", cc);
+        return -1;
+    }
+    if(waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "Unable to link %s\n", path);
+        return -1;
+    }
+
+    return 0;
+}
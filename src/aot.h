@@ -0,0 +1,65 @@
+#ifndef _aot_h
+#define _aot_h
+
+#include <llvm-c/Core.h>
+#include "ast.h"
+#include "context.h"
+
+
+//==============================================================================
+//
+// Definitions
+//
+//==============================================================================
+
+// The number of versions that multiversioned output has on top of the
+// baseline.
+#define KAL_AOT_VERSION_COUNT 2
+
+
+//==============================================================================
+//
+// Typedefs
+//
+//==============================================================================
+
+// A version of every exported function that is built for a CPU with more
+// features than the baseline. `suffix` is added to the version's name,
+// `features` are added to the baseline CPU's and `cpu_features` are the
+// bits of the runtime's CPU model that a host needs to run the version.
+typedef struct kal_aot_version {
+    const char *suffix;
+    const char *features;
+    uint32_t cpu_features;
+} kal_aot_version;
+
+
+//==============================================================================
+//
+// Functions
+//
+//==============================================================================
+
+int kal_aot_compile(kal_context *context, kal_ast_node **nodes,
+    unsigned int count);
+
+int kal_aot_optimize(kal_context *context);
+
+kal_context **kal_aot_versions_create(kal_context *context);
+
+void kal_aot_versions_free(kal_context **versions);
+
+int kal_aot_versions_compile(kal_context **versions, kal_ast_node **nodes,
+    unsigned int count);
+
+int kal_aot_versions_link(kal_context *context, kal_context **versions);
+
+int kal_aot_emit_object(kal_context *context, const char *path);
+
+int kal_aot_emit_bitcode(kal_context *context, const char *path);
+
+int kal_aot_emit_header(kal_context *context, const char *path);
+
+int kal_aot_link_shared(const char *object_path, const char *path);
+
+#endif
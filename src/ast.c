@@ -4,24 +4,163 @@
 #include "ast.h"
 
 
+//==============================================================================
+//
+// Definitions
+//
+//==============================================================================
+
+// The minimum size of a block requested from malloc by an arena.
+#define KAL_AST_ARENA_BLOCK_SIZE 16384
+
+// The alignment of every allocation made from an arena.
+#define KAL_AST_ARENA_ALIGN sizeof(double)
+
+
 //==============================================================================
 //
 // Functions
 //
 //==============================================================================
 
+//--------------------------------------
+// Arena
+//--------------------------------------
+
+// Creates an empty arena. No memory is reserved until the first allocation.
+//
+// Returns a new arena.
+kal_ast_arena *kal_ast_arena_create()
+{
+    kal_ast_arena *arena = calloc(1, sizeof(kal_ast_arena));
+    return arena;
+}
+
+// Allocates memory from an arena. The memory is only released when the arena
+// is reset or freed.
+//
+// arena - The arena to allocate from.
+// size  - The number of bytes to allocate.
+//
+// Returns a pointer to the allocated memory.
+void *kal_ast_arena_alloc(kal_ast_arena *arena, size_t size)
+{
+    size = (size + KAL_AST_ARENA_ALIGN - 1) & ~(KAL_AST_ARENA_ALIGN - 1);
+
+    // Move to the next retained block (or add a new one) if the current one
+    // is full.
+    kal_ast_arena_block *block = arena->current;
+    while(block == NULL || block->used + size > block->size) {
+        if(block != NULL && block->next != NULL) {
+            block = block->next;
+            block->used = 0;
+            continue;
+        }
+
+        size_t block_size = (size > KAL_AST_ARENA_BLOCK_SIZE ? size : KAL_AST_ARENA_BLOCK_SIZE);
+        kal_ast_arena_block *next = malloc(sizeof(kal_ast_arena_block) + block_size);
+        next->next = NULL;
+        next->size = block_size;
+        next->used = 0;
+
+        if(block != NULL) {
+            block->next = next;
+        }
+        else {
+            arena->head = next;
+        }
+        block = next;
+        arena->blocks++;
+        arena->capacity += block_size;
+    }
+    arena->current = block;
+
+    void *ptr = block->data + block->used;
+    block->used += size;
+    arena->allocations++;
+    arena->bytes += size;
+    return ptr;
+}
+
+// Copies a string into an arena.
+//
+// arena - The arena to allocate from.
+// str   - The string to copy.
+//
+// Returns the copy of the string.
+char *kal_ast_arena_strdup(kal_ast_arena *arena, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *copy = kal_ast_arena_alloc(arena, len);
+    memcpy(copy, str, len);
+    return copy;
+}
+
+// Releases every allocation made from an arena while keeping its blocks
+// around for reuse. The counters are cleared so they describe the next parse.
+//
+// arena - The arena to reset.
+void kal_ast_arena_reset(kal_ast_arena *arena)
+{
+    if(!arena) return;
+
+    arena->current = arena->head;
+    if(arena->current) {
+        arena->current->used = 0;
+    }
+    arena->allocations = 0;
+    arena->bytes = 0;
+    arena->blocks = 0;
+    arena->capacity = 0;
+}
+
+// Frees an arena along with every node allocated from it.
+//
+// arena - The arena to free.
+void kal_ast_arena_free(kal_ast_arena *arena)
+{
+    if(!arena) return;
+
+    kal_ast_arena_block *block = arena->head;
+    while(block != NULL) {
+        kal_ast_arena_block *next = block->next;
+        free(block);
+        block = next;
+    }
+
+    free(arena);
+}
+
+
+//--------------------------------------
+// Allocation
+//--------------------------------------
+
+// Allocates memory for a node from an arena or, if no arena is given, from
+// the heap.
+//
+// arena - The arena to allocate from. May be NULL.
+// size  - The number of bytes to allocate.
+//
+// Returns a pointer to the allocated memory.
+static void *kal_ast_alloc(kal_ast_arena *arena, size_t size)
+{
+    return (arena ? kal_ast_arena_alloc(arena, size) : malloc(size));
+}
+
 //--------------------------------------
 // Number AST
 //--------------------------------------
 
 // Creates an AST node for a number.
 //
+// arena - The arena to allocate from or NULL to use the heap.
 // value - The value of the AST.
 //
 // Returns a Number AST Node.
-kal_ast_node *kal_ast_number_create(double value)
+kal_ast_node *kal_ast_number_create(kal_ast_arena *arena, double value)
 {
-    kal_ast_node *node = malloc(sizeof(kal_ast_node));
+    kal_ast_node *node = kal_ast_alloc(arena, sizeof(kal_ast_node));
     node->type = KAL_AST_TYPE_NUMBER;
     node->number.value = value;
     return node;
@@ -34,14 +173,15 @@ kal_ast_node *kal_ast_number_create(double value)
 
 // Creates an AST node for a variable.
 //
-// name - The name of the variable.
+// arena - The arena to allocate from or NULL to use the heap.
+// name  - The name of the variable.
 //
 // Returns a Variable AST Node.
-kal_ast_node *kal_ast_variable_create(char *name)
+kal_ast_node *kal_ast_variable_create(kal_ast_arena *arena, kal_symbol name)
 {
-    kal_ast_node *node = malloc(sizeof(kal_ast_node));
+    kal_ast_node *node = kal_ast_alloc(arena, sizeof(kal_ast_node));
     node->type = KAL_AST_TYPE_VARIABLE;
-    node->variable.name = strdup(name);
+    node->variable.name = name;
     return node;
 }
 
@@ -52,16 +192,18 @@ kal_ast_node *kal_ast_variable_create(char *name)
 
 // Creates an AST node for a binary expression.
 //
-// op  - The operation being performed.
-// lhs - The AST node for the left hand side of the expression.
-// rhs - The AST node for the right hand side of the expression.
+// arena - The arena to allocate from or NULL to use the heap.
+// op    - The operation being performed.
+// lhs   - The AST node for the left hand side of the expression.
+// rhs   - The AST node for the right hand side of the expression.
 //
 // Returns a Binary Expression AST Node.
-kal_ast_node *kal_ast_binary_expr_create(kal_ast_binop_e operator,
+kal_ast_node *kal_ast_binary_expr_create(kal_ast_arena *arena,
+                                         kal_ast_binop_e operator,
                                          kal_ast_node *lhs,
                                          kal_ast_node *rhs)
 {
-    kal_ast_node *node = malloc(sizeof(kal_ast_node));
+    kal_ast_node *node = kal_ast_alloc(arena, sizeof(kal_ast_node));
     node->type = KAL_AST_TYPE_BINARY_EXPR;
     node->binary_expr.operator = operator;
     node->binary_expr.lhs      = lhs;
@@ -76,22 +218,25 @@ kal_ast_node *kal_ast_binary_expr_create(kal_ast_binop_e operator,
 
 // Creates an AST node for a function call.
 //
+// arena     - The arena to allocate from or NULL to use the heap.
 // name      - The name of the function being called.
 // args      - A list of AST node expressions passed as arguments.
 // arg_count - The number of arguments.
 //
 // Returns a Function Call AST Node.
-kal_ast_node *kal_ast_call_create(char *name, kal_ast_node **args,
-                                  int arg_count)
+kal_ast_node *kal_ast_call_create(kal_ast_arena *arena, kal_symbol name,
+                                  kal_ast_node **args, int arg_count)
 {
-    kal_ast_node *node = malloc(sizeof(kal_ast_node));
+    kal_ast_node *node = kal_ast_alloc(arena, sizeof(kal_ast_node));
     node->type = KAL_AST_TYPE_CALL;
-    node->call.name = strdup(name);
+    node->call.name = name;
 
     // Shallow copy arguments.
-    node->prototype.args = malloc(sizeof(kal_ast_node*) * arg_count);
-    memcpy(node->prototype.args, args, sizeof(kal_ast_node*) * arg_count);
-    node->prototype.arg_count = arg_count;
+    node->call.args = kal_ast_alloc(arena, sizeof(kal_ast_node*) * arg_count);
+    if(arg_count > 0) {
+        memcpy(node->call.args, args, sizeof(kal_ast_node*) * arg_count);
+    }
+    node->call.arg_count = arg_count;
 
     return node;
 }
@@ -103,26 +248,26 @@ kal_ast_node *kal_ast_call_create(char *name, kal_ast_node **args,
 
 // Creates an AST node for a function prototype.
 //
+// arena     - The arena to allocate from or NULL to use the heap.
 // name      - The name of the function.
 // args      - A list of argument names.
 // arg_count - The number of arguments.
 //
 // Returns a Function Prototype AST Node.
-kal_ast_node *kal_ast_prototype_create(char *name, char **args,
-                                       int arg_count)
+kal_ast_node *kal_ast_prototype_create(kal_ast_arena *arena, kal_symbol name,
+                                       kal_symbol *args, int arg_count)
 {
-    int i;
-
-    kal_ast_node *node = malloc(sizeof(kal_ast_node));
+    kal_ast_node *node = kal_ast_alloc(arena, sizeof(kal_ast_node));
     node->type = KAL_AST_TYPE_PROTOTYPE;
-    node->prototype.name = strdup(name);
+    node->prototype.name = name;
     
     // Copy arguments.
-    node->prototype.args = malloc(sizeof(char*) * arg_count);
-    for(i=0; i<arg_count; i++) {
-        node->prototype.args[i] = strdup(args[i]);
+    node->prototype.args = kal_ast_alloc(arena, sizeof(kal_symbol) * arg_count);
+    if(arg_count > 0) {
+        memcpy(node->prototype.args, args, sizeof(kal_symbol) * arg_count);
     }
     node->prototype.arg_count = arg_count;
+    node->prototype.pure = false;
 
     return node;
 }
@@ -134,17 +279,21 @@ kal_ast_node *kal_ast_prototype_create(char *name, char **args,
 
 // Creates an AST node for a function declaration.
 //
+// arena     - The arena to allocate from or NULL to use the heap.
 // prototype - The definition for the function.
 // body      - The body expression.
 //
 // Returns a Function AST Node.
-kal_ast_node *kal_ast_function_create(kal_ast_node *prototype,
+kal_ast_node *kal_ast_function_create(kal_ast_arena *arena,
+                                      kal_ast_node *prototype,
                                       kal_ast_node *body)
 {
-    kal_ast_node *node = malloc(sizeof(kal_ast_node));
+    kal_ast_node *node = kal_ast_alloc(arena, sizeof(kal_ast_node));
     node->type = KAL_AST_TYPE_FUNCTION;
     node->function.prototype = prototype;
     node->function.body      = body;
+    node->function.memo      = false;
+    node->function.fast      = false;
     return node;
 }
 
@@ -155,16 +304,18 @@ kal_ast_node *kal_ast_function_create(kal_ast_node *prototype,
 
 // Creates an AST node for an if statement.
 //
+// arena      - The arena to allocate from or NULL to use the heap.
 // condition  - The condition to evaluate.
 // true_expr  - The expression to evaluate if the condition is true.
 // false_expr - The expression to evaluate if the condition is false.
 //
 // Returns a If Expression AST Node.
-kal_ast_node *kal_ast_if_expr_create(kal_ast_node *condition,
-                                         kal_ast_node *true_expr,
-                                         kal_ast_node *false_expr)
+kal_ast_node *kal_ast_if_expr_create(kal_ast_arena *arena,
+                                     kal_ast_node *condition,
+                                     kal_ast_node *true_expr,
+                                     kal_ast_node *false_expr)
 {
-    kal_ast_node *node = malloc(sizeof(kal_ast_node));
+    kal_ast_node *node = kal_ast_alloc(arena, sizeof(kal_ast_node));
     node->type = KAL_AST_TYPE_IF_EXPR;
     node->if_expr.condition = condition;
     node->if_expr.true_expr = true_expr;
@@ -173,11 +324,99 @@ kal_ast_node *kal_ast_if_expr_create(kal_ast_node *condition,
 }
 
 
+//--------------------------------------
+// For Expression AST
+//--------------------------------------
+
+// Creates an AST node for a for loop.
+//
+// arena     - The arena to allocate from or NULL to use the heap.
+// name      - The name of the loop variable.
+// start     - The initial value of the loop variable.
+// condition - The expression that keeps the loop going while it is true.
+// step      - The amount added to the loop variable after each pass or NULL
+//             to add 1.
+// body      - The body expression.
+//
+// Returns a For Expression AST Node.
+kal_ast_node *kal_ast_for_expr_create(kal_ast_arena *arena, kal_symbol name,
+                                      kal_ast_node *start,
+                                      kal_ast_node *condition,
+                                      kal_ast_node *step, kal_ast_node *body)
+{
+    kal_ast_node *node = kal_ast_alloc(arena, sizeof(kal_ast_node));
+    node->type = KAL_AST_TYPE_FOR_EXPR;
+    node->for_expr.name = name;
+    node->for_expr.start = start;
+    node->for_expr.condition = condition;
+    node->for_expr.step = step;
+    node->for_expr.body = body;
+    return node;
+}
+
+
+//--------------------------------------
+// Var Expression AST
+//--------------------------------------
+
+// Creates an AST node for a block of local variables.
+//
+// arena     - The arena to allocate from or NULL to use the heap.
+// names     - The variable names.
+// inits     - The initial value of each variable. Entries may be NULL.
+// var_count - The number of variables.
+// body      - The body expression.
+//
+// Returns a Var Expression AST Node.
+kal_ast_node *kal_ast_var_expr_create(kal_ast_arena *arena, kal_symbol *names,
+                                      kal_ast_node **inits, int var_count,
+                                      kal_ast_node *body)
+{
+    kal_ast_node *node = kal_ast_alloc(arena, sizeof(kal_ast_node));
+    node->type = KAL_AST_TYPE_VAR_EXPR;
+
+    // Copy the names and shallow copy the initializers.
+    node->var_expr.names = kal_ast_alloc(arena, sizeof(kal_symbol) * var_count);
+    node->var_expr.inits = kal_ast_alloc(arena, sizeof(kal_ast_node*) * var_count);
+    if(var_count > 0) {
+        memcpy(node->var_expr.names, names, sizeof(kal_symbol) * var_count);
+        memcpy(node->var_expr.inits, inits, sizeof(kal_ast_node*) * var_count);
+    }
+    node->var_expr.var_count = var_count;
+    node->var_expr.body = body;
+
+    return node;
+}
+
+
+//--------------------------------------
+// Assignment AST
+//--------------------------------------
+
+// Creates an AST node for an assignment.
+//
+// arena - The arena to allocate from or NULL to use the heap.
+// name  - The name of the variable being assigned.
+// value - The value to assign.
+//
+// Returns an Assignment AST Node.
+kal_ast_node *kal_ast_assign_create(kal_ast_arena *arena, kal_symbol name,
+                                    kal_ast_node *value)
+{
+    kal_ast_node *node = kal_ast_alloc(arena, sizeof(kal_ast_node));
+    node->type = KAL_AST_TYPE_ASSIGN;
+    node->assign.name = name;
+    node->assign.value = value;
+    return node;
+}
+
+
 //--------------------------------------
 // Node Lifecycle
 //--------------------------------------
 
-// Recursively frees an AST node.
+// Recursively frees an AST node. Nodes that were allocated from an arena are
+// released with the arena instead and must not be passed here.
 //
 // node - The node to free.
 void kal_ast_node_free(kal_ast_node *node)
@@ -189,17 +428,13 @@ void kal_ast_node_free(kal_ast_node *node)
     // Recursively free dependent data.
     switch(node->type) {
         case KAL_AST_TYPE_NUMBER: break;
-        case KAL_AST_TYPE_VARIABLE: {
-            if(node->variable.name) free(node->variable.name);
-            break;
-        }
+        case KAL_AST_TYPE_VARIABLE: break;
         case KAL_AST_TYPE_BINARY_EXPR: {
             if(node->binary_expr.lhs) kal_ast_node_free(node->binary_expr.lhs);
             if(node->binary_expr.rhs) kal_ast_node_free(node->binary_expr.rhs);
             break;
         }
         case KAL_AST_TYPE_CALL: {
-            if(node->call.name) free(node->call.name);
             for(i=0; i<node->call.arg_count; i++) {
                 kal_ast_node_free(node->call.args[i]);
             }
@@ -207,10 +442,6 @@ void kal_ast_node_free(kal_ast_node *node)
             break;
         }
         case KAL_AST_TYPE_PROTOTYPE: {
-            if(node->prototype.name) free(node->prototype.name);
-            for(i=0; i<node->prototype.arg_count; i++) {
-                free(node->prototype.args[i]);
-            }
             free(node->prototype.args);
             break;
         }
@@ -225,6 +456,26 @@ void kal_ast_node_free(kal_ast_node *node)
             if(node->if_expr.false_expr) kal_ast_node_free(node->if_expr.false_expr);
             break;
         }
+        case KAL_AST_TYPE_FOR_EXPR: {
+            if(node->for_expr.start) kal_ast_node_free(node->for_expr.start);
+            if(node->for_expr.condition) kal_ast_node_free(node->for_expr.condition);
+            if(node->for_expr.step) kal_ast_node_free(node->for_expr.step);
+            if(node->for_expr.body) kal_ast_node_free(node->for_expr.body);
+            break;
+        }
+        case KAL_AST_TYPE_VAR_EXPR: {
+            for(i=0; i<node->var_expr.var_count; i++) {
+                if(node->var_expr.inits[i]) kal_ast_node_free(node->var_expr.inits[i]);
+            }
+            free(node->var_expr.names);
+            free(node->var_expr.inits);
+            if(node->var_expr.body) kal_ast_node_free(node->var_expr.body);
+            break;
+        }
+        case KAL_AST_TYPE_ASSIGN: {
+            if(node->assign.value) kal_ast_node_free(node->assign.value);
+            break;
+        }
     }
     
     free(node);
@@ -1,6 +1,11 @@
 #ifndef _ast_h
 #define _ast_h
 
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "symbol.h"
+
 //==============================================================================
 //
 // Definitions
@@ -16,6 +21,9 @@ typedef enum kal_ast_node_type_e {
     KAL_AST_TYPE_PROTOTYPE,
     KAL_AST_TYPE_FUNCTION,
     KAL_AST_TYPE_IF_EXPR,
+    KAL_AST_TYPE_FOR_EXPR,
+    KAL_AST_TYPE_VAR_EXPR,
+    KAL_AST_TYPE_ASSIGN,
 } kal_ast_node_type_e;
 
 // Defines the types of binary expressions.
@@ -24,6 +32,12 @@ typedef enum kal_ast_binop_e {
     KAL_BINOP_MINUS,
     KAL_BINOP_MUL,
     KAL_BINOP_DIV,
+    KAL_BINOP_LT,
+    KAL_BINOP_LE,
+    KAL_BINOP_GT,
+    KAL_BINOP_GE,
+    KAL_BINOP_EQ,
+    KAL_BINOP_NE,
 } kal_ast_binop_e;
 
 
@@ -36,7 +50,7 @@ typedef struct kal_ast_number {
 
 // Represents a variable in the AST.
 typedef struct kal_ast_variable {
-    char *name;
+    kal_symbol name;
 } kal_ast_variable;
 
 // Represents a binary expression in the AST.
@@ -48,22 +62,28 @@ typedef struct kal_ast_binary_expr {
 
 // Represents a function call in the AST.
 typedef struct kal_ast_call {
-    char *name;
+    kal_symbol name;
     struct kal_ast_node **args;
     unsigned int arg_count;
 } kal_ast_call;
 
-// Represents a function prototype in the AST.
+// Represents a function prototype in the AST. `pure` is set for externs
+// declared as `extern pure`, which promise to have no side effects.
 typedef struct kal_ast_prototype {
-    char *name;
-    char **args;
+    kal_symbol name;
+    kal_symbol *args;
     unsigned int arg_count;
+    bool pure;
 } kal_ast_prototype;
 
-// Represents a function in the AST.
+// Represents a function in the AST. `memo` is set for definitions written
+// as `def memo` whose results should be cached and `fast` for ones written
+// as `def fast` that may use relaxed floating point rules.
 typedef struct kal_ast_function {
     struct kal_ast_node *prototype;
     struct kal_ast_node *body;
+    bool memo;
+    bool fast;
 } kal_ast_function;
 
 // Represents an if statement in the AST.
@@ -73,6 +93,34 @@ typedef struct kal_ast_if_expr {
     struct kal_ast_node *false_expr;
 } kal_ast_if_expr;
 
+// Represents a for loop in the AST. The variable starts at `start` and the
+// body runs while `condition` is true, adding `step` (1 if it is NULL) to
+// the variable after each pass. The loop itself evaluates to 0.
+typedef struct kal_ast_for_expr {
+    kal_symbol name;
+    struct kal_ast_node *start;
+    struct kal_ast_node *condition;
+    struct kal_ast_node *step;
+    struct kal_ast_node *body;
+} kal_ast_for_expr;
+
+// Represents a block of local variables in the AST. Each variable starts
+// at its initializer, or 0 if that is NULL, and is in scope for the
+// initializers after it and for the body.
+typedef struct kal_ast_var_expr {
+    kal_symbol *names;
+    struct kal_ast_node **inits;
+    unsigned int var_count;
+    struct kal_ast_node *body;
+} kal_ast_var_expr;
+
+// Represents an assignment to a variable in the AST. It evaluates to the
+// assigned value.
+typedef struct kal_ast_assign {
+    kal_symbol name;
+    struct kal_ast_node *value;
+} kal_ast_assign;
+
 // Represents an expression in the AST.
 typedef struct kal_ast_node {
     kal_ast_node_type_e type;
@@ -84,9 +132,34 @@ typedef struct kal_ast_node {
         kal_ast_prototype prototype;
         kal_ast_function function;
         kal_ast_if_expr if_expr;
+        kal_ast_for_expr for_expr;
+        kal_ast_var_expr var_expr;
+        kal_ast_assign assign;
     };
 } kal_ast_node;
 
+// Represents a single chunk of memory owned by an arena.
+typedef struct kal_ast_arena_block {
+    struct kal_ast_arena_block *next;
+    size_t size;
+    size_t used;
+    char data[];
+} kal_ast_arena_block;
+
+// Represents a region that nodes, names and argument arrays are allocated
+// from so that an entire parse can be released in a single call. The
+// counters cover everything since the last reset: `allocations` and `bytes`
+// are what was handed out while `blocks` and `capacity` are what actually
+// had to be requested from malloc, so `allocations - blocks` is the number
+// of mallocs (and frees) saved.
+typedef struct kal_ast_arena {
+    kal_ast_arena_block *head;
+    kal_ast_arena_block *current;
+    size_t allocations;
+    size_t bytes;
+    size_t blocks;
+    size_t capacity;
+} kal_ast_arena;
 
 
 //==============================================================================
@@ -95,24 +168,53 @@ typedef struct kal_ast_node {
 //
 //==============================================================================
 
-kal_ast_node *kal_ast_number_create(double value);
+//--------------------------------------
+// Arena
+//--------------------------------------
+
+kal_ast_arena *kal_ast_arena_create();
+
+void *kal_ast_arena_alloc(kal_ast_arena *arena, size_t size);
 
-kal_ast_node *kal_ast_variable_create(char *name);
+char *kal_ast_arena_strdup(kal_ast_arena *arena, const char *str);
 
-kal_ast_node *kal_ast_binary_expr_create(kal_ast_binop_e operator,
-    kal_ast_node *lhs, kal_ast_node *rhs);
+void kal_ast_arena_reset(kal_ast_arena *arena);
 
-kal_ast_node *kal_ast_call_create(char *name, kal_ast_node **args,
-    int arg_count);
+void kal_ast_arena_free(kal_ast_arena *arena);
 
-kal_ast_node *kal_ast_prototype_create(char *name, char **args,
-    int arg_count);
 
-kal_ast_node *kal_ast_function_create(kal_ast_node *prototype,
+//--------------------------------------
+// Nodes
+//--------------------------------------
+
+kal_ast_node *kal_ast_number_create(kal_ast_arena *arena, double value);
+
+kal_ast_node *kal_ast_variable_create(kal_ast_arena *arena, kal_symbol name);
+
+kal_ast_node *kal_ast_binary_expr_create(kal_ast_arena *arena,
+    kal_ast_binop_e operator, kal_ast_node *lhs, kal_ast_node *rhs);
+
+kal_ast_node *kal_ast_call_create(kal_ast_arena *arena, kal_symbol name,
+    kal_ast_node **args, int arg_count);
+
+kal_ast_node *kal_ast_prototype_create(kal_ast_arena *arena, kal_symbol name,
+    kal_symbol *args, int arg_count);
+
+kal_ast_node *kal_ast_function_create(kal_ast_arena *arena,
+    kal_ast_node *prototype, kal_ast_node *body);
+
+kal_ast_node *kal_ast_if_expr_create(kal_ast_arena *arena,
+    kal_ast_node *condition, kal_ast_node *true_expr, kal_ast_node *false_expr);
+
+kal_ast_node *kal_ast_for_expr_create(kal_ast_arena *arena, kal_symbol name,
+    kal_ast_node *start, kal_ast_node *condition, kal_ast_node *step,
     kal_ast_node *body);
 
-kal_ast_node *kal_ast_if_expr_create(kal_ast_node *condition,
-    kal_ast_node *true_expr, kal_ast_node *false_expr);
+kal_ast_node *kal_ast_var_expr_create(kal_ast_arena *arena, kal_symbol *names,
+    kal_ast_node **inits, int var_count, kal_ast_node *body);
+
+kal_ast_node *kal_ast_assign_create(kal_ast_arena *arena, kal_symbol name,
+    kal_ast_node *value);
 
 void kal_ast_node_free(kal_ast_node *node);
 
@@ -1,19 +1,36 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdbool.h>
 #include <llvm-c/Core.h>
 #include <llvm-c/Analysis.h>
 
 #include "codegen.h"
 
+
 //==============================================================================
 //
-// Variables
+// Typedefs
 //
 //==============================================================================
 
-// The look up for variables by name.
-kal_named_value *named_values = NULL;
+// What a memoized function's return needs from its lookup: the result
+// table, the argument bits that make up the key and the entry to store the
+// result in.
+typedef struct kal_codegen_memo {
+    LLVMValueRef table;
+    LLVMValueRef *keys;
+    unsigned int key_count;
+    LLVMValueRef slot;
+} kal_codegen_memo;
+
+// What a profiled function's returns need from its entry: the counters,
+// whether this is the outermost call and the cycle count it started at.
+typedef struct kal_codegen_profile {
+    LLVMValueRef counters;
+    LLVMValueRef outermost;
+    LLVMValueRef start;
+} kal_codegen_profile;
 
 
 //==============================================================================
@@ -28,12 +45,13 @@ kal_named_value *named_values = NULL;
 
 // Generates an LLVM value object for a Number AST.
 //
+// context - The compilation context.
 // node    - The node to generate code for.
 //
 // Returns an LLVM value reference.
-LLVMValueRef kal_codegen_number(kal_ast_node *node)
+LLVMValueRef kal_codegen_number(kal_context *context, kal_ast_node *node)
 {
-    return LLVMConstReal(LLVMDoubleType(), node->number.value);
+    return LLVMConstReal(LLVMDoubleTypeInContext(context->llvm), node->number.value);
 }
 
 
@@ -41,49 +59,127 @@ LLVMValueRef kal_codegen_number(kal_ast_node *node)
 // Variable
 //--------------------------------------
 
-// Generates an LLVM value object for a Variable AST.
+// Generates an LLVM value object for a Variable AST. Variables in stack
+// slots are loaded.
 //
+// context - The compilation context.
 // node    - The node to generate code for.
 //
 // Returns an LLVM value reference.
-LLVMValueRef kal_codegen_variable(kal_ast_node *node)
+LLVMValueRef kal_codegen_variable(kal_context *context, kal_ast_node *node)
 {
     // Lookup variable reference.
-    kal_named_value *val = NULL;
-    HASH_FIND_STR(named_values, node->variable.name, val);
+    kal_named_value *val = kal_codegen_named_value(context, node->variable.name);
     
-    if(val != NULL) {
-        return val->value;
+    if(val == NULL) {
+        return NULL;
+    }
+    else if(val->slot) {
+        return LLVMBuildLoad(context->builder, val->value, kal_symbol_name(node->variable.name));
     }
     else {
-        return NULL;
+        return val->value;
     }
 }
 
 
 //--------------------------------------
-// Variable
+// Binary Expression
 //--------------------------------------
 
-// Generates an LLVM value object for a Binary Expression AST.
+// Checks whether a value is a multiply that has just been generated and
+// isn't used by anything yet.
 //
-// node    - The node to generate code for.
+// value - The value.
+//
+// Returns true if the multiply can be fused into whatever uses it.
+static bool kal_codegen_is_fresh_fmul(LLVMValueRef value)
+{
+    return LLVMIsAInstruction(value) != NULL &&
+        LLVMGetInstructionOpcode(value) == LLVMFMul &&
+        LLVMGetFirstUse(value) == NULL;
+}
+
+// Fuses a multiply on either side of an add or subtract into a call to
+// llvm.fmuladd, which becomes a single FMA on targets that have one. The
+// multiply is removed.
+//
+// context  - The compilation context.
+// operator - The add or subtract.
+// lhs      - The left hand value.
+// rhs      - The right hand value.
+//
+// Returns the fused value or NULL if neither side is a fresh multiply.
+static LLVMValueRef kal_codegen_contract(kal_context *context,
+                                         kal_ast_binop_e operator,
+                                         LLVMValueRef lhs, LLVMValueRef rhs)
+{
+    LLVMValueRef mul, addend;
+    bool negate_mul = false, negate_addend = false;
+
+    if(kal_codegen_is_fresh_fmul(lhs)) {
+        mul = lhs;
+        addend = rhs;
+        negate_addend = (operator == KAL_BINOP_MINUS);
+    }
+    else if(kal_codegen_is_fresh_fmul(rhs)) {
+        mul = rhs;
+        addend = lhs;
+        negate_mul = (operator == KAL_BINOP_MINUS);
+    }
+    else {
+        return NULL;
+    }
+
+    // Negation is exact so a*b-c and c-a*b fuse as a*b+(-c) and (-a)*b+c.
+    LLVMValueRef args[3] = {LLVMGetOperand(mul, 0), LLVMGetOperand(mul, 1), addend};
+    if(negate_mul) {
+        args[0] = LLVMBuildFNeg(context->builder, args[0], "negtmp");
+    }
+    if(negate_addend) {
+        args[2] = LLVMBuildFNeg(context->builder, args[2], "negtmp");
+    }
+    LLVMInstructionEraseFromParent(mul);
+
+    LLVMTypeRef type = LLVMTypeOf(addend);
+    unsigned int id = LLVMLookupIntrinsicID("llvm.fmuladd", strlen("llvm.fmuladd"));
+    LLVMValueRef func = LLVMGetIntrinsicDeclaration(context->module, id, &type, 1);
+    return LLVMBuildCall(context->builder, func, args, 3, "fmatmp");
+}
+
+// Generates the instruction for a binary operator. Comparisons give 1 if
+// they hold and 0 if not. NaN compares false to everything, so only != holds
+// when either side is NaN. The operands may be doubles or vectors of them.
+// If the function being generated allows contraction then a multiply that
+// feeds an add or subtract is fused with it.
+//
+// context  - The compilation context.
+// operator - The operator.
+// lhs      - The left hand value.
+// rhs      - The right hand value.
 //
 // Returns an LLVM value reference.
-LLVMValueRef kal_codegen_binary_expr(kal_ast_node *node, LLVMModuleRef module,
-                                     LLVMBuilderRef builder)
+LLVMValueRef kal_codegen_binop(kal_context *context, kal_ast_binop_e operator,
+                               LLVMValueRef lhs, LLVMValueRef rhs)
 {
-    // Evaluate left and right hand values.
-    LLVMValueRef lhs = kal_codegen(node->binary_expr.lhs, module, builder);
-    LLVMValueRef rhs = kal_codegen(node->binary_expr.rhs, module, builder);
+    LLVMBuilderRef builder = context->builder;
 
     // Return NULL if one of the sides is invalid.
     if(lhs == NULL || rhs == NULL) {
         return NULL;
     }
+
+    if((context->function_fast_math & KAL_FAST_MATH_CONTRACT) != 0 &&
+       (operator == KAL_BINOP_PLUS || operator == KAL_BINOP_MINUS))
+    {
+        LLVMValueRef value = kal_codegen_contract(context, operator, lhs, rhs);
+        if(value != NULL) {
+            return value;
+        }
+    }
     
     // Create different IR code depending on the operator.
-    switch(node->binary_expr.operator) {
+    switch(operator) {
         case KAL_BINOP_PLUS: {
             return LLVMBuildFAdd(builder, lhs, rhs, "addtmp");
         }
@@ -96,26 +192,72 @@ LLVMValueRef kal_codegen_binary_expr(kal_ast_node *node, LLVMModuleRef module,
         case KAL_BINOP_DIV: {
             return LLVMBuildFDiv(builder, lhs, rhs, "divtmp");
         }
+        case KAL_BINOP_LT:
+        case KAL_BINOP_LE:
+        case KAL_BINOP_GT:
+        case KAL_BINOP_GE:
+        case KAL_BINOP_EQ:
+        case KAL_BINOP_NE: {
+            LLVMRealPredicate predicate;
+            switch(operator) {
+                case KAL_BINOP_LT: predicate = LLVMRealOLT; break;
+                case KAL_BINOP_LE: predicate = LLVMRealOLE; break;
+                case KAL_BINOP_GT: predicate = LLVMRealOGT; break;
+                case KAL_BINOP_GE: predicate = LLVMRealOGE; break;
+                case KAL_BINOP_EQ: predicate = LLVMRealOEQ; break;
+                default: predicate = LLVMRealUNE; break;
+            }
+            LLVMValueRef cmp = LLVMBuildFCmp(builder, predicate, lhs, rhs, "cmptmp");
+            return LLVMBuildUIToFP(builder, cmp, LLVMTypeOf(lhs), "booltmp");
+        }
     }
     
     return NULL;
 }
 
+// Generates an LLVM value object for a Binary Expression AST.
+//
+// context - The compilation context.
+// node    - The node to generate code for.
+//
+// Returns an LLVM value reference.
+LLVMValueRef kal_codegen_binary_expr(kal_context *context, kal_ast_node *node)
+{
+    // Evaluate left and right hand values.
+    context->tail = false;
+    LLVMValueRef lhs = kal_codegen(context, node->binary_expr.lhs);
+    LLVMValueRef rhs = kal_codegen(context, node->binary_expr.rhs);
+
+    return kal_codegen_binop(context, node->binary_expr.operator, lhs, rhs);
+}
+
 
 //--------------------------------------
 // Function Call
 //--------------------------------------
 
-// Generates an LLVM value object for a Function Call AST.
+// Generates an LLVM value object for a Function Call AST. A call from a
+// function to itself in tail position becomes a jump back to the start of
+// the function with the new arguments, so it never uses any stack. Other
+// recursive calls are reported since each one costs a stack frame.
 //
+// context - The compilation context.
 // node    - The node to generate code for.
 //
-// Returns an LLVM value reference.
-LLVMValueRef kal_codegen_call(kal_ast_node *node, LLVMModuleRef module,
-                              LLVMBuilderRef builder)
+// Returns an LLVM value reference. A self tail call returns undef and
+// leaves the current block terminated.
+LLVMValueRef kal_codegen_call(kal_context *context, kal_ast_node *node)
 {
+    bool tail = context->tail;
+    bool is_recursive = (node->call.name == context->function);
+    context->tail = false;
+    if(is_recursive && (!tail || context->tail_block == NULL)) {
+        fprintf(stderr, "Recursive call to %s is not in tail position\n",
+            kal_symbol_name(node->call.name));
+    }
+
     // Retrieve function.
-    LLVMValueRef func = LLVMGetNamedFunction(module, node->call.name);
+    LLVMValueRef func = kal_codegen_get_function(context, node->call.name);
     
     // Return error if function not found in module.
     if(func == NULL) {
@@ -132,7 +274,7 @@ LLVMValueRef kal_codegen_call(kal_ast_node *node, LLVMModuleRef module,
     unsigned int i;
     unsigned int arg_count = node->call.arg_count;
     for(i=0; i<arg_count; i++) {
-        args[i] = kal_codegen(node->call.args[i], module, builder);
+        args[i] = kal_codegen(context, node->call.args[i]);
 
         if(args[i] == NULL) {
             free(args);
@@ -140,8 +282,21 @@ LLVMValueRef kal_codegen_call(kal_ast_node *node, LLVMModuleRef module,
         }
     }
     
+    // Jump back to the top for a self tail call.
+    if(is_recursive && tail && context->tail_block != NULL) {
+        LLVMBasicBlockRef block = LLVMGetInsertBlock(context->builder);
+        for(i=0; i<arg_count; i++) {
+            LLVMAddIncoming(context->tail_args[i], &args[i], &block, 1);
+        }
+        free(args);
+        LLVMBuildBr(context->builder, context->tail_block);
+        return LLVMGetUndef(LLVMDoubleTypeInContext(context->llvm));
+    }
+
     // Create call instruction.
-    return LLVMBuildCall(builder, func, args, arg_count, "calltmp");
+    LLVMValueRef value = LLVMBuildCall(context->builder, func, args, arg_count, "calltmp");
+    free(args);
+    return value;
 }
 
 
@@ -149,18 +304,22 @@ LLVMValueRef kal_codegen_call(kal_ast_node *node, LLVMModuleRef module,
 // Function Prototype
 //--------------------------------------
 
-// Generates an LLVM value object for a Function Prototype AST.
+// Declares a function and adds its arguments to the named values lookup.
 //
-// node    - The node to generate code for.
+// context     - The compilation context.
+// name_symbol - The function name.
+// args        - The argument names.
+// arg_count   - The number of arguments.
 //
 // Returns an LLVM value reference.
-LLVMValueRef kal_codegen_prototype(kal_ast_node *node, LLVMModuleRef module)
+LLVMValueRef kal_codegen_declare(kal_context *context, kal_symbol name_symbol,
+                                 kal_symbol *args, unsigned int arg_count)
 {
     unsigned int i;
-    unsigned int arg_count = node->prototype.arg_count;
 
     // Use an existing definition if one exists.
-    LLVMValueRef func = LLVMGetNamedFunction(module, node->prototype.name);
+    const char *name = kal_symbol_name(name_symbol);
+    LLVMValueRef func = LLVMGetNamedFunction(context->module, name);
     if(func != NULL) {
         // Verify parameter count matches.
         if(LLVMCountParams(func) != arg_count) {
@@ -173,201 +332,2175 @@ LLVMValueRef kal_codegen_prototype(kal_ast_node *node, LLVMModuleRef module)
             fprintf(stderr, "Existing function exists with a body");
             return NULL;
         }
+        kal_codegen_add_function(context, name_symbol, arg_count);
+    }
+    // Verify the parameter count matches any earlier module's declaration.
+    else if(name_symbol < context->function_capacity &&
+            context->functions[name_symbol] != 0 &&
+            context->functions[name_symbol] != arg_count + 1)
+    {
+        fprintf(stderr, "Existing function exists with different parameter count");
+        return NULL;
     }
     // Otherwise create a new function definition.
     else {
-        // Create argument list.
-        LLVMTypeRef *params = malloc(sizeof(LLVMTypeRef) * arg_count);
-        for(i=0; i<arg_count; i++) {
-            params[i] = LLVMDoubleType();
-        }
-    
-        // Create function type.
-        LLVMTypeRef funcType = LLVMFunctionType(LLVMDoubleType(), params, arg_count, 0);
-    
-        // Create function.
-        func = LLVMAddFunction(module, node->prototype.name, funcType);
-        LLVMSetLinkage(func, LLVMExternalLinkage);
+        kal_codegen_add_function(context, name_symbol, arg_count);
+        func = kal_codegen_get_function(context, name_symbol);
     }
     
     // Assign arguments to named values lookup.
     for(i=0; i<arg_count; i++) {
         LLVMValueRef param = LLVMGetParam(func, i);
-        LLVMSetValueName(param, node->prototype.args[i]);
-        
-        kal_named_value *val = malloc(sizeof(kal_named_value));
-        val->name  = strdup(node->prototype.args[i]);
-        val->value = param;
-        HASH_ADD_KEYPTR(hh, named_values, val->name, strlen(val->name), val);
+        LLVMSetValueName(param, kal_symbol_name(args[i]));
+        kal_codegen_add_named_value(context, args[i], param);
     }
     
     return func;
 }
 
+// Generates an LLVM value object for a Function Prototype AST. Externs
+// declared pure are marked as having no side effects so calls to them can
+// be optimized like calls to pure definitions.
+//
+// context - The compilation context.
+// node    - The node to generate code for.
+//
+// Returns an LLVM value reference.
+LLVMValueRef kal_codegen_prototype(kal_context *context, kal_ast_node *node)
+{
+    LLVMValueRef func = kal_codegen_declare(context, node->prototype.name,
+        node->prototype.args, node->prototype.arg_count);
+    if(func != NULL && node->prototype.pure) {
+        kal_codegen_set_flags(context, node->prototype.name, KAL_FUNCTION_ALL);
+        kal_codegen_add_attributes(context, func, KAL_FUNCTION_ALL);
+    }
+    return func;
+}
+
 
 //--------------------------------------
-// Function
+// Effects
 //--------------------------------------
 
-// Generates an LLVM value object for a Function AST.
+// Works out what is known about an expression's effects from the functions
+// it calls. A call to the function being defined keeps it pure but means
+// it might never return, as does a loop. Local variables are private to
+// the call so they don't count as effects.
 //
-// node    - The node to generate code for.
+// context - The compilation context.
+// node    - The expression.
+// self    - The name of the function the expression is in.
 //
-// Returns an LLVM value reference.
-LLVMValueRef kal_codegen_function(kal_ast_node *node, LLVMModuleRef module,
-                                  LLVMBuilderRef builder)
+// Returns the expression's kal_function_flag_e flags.
+static uint8_t kal_codegen_expr_flags(kal_context *context, kal_ast_node *node,
+                                      kal_symbol self)
 {
-    HASH_CLEAR(hh, named_values);
-    
-    // Generate the prototype first.
-    LLVMValueRef func = kal_codegen(node->function.prototype, module, builder);
-    if(func == NULL) {
-        return NULL;
+    unsigned int i;
+    uint8_t flags;
+
+    switch(node->type) {
+        case KAL_AST_TYPE_BINARY_EXPR: {
+            return kal_codegen_expr_flags(context, node->binary_expr.lhs, self) &
+                kal_codegen_expr_flags(context, node->binary_expr.rhs, self);
+        }
+        case KAL_AST_TYPE_CALL: {
+            if(node->call.name == self) {
+                flags = KAL_FUNCTION_ALL & ~KAL_FUNCTION_WILLRETURN;
+            }
+            else if(node->call.name < context->function_capacity) {
+                flags = context->function_flags[node->call.name];
+            }
+            else {
+                flags = 0;
+            }
+            for(i=0; i<node->call.arg_count; i++) {
+                flags &= kal_codegen_expr_flags(context, node->call.args[i], self);
+            }
+            return flags;
+        }
+        case KAL_AST_TYPE_IF_EXPR: {
+            return kal_codegen_expr_flags(context, node->if_expr.condition, self) &
+                kal_codegen_expr_flags(context, node->if_expr.true_expr, self) &
+                kal_codegen_expr_flags(context, node->if_expr.false_expr, self);
+        }
+        case KAL_AST_TYPE_FOR_EXPR: {
+            flags = KAL_FUNCTION_ALL & ~KAL_FUNCTION_WILLRETURN;
+            flags &= kal_codegen_expr_flags(context, node->for_expr.start, self) &
+                kal_codegen_expr_flags(context, node->for_expr.condition, self) &
+                kal_codegen_expr_flags(context, node->for_expr.body, self);
+            if(node->for_expr.step != NULL) {
+                flags &= kal_codegen_expr_flags(context, node->for_expr.step, self);
+            }
+            return flags;
+        }
+        case KAL_AST_TYPE_VAR_EXPR: {
+            flags = kal_codegen_expr_flags(context, node->var_expr.body, self);
+            for(i=0; i<node->var_expr.var_count; i++) {
+                if(node->var_expr.inits[i] != NULL) {
+                    flags &= kal_codegen_expr_flags(context, node->var_expr.inits[i], self);
+                }
+            }
+            return flags;
+        }
+        case KAL_AST_TYPE_ASSIGN: {
+            return kal_codegen_expr_flags(context, node->assign.value, self);
+        }
+        default: {
+            return KAL_FUNCTION_ALL;
+        }
     }
-    
-    // Create basic block.
-    LLVMBasicBlockRef block = LLVMAppendBasicBlock(func, "entry");
-    LLVMPositionBuilderAtEnd(builder, block);
-    
-    // Generate body.
-    LLVMValueRef body = kal_codegen(node->function.body, module, builder);
-    if(body == NULL) {
-        LLVMDeleteFunction(func);
-        return NULL;
+}
+
+// Works out what is known about a function definition's effects. Externs
+// could do anything unless they are declared pure, so a definition is only
+// pure if everything it calls is a pure extern or an earlier pure
+// definition. Memoized functions write to their tables and profiled ones to
+// their counters, so neither counts as read-none.
+//
+// context - The compilation context.
+// node    - The function node.
+//
+// Returns the function's kal_function_flag_e flags.
+uint8_t kal_codegen_function_flags(kal_context *context, kal_ast_node *node)
+{
+    uint8_t flags = kal_codegen_expr_flags(context, node->function.body,
+        node->function.prototype->prototype.name);
+    if(kal_codegen_memoizes(context, node) || context->profile) {
+        flags &= ~KAL_FUNCTION_READNONE;
     }
-    
-    // Insert body as return vale.
-    LLVMBuildRet(builder, body);
-    
-    // Verify function.
-    if(LLVMVerifyFunction(func, LLVMPrintMessageAction) == 1) {
-        fprintf(stderr, "Invalid function");
-        LLVMDeleteFunction(func);
-        return NULL;
+    return flags;
+}
+
+// Adds the LLVM attributes that follow from a function's effects. With
+// them, passes such as GVN can merge repeated calls with the same
+// arguments and LICM can hoist calls out of loops.
+//
+// context - The compilation context.
+// func    - The function or declaration.
+// flags   - The function's kal_function_flag_e flags.
+void kal_codegen_add_attributes(kal_context *context, LLVMValueRef func,
+                                uint8_t flags)
+{
+    unsigned int i;
+    const char *names[] = {"nounwind", "readnone", "willreturn"};
+    uint8_t required[] = {KAL_FUNCTION_PURE, KAL_FUNCTION_READNONE, KAL_FUNCTION_WILLRETURN};
+
+    for(i=0; i<sizeof(names)/sizeof(*names); i++) {
+        if((flags & required[i]) != 0) {
+            unsigned int kind = LLVMGetEnumAttributeKindForName(names[i], strlen(names[i]));
+            LLVMAddAttributeAtIndex(func, LLVMAttributeFunctionIndex,
+                LLVMCreateEnumAttribute(context->llvm, kind, 0));
+        }
     }
-    
-    return func;
+}
+
+// Removes the LLVM attributes that kal_codegen_add_attributes() adds. A
+// definition's body decides its own effects, so anything promised by an
+// earlier `extern pure` declaration of the same function is dropped first.
+//
+// func - The function or declaration.
+//
+// Returns true if the function had any of the attributes.
+bool kal_codegen_remove_attributes(LLVMValueRef func)
+{
+    unsigned int i;
+    bool pure = false;
+    const char *names[] = {"nounwind", "readnone", "willreturn"};
+
+    for(i=0; i<sizeof(names)/sizeof(*names); i++) {
+        unsigned int kind = LLVMGetEnumAttributeKindForName(names[i], strlen(names[i]));
+        if(LLVMGetEnumAttributeAtIndex(func, LLVMAttributeFunctionIndex, kind) != NULL) {
+            LLVMRemoveEnumAttributeAtIndex(func, LLVMAttributeFunctionIndex, kind);
+            pure = true;
+        }
+    }
+    return pure;
+}
+
+// Checks whether a function definition's results will be cached. That
+// happens for pure functions with arguments that are defined with
+// `def memo` or that are compiled with memoization turned on for the whole
+// context.
+//
+// context - The compilation context.
+// node    - The function node.
+//
+// Returns true if the function will be memoized.
+bool kal_codegen_memoizes(kal_context *context, kal_ast_node *node)
+{
+    kal_ast_node *prototype = node->function.prototype;
+    return (node->function.memo || context->memo) && prototype->prototype.arg_count > 0 &&
+        (kal_codegen_expr_flags(context, node->function.body, prototype->prototype.name) & KAL_FUNCTION_PURE) != 0;
 }
 
 
 //--------------------------------------
-// If Expression
+// Fast Math
 //--------------------------------------
 
-// Generates an LLVM value object for an If Expression AST.
+// Works out which relaxed floating point rules a definition is compiled
+// with. These are the context's rules, or all of them for `def fast`.
 //
-// node    - The node to generate code for.
+// context - The compilation context.
+// node    - The function node.
 //
-// Returns an LLVM value reference.
-LLVMValueRef kal_codegen_if_expr(kal_ast_node *node, LLVMModuleRef module,
-                                 LLVMBuilderRef builder)
+// Returns the kal_fast_math_e rules.
+uint8_t kal_codegen_fast_math(kal_context *context, kal_ast_node *node)
 {
-    // Generate the condition.
-    LLVMValueRef condition = kal_codegen(node->if_expr.condition, module, builder);
-    if(condition == NULL) {
-        return NULL;
+    return context->fast_math | (node->function.fast ? KAL_FAST_MATH_ALL : 0);
+}
+
+// Adds the function attributes that let the backend apply relaxed floating
+// point rules. The C API can't set fast-math flags on single instructions
+// so these cover the whole function. Contraction needs no attribute since
+// it is done with llvm.fmuladd as the code is generated.
+//
+// context   - The compilation context.
+// func      - The function.
+// fast_math - The kal_fast_math_e rules.
+void kal_codegen_add_fast_math(kal_context *context, LLVMValueRef func,
+                               uint8_t fast_math)
+{
+    unsigned int i;
+    const char *names[] = {"no-nans-fp-math", "no-infs-fp-math", "no-signed-zeros-fp-math", "unsafe-fp-math"};
+    uint8_t required[] = {KAL_FAST_MATH_NNAN, KAL_FAST_MATH_NINF, KAL_FAST_MATH_REASSOC, KAL_FAST_MATH_REASSOC};
+
+    for(i=0; i<sizeof(names)/sizeof(*names); i++) {
+        if((fast_math & required[i]) != 0) {
+            LLVMAddAttributeAtIndex(func, LLVMAttributeFunctionIndex,
+                LLVMCreateStringAttribute(context->llvm, names[i], strlen(names[i]), "true", 4));
+        }
     }
-    
-    // Convert condition to bool.
-    LLVMValueRef zero = LLVMConstReal(LLVMDoubleType(), 0);
-    condition = LLVMBuildFCmp(builder, LLVMRealONE, condition, zero, "ifcond");
+}
 
-    // Retrieve function.
-    LLVMValueRef func = LLVMGetBasicBlockParent(LLVMGetInsertBlock(builder));
-    
-    // Generate true/false expr and merge.
-    LLVMBasicBlockRef then_block = LLVMAppendBasicBlock(func, "then");
-    LLVMBasicBlockRef else_block = LLVMAppendBasicBlock(func, "else");
-    LLVMBasicBlockRef merge_block = LLVMAppendBasicBlock(func, "ifcont");
-    
-    LLVMBuildCondBr(builder, condition, then_block, else_block);
 
-    // Generate 'then' block.
-    LLVMPositionBuilderAtEnd(builder, then_block);
-    LLVMValueRef then_value = kal_codegen(node->if_expr.true_expr, module, builder);
-    if(then_value == NULL) {
-        return NULL;
+//--------------------------------------
+// Memoization
+//--------------------------------------
+
+// Retrieves one of a function's memo or profile globals, creating it zeroed
+// if the module doesn't have it yet. The globals are visible outside the
+// module so that their counters can be read and so that a recompiled copy
+// of the function can share them.
+//
+// context - The compilation context.
+// name    - The global's name.
+// type    - The global's type.
+//
+// Returns the global.
+static LLVMValueRef kal_codegen_global(kal_context *context,
+                                       const char *name, LLVMTypeRef type)
+{
+    LLVMValueRef global = LLVMGetNamedGlobal(context->module, name);
+    if(global == NULL) {
+        global = LLVMAddGlobal(context->module, type, name);
+        LLVMSetInitializer(global, LLVMConstNull(type));
+        LLVMSetAlignment(global, 64);
     }
-    
-    LLVMBuildBr(builder, merge_block);
-    then_block = LLVMGetInsertBlock(builder);
-    
-    LLVMPositionBuilderAtEnd(builder, else_block);
-    LLVMValueRef else_value = kal_codegen(node->if_expr.false_expr, module, builder);
-    if(else_value == NULL) {
-        return NULL;
+    return global;
+}
+
+// Builds an atomic load or store of a table field.
+//
+// builder  - The LLVM builder.
+// ordering - The memory ordering.
+// ptr      - The field.
+// value    - The value to store or NULL to load.
+//
+// Returns the loaded value or the store instruction.
+static LLVMValueRef kal_codegen_memo_access(LLVMBuilderRef builder,
+                                            LLVMAtomicOrdering ordering,
+                                            LLVMValueRef ptr, LLVMValueRef value)
+{
+    LLVMValueRef inst = (value != NULL ? LLVMBuildStore(builder, value, ptr) : LLVMBuildLoad(builder, ptr, ""));
+    LLVMSetOrdering(inst, ordering);
+    LLVMSetAlignment(inst, 8);
+    return inst;
+}
+
+// Looks up a memoized function's arguments in its result table before the
+// body runs and returns the cached result if it is there. The table is a
+// fixed size open addressing hash table keyed on the bits of the arguments
+// and named after the function with a ".memo" suffix. Lookups check up to
+// KAL_CODEGEN_MEMO_PROBES entries and stop at the first empty one. Hits
+// and misses are counted in the ".memo.hits" and ".memo.misses" globals.
+//
+// Each entry has a version that is odd while it is being written, so
+// threads can share a table without locking: a reader that sees the
+// version change underneath it just treats the lookup as a miss.
+//
+// context - The compilation context.
+// func    - The function, positioned at the end of its entry block.
+// memo    - The state that kal_codegen_memo_store() needs. The keys array
+//           must be freed by the caller.
+static void kal_codegen_memo_lookup(kal_context *context, LLVMValueRef func,
+                                    kal_codegen_memo *memo)
+{
+    unsigned int i;
+    LLVMBuilderRef builder = context->builder;
+    LLVMTypeRef int64 = LLVMInt64TypeInContext(context->llvm);
+    LLVMTypeRef double_type = LLVMDoubleTypeInContext(context->llvm);
+    LLVMValueRef zero = LLVMConstInt(int64, 0, 0);
+    LLVMValueRef one = LLVMConstInt(int64, 1, 0);
+    unsigned int arg_count = LLVMCountParams(func);
+
+    // Find or create the table and counters.
+    size_t length;
+    const char *name = LLVMGetValueName2(func, &length);
+    char *global_name = malloc(length + 16);
+    LLVMTypeRef fields[] = {LLVMArrayType(int64, arg_count), double_type, int64};
+    LLVMTypeRef entry_type = LLVMStructTypeInContext(context->llvm, fields, 3, 0);
+    snprintf(global_name, length + 16, "%s.memo", name);
+    memo->table = kal_codegen_global(context, global_name,
+        LLVMArrayType(entry_type, 1 << KAL_CODEGEN_MEMO_BITS));
+    snprintf(global_name, length + 16, "%s.memo.hits", name);
+    LLVMValueRef hits = kal_codegen_global(context, global_name, int64);
+    snprintf(global_name, length + 16, "%s.memo.misses", name);
+    LLVMValueRef misses = kal_codegen_global(context, global_name, int64);
+    free(global_name);
+
+    // Hash the argument bits. The top bits of the hash pick the home entry.
+    memo->key_count = arg_count;
+    memo->keys = malloc(sizeof(LLVMValueRef) * arg_count);
+    LLVMValueRef hash = zero;
+    for(i=0; i<arg_count; i++) {
+        memo->keys[i] = LLVMBuildBitCast(builder, LLVMGetParam(func, i), int64, "key");
+        hash = LLVMBuildXor(builder, hash, memo->keys[i], "");
+        hash = LLVMBuildMul(builder, hash, LLVMConstInt(int64, 0x9E3779B97F4A7C15ULL, 0), "hash");
     }
-    LLVMBuildBr(builder, merge_block);
-    else_block = LLVMGetInsertBlock(builder);
+    LLVMValueRef home = LLVMBuildLShr(builder, hash,
+        LLVMConstInt(int64, 64 - KAL_CODEGEN_MEMO_BITS, 0), "memo.home");
 
-    LLVMPositionBuilderAtEnd(builder, merge_block);
-    LLVMValueRef phi = LLVMBuildPhi(builder, LLVMDoubleType (), "");
-    LLVMAddIncoming(phi, &then_value, &then_block, 1);
-    LLVMAddIncoming(phi, &else_value, &else_block, 1);
-    
-    return phi;
+    LLVMBasicBlockRef entry_block = LLVMGetInsertBlock(builder);
+    LLVMBasicBlockRef probe_block = LLVMAppendBasicBlockInContext(context->llvm, func, "memo.probe");
+    LLVMBasicBlockRef check_block = LLVMAppendBasicBlockInContext(context->llvm, func, "memo.check");
+    LLVMBasicBlockRef hit_block = LLVMAppendBasicBlockInContext(context->llvm, func, "memo.hit");
+    LLVMBasicBlockRef next_block = LLVMAppendBasicBlockInContext(context->llvm, func, "memo.next");
+    LLVMBasicBlockRef miss_block = LLVMAppendBasicBlockInContext(context->llvm, func, "memo.miss");
+    LLVMBuildBr(builder, probe_block);
+
+    // Stop at an empty entry since nothing is ever stored past one.
+    LLVMPositionBuilderAtEnd(builder, probe_block);
+    LLVMValueRef probe = LLVMBuildPhi(builder, int64, "memo.probe");
+    LLVMAddIncoming(probe, &zero, &entry_block, 1);
+    LLVMValueRef slot = LLVMBuildAnd(builder, LLVMBuildAdd(builder, home, probe, ""),
+        LLVMConstInt(int64, (1 << KAL_CODEGEN_MEMO_BITS) - 1, 0), "memo.slot");
+    LLVMValueRef indices[] = {zero, slot};
+    LLVMValueRef entry = LLVMBuildInBoundsGEP(builder, memo->table, indices, 2, "");
+    LLVMValueRef version_ptr = LLVMBuildStructGEP(builder, entry, 2, "");
+    LLVMValueRef version = kal_codegen_memo_access(builder, LLVMAtomicOrderingAcquire, version_ptr, NULL);
+    LLVMBuildCondBr(builder, LLVMBuildICmp(builder, LLVMIntEQ, version, zero, ""),
+        miss_block, check_block);
+
+    // Compare the keys and make sure the entry didn't change while reading.
+    LLVMPositionBuilderAtEnd(builder, check_block);
+    LLVMValueRef match = LLVMBuildICmp(builder, LLVMIntEQ,
+        LLVMBuildAnd(builder, version, one, ""), zero, "");
+    LLVMValueRef keys_ptr = LLVMBuildStructGEP(builder, entry, 0, "");
+    for(i=0; i<arg_count; i++) {
+        LLVMValueRef key_indices[] = {zero, LLVMConstInt(int64, i, 0)};
+        LLVMValueRef key = kal_codegen_memo_access(builder, LLVMAtomicOrderingMonotonic,
+            LLVMBuildInBoundsGEP(builder, keys_ptr, key_indices, 2, ""), NULL);
+        match = LLVMBuildAnd(builder, match, LLVMBuildICmp(builder, LLVMIntEQ, key, memo->keys[i], ""), "");
+    }
+    LLVMValueRef value = kal_codegen_memo_access(builder, LLVMAtomicOrderingMonotonic,
+        LLVMBuildStructGEP(builder, entry, 1, ""), NULL);
+    LLVMBuildFence(builder, LLVMAtomicOrderingAcquire, 0, "");
+    LLVMValueRef again = kal_codegen_memo_access(builder, LLVMAtomicOrderingMonotonic, version_ptr, NULL);
+    match = LLVMBuildAnd(builder, match, LLVMBuildICmp(builder, LLVMIntEQ, again, version, ""), "memo.match");
+    LLVMBuildCondBr(builder, match, hit_block, next_block);
+
+    LLVMPositionBuilderAtEnd(builder, hit_block);
+    LLVMBuildAtomicRMW(builder, LLVMAtomicRMWBinOpAdd, hits, one, LLVMAtomicOrderingMonotonic, 0);
+    LLVMBuildRet(builder, value);
+
+    LLVMPositionBuilderAtEnd(builder, next_block);
+    LLVMValueRef next = LLVMBuildAdd(builder, probe, one, "");
+    LLVMAddIncoming(probe, &next, &next_block, 1);
+    LLVMBuildCondBr(builder, LLVMBuildICmp(builder, LLVMIntULT, next,
+        LLVMConstInt(int64, KAL_CODEGEN_MEMO_PROBES, 0), ""), probe_block, miss_block);
+
+    // A miss goes in the empty entry if there was one or else replaces the
+    // home entry.
+    LLVMPositionBuilderAtEnd(builder, miss_block);
+    memo->slot = LLVMBuildPhi(builder, int64, "memo.insert");
+    LLVMValueRef slots[] = {slot, home};
+    LLVMBasicBlockRef blocks[] = {probe_block, next_block};
+    LLVMAddIncoming(memo->slot, slots, blocks, 2);
+    LLVMBuildAtomicRMW(builder, LLVMAtomicRMWBinOpAdd, misses, one, LLVMAtomicOrderingMonotonic, 0);
+}
+
+// Stores a memoized function's result in the entry picked by the lookup.
+// The entry is claimed by making its version odd, so if another thread is
+// already writing it then the result just isn't stored.
+//
+// context - The compilation context.
+// func    - The function.
+// memo    - The state from kal_codegen_memo_lookup().
+// result  - The value being returned.
+static void kal_codegen_memo_store(kal_context *context, LLVMValueRef func,
+                                   kal_codegen_memo *memo, LLVMValueRef result)
+{
+    unsigned int i;
+    LLVMBuilderRef builder = context->builder;
+    LLVMTypeRef int64 = LLVMInt64TypeInContext(context->llvm);
+    LLVMValueRef zero = LLVMConstInt(int64, 0, 0);
+    LLVMValueRef one = LLVMConstInt(int64, 1, 0);
+
+    LLVMBasicBlockRef claim_block = LLVMAppendBasicBlockInContext(context->llvm, func, "memo.claim");
+    LLVMBasicBlockRef write_block = LLVMAppendBasicBlockInContext(context->llvm, func, "memo.write");
+    LLVMBasicBlockRef done_block = LLVMAppendBasicBlockInContext(context->llvm, func, "memo.done");
+
+    LLVMValueRef indices[] = {zero, memo->slot};
+    LLVMValueRef entry = LLVMBuildInBoundsGEP(builder, memo->table, indices, 2, "");
+    LLVMValueRef version_ptr = LLVMBuildStructGEP(builder, entry, 2, "");
+    LLVMValueRef version = kal_codegen_memo_access(builder, LLVMAtomicOrderingMonotonic, version_ptr, NULL);
+    LLVMBuildCondBr(builder, LLVMBuildICmp(builder, LLVMIntEQ,
+        LLVMBuildAnd(builder, version, one, ""), zero, ""), claim_block, done_block);
+
+    LLVMPositionBuilderAtEnd(builder, claim_block);
+    LLVMValueRef claimed = LLVMBuildAtomicCmpXchg(builder, version_ptr, version,
+        LLVMBuildAdd(builder, version, one, ""), LLVMAtomicOrderingAcquire,
+        LLVMAtomicOrderingMonotonic, 0);
+    LLVMBuildCondBr(builder, LLVMBuildExtractValue(builder, claimed, 1, ""), write_block, done_block);
+
+    LLVMPositionBuilderAtEnd(builder, write_block);
+    LLVMValueRef keys_ptr = LLVMBuildStructGEP(builder, entry, 0, "");
+    for(i=0; i<memo->key_count; i++) {
+        LLVMValueRef key_indices[] = {zero, LLVMConstInt(int64, i, 0)};
+        kal_codegen_memo_access(builder, LLVMAtomicOrderingMonotonic,
+            LLVMBuildInBoundsGEP(builder, keys_ptr, key_indices, 2, ""), memo->keys[i]);
+    }
+    kal_codegen_memo_access(builder, LLVMAtomicOrderingMonotonic,
+        LLVMBuildStructGEP(builder, entry, 1, ""), result);
+    kal_codegen_memo_access(builder, LLVMAtomicOrderingRelease, version_ptr,
+        LLVMBuildAdd(builder, version, LLVMConstInt(int64, 2, 0), ""));
+    LLVMBuildBr(builder, done_block);
+
+    LLVMPositionBuilderAtEnd(builder, done_block);
+}
+
+
+//--------------------------------------
+// Profiling
+//--------------------------------------
+
+// Counts a call to a profiled function and reads the cycle counter as it
+// starts. The counters are an { i64 calls, i64 cycles, i64 depth } global
+// named after the function with a KAL_CODEGEN_PROFILE_SUFFIX suffix.
+// `depth` is the number of calls to the function that are running so that
+// only the outermost one adds its cycles, which keeps recursive functions
+// from being counted more than once. It is shared by every thread, so when
+// calls on different threads overlap only the first to start adds its
+// cycles and the total is only exact for single-threaded runs.
+//
+// context - The compilation context.
+// func    - The function, positioned at the start of its entry block.
+// profile - The state that kal_codegen_profile_exit() needs.
+static void kal_codegen_profile_enter(kal_context *context, LLVMValueRef func,
+                                      kal_codegen_profile *profile)
+{
+    LLVMBuilderRef builder = context->builder;
+    LLVMTypeRef int64 = LLVMInt64TypeInContext(context->llvm);
+    LLVMValueRef one = LLVMConstInt(int64, 1, 0);
+
+    size_t length;
+    const char *name = LLVMGetValueName2(func, &length);
+    size_t global_length = length + strlen(KAL_CODEGEN_PROFILE_SUFFIX) + 1;
+    char *global_name = malloc(global_length);
+    snprintf(global_name, global_length, "%s%s", name, KAL_CODEGEN_PROFILE_SUFFIX);
+    LLVMTypeRef fields[] = {int64, int64, int64};
+    profile->counters = kal_codegen_global(context, global_name,
+        LLVMStructTypeInContext(context->llvm, fields, 3, 0));
+    free(global_name);
+
+    LLVMBuildAtomicRMW(builder, LLVMAtomicRMWBinOpAdd,
+        LLVMBuildStructGEP(builder, profile->counters, 0, ""), one, LLVMAtomicOrderingMonotonic, 0);
+    LLVMValueRef depth = LLVMBuildAtomicRMW(builder, LLVMAtomicRMWBinOpAdd,
+        LLVMBuildStructGEP(builder, profile->counters, 2, ""), one, LLVMAtomicOrderingMonotonic, 0);
+    profile->outermost = LLVMBuildICmp(builder, LLVMIntEQ, depth,
+        LLVMConstInt(int64, 0, 0), "profile.outermost");
+
+    unsigned int id = LLVMLookupIntrinsicID("llvm.readcyclecounter", strlen("llvm.readcyclecounter"));
+    LLVMValueRef counter = LLVMGetIntrinsicDeclaration(context->module, id, NULL, 0);
+    profile->start = LLVMBuildCall(builder, counter, NULL, 0, "profile.start");
 }
 
+// Adds the cycles a call took to a profiled function's counters in front of
+// every return. This runs once the body is complete so that it also catches
+// the returns that memoization adds.
+//
+// context - The compilation context.
+// func    - The function.
+// profile - The state from kal_codegen_profile_enter().
+static void kal_codegen_profile_exit(kal_context *context, LLVMValueRef func,
+                                     kal_codegen_profile *profile)
+{
+    LLVMBuilderRef builder = context->builder;
+    LLVMTypeRef int64 = LLVMInt64TypeInContext(context->llvm);
+    LLVMValueRef zero = LLVMConstInt(int64, 0, 0);
+
+    unsigned int id = LLVMLookupIntrinsicID("llvm.readcyclecounter", strlen("llvm.readcyclecounter"));
+    LLVMValueRef counter = LLVMGetIntrinsicDeclaration(context->module, id, NULL, 0);
 
+    LLVMBasicBlockRef block;
+    for(block = LLVMGetFirstBasicBlock(func); block != NULL; block = LLVMGetNextBasicBlock(block)) {
+        LLVMValueRef ret = LLVMGetBasicBlockTerminator(block);
+        if(ret == NULL || LLVMGetInstructionOpcode(ret) != LLVMRet) {
+            continue;
+        }
+
+        LLVMPositionBuilderBefore(builder, ret);
+        LLVMValueRef end = LLVMBuildCall(builder, counter, NULL, 0, "profile.end");
+        LLVMBuildAtomicRMW(builder, LLVMAtomicRMWBinOpSub,
+            LLVMBuildStructGEP(builder, profile->counters, 2, ""),
+            LLVMConstInt(int64, 1, 0), LLVMAtomicOrderingMonotonic, 0);
+        LLVMValueRef cycles = LLVMBuildSelect(builder, profile->outermost,
+            LLVMBuildSub(builder, end, profile->start, ""), zero, "profile.cycles");
+        LLVMBuildAtomicRMW(builder, LLVMAtomicRMWBinOpAdd,
+            LLVMBuildStructGEP(builder, profile->counters, 1, ""), cycles, LLVMAtomicOrderingMonotonic, 0);
+    }
+}
 
 
 //--------------------------------------
-// Code Generation
+// Function
 //--------------------------------------
 
-// Recursively generates LLVM objects to build the code.
+// Removes a function whose body could not be generated. If other functions
+// already call it then it is replaced by a bare declaration so that those
+// calls stay valid.
 //
-// node    - The node to generate code for.
-// module  - The module that the code is being generated for.
-// builder - The LLVM builder that is creating the IR.
+// context - The compilation context.
+// func    - The function to remove.
+void kal_codegen_discard_function(kal_context *context, LLVMValueRef func)
+{
+    if(LLVMGetFirstUse(func) == NULL) {
+        LLVMDeleteFunction(func);
+        return;
+    }
+
+    LLVMTypeRef type = LLVMGetElementType(LLVMTypeOf(func));
+    LLVMValueRef decl = LLVMAddFunction(context->module, "", type);
+    LLVMSetLinkage(decl, LLVMExternalLinkage);
+    LLVMReplaceAllUsesWith(func, decl);
+
+    const char *value_name = LLVMGetValueName(func);
+    char *name = malloc(strlen(value_name) + 1);
+    strcpy(name, value_name);
+    LLVMDeleteFunction(func);
+    LLVMSetValueName(decl, name);
+    free(name);
+}
+
+// Checks whether an expression calls a function from a tail position.
 //
-// Returns an LLVM value reference.
-LLVMValueRef kal_codegen(kal_ast_node *node, LLVMModuleRef module,
-                         LLVMBuilderRef builder)
+// node - The expression, which is in tail position itself.
+// name - The function.
+//
+// Returns true if there is a tail call to the function.
+bool kal_codegen_has_tail_call(kal_ast_node *node, kal_symbol name)
 {
-    // Recursively free dependent data.
     switch(node->type) {
-        case KAL_AST_TYPE_NUMBER: {
-            return kal_codegen_number(node);
-        }
-        case KAL_AST_TYPE_VARIABLE: {
-            return kal_codegen_variable(node);
-        }
-        case KAL_AST_TYPE_BINARY_EXPR: {
-            return kal_codegen_binary_expr(node, module, builder);
-        }
         case KAL_AST_TYPE_CALL: {
-            return kal_codegen_call(node, module, builder);
+            return node->call.name == name;
         }
-        case KAL_AST_TYPE_PROTOTYPE: {
-            return kal_codegen_prototype(node, module);
+        case KAL_AST_TYPE_IF_EXPR: {
+            return kal_codegen_has_tail_call(node->if_expr.true_expr, name) ||
+                kal_codegen_has_tail_call(node->if_expr.false_expr, name);
         }
-        case KAL_AST_TYPE_FUNCTION: {
-            return kal_codegen_function(node, module, builder);
+        case KAL_AST_TYPE_VAR_EXPR: {
+            return kal_codegen_has_tail_call(node->var_expr.body, name);
         }
-        case KAL_AST_TYPE_IF_EXPR: {
-            return kal_codegen_if_expr(node, module, builder);
+        default: {
+            return false;
         }
     }
-    
-    return NULL;
 }
 
+// Sets up a loop for a function that calls itself from a tail position. The
+// entry block falls through to a block with a phi for each argument, and
+// the arguments are looked up through the phis from then on so that a self
+// tail call only has to jump back with new values.
+//
+// context   - The compilation context.
+// func      - The function.
+// args      - The argument names.
+// arg_count - The number of arguments.
+void kal_codegen_tail_loop(kal_context *context, LLVMValueRef func,
+                           kal_symbol *args, unsigned int arg_count)
+{
+    unsigned int i;
+    LLVMBasicBlockRef entry = LLVMGetInsertBlock(context->builder);
 
-//--------------------------------------
-// Utility
-//--------------------------------------
+    context->tail_block = LLVMAppendBasicBlockInContext(context->llvm, func, "tailrecurse");
+    LLVMBuildBr(context->builder, context->tail_block);
+    LLVMPositionBuilderAtEnd(context->builder, context->tail_block);
 
-// Clears the named variables.
-void kal_codegen_reset()
-{
-    HASH_CLEAR(hh, named_values);
+    free(context->tail_args);
+    context->tail_args = malloc(sizeof(LLVMValueRef) * (arg_count > 0 ? arg_count : 1));
+    kal_codegen_reset(context);
+    for(i=0; i<arg_count; i++) {
+        LLVMValueRef param = LLVMGetParam(func, i);
+        LLVMValueRef phi = LLVMBuildPhi(context->builder, LLVMDoubleTypeInContext(context->llvm),
+            kal_symbol_name(args[i]));
+        LLVMAddIncoming(phi, &param, &entry, 1);
+        context->tail_args[i] = phi;
+        kal_codegen_add_named_value(context, args[i], phi);
+    }
 }
 
-// Clears the named variables.
-kal_named_value *kal_codegen_named_value(const char *name)
-{
-    kal_named_value *val = NULL;
-    HASH_FIND_STR(named_values, name, val);
-    return val;
+// Generates an LLVM value object for a Function AST. Self calls in tail
+// position are turned into a loop here rather than left to the optimizer,
+// so they never grow the stack whatever the optimization level. Memoized
+// functions check their result table before the loop. Arguments that the
+// body assigns to are copied into stack slots. When the context profiles,
+// calls and cycles are counted around all of it.
+//
+// context - The compilation context.
+// node    - The node to generate code for.
+//
+// Returns an LLVM value reference.
+LLVMValueRef kal_codegen_function(kal_context *context, kal_ast_node *node)
+{
+    kal_codegen_memo memo = {NULL, NULL, 0, NULL};
+    kal_codegen_profile profile = {NULL, NULL, NULL};
+    kal_symbol name = node->function.prototype->prototype.name;
+    uint8_t flags = kal_codegen_function_flags(context, node);
+    bool memoize = kal_codegen_memoizes(context, node);
+    if(node->function.memo && (flags & KAL_FUNCTION_PURE) == 0) {
+        fprintf(stderr, "Not memoizing %s since it isn't pure\n", kal_symbol_name(name));
+    }
+
+    kal_codegen_reset(context);
+    
+    // Generate the prototype first.
+    LLVMValueRef func = kal_codegen(context, node->function.prototype);
+    if(func == NULL) {
+        return NULL;
+    }
+    if(kal_codegen_remove_attributes(func) && (flags & KAL_FUNCTION_PURE) == 0) {
+        fprintf(stderr, "%s was declared pure but has side effects\n", kal_symbol_name(name));
+    }
+    
+    // Create basic block.
+    LLVMBasicBlockRef block = LLVMAppendBasicBlockInContext(context->llvm, func, "entry");
+    LLVMPositionBuilderAtEnd(context->builder, block);
+
+    if(context->profile) {
+        kal_codegen_profile_enter(context, func, &profile);
+    }
+    if(memoize) {
+        kal_codegen_memo_lookup(context, func, &memo);
+    }
+    if(kal_codegen_has_tail_call(node->function.body, name)) {
+        kal_codegen_tail_loop(context, func, node->function.prototype->prototype.args,
+            node->function.prototype->prototype.arg_count);
+    }
+    kal_codegen_spill_args(context, node->function.prototype, node->function.body);
+    
+    // Generate body.
+    context->function = name;
+    context->function_fast_math = kal_codegen_fast_math(context, node);
+    context->tail = true;
+    LLVMValueRef body = kal_codegen(context, node->function.body);
+    context->function = KAL_SYMBOL_NONE;
+    context->function_fast_math = 0;
+    context->tail = false;
+    context->tail_block = NULL;
+    if(body == NULL) {
+        free(memo.keys);
+        kal_codegen_discard_function(context, func);
+        return NULL;
+    }
+    
+    // Insert body as return vale unless the body ended in a self tail call.
+    if(LLVMGetBasicBlockTerminator(LLVMGetInsertBlock(context->builder)) == NULL) {
+        if(memoize) {
+            kal_codegen_memo_store(context, func, &memo, body);
+        }
+        LLVMBuildRet(context->builder, body);
+    }
+    free(memo.keys);
+    if(context->profile) {
+        kal_codegen_profile_exit(context, func, &profile);
+    }
+    
+    // Verify function.
+    if(LLVMVerifyFunction(func, LLVMPrintMessageAction) == 1) {
+        fprintf(stderr, "Invalid function");
+        kal_codegen_discard_function(context, func);
+        return NULL;
+    }
+    
+    kal_codegen_set_flags(context, name, flags);
+    kal_codegen_add_attributes(context, func, flags);
+    kal_codegen_add_fast_math(context, func, kal_codegen_fast_math(context, node));
+    kal_target_add_attributes(context->target, context->llvm, func);
+    return func;
+}
+
+
+//--------------------------------------
+// If Expression
+//--------------------------------------
+
+// Checks whether an expression is cheap to compute and has no effects, which
+// means it only does arithmetic on numbers and variables. Each node uses up
+// one from the budget.
+//
+// node   - The expression.
+// budget - The number of nodes left.
+//
+// Returns true if the expression fits in the budget.
+static bool kal_codegen_is_cheap(kal_ast_node *node, unsigned int *budget)
+{
+    if(*budget == 0) {
+        return false;
+    }
+    (*budget)--;
+
+    switch(node->type) {
+        case KAL_AST_TYPE_NUMBER:
+        case KAL_AST_TYPE_VARIABLE: {
+            return true;
+        }
+        case KAL_AST_TYPE_BINARY_EXPR: {
+            return kal_codegen_is_cheap(node->binary_expr.lhs, budget) &&
+                kal_codegen_is_cheap(node->binary_expr.rhs, budget);
+        }
+        case KAL_AST_TYPE_IF_EXPR: {
+            return kal_codegen_is_cheap(node->if_expr.condition, budget) &&
+                kal_codegen_is_cheap(node->if_expr.true_expr, budget) &&
+                kal_codegen_is_cheap(node->if_expr.false_expr, budget);
+        }
+        default: {
+            return false;
+        }
+    }
+}
+
+// Generates an LLVM value object for an If Expression AST. When both
+// branches are cheap and have no effects they are both computed and one is
+// selected, which costs less than a mispredicted branch. Otherwise both
+// branches are in tail position if the if expression is and a branch that
+// ends in a self tail call jumps away instead of reaching the merge block.
+//
+// context - The compilation context.
+// node    - The node to generate code for.
+//
+// Returns an LLVM value reference.
+LLVMValueRef kal_codegen_if_expr(kal_context *context, kal_ast_node *node)
+{
+    bool tail = context->tail;
+    unsigned int incoming_count = 0;
+    LLVMValueRef incoming_values[2];
+    LLVMBasicBlockRef incoming_blocks[2];
+
+    // Generate the condition.
+    context->tail = false;
+    LLVMValueRef condition = kal_codegen(context, node->if_expr.condition);
+    if(condition == NULL) {
+        return NULL;
+    }
+    
+    // Convert condition to bool.
+    LLVMValueRef zero = LLVMConstReal(LLVMDoubleTypeInContext(context->llvm), 0);
+    condition = LLVMBuildFCmp(context->builder, LLVMRealONE, condition, zero, "ifcond");
+
+    // Select between cheap branches.
+    unsigned int budget = KAL_CODEGEN_SELECT_MAX_NODES;
+    if(kal_codegen_is_cheap(node->if_expr.true_expr, &budget) &&
+       kal_codegen_is_cheap(node->if_expr.false_expr, &budget))
+    {
+        LLVMValueRef then_value = kal_codegen(context, node->if_expr.true_expr);
+        LLVMValueRef else_value = kal_codegen(context, node->if_expr.false_expr);
+        if(then_value == NULL || else_value == NULL) {
+            return NULL;
+        }
+        return LLVMBuildSelect(context->builder, condition, then_value, else_value, "iftmp");
+    }
+
+    // Retrieve function.
+    LLVMValueRef func = LLVMGetBasicBlockParent(LLVMGetInsertBlock(context->builder));
+    
+    // Generate true/false expr and merge.
+    LLVMBasicBlockRef then_block = LLVMAppendBasicBlockInContext(context->llvm, func, "then");
+    LLVMBasicBlockRef else_block = LLVMAppendBasicBlockInContext(context->llvm, func, "else");
+    LLVMBasicBlockRef merge_block = LLVMAppendBasicBlockInContext(context->llvm, func, "ifcont");
+    
+    LLVMBuildCondBr(context->builder, condition, then_block, else_block);
+
+    // Generate 'then' block.
+    LLVMPositionBuilderAtEnd(context->builder, then_block);
+    context->tail = tail;
+    LLVMValueRef then_value = kal_codegen(context, node->if_expr.true_expr);
+    if(then_value == NULL) {
+        return NULL;
+    }
+    
+    then_block = LLVMGetInsertBlock(context->builder);
+    if(LLVMGetBasicBlockTerminator(then_block) == NULL) {
+        LLVMBuildBr(context->builder, merge_block);
+        incoming_values[incoming_count] = then_value;
+        incoming_blocks[incoming_count++] = then_block;
+    }
+    
+    LLVMPositionBuilderAtEnd(context->builder, else_block);
+    context->tail = tail;
+    LLVMValueRef else_value = kal_codegen(context, node->if_expr.false_expr);
+    if(else_value == NULL) {
+        return NULL;
+    }
+    else_block = LLVMGetInsertBlock(context->builder);
+    if(LLVMGetBasicBlockTerminator(else_block) == NULL) {
+        LLVMBuildBr(context->builder, merge_block);
+        incoming_values[incoming_count] = else_value;
+        incoming_blocks[incoming_count++] = else_block;
+    }
+
+    // If both branches jump back to the top then nothing reaches the merge.
+    LLVMPositionBuilderAtEnd(context->builder, merge_block);
+    if(incoming_count == 0) {
+        LLVMBuildUnreachable(context->builder);
+        return LLVMGetUndef(LLVMDoubleTypeInContext(context->llvm));
+    }
+    LLVMValueRef phi = LLVMBuildPhi(context->builder, LLVMDoubleTypeInContext(context->llvm), "");
+    LLVMAddIncoming(phi, incoming_values, incoming_blocks, incoming_count);
+    
+    return phi;
+}
+
+
+//--------------------------------------
+// Local Variables
+//--------------------------------------
+
+// Checks whether an expression assigns to a variable anywhere in it.
+//
+// node - The expression.
+// name - The variable name.
+//
+// Returns true if there is an assignment to the name.
+bool kal_codegen_assigns(kal_ast_node *node, kal_symbol name)
+{
+    unsigned int i;
+
+    switch(node->type) {
+        case KAL_AST_TYPE_BINARY_EXPR: {
+            return kal_codegen_assigns(node->binary_expr.lhs, name) ||
+                kal_codegen_assigns(node->binary_expr.rhs, name);
+        }
+        case KAL_AST_TYPE_CALL: {
+            for(i=0; i<node->call.arg_count; i++) {
+                if(kal_codegen_assigns(node->call.args[i], name)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        case KAL_AST_TYPE_IF_EXPR: {
+            return kal_codegen_assigns(node->if_expr.condition, name) ||
+                kal_codegen_assigns(node->if_expr.true_expr, name) ||
+                kal_codegen_assigns(node->if_expr.false_expr, name);
+        }
+        case KAL_AST_TYPE_FOR_EXPR: {
+            return kal_codegen_assigns(node->for_expr.start, name) ||
+                kal_codegen_assigns(node->for_expr.condition, name) ||
+                (node->for_expr.step != NULL && kal_codegen_assigns(node->for_expr.step, name)) ||
+                kal_codegen_assigns(node->for_expr.body, name);
+        }
+        case KAL_AST_TYPE_VAR_EXPR: {
+            for(i=0; i<node->var_expr.var_count; i++) {
+                if(node->var_expr.inits[i] != NULL && kal_codegen_assigns(node->var_expr.inits[i], name)) {
+                    return true;
+                }
+            }
+            return kal_codegen_assigns(node->var_expr.body, name);
+        }
+        case KAL_AST_TYPE_ASSIGN: {
+            return node->assign.name == name || kal_codegen_assigns(node->assign.value, name);
+        }
+        default: {
+            return false;
+        }
+    }
+}
+
+// Adds a variable in a new stack slot to the current scope. The slot is
+// allocated at the top of the function's entry block, where mem2reg looks
+// for slots to promote to registers, and the initial value is stored where
+// the builder is.
+//
+// context - The compilation context.
+// name    - The symbol for the variable name.
+// value   - The variable's initial value.
+//
+// Returns the slot.
+LLVMValueRef kal_codegen_add_slot(kal_context *context, kal_symbol name,
+                                  LLVMValueRef value)
+{
+    LLVMBasicBlockRef block = LLVMGetInsertBlock(context->builder);
+    LLVMBasicBlockRef entry = LLVMGetEntryBasicBlock(LLVMGetBasicBlockParent(block));
+    LLVMValueRef first = LLVMGetFirstInstruction(entry);
+    if(first != NULL) {
+        LLVMPositionBuilderBefore(context->builder, first);
+    }
+    else {
+        LLVMPositionBuilderAtEnd(context->builder, entry);
+    }
+    LLVMValueRef slot = LLVMBuildAlloca(context->builder,
+        LLVMDoubleTypeInContext(context->llvm), kal_symbol_name(name));
+    LLVMPositionBuilderAtEnd(context->builder, block);
+
+    LLVMBuildStore(context->builder, value, slot);
+    kal_codegen_add_named_value(context, name, slot);
+    context->named_values[context->named_value_count-1].slot = true;
+    return slot;
+}
+
+// Moves the arguments that a function body assigns to into stack slots.
+// The rest stay as plain values.
+//
+// context   - The compilation context.
+// prototype - The function's prototype.
+// body      - The function's body.
+void kal_codegen_spill_args(kal_context *context, kal_ast_node *prototype,
+                            kal_ast_node *body)
+{
+    unsigned int i;
+    for(i=0; i<prototype->prototype.arg_count; i++) {
+        kal_symbol name = prototype->prototype.args[i];
+        if(kal_codegen_assigns(body, name)) {
+            kal_codegen_add_slot(context, name, kal_codegen_named_value(context, name)->value);
+        }
+    }
+}
+
+// Generates an LLVM value object for a Var Expression AST. Each variable
+// gets a stack slot and goes out of scope after the body. The body is in
+// tail position if the var expression is.
+//
+// context - The compilation context.
+// node    - The node to generate code for.
+//
+// Returns an LLVM value reference.
+LLVMValueRef kal_codegen_var_expr(kal_context *context, kal_ast_node *node)
+{
+    unsigned int i;
+    bool tail = context->tail;
+    unsigned int named_value_count = context->named_value_count;
+
+    for(i=0; i<node->var_expr.var_count; i++) {
+        LLVMValueRef value;
+        if(node->var_expr.inits[i] != NULL) {
+            context->tail = false;
+            value = kal_codegen(context, node->var_expr.inits[i]);
+            if(value == NULL) {
+                context->named_value_count = named_value_count;
+                return NULL;
+            }
+        }
+        else {
+            value = LLVMConstReal(LLVMDoubleTypeInContext(context->llvm), 0);
+        }
+        kal_codegen_add_slot(context, node->var_expr.names[i], value);
+    }
+
+    context->tail = tail;
+    LLVMValueRef body = kal_codegen(context, node->var_expr.body);
+    context->named_value_count = named_value_count;
+    return body;
+}
+
+// Generates an LLVM value object for an Assignment AST.
+//
+// context - The compilation context.
+// node    - The node to generate code for.
+//
+// Returns the assigned value.
+LLVMValueRef kal_codegen_assign(kal_context *context, kal_ast_node *node)
+{
+    context->tail = false;
+    LLVMValueRef value = kal_codegen(context, node->assign.value);
+    if(value == NULL) {
+        return NULL;
+    }
+
+    kal_named_value *val = kal_codegen_named_value(context, node->assign.name);
+    if(val == NULL || !val->slot) {
+        fprintf(stderr, "Unknown variable: %s\n", kal_symbol_name(node->assign.name));
+        return NULL;
+    }
+    LLVMBuildStore(context->builder, value, val->value);
+    return value;
+}
+
+
+//--------------------------------------
+// For Expression
+//--------------------------------------
+
+// Generates an LLVM value object for a For Expression AST. The loop has the
+// shape LLVM's loop passes expect: the condition is checked in a header
+// block that the body's single latch jumps back to, and the loop variable
+// is a stack slot that mem2reg turns into a phi in the header.
+//
+// context - The compilation context.
+// node    - The node to generate code for.
+//
+// Returns an LLVM value reference, which is always 0.
+LLVMValueRef kal_codegen_for_expr(kal_context *context, kal_ast_node *node)
+{
+    unsigned int named_value_count = context->named_value_count;
+    LLVMTypeRef double_type = LLVMDoubleTypeInContext(context->llvm);
+
+    // Start the loop variable.
+    context->tail = false;
+    LLVMValueRef start = kal_codegen(context, node->for_expr.start);
+    if(start == NULL) {
+        return NULL;
+    }
+    LLVMValueRef slot = kal_codegen_add_slot(context, node->for_expr.name, start);
+
+    LLVMValueRef func = LLVMGetBasicBlockParent(LLVMGetInsertBlock(context->builder));
+    LLVMBasicBlockRef cond_block = LLVMAppendBasicBlockInContext(context->llvm, func, "loopcond");
+    LLVMBasicBlockRef loop_block = LLVMAppendBasicBlockInContext(context->llvm, func, "loop");
+    LLVMBasicBlockRef after_block = LLVMAppendBasicBlockInContext(context->llvm, func, "afterloop");
+    LLVMBuildBr(context->builder, cond_block);
+
+    // Check the condition before each pass.
+    LLVMPositionBuilderAtEnd(context->builder, cond_block);
+    LLVMValueRef condition = kal_codegen(context, node->for_expr.condition);
+    if(condition == NULL) {
+        context->named_value_count = named_value_count;
+        return NULL;
+    }
+    condition = LLVMBuildFCmp(context->builder, LLVMRealONE, condition,
+        LLVMConstReal(double_type, 0), "loopcond");
+    LLVMBuildCondBr(context->builder, condition, loop_block, after_block);
+
+    // Run the body and step the variable.
+    LLVMPositionBuilderAtEnd(context->builder, loop_block);
+    context->tail = false;
+    LLVMValueRef step = NULL;
+    if(kal_codegen(context, node->for_expr.body) != NULL) {
+        context->tail = false;
+        step = (node->for_expr.step != NULL ? kal_codegen(context, node->for_expr.step) : LLVMConstReal(double_type, 1));
+    }
+    if(step == NULL) {
+        context->named_value_count = named_value_count;
+        return NULL;
+    }
+    LLVMValueRef value = LLVMBuildLoad(context->builder, slot, kal_symbol_name(node->for_expr.name));
+    LLVMBuildStore(context->builder, LLVMBuildFAdd(context->builder, value, step, "nextvar"), slot);
+    LLVMBuildBr(context->builder, cond_block);
+
+    LLVMPositionBuilderAtEnd(context->builder, after_block);
+    context->named_value_count = named_value_count;
+    return LLVMConstReal(double_type, 0);
+}
+
+
+//--------------------------------------
+// Batch
+//--------------------------------------
+
+// Checks whether an expression has to be generated one lane at a time
+// because it calls a function, loops or uses local variables.
+//
+// node - The expression.
+//
+// Returns true if the expression can't be generated over whole vectors.
+static bool kal_codegen_needs_lanes(kal_ast_node *node)
+{
+    switch(node->type) {
+        case KAL_AST_TYPE_CALL:
+        case KAL_AST_TYPE_FOR_EXPR:
+        case KAL_AST_TYPE_VAR_EXPR:
+        case KAL_AST_TYPE_ASSIGN: {
+            return true;
+        }
+        case KAL_AST_TYPE_BINARY_EXPR: {
+            return kal_codegen_needs_lanes(node->binary_expr.lhs) ||
+                kal_codegen_needs_lanes(node->binary_expr.rhs);
+        }
+        case KAL_AST_TYPE_IF_EXPR: {
+            return kal_codegen_needs_lanes(node->if_expr.condition) ||
+                kal_codegen_needs_lanes(node->if_expr.true_expr) ||
+                kal_codegen_needs_lanes(node->if_expr.false_expr);
+        }
+        default: {
+            return false;
+        }
+    }
+}
+
+// Generates an expression once for each lane of the vectors in scope. Each
+// variable is rebound to its value in the lane and the ordinary scalar code
+// is generated, so the expression runs exactly as it would for one row.
+// Variables the expression assigns to are rebound in stack slots.
+//
+// context - The compilation context.
+// node    - The expression.
+// lanes   - The number of lanes.
+//
+// Returns a vector of the results.
+static LLVMValueRef kal_codegen_vector_lanes(kal_context *context,
+                                             kal_ast_node *node,
+                                             unsigned int lanes)
+{
+    unsigned int i, lane;
+    unsigned int named_value_count = context->named_value_count;
+    LLVMTypeRef int_type = LLVMInt32TypeInContext(context->llvm);
+    LLVMValueRef result = LLVMGetUndef(LLVMVectorType(LLVMDoubleTypeInContext(context->llvm), lanes));
+
+    for(lane=0; lane<lanes; lane++) {
+        LLVMValueRef index = LLVMConstInt(int_type, lane, 0);
+        for(i=0; i<named_value_count; i++) {
+            kal_symbol name = context->named_values[i].name;
+            LLVMValueRef value = LLVMBuildExtractElement(context->builder,
+                context->named_values[i].value, index, "");
+            if(kal_codegen_assigns(node, name)) {
+                kal_codegen_add_slot(context, name, value);
+            }
+            else {
+                kal_codegen_add_named_value(context, name, value);
+            }
+        }
+
+        LLVMValueRef value = kal_codegen(context, node);
+        context->named_value_count = named_value_count;
+        if(value == NULL) {
+            return NULL;
+        }
+        result = LLVMBuildInsertElement(context->builder, result, value, index, "");
+    }
+
+    return result;
+}
+
+// Generates an expression over vectors of arguments. Arithmetic works on
+// whole vectors. An if expression computes both branches and selects
+// between them, which is only done when the branches make no calls so that
+// nothing runs that the row wouldn't have run. Calls, loops, local
+// variables and the remaining if expressions are generated one lane at a
+// time.
+//
+// context - The compilation context.
+// node    - The expression.
+// lanes   - The number of lanes.
+//
+// Returns a vector of the results.
+static LLVMValueRef kal_codegen_vector(kal_context *context, kal_ast_node *node,
+                                       unsigned int lanes)
+{
+    unsigned int i, lane;
+    LLVMTypeRef int_type = LLVMInt32TypeInContext(context->llvm);
+    LLVMTypeRef vector_type = LLVMVectorType(LLVMDoubleTypeInContext(context->llvm), lanes);
+
+    switch(node->type) {
+        case KAL_AST_TYPE_NUMBER: {
+            LLVMValueRef value = kal_codegen_number(context, node);
+            LLVMValueRef *values = malloc(sizeof(LLVMValueRef) * lanes);
+            for(lane=0; lane<lanes; lane++) {
+                values[lane] = value;
+            }
+            LLVMValueRef vector = LLVMConstVector(values, lanes);
+            free(values);
+            return vector;
+        }
+        case KAL_AST_TYPE_VARIABLE: {
+            return kal_codegen_variable(context, node);
+        }
+        case KAL_AST_TYPE_BINARY_EXPR: {
+            LLVMValueRef lhs = kal_codegen_vector(context, node->binary_expr.lhs, lanes);
+            LLVMValueRef rhs = kal_codegen_vector(context, node->binary_expr.rhs, lanes);
+            return kal_codegen_binop(context, node->binary_expr.operator, lhs, rhs);
+        }
+        case KAL_AST_TYPE_IF_EXPR: {
+            if(kal_codegen_needs_lanes(node->if_expr.true_expr) ||
+               kal_codegen_needs_lanes(node->if_expr.false_expr))
+            {
+                return kal_codegen_vector_lanes(context, node, lanes);
+            }
+            LLVMValueRef condition = kal_codegen_vector(context, node->if_expr.condition, lanes);
+            LLVMValueRef then_value = kal_codegen_vector(context, node->if_expr.true_expr, lanes);
+            LLVMValueRef else_value = kal_codegen_vector(context, node->if_expr.false_expr, lanes);
+            if(condition == NULL || then_value == NULL || else_value == NULL) {
+                return NULL;
+            }
+            condition = LLVMBuildFCmp(context->builder, LLVMRealONE, condition,
+                LLVMConstNull(vector_type), "ifcond");
+            return LLVMBuildSelect(context->builder, condition, then_value, else_value, "");
+        }
+        case KAL_AST_TYPE_CALL: {
+            LLVMValueRef func = kal_codegen_get_function(context, node->call.name);
+            if(func == NULL || LLVMCountParams(func) != node->call.arg_count) {
+                return NULL;
+            }
+
+            // Evaluate the arguments as vectors and call once per lane.
+            unsigned int arg_count = node->call.arg_count;
+            LLVMValueRef *vectors = malloc(sizeof(LLVMValueRef) * (arg_count > 0 ? arg_count : 1));
+            LLVMValueRef *args = malloc(sizeof(LLVMValueRef) * (arg_count > 0 ? arg_count : 1));
+            for(i=0; i<arg_count; i++) {
+                vectors[i] = kal_codegen_vector(context, node->call.args[i], lanes);
+                if(vectors[i] == NULL) {
+                    free(vectors);
+                    free(args);
+                    return NULL;
+                }
+            }
+
+            LLVMValueRef result = LLVMGetUndef(vector_type);
+            for(lane=0; lane<lanes; lane++) {
+                LLVMValueRef index = LLVMConstInt(int_type, lane, 0);
+                for(i=0; i<arg_count; i++) {
+                    args[i] = LLVMBuildExtractElement(context->builder, vectors[i], index, "");
+                }
+                LLVMValueRef value = LLVMBuildCall(context->builder, func, args, arg_count, "calltmp");
+                result = LLVMBuildInsertElement(context->builder, result, value, index, "");
+            }
+            free(vectors);
+            free(args);
+            return result;
+        }
+        case KAL_AST_TYPE_FOR_EXPR:
+        case KAL_AST_TYPE_VAR_EXPR:
+        case KAL_AST_TYPE_ASSIGN: {
+            return kal_codegen_vector_lanes(context, node, lanes);
+        }
+        default: {
+            return NULL;
+        }
+    }
+}
+
+// Generates a function that evaluates a definition over a batch of rows:
+//
+//     void name.batch(double **columns, i64 start, i64 end, double *out)
+//
+// Each argument is read from its own column and the result of row i is
+// stored in out[i]. The main loop handles `lanes` rows at a time with
+// vector loads and stores and the definition's body generated over vectors.
+// The rows left over at the end are run through the scalar function. The
+// definition must already have been generated in this context.
+//
+// context - The compilation context.
+// node    - The function definition.
+// lanes   - The number of rows per vector, which is normally 4 or 8.
+//
+// Returns the batch function or NULL if it could not be generated.
+LLVMValueRef kal_codegen_batch(kal_context *context, kal_ast_node *node,
+                               unsigned int lanes)
+{
+    unsigned int i;
+    kal_ast_node *prototype = node->function.prototype;
+    unsigned int arg_count = prototype->prototype.arg_count;
+
+    LLVMValueRef scalar = kal_codegen_get_function(context, prototype->prototype.name);
+    if(scalar == NULL || LLVMCountParams(scalar) != arg_count) {
+        return NULL;
+    }
+
+    LLVMTypeRef double_type = LLVMDoubleTypeInContext(context->llvm);
+    LLVMTypeRef vector_type = LLVMVectorType(double_type, lanes);
+    LLVMTypeRef index_type = LLVMInt64TypeInContext(context->llvm);
+    LLVMTypeRef double_ptr_type = LLVMPointerType(double_type, 0);
+    LLVMTypeRef vector_ptr_type = LLVMPointerType(vector_type, 0);
+    LLVMTypeRef params[] = {LLVMPointerType(double_ptr_type, 0), index_type, index_type, double_ptr_type};
+    LLVMTypeRef func_type = LLVMFunctionType(LLVMVoidTypeInContext(context->llvm), params, 4, 0);
+
+    const char *name = kal_symbol_name(prototype->prototype.name);
+    char *batch_name = malloc(strlen(name) + strlen(KAL_CODEGEN_BATCH_SUFFIX) + 1);
+    strcpy(batch_name, name);
+    strcat(batch_name, KAL_CODEGEN_BATCH_SUFFIX);
+    LLVMValueRef func = LLVMAddFunction(context->module, batch_name, func_type);
+    LLVMSetLinkage(func, LLVMExternalLinkage);
+    free(batch_name);
+
+    LLVMValueRef columns = LLVMGetParam(func, 0);
+    LLVMValueRef start = LLVMGetParam(func, 1);
+    LLVMValueRef end = LLVMGetParam(func, 2);
+    LLVMValueRef out = LLVMGetParam(func, 3);
+    LLVMSetValueName(columns, "columns");
+    LLVMSetValueName(start, "start");
+    LLVMSetValueName(end, "end");
+    LLVMSetValueName(out, "out");
+
+    LLVMBasicBlockRef entry_block = LLVMAppendBasicBlockInContext(context->llvm, func, "entry");
+    LLVMBasicBlockRef vector_cond = LLVMAppendBasicBlockInContext(context->llvm, func, "vector.cond");
+    LLVMBasicBlockRef vector_body = LLVMAppendBasicBlockInContext(context->llvm, func, "vector.body");
+    LLVMBasicBlockRef scalar_cond = LLVMAppendBasicBlockInContext(context->llvm, func, "scalar.cond");
+    LLVMBasicBlockRef scalar_body = LLVMAppendBasicBlockInContext(context->llvm, func, "scalar.body");
+    LLVMBasicBlockRef exit_block = LLVMAppendBasicBlockInContext(context->llvm, func, "exit");
+
+    // Load the column pointers once.
+    LLVMPositionBuilderAtEnd(context->builder, entry_block);
+    LLVMValueRef *column_ptrs = malloc(sizeof(LLVMValueRef) * (arg_count > 0 ? arg_count : 1));
+    LLVMValueRef *args = malloc(sizeof(LLVMValueRef) * (arg_count > 0 ? arg_count : 1));
+    for(i=0; i<arg_count; i++) {
+        LLVMValueRef index = LLVMConstInt(index_type, i, 0);
+        LLVMValueRef ptr = LLVMBuildInBoundsGEP(context->builder, columns, &index, 1, "");
+        column_ptrs[i] = LLVMBuildLoad(context->builder, ptr, kal_symbol_name(prototype->prototype.args[i]));
+    }
+    LLVMBuildBr(context->builder, vector_cond);
+
+    // Run whole vectors while there are enough rows left.
+    LLVMPositionBuilderAtEnd(context->builder, vector_cond);
+    LLVMValueRef row = LLVMBuildPhi(context->builder, index_type, "row");
+    LLVMAddIncoming(row, &start, &entry_block, 1);
+    LLVMValueRef next_row = LLVMBuildAdd(context->builder, row, LLVMConstInt(index_type, lanes, 0), "nextrow");
+    LLVMBuildCondBr(context->builder, LLVMBuildICmp(context->builder, LLVMIntULE, next_row, end, ""),
+        vector_body, scalar_cond);
+
+    LLVMPositionBuilderAtEnd(context->builder, vector_body);
+    kal_codegen_reset(context);
+    for(i=0; i<arg_count; i++) {
+        LLVMValueRef ptr = LLVMBuildInBoundsGEP(context->builder, column_ptrs[i], &row, 1, "");
+        ptr = LLVMBuildBitCast(context->builder, ptr, vector_ptr_type, "");
+        LLVMValueRef value = LLVMBuildLoad(context->builder, ptr, "");
+        LLVMSetAlignment(value, sizeof(double));
+        kal_codegen_add_named_value(context, prototype->prototype.args[i], value);
+    }
+    context->function = KAL_SYMBOL_NONE;
+    context->function_fast_math = kal_codegen_fast_math(context, node);
+    context->tail = false;
+
+    // Assigning to an argument changes it for the rest of the body, so the
+    // whole body goes one lane at a time.
+    bool assigns = false;
+    for(i=0; i<arg_count; i++) {
+        assigns = assigns || kal_codegen_assigns(node->function.body, prototype->prototype.args[i]);
+    }
+    LLVMValueRef result = (assigns ?
+        kal_codegen_vector_lanes(context, node->function.body, lanes) :
+        kal_codegen_vector(context, node->function.body, lanes));
+    kal_codegen_reset(context);
+    context->function_fast_math = 0;
+    if(result == NULL) {
+        free(column_ptrs);
+        free(args);
+        LLVMDeleteFunction(func);
+        return NULL;
+    }
+    LLVMValueRef out_ptr = LLVMBuildInBoundsGEP(context->builder, out, &row, 1, "");
+    out_ptr = LLVMBuildBitCast(context->builder, out_ptr, vector_ptr_type, "");
+    LLVMSetAlignment(LLVMBuildStore(context->builder, result, out_ptr), sizeof(double));
+    LLVMBasicBlockRef block = LLVMGetInsertBlock(context->builder);
+    LLVMAddIncoming(row, &next_row, &block, 1);
+    LLVMBuildBr(context->builder, vector_cond);
+
+    // Finish the remaining rows one at a time.
+    LLVMPositionBuilderAtEnd(context->builder, scalar_cond);
+    LLVMValueRef scalar_row = LLVMBuildPhi(context->builder, index_type, "row");
+    LLVMAddIncoming(scalar_row, &row, &vector_cond, 1);
+    LLVMBuildCondBr(context->builder, LLVMBuildICmp(context->builder, LLVMIntULT, scalar_row, end, ""),
+        scalar_body, exit_block);
+
+    LLVMPositionBuilderAtEnd(context->builder, scalar_body);
+    for(i=0; i<arg_count; i++) {
+        LLVMValueRef ptr = LLVMBuildInBoundsGEP(context->builder, column_ptrs[i], &scalar_row, 1, "");
+        args[i] = LLVMBuildLoad(context->builder, ptr, "");
+    }
+    result = LLVMBuildCall(context->builder, scalar, args, arg_count, "calltmp");
+    LLVMBuildStore(context->builder, result,
+        LLVMBuildInBoundsGEP(context->builder, out, &scalar_row, 1, ""));
+    next_row = LLVMBuildAdd(context->builder, scalar_row, LLVMConstInt(index_type, 1, 0), "nextrow");
+    LLVMAddIncoming(scalar_row, &next_row, &scalar_body, 1);
+    LLVMBuildBr(context->builder, scalar_cond);
+
+    LLVMPositionBuilderAtEnd(context->builder, exit_block);
+    LLVMBuildRetVoid(context->builder);
+    free(column_ptrs);
+    free(args);
+    kal_codegen_add_fast_math(context, func, kal_codegen_fast_math(context, node));
+    kal_target_add_attributes(context->target, context->llvm, func);
+
+    if(LLVMVerifyFunction(func, LLVMPrintMessageAction) == 1) {
+        fprintf(stderr, "Invalid function");
+        LLVMDeleteFunction(func);
+        return NULL;
+    }
+
+    return func;
+}
+
+
+//--------------------------------------
+// Code Generation
+//--------------------------------------
+
+// Recursively generates LLVM objects to build the code.
+//
+// context - The compilation context.
+// node    - The node to generate code for.
+//
+// Returns an LLVM value reference.
+LLVMValueRef kal_codegen(kal_context *context, kal_ast_node *node)
+{
+    // Recursively free dependent data.
+    switch(node->type) {
+        case KAL_AST_TYPE_NUMBER: {
+            return kal_codegen_number(context, node);
+        }
+        case KAL_AST_TYPE_VARIABLE: {
+            return kal_codegen_variable(context, node);
+        }
+        case KAL_AST_TYPE_BINARY_EXPR: {
+            return kal_codegen_binary_expr(context, node);
+        }
+        case KAL_AST_TYPE_CALL: {
+            return kal_codegen_call(context, node);
+        }
+        case KAL_AST_TYPE_PROTOTYPE: {
+            return kal_codegen_prototype(context, node);
+        }
+        case KAL_AST_TYPE_FUNCTION: {
+            return kal_codegen_function(context, node);
+        }
+        case KAL_AST_TYPE_IF_EXPR: {
+            return kal_codegen_if_expr(context, node);
+        }
+        case KAL_AST_TYPE_FOR_EXPR: {
+            return kal_codegen_for_expr(context, node);
+        }
+        case KAL_AST_TYPE_VAR_EXPR: {
+            return kal_codegen_var_expr(context, node);
+        }
+        case KAL_AST_TYPE_ASSIGN: {
+            return kal_codegen_assign(context, node);
+        }
+    }
+    
+    return NULL;
+}
+
+
+//--------------------------------------
+// Flat AST
+//--------------------------------------
+
+LLVMValueRef kal_codegen_flat_range(kal_context *context, kal_ast_flat *flat,
+    uint32_t start, uint32_t end, LLVMValueRef *values, uint32_t base);
+
+// Finds the root of a range of flat AST nodes that make up a single subtree.
+// Functions, if, for and var expressions come before their children so they
+// are the root when their own range ends where the subtree does. Otherwise
+// the root is the last node.
+//
+// flat  - The flat AST.
+// start - The index of the first node in the range.
+// end   - The index of the last node in the range.
+//
+// Returns the index of the root node.
+static uint32_t kal_codegen_flat_root(kal_ast_flat *flat, uint32_t start,
+                                      uint32_t end)
+{
+    kal_ast_flat_node *node = &flat->nodes[start];
+    switch(node->type) {
+        case KAL_AST_TYPE_FUNCTION: return (node->b == end ? start : end);
+        case KAL_AST_TYPE_IF_EXPR: return (node->c == end ? start : end);
+        case KAL_AST_TYPE_FOR_EXPR: return (flat->operands[node->b + 3] == end ? start : end);
+        case KAL_AST_TYPE_VAR_EXPR: return (flat->operands[node->b + node->a * 2] == end ? start : end);
+        default: return end;
+    }
+}
+
+// Checks whether a range of flat AST nodes calls a function from a tail
+// position. See kal_codegen_has_tail_call().
+//
+// flat  - The flat AST.
+// start - The index of the first node in the range, which is in tail
+//         position itself.
+// end   - The index of the last node in the range.
+// name  - The function.
+//
+// Returns true if there is a tail call to the function.
+static bool kal_codegen_flat_has_tail_call(kal_ast_flat *flat, uint32_t start,
+                                           uint32_t end, kal_symbol name)
+{
+    uint32_t root = kal_codegen_flat_root(flat, start, end);
+    kal_ast_flat_node *node = &flat->nodes[root];
+    switch(node->type) {
+        case KAL_AST_TYPE_CALL: {
+            return node->a == name;
+        }
+        case KAL_AST_TYPE_IF_EXPR: {
+            return kal_codegen_flat_has_tail_call(flat, node->a + 1, node->b, name) ||
+                kal_codegen_flat_has_tail_call(flat, node->b + 1, node->c, name);
+        }
+        case KAL_AST_TYPE_VAR_EXPR: {
+            uint32_t body = (node->a > 0 ? flat->operands[node->b + node->a * 2 - 1] : root) + 1;
+            return kal_codegen_flat_has_tail_call(flat, body, end, name);
+        }
+        default: {
+            return false;
+        }
+    }
+}
+
+// Works out what is known about the effects of a range of flat AST nodes.
+// Effects only come from calls and loops, wherever they are in the subtree,
+// so this is a single pass over the range. See kal_codegen_expr_flags().
+//
+// context - The compilation context.
+// flat    - The flat AST.
+// start   - The index of the first node in the range.
+// end     - The index of the last node in the range.
+// self    - The name of the function the range is in.
+//
+// Returns the range's kal_function_flag_e flags.
+static uint8_t kal_codegen_flat_flags(kal_context *context, kal_ast_flat *flat,
+                                      uint32_t start, uint32_t end,
+                                      kal_symbol self)
+{
+    uint32_t i;
+    uint8_t flags = KAL_FUNCTION_ALL;
+
+    for(i=start; i<=end; i++) {
+        kal_ast_flat_node *node = &flat->nodes[i];
+        if(node->type == KAL_AST_TYPE_CALL) {
+            if(node->a == self) {
+                flags &= ~KAL_FUNCTION_WILLRETURN;
+            }
+            else if(node->a < context->function_capacity) {
+                flags &= context->function_flags[node->a];
+            }
+            else {
+                flags = 0;
+            }
+        }
+        else if(node->type == KAL_AST_TYPE_FOR_EXPR) {
+            flags &= ~KAL_FUNCTION_WILLRETURN;
+        }
+    }
+    return flags;
+}
+
+// Generates an LLVM value object for a function in a flat AST. Self calls
+// in tail position become a loop, memoized functions check their result
+// table and effects are worked out the same way as they are in
+// kal_codegen_function().
+//
+// context - The compilation context.
+// flat    - The flat AST.
+// index   - The index of the function node.
+// values  - The generated values, indexed from `base`.
+// base    - The index of the first node in `values`.
+//
+// Returns an LLVM value reference.
+LLVMValueRef kal_codegen_flat_function(kal_context *context,
+                                       kal_ast_flat *flat, uint32_t index,
+                                       LLVMValueRef *values, uint32_t base)
+{
+    uint32_t i, j;
+    kal_ast_flat_node *node = &flat->nodes[index];
+    kal_ast_flat_node *prototype = &flat->nodes[node->a];
+    kal_codegen_memo memo = {NULL, NULL, 0, NULL};
+    uint8_t flags = kal_codegen_flat_flags(context, flat, node->a + 1, node->b, prototype->a);
+    bool memoize = (node->flags || context->memo) && prototype->c > 0 && (flags & KAL_FUNCTION_PURE) != 0;
+    if(node->flags && (flags & KAL_FUNCTION_PURE) == 0) {
+        fprintf(stderr, "Not memoizing %s since it isn't pure\n", kal_symbol_name(prototype->a));
+    }
+    if(memoize || context->profile) {
+        flags &= ~KAL_FUNCTION_READNONE;
+    }
+
+    kal_codegen_reset(context);
+
+    // Generate the prototype first.
+    LLVMValueRef func = kal_codegen_declare(context, prototype->a,
+        &flat->operands[prototype->b], prototype->c);
+    if(func == NULL) {
+        return NULL;
+    }
+    if(kal_codegen_remove_attributes(func) && (flags & KAL_FUNCTION_PURE) == 0) {
+        fprintf(stderr, "%s was declared pure but has side effects\n", kal_symbol_name(prototype->a));
+    }
+
+    // Create basic block.
+    LLVMBasicBlockRef block = LLVMAppendBasicBlockInContext(context->llvm, func, "entry");
+    LLVMPositionBuilderAtEnd(context->builder, block);
+    kal_codegen_profile profile = {NULL, NULL, NULL};
+    if(context->profile) {
+        kal_codegen_profile_enter(context, func, &profile);
+    }
+    if(memoize) {
+        kal_codegen_memo_lookup(context, func, &memo);
+    }
+    if(kal_codegen_flat_has_tail_call(flat, node->a + 1, node->b, prototype->a)) {
+        kal_codegen_tail_loop(context, func, &flat->operands[prototype->b], prototype->c);
+    }
+
+    // Move arguments that are assigned to into stack slots.
+    for(i=0; i<prototype->c; i++) {
+        kal_symbol name = flat->operands[prototype->b + i];
+        for(j=node->a + 1; j<=node->b; j++) {
+            if(flat->nodes[j].type == KAL_AST_TYPE_ASSIGN && flat->nodes[j].a == name) {
+                kal_codegen_add_slot(context, name, kal_codegen_named_value(context, name)->value);
+                break;
+            }
+        }
+    }
+
+    // Generate body.
+    uint8_t fast_math = context->fast_math | (node->c ? KAL_FAST_MATH_ALL : 0);
+    context->function = prototype->a;
+    context->function_fast_math = fast_math;
+    context->tail = true;
+    LLVMValueRef body = kal_codegen_flat_range(context, flat, node->a + 1, node->b,
+        values, base);
+    context->function = KAL_SYMBOL_NONE;
+    context->function_fast_math = 0;
+    context->tail = false;
+    context->tail_block = NULL;
+    if(body == NULL) {
+        free(memo.keys);
+        kal_codegen_discard_function(context, func);
+        return NULL;
+    }
+
+    // Insert body as return vale unless the body ended in a self tail call.
+    if(LLVMGetBasicBlockTerminator(LLVMGetInsertBlock(context->builder)) == NULL) {
+        if(memoize) {
+            kal_codegen_memo_store(context, func, &memo, body);
+        }
+        LLVMBuildRet(context->builder, body);
+    }
+    free(memo.keys);
+    if(context->profile) {
+        kal_codegen_profile_exit(context, func, &profile);
+    }
+
+    // Verify function.
+    if(LLVMVerifyFunction(func, LLVMPrintMessageAction) == 1) {
+        fprintf(stderr, "Invalid function");
+        kal_codegen_discard_function(context, func);
+        return NULL;
+    }
+
+    kal_codegen_set_flags(context, prototype->a, flags);
+    kal_codegen_add_attributes(context, func, flags);
+    kal_codegen_add_fast_math(context, func, fast_math);
+    kal_target_add_attributes(context->target, context->llvm, func);
+    return func;
+}
+
+// Checks whether a range of flat AST nodes only does arithmetic on numbers
+// and variables. See kal_codegen_is_cheap().
+//
+// flat  - The flat AST.
+// start - The index of the first node in the range.
+// end   - The index of the last node in the range.
+//
+// Returns true if the range is cheap to compute and has no effects.
+static bool kal_codegen_flat_is_cheap(kal_ast_flat *flat, uint32_t start,
+                                      uint32_t end)
+{
+    uint32_t i;
+    for(i=start; i<=end; i++) {
+        uint8_t type = flat->nodes[i].type;
+        if(type != KAL_AST_TYPE_NUMBER && type != KAL_AST_TYPE_VARIABLE &&
+           type != KAL_AST_TYPE_BINARY_EXPR && type != KAL_AST_TYPE_IF_EXPR)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Generates an LLVM value object for an if expression in a flat AST. Cheap
+// branches are selected between and branches that end in a self tail call
+// are left out of the merge as they are in kal_codegen_if_expr().
+//
+// context - The compilation context.
+// flat    - The flat AST.
+// index   - The index of the if expression node.
+// values  - The generated values, indexed from `base`.
+// base    - The index of the first node in `values`.
+//
+// Returns an LLVM value reference.
+LLVMValueRef kal_codegen_flat_if_expr(kal_context *context,
+                                      kal_ast_flat *flat, uint32_t index,
+                                      LLVMValueRef *values, uint32_t base)
+{
+    bool tail = context->tail;
+    unsigned int incoming_count = 0;
+    LLVMValueRef incoming_values[2];
+    LLVMBasicBlockRef incoming_blocks[2];
+    kal_ast_flat_node *node = &flat->nodes[index];
+
+    // Generate the condition.
+    context->tail = false;
+    LLVMValueRef condition = kal_codegen_flat_range(context, flat, index + 1, node->a,
+        values, base);
+    if(condition == NULL) {
+        return NULL;
+    }
+
+    // Convert condition to bool.
+    LLVMValueRef zero = LLVMConstReal(LLVMDoubleTypeInContext(context->llvm), 0);
+    condition = LLVMBuildFCmp(context->builder, LLVMRealONE, condition, zero, "ifcond");
+
+    // Select between cheap branches.
+    if(node->c - node->a <= KAL_CODEGEN_SELECT_MAX_NODES &&
+       kal_codegen_flat_is_cheap(flat, node->a + 1, node->c))
+    {
+        LLVMValueRef then_value = kal_codegen_flat_range(context, flat, node->a + 1, node->b,
+            values, base);
+        LLVMValueRef else_value = kal_codegen_flat_range(context, flat, node->b + 1, node->c,
+            values, base);
+        if(then_value == NULL || else_value == NULL) {
+            return NULL;
+        }
+        return LLVMBuildSelect(context->builder, condition, then_value, else_value, "iftmp");
+    }
+
+    // Retrieve function.
+    LLVMValueRef func = LLVMGetBasicBlockParent(LLVMGetInsertBlock(context->builder));
+
+    // Generate true/false expr and merge.
+    LLVMBasicBlockRef then_block = LLVMAppendBasicBlockInContext(context->llvm, func, "then");
+    LLVMBasicBlockRef else_block = LLVMAppendBasicBlockInContext(context->llvm, func, "else");
+    LLVMBasicBlockRef merge_block = LLVMAppendBasicBlockInContext(context->llvm, func, "ifcont");
+
+    LLVMBuildCondBr(context->builder, condition, then_block, else_block);
+
+    // Generate 'then' block.
+    LLVMPositionBuilderAtEnd(context->builder, then_block);
+    context->tail = tail;
+    LLVMValueRef then_value = kal_codegen_flat_range(context, flat, node->a + 1, node->b,
+        values, base);
+    if(then_value == NULL) {
+        return NULL;
+    }
+
+    then_block = LLVMGetInsertBlock(context->builder);
+    if(LLVMGetBasicBlockTerminator(then_block) == NULL) {
+        LLVMBuildBr(context->builder, merge_block);
+        incoming_values[incoming_count] = then_value;
+        incoming_blocks[incoming_count++] = then_block;
+    }
+
+    LLVMPositionBuilderAtEnd(context->builder, else_block);
+    context->tail = tail;
+    LLVMValueRef else_value = kal_codegen_flat_range(context, flat, node->b + 1, node->c,
+        values, base);
+    if(else_value == NULL) {
+        return NULL;
+    }
+    else_block = LLVMGetInsertBlock(context->builder);
+    if(LLVMGetBasicBlockTerminator(else_block) == NULL) {
+        LLVMBuildBr(context->builder, merge_block);
+        incoming_values[incoming_count] = else_value;
+        incoming_blocks[incoming_count++] = else_block;
+    }
+
+    // If both branches jump back to the top then nothing reaches the merge.
+    LLVMPositionBuilderAtEnd(context->builder, merge_block);
+    if(incoming_count == 0) {
+        LLVMBuildUnreachable(context->builder);
+        return LLVMGetUndef(LLVMDoubleTypeInContext(context->llvm));
+    }
+    LLVMValueRef phi = LLVMBuildPhi(context->builder, LLVMDoubleTypeInContext(context->llvm), "");
+    LLVMAddIncoming(phi, incoming_values, incoming_blocks, incoming_count);
+
+    return phi;
+}
+
+// Generates an LLVM value object for a for expression in a flat AST. See
+// kal_codegen_for_expr() for the shape of the loop.
+//
+// context - The compilation context.
+// flat    - The flat AST.
+// index   - The index of the for expression node.
+// values  - The generated values, indexed from `base`.
+// base    - The index of the first node in `values`.
+//
+// Returns an LLVM value reference, which is always 0.
+LLVMValueRef kal_codegen_flat_for_expr(kal_context *context,
+                                       kal_ast_flat *flat, uint32_t index,
+                                       LLVMValueRef *values, uint32_t base)
+{
+    kal_ast_flat_node *node = &flat->nodes[index];
+    uint32_t *ends = &flat->operands[node->b];
+    unsigned int named_value_count = context->named_value_count;
+    LLVMTypeRef double_type = LLVMDoubleTypeInContext(context->llvm);
+    context->tail = false;
+
+    // Start the loop variable.
+    LLVMValueRef start = kal_codegen_flat_range(context, flat, index + 1, ends[0],
+        values, base);
+    if(start == NULL) {
+        return NULL;
+    }
+    LLVMValueRef slot = kal_codegen_add_slot(context, node->a, start);
+
+    LLVMValueRef func = LLVMGetBasicBlockParent(LLVMGetInsertBlock(context->builder));
+    LLVMBasicBlockRef cond_block = LLVMAppendBasicBlockInContext(context->llvm, func, "loopcond");
+    LLVMBasicBlockRef loop_block = LLVMAppendBasicBlockInContext(context->llvm, func, "loop");
+    LLVMBasicBlockRef after_block = LLVMAppendBasicBlockInContext(context->llvm, func, "afterloop");
+    LLVMBuildBr(context->builder, cond_block);
+
+    // Check the condition before each pass.
+    LLVMPositionBuilderAtEnd(context->builder, cond_block);
+    LLVMValueRef condition = kal_codegen_flat_range(context, flat, ends[0] + 1, ends[1],
+        values, base);
+    if(condition == NULL) {
+        context->named_value_count = named_value_count;
+        return NULL;
+    }
+    condition = LLVMBuildFCmp(context->builder, LLVMRealONE, condition,
+        LLVMConstReal(double_type, 0), "loopcond");
+    LLVMBuildCondBr(context->builder, condition, loop_block, after_block);
+
+    // Run the body and step the variable.
+    LLVMPositionBuilderAtEnd(context->builder, loop_block);
+    LLVMValueRef step = NULL;
+    if(kal_codegen_flat_range(context, flat, ends[2] + 1, ends[3], values, base) != NULL) {
+        step = (ends[2] > ends[1] ?
+            kal_codegen_flat_range(context, flat, ends[1] + 1, ends[2], values, base) :
+            LLVMConstReal(double_type, 1));
+    }
+    if(step == NULL) {
+        context->named_value_count = named_value_count;
+        return NULL;
+    }
+    LLVMValueRef value = LLVMBuildLoad(context->builder, slot, kal_symbol_name(node->a));
+    LLVMBuildStore(context->builder, LLVMBuildFAdd(context->builder, value, step, "nextvar"), slot);
+    LLVMBuildBr(context->builder, cond_block);
+
+    LLVMPositionBuilderAtEnd(context->builder, after_block);
+    context->named_value_count = named_value_count;
+    return LLVMConstReal(double_type, 0);
+}
+
+// Generates an LLVM value object for a var expression in a flat AST.
+//
+// context - The compilation context.
+// flat    - The flat AST.
+// index   - The index of the var expression node.
+// values  - The generated values, indexed from `base`.
+// base    - The index of the first node in `values`.
+//
+// Returns an LLVM value reference.
+LLVMValueRef kal_codegen_flat_var_expr(kal_context *context,
+                                       kal_ast_flat *flat, uint32_t index,
+                                       LLVMValueRef *values, uint32_t base)
+{
+    uint32_t i;
+    bool tail = context->tail;
+    kal_ast_flat_node *node = &flat->nodes[index];
+    uint32_t *operands = &flat->operands[node->b];
+    unsigned int named_value_count = context->named_value_count;
+    uint32_t end = index;
+
+    for(i=0; i<node->a; i++) {
+        LLVMValueRef value;
+        if(operands[i * 2 + 1] > end) {
+            context->tail = false;
+            value = kal_codegen_flat_range(context, flat, end + 1, operands[i * 2 + 1],
+                values, base);
+            if(value == NULL) {
+                context->named_value_count = named_value_count;
+                return NULL;
+            }
+            end = operands[i * 2 + 1];
+        }
+        else {
+            value = LLVMConstReal(LLVMDoubleTypeInContext(context->llvm), 0);
+        }
+        kal_codegen_add_slot(context, operands[i * 2], value);
+    }
+
+    context->tail = tail;
+    LLVMValueRef body = kal_codegen_flat_range(context, flat, end + 1, operands[node->a * 2],
+        values, base);
+    context->named_value_count = named_value_count;
+    return body;
+}
+
+// Generates LLVM objects for a contiguous range of flat AST nodes that make
+// up a single subtree. Nodes are visited in order; functions, if, for and
+// var expressions generate their own child ranges and are then skipped over.
+// If the range is in tail position then only its root is.
+//
+// context - The compilation context.
+// flat    - The flat AST.
+// start   - The index of the first node in the range.
+// end     - The index of the last node in the range.
+// values  - The generated values, indexed from `base`.
+// base    - The index of the first node in `values`.
+//
+// Returns the LLVM value reference for the root of the subtree.
+LLVMValueRef kal_codegen_flat_range(kal_context *context, kal_ast_flat *flat,
+                                    uint32_t start, uint32_t end,
+                                    LLVMValueRef *values, uint32_t base)
+{
+    uint32_t i, j;
+    LLVMValueRef value = NULL;
+    bool tail = context->tail;
+    uint32_t root = kal_codegen_flat_root(flat, start, end);
+
+    for(i=start; i<=end; i++) {
+        uint32_t index = i;
+        kal_ast_flat_node *node = &flat->nodes[i];
+        context->tail = (tail && i == root);
+
+        switch(node->type) {
+            case KAL_AST_TYPE_NUMBER: {
+                value = LLVMConstReal(LLVMDoubleTypeInContext(context->llvm), flat->numbers[node->a]);
+                break;
+            }
+            case KAL_AST_TYPE_VARIABLE: {
+                kal_named_value *val = kal_codegen_named_value(context, node->a);
+                if(val == NULL) {
+                    value = NULL;
+                }
+                else if(val->slot) {
+                    value = LLVMBuildLoad(context->builder, val->value, kal_symbol_name(node->a));
+                }
+                else {
+                    value = val->value;
+                }
+                break;
+            }
+            case KAL_AST_TYPE_BINARY_EXPR: {
+                value = kal_codegen_binop(context, node->operator, values[node->a - base],
+                    values[node->b - base]);
+                break;
+            }
+            case KAL_AST_TYPE_CALL: {
+                bool is_recursive = (node->a == context->function);
+                bool is_tail_call = (is_recursive && context->tail && context->tail_block != NULL);
+                if(is_recursive && !is_tail_call) {
+                    fprintf(stderr, "Recursive call to %s is not in tail position\n",
+                        kal_symbol_name(node->a));
+                }
+
+                LLVMValueRef func = kal_codegen_get_function(context, node->a);
+                if(func == NULL || LLVMCountParams(func) != node->c) {
+                    return NULL;
+                }
+
+                LLVMValueRef *args = malloc(sizeof(LLVMValueRef) * node->c);
+                for(j=0; j<node->c; j++) {
+                    args[j] = values[flat->operands[node->b + j] - base];
+                }
+
+                // Jump back to the top for a self tail call.
+                if(is_tail_call) {
+                    LLVMBasicBlockRef block = LLVMGetInsertBlock(context->builder);
+                    for(j=0; j<node->c; j++) {
+                        LLVMAddIncoming(context->tail_args[j], &args[j], &block, 1);
+                    }
+                    LLVMBuildBr(context->builder, context->tail_block);
+                    value = LLVMGetUndef(LLVMDoubleTypeInContext(context->llvm));
+                }
+                else {
+                    value = LLVMBuildCall(context->builder, func, args, node->c, "calltmp");
+                }
+                free(args);
+                break;
+            }
+            case KAL_AST_TYPE_PROTOTYPE: {
+                value = kal_codegen_declare(context, node->a,
+                    &flat->operands[node->b], node->c);
+                if(value != NULL && node->flags) {
+                    kal_codegen_set_flags(context, node->a, KAL_FUNCTION_ALL);
+                    kal_codegen_add_attributes(context, value, KAL_FUNCTION_ALL);
+                }
+                break;
+            }
+            case KAL_AST_TYPE_FUNCTION: {
+                value = kal_codegen_flat_function(context, flat, i, values, base);
+                i = node->b;
+                break;
+            }
+            case KAL_AST_TYPE_IF_EXPR: {
+                value = kal_codegen_flat_if_expr(context, flat, i, values, base);
+                i = node->c;
+                break;
+            }
+            case KAL_AST_TYPE_FOR_EXPR: {
+                value = kal_codegen_flat_for_expr(context, flat, i, values, base);
+                i = flat->operands[node->b + 3];
+                break;
+            }
+            case KAL_AST_TYPE_VAR_EXPR: {
+                value = kal_codegen_flat_var_expr(context, flat, i, values, base);
+                i = flat->operands[node->b + node->a * 2];
+                break;
+            }
+            case KAL_AST_TYPE_ASSIGN: {
+                kal_named_value *val = kal_codegen_named_value(context, node->a);
+                if(val == NULL || !val->slot) {
+                    fprintf(stderr, "Unknown variable: %s\n", kal_symbol_name(node->a));
+                    return NULL;
+                }
+                value = values[node->b - base];
+                LLVMBuildStore(context->builder, value, val->value);
+                break;
+            }
+        }
+
+        if(value == NULL) {
+            return NULL;
+        }
+        values[index - base] = value;
+    }
+
+    context->tail = false;
+    return value;
+}
+
+// Generates LLVM objects for a top-level item in a flat AST. This walks the
+// item's nodes in a single forward pass instead of chasing child pointers.
+//
+// context - The compilation context.
+// flat    - The flat AST.
+// item    - The index of the top-level item.
+//
+// Returns an LLVM value reference.
+LLVMValueRef kal_codegen_flat(kal_context *context, kal_ast_flat *flat,
+                              uint32_t item)
+{
+    uint32_t start = flat->items[item];
+    uint32_t end = kal_ast_flat_item_end(flat, item);
+
+    LLVMValueRef *values = malloc(sizeof(LLVMValueRef) * (end - start + 1));
+    LLVMValueRef value = kal_codegen_flat_range(context, flat, start, end,
+        values, start);
+    free(values);
+
+    return value;
+}
+
+
+//--------------------------------------
+// Utility
+//--------------------------------------
+
+// Records the parameter count of a function so that it can be declared again
+// in later modules generated by the same context. Nothing is known about
+// the function's effects until kal_codegen_set_flags() says otherwise.
+//
+// context   - The compilation context.
+// name      - The symbol for the function name.
+// arg_count - The number of parameters.
+void kal_codegen_add_function(kal_context *context, kal_symbol name,
+                              unsigned int arg_count)
+{
+    if(name >= context->function_capacity) {
+        unsigned int capacity = (context->function_capacity == 0 ? 64 : context->function_capacity);
+        while(capacity <= name) {
+            capacity *= 2;
+        }
+        context->functions = realloc(context->functions, sizeof(unsigned int) * capacity);
+        memset(&context->functions[context->function_capacity], 0,
+            sizeof(unsigned int) * (capacity - context->function_capacity));
+        context->function_flags = realloc(context->function_flags, sizeof(uint8_t) * capacity);
+        memset(&context->function_flags[context->function_capacity], 0,
+            sizeof(uint8_t) * (capacity - context->function_capacity));
+        context->function_capacity = capacity;
+    }
+
+    context->functions[name] = arg_count + 1;
+    context->function_flags[name] = 0;
+}
+
+// Records what is known about the effects of a function that has already
+// been added.
+//
+// context - The compilation context.
+// name    - The symbol for the function name.
+// flags   - The function's kal_function_flag_e flags.
+void kal_codegen_set_flags(kal_context *context, kal_symbol name, uint8_t flags)
+{
+    if(name < context->function_capacity && context->functions[name] != 0) {
+        context->function_flags[name] = flags;
+    }
+}
+
+// Retrieves a function from the current module. If the module doesn't have
+// it but the context has seen it before then a declaration is added along
+// with the attributes for what is known about its effects.
+//
+// context - The compilation context.
+// name    - The symbol for the function name.
+//
+// Returns the function or NULL if it has never been declared.
+LLVMValueRef kal_codegen_get_function(kal_context *context, kal_symbol name)
+{
+    unsigned int i;
+
+    LLVMValueRef func = LLVMGetNamedFunction(context->module, kal_symbol_name(name));
+    if(func != NULL) {
+        return func;
+    }
+    if(name >= context->function_capacity || context->functions[name] == 0) {
+        return NULL;
+    }
+
+    unsigned int arg_count = context->functions[name] - 1;
+    LLVMTypeRef *params = malloc(sizeof(LLVMTypeRef) * arg_count);
+    for(i=0; i<arg_count; i++) {
+        params[i] = LLVMDoubleTypeInContext(context->llvm);
+    }
+
+    LLVMTypeRef funcType = LLVMFunctionType(LLVMDoubleTypeInContext(context->llvm), params, arg_count, 0);
+    func = LLVMAddFunction(context->module, kal_symbol_name(name), funcType);
+    LLVMSetLinkage(func, LLVMExternalLinkage);
+    kal_codegen_add_attributes(context, func, context->function_flags[name]);
+    free(params);
+
+    return func;
+}
+
+// Clears the named variables.
+//
+// context - The compilation context.
+void kal_codegen_reset(kal_context *context)
+{
+    context->named_value_count = 0;
+}
+
+// Adds a variable to the current scope. Functions only have a handful of
+// arguments so the scope is a flat array.
+//
+// context - The compilation context.
+// name    - The symbol for the variable name.
+// value   - The LLVM value the variable refers to.
+void kal_codegen_add_named_value(kal_context *context, kal_symbol name,
+                                 LLVMValueRef value)
+{
+    if(context->named_value_count == context->named_value_capacity) {
+        context->named_value_capacity = (context->named_value_capacity == 0 ? 16 : context->named_value_capacity * 2);
+        context->named_values = realloc(context->named_values, sizeof(kal_named_value) * context->named_value_capacity);
+    }
+    
+    context->named_values[context->named_value_count].name  = name;
+    context->named_values[context->named_value_count].value = value;
+    context->named_values[context->named_value_count].slot = false;
+    context->named_value_count++;
+}
+
+// Retrieves a variable from the current scope by comparing symbols. The most
+// recently added variable wins if a name appears more than once.
+//
+// context - The compilation context.
+// name    - The symbol for the variable name.
+//
+// Returns the named value or NULL if it is not in scope.
+kal_named_value *kal_codegen_named_value(kal_context *context, kal_symbol name)
+{
+    unsigned int i;
+    for(i=context->named_value_count; i>0; i--) {
+        if(context->named_values[i-1].name == name) {
+            return &context->named_values[i-1];
+        }
+    }
+    return NULL;
 }
@@ -1,23 +1,38 @@
 #ifndef _codegen_h
 #define _codegen_h
 
+#include <stdbool.h>
 #include <llvm-c/Core.h>
 #include "ast.h"
-#include "uthash.h"
+#include "flat.h"
+#include "context.h"
 
 
 //==============================================================================
 //
-// Typedefs
+// Definitions
 //
 //==============================================================================
 
-// Used to hold references to arguments by name.
-typedef struct kal_named_value {
-    const char *name;             
-    LLVMValueRef value;
-    UT_hash_handle hh;
-} kal_named_value;
+// The number of entries in a memoized function's result table is two to the
+// power of this.
+#define KAL_CODEGEN_MEMO_BITS 12
+
+// The number of entries a lookup checks before giving up.
+#define KAL_CODEGEN_MEMO_PROBES 8
+
+// The most nodes the two arms of an if expression can have between them for
+// both to be computed and one selected instead of branching.
+#define KAL_CODEGEN_SELECT_MAX_NODES 16
+
+// The suffix given to the function that evaluates a definition over a batch
+// of rows. Identifiers can't contain a '.' so it never clashes with a
+// user-defined function.
+#define KAL_CODEGEN_BATCH_SUFFIX ".batch"
+
+// The suffix of the global that a profiled function counts its calls and
+// cycles in.
+#define KAL_CODEGEN_PROFILE_SUFFIX ".profile"
 
 
 //==============================================================================
@@ -30,17 +45,71 @@ typedef struct kal_named_value {
 // Codegen
 //--------------------------------------
 
-LLVMValueRef kal_codegen(kal_ast_node *node, LLVMModuleRef module,
-    LLVMBuilderRef builder);
+LLVMValueRef kal_codegen(kal_context *context, kal_ast_node *node);
+
+LLVMValueRef kal_codegen_flat(kal_context *context, kal_ast_flat *flat,
+    uint32_t item);
+
+LLVMValueRef kal_codegen_batch(kal_context *context, kal_ast_node *node,
+    unsigned int lanes);
 
 
 //--------------------------------------
 // Utility
 //--------------------------------------
 
-void kal_codegen_reset();
+void kal_codegen_reset(kal_context *context);
+
+void kal_codegen_add_function(kal_context *context, kal_symbol name,
+    unsigned int arg_count);
+
+LLVMValueRef kal_codegen_get_function(kal_context *context, kal_symbol name);
+
+void kal_codegen_set_flags(kal_context *context, kal_symbol name,
+    uint8_t flags);
+
+
+//--------------------------------------
+// Effects
+//--------------------------------------
+
+uint8_t kal_codegen_function_flags(kal_context *context, kal_ast_node *node);
+
+void kal_codegen_add_attributes(kal_context *context, LLVMValueRef func,
+    uint8_t flags);
+
+bool kal_codegen_remove_attributes(LLVMValueRef func);
+
+bool kal_codegen_memoizes(kal_context *context, kal_ast_node *node);
+
+
+//--------------------------------------
+// Fast Math
+//--------------------------------------
+
+uint8_t kal_codegen_fast_math(kal_context *context, kal_ast_node *node);
+
+void kal_codegen_add_fast_math(kal_context *context, LLVMValueRef func,
+    uint8_t fast_math);
+
+void kal_codegen_add_named_value(kal_context *context, kal_symbol name,
+    LLVMValueRef value);
+
+kal_named_value *kal_codegen_named_value(kal_context *context,
+    kal_symbol name);
+
+
+//--------------------------------------
+// Local Variables
+//--------------------------------------
+
+bool kal_codegen_assigns(kal_ast_node *node, kal_symbol name);
+
+LLVMValueRef kal_codegen_add_slot(kal_context *context, kal_symbol name,
+    LLVMValueRef value);
 
-kal_named_value *kal_codegen_named_value(const char *name);
+void kal_codegen_spill_args(kal_context *context, kal_ast_node *prototype,
+    kal_ast_node *body);
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,471 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <llvm-c/Core.h>
+#include <llvm-c/BitReader.h>
+#include <llvm-c/BitWriter.h>
+#include <llvm-c/Linker.h>
+#include <llvm-c/TargetMachine.h>
+#include <llvm-c/Transforms/PassManagerBuilder.h>
+#include <llvm-c/Transforms/Scalar.h>
+#include <llvm-c/Transforms/Utils.h>
+#include <llvm-c/Transforms/Vectorize.h>
+
+#include "compile.h"
+#include "codegen.h"
+
+
+//==============================================================================
+//
+// Typedefs
+//
+//==============================================================================
+
+// The function definitions waiting to be compiled. Workers pull the next
+// definition off the queue as soon as they finish the previous one so that
+// a few large functions don't hold up the rest of the batch.
+typedef struct kal_compile_queue {
+    kal_ast_node **nodes;
+    unsigned int count;
+    unsigned int next;
+    pthread_mutex_t mutex;
+} kal_compile_queue;
+
+// A single worker thread. Each worker generates code into its own context
+// and hands back the result as bitcode once the queue is empty.
+typedef struct kal_compile_worker {
+    pthread_t thread;
+    kal_context *context;
+    LLVMPassManagerRef pass_manager;
+    kal_compile_queue *queue;
+    LLVMMemoryBufferRef bitcode;
+    int rc;
+} kal_compile_worker;
+
+
+//==============================================================================
+//
+// Functions
+//
+//==============================================================================
+
+//--------------------------------------
+// Optimization
+//--------------------------------------
+
+// Creates a function pass manager with the same passes as the REPL. This is
+// used by engines that optimize modules away from the REPL's own module.
+// These passes clean up each function as it is generated. At -O0 there are
+// none.
+//
+// context - The context whose optimization level is used.
+// module  - The module the pass manager runs on.
+//
+// Returns an initialized function pass manager.
+LLVMPassManagerRef kal_compile_pass_manager_create(kal_context *context,
+                                                   LLVMModuleRef module)
+{
+    LLVMPassManagerRef pass_manager = LLVMCreateFunctionPassManagerForModule(module);
+    if(context->opt_level > 0) {
+        LLVMAddPromoteMemoryToRegisterPass(pass_manager);
+        LLVMAddInstructionCombiningPass(pass_manager);
+        LLVMAddReassociatePass(pass_manager);
+        LLVMAddGVNPass(pass_manager);
+        LLVMAddCFGSimplificationPass(pass_manager);
+    }
+    LLVMInitializeFunctionPassManager(pass_manager);
+    return pass_manager;
+}
+
+// Creates a pass manager that runs LLVM's standard module pipeline for the
+// context's optimization level. It includes the function inliner, IPSCCP
+// and dead argument elimination. At -O2 and above when optimizing for
+// speed, the loop and SLP vectorizers run as well, since LLVM leaves them
+// to the front end. The inliner's threshold follows clang's for each level.
+//
+// context - The context whose optimization level is used.
+// machine - The target the code is for, used to cost vectorization. May
+//           be NULL.
+//
+// Returns a new pass manager, which is empty at -O0.
+LLVMPassManagerRef kal_compile_module_pass_manager_create(kal_context *context,
+                                                          LLVMTargetMachineRef machine)
+{
+    LLVMPassManagerRef pass_manager = LLVMCreatePassManager();
+    if(context->opt_level == 0) {
+        return pass_manager;
+    }
+    if(machine != NULL) {
+        LLVMAddAnalysisPasses(machine, pass_manager);
+    }
+
+    unsigned int threshold = 225;
+    if(context->size_level == 1) {
+        threshold = 75;
+    }
+    else if(context->size_level > 1) {
+        threshold = 25;
+    }
+    else if(context->opt_level > 2) {
+        threshold = 250;
+    }
+
+    LLVMPassManagerBuilderRef builder = LLVMPassManagerBuilderCreate();
+    LLVMPassManagerBuilderSetOptLevel(builder, context->opt_level);
+    LLVMPassManagerBuilderSetSizeLevel(builder, context->size_level);
+    LLVMPassManagerBuilderUseInlinerWithThreshold(builder, threshold);
+    LLVMPassManagerBuilderPopulateModulePassManager(builder, pass_manager);
+    LLVMPassManagerBuilderDispose(builder);
+
+    if(context->opt_level >= 2 && context->size_level == 0) {
+        LLVMAddLoopVectorizePass(pass_manager);
+        LLVMAddSLPVectorizePass(pass_manager);
+        LLVMAddInstructionCombiningPass(pass_manager);
+        LLVMAddCFGSimplificationPass(pass_manager);
+    }
+
+    return pass_manager;
+}
+
+// Runs the module pipeline for the context's optimization level over a
+// module.
+//
+// context - The context whose optimization level is used.
+// module  - The module to optimize.
+// machine - The target the code is for. May be NULL.
+void kal_compile_optimize_module(kal_context *context, LLVMModuleRef module,
+                                 LLVMTargetMachineRef machine)
+{
+    if(context->opt_level == 0) {
+        return;
+    }
+    LLVMPassManagerRef pass_manager = kal_compile_module_pass_manager_create(context, machine);
+    LLVMRunPassManager(pass_manager, module);
+    LLVMDisposePassManager(pass_manager);
+}
+
+// Retrieves the code generation level that matches the context's
+// optimization level. Size levels generate code at LLVM's default level.
+//
+// context - The context.
+//
+// Returns the code generation level.
+LLVMCodeGenOptLevel kal_compile_codegen_level(kal_context *context)
+{
+    if(context->size_level > 0) {
+        return LLVMCodeGenLevelDefault;
+    }
+    switch(context->opt_level) {
+        case 0: return LLVMCodeGenLevelNone;
+        case 1: return LLVMCodeGenLevelLess;
+        case 2: return LLVMCodeGenLevelDefault;
+        default: return LLVMCodeGenLevelAggressive;
+    }
+}
+
+// Parses an optimization flag such as -O2 or -Os.
+//
+// flag       - The flag: -O0, -O1, -O2, -O3, -Os or -Oz.
+// opt_level  - Where the optimization level is stored.
+// size_level - Where the size level is stored.
+//
+// Returns 0 if the flag is valid, otherwise returns -1.
+int kal_compile_parse_opt_level(const char *flag, unsigned int *opt_level,
+                                unsigned int *size_level)
+{
+    if(strncmp(flag, "-O", 2) != 0 || flag[2] == '\0' || flag[3] != '\0') {
+        return -1;
+    }
+    switch(flag[2]) {
+        case '0': case '1': case '2': case '3': {
+            *opt_level = flag[2] - '0';
+            *size_level = 0;
+            return 0;
+        }
+        case 's': case 'z': {
+            *opt_level = 2;
+            *size_level = (flag[2] == 's' ? 1 : 2);
+            return 0;
+        }
+        default: return -1;
+    }
+}
+
+// Parses a fast-math flag. -ffast-math turns on every relaxed rule and
+// -ffast-math=nnan,contract turns on the rules listed, which can be any of
+// nnan, ninf, contract and reassoc.
+//
+// flag      - The flag.
+// fast_math - Where the kal_fast_math_e rules are stored.
+//
+// Returns 0 if the flag is valid, otherwise returns -1.
+int kal_compile_parse_fast_math(const char *flag, uint8_t *fast_math)
+{
+    const char *names[] = {"nnan", "ninf", "contract", "reassoc"};
+    uint8_t rules[] = {KAL_FAST_MATH_NNAN, KAL_FAST_MATH_NINF, KAL_FAST_MATH_CONTRACT, KAL_FAST_MATH_REASSOC};
+    unsigned int i;
+
+    if(strcmp(flag, "-ffast-math") == 0) {
+        *fast_math = KAL_FAST_MATH_ALL;
+        return 0;
+    }
+    if(strncmp(flag, "-ffast-math=", 12) != 0) {
+        return -1;
+    }
+
+    uint8_t value = 0;
+    const char *name = flag + 12;
+    while(true) {
+        size_t length = strcspn(name, ",");
+        for(i=0; i<sizeof(names)/sizeof(*names); i++) {
+            if(strlen(names[i]) == length && strncmp(name, names[i], length) == 0) {
+                value |= rules[i];
+                break;
+            }
+        }
+        if(i == sizeof(names)/sizeof(*names)) {
+            return -1;
+        }
+        if(name[length] == '\0') {
+            break;
+        }
+        name += length + 1;
+    }
+
+    *fast_math = value;
+    return 0;
+}
+
+
+//--------------------------------------
+// Worker
+//--------------------------------------
+
+// Declares every named function from one module in a worker's module so that
+// calls across definitions resolve no matter which worker compiles them.
+//
+// context - The worker's compilation context.
+// module  - The module to copy declarations from.
+void kal_compile_declare_all(kal_context *context, LLVMModuleRef module)
+{
+    unsigned int i;
+    LLVMTypeRef type = LLVMDoubleTypeInContext(context->llvm);
+
+    LLVMValueRef func;
+    for(func = LLVMGetFirstFunction(module); func != NULL; func = LLVMGetNextFunction(func)) {
+        const char *name = LLVMGetValueName(func);
+        if(name[0] == '\0') {
+            continue;
+        }
+
+        unsigned int param_count = LLVMCountParams(func);
+        LLVMTypeRef *params = malloc(sizeof(LLVMTypeRef) * param_count);
+        for(i=0; i<param_count; i++) {
+            params[i] = type;
+        }
+
+        LLVMValueRef decl = LLVMAddFunction(context->module, name,
+            LLVMFunctionType(type, params, param_count, 0));
+        LLVMSetLinkage(decl, LLVMExternalLinkage);
+        free(params);
+    }
+}
+
+// Creates a worker with its own context and function pass manager. This is
+// done on the calling thread before any workers start. The worker knows
+// every function the context has seen, including those declared in earlier
+// modules, along with their effects so that it marks and memoizes them the
+// same way a serial compile would.
+//
+// context - The context whose functions should be declared in the worker.
+// queue   - The shared queue of definitions.
+//
+// Returns a new worker.
+kal_compile_worker *kal_compile_worker_create(kal_context *context,
+                                              kal_compile_queue *queue)
+{
+    kal_symbol i;
+    kal_compile_worker *worker = calloc(1, sizeof(kal_compile_worker));
+    worker->context = kal_context_create("worker");
+    worker->context->opt_level = context->opt_level;
+    worker->context->size_level = context->size_level;
+    worker->context->memo = context->memo;
+    worker->context->fast_math = context->fast_math;
+    worker->context->profile = context->profile;
+    worker->context->target = kal_target_copy(context->target);
+    worker->queue = queue;
+    kal_compile_declare_all(worker->context, context->module);
+    for(i=0; i<context->function_capacity; i++) {
+        if(context->functions[i] == 0) {
+            continue;
+        }
+        kal_codegen_add_function(worker->context, i, context->functions[i] - 1);
+        if(context->function_flags[i] != 0) {
+            kal_codegen_set_flags(worker->context, i, context->function_flags[i]);
+            LLVMValueRef func = LLVMGetNamedFunction(worker->context->module, kal_symbol_name(i));
+            if(func != NULL) {
+                kal_codegen_add_attributes(worker->context, func, context->function_flags[i]);
+            }
+        }
+    }
+
+    worker->pass_manager = kal_compile_pass_manager_create(worker->context, worker->context->module);
+
+    return worker;
+}
+
+// Compiles definitions from the queue until it is empty and then serializes
+// the worker's module. The worker's context is released before returning so
+// that teardown also happens in parallel.
+//
+// data - The worker.
+//
+// Returns NULL.
+void *kal_compile_worker_run(void *data)
+{
+    kal_compile_worker *worker = data;
+    kal_compile_queue *queue = worker->queue;
+
+    while(true) {
+        pthread_mutex_lock(&queue->mutex);
+        unsigned int index = queue->next++;
+        pthread_mutex_unlock(&queue->mutex);
+        if(index >= queue->count) {
+            break;
+        }
+
+        LLVMValueRef func = kal_codegen(worker->context, queue->nodes[index]);
+        if(func == NULL) {
+            fprintf(stderr, "Unable to codegen for node\n");
+            worker->rc = -1;
+            continue;
+        }
+        LLVMRunFunctionPassManager(worker->pass_manager, func);
+    }
+
+    LLVMFinalizeFunctionPassManager(worker->pass_manager);
+    LLVMDisposePassManager(worker->pass_manager);
+    worker->bitcode = LLVMWriteBitcodeToMemoryBuffer(worker->context->module);
+    kal_context_free(worker->context);
+    worker->context = NULL;
+
+    return NULL;
+}
+
+
+//--------------------------------------
+// Parallel Compilation
+//--------------------------------------
+
+// Compiles the function definitions in a list of top-level items on a pool
+// of worker threads and links the results into a context's module. Every
+// worker has its own LLVM context, module and builder, and runs the function
+// passes on its own definitions before handing them back. Prototypes are
+// declared in the target module first. Top-level expressions are skipped and
+// are left for the caller to evaluate once the definitions exist.
+//
+// context      - The context to link the compiled functions into.
+// nodes        - The top-level items.
+// count        - The number of items.
+// worker_count - The number of threads to use or 0 to use one per core.
+//
+// Returns 0 if every definition compiled, otherwise returns -1. Definitions
+// that compile are linked in either way.
+int kal_compile_parallel(kal_context *context, kal_ast_node **nodes,
+                         unsigned int count, unsigned int worker_count)
+{
+    int rc = 0;
+    unsigned int i;
+
+    // Declare everything up front in the target so redefinitions are caught
+    // here and the workers can see every name.
+    kal_compile_queue queue;
+    queue.nodes = malloc(sizeof(kal_ast_node*) * (count > 0 ? count : 1));
+    queue.count = 0;
+    queue.next = 0;
+    pthread_mutex_init(&queue.mutex, NULL);
+
+    for(i=0; i<count; i++) {
+        kal_ast_node *node = nodes[i];
+        if(node->type == KAL_AST_TYPE_PROTOTYPE) {
+            if(kal_codegen(context, node) == NULL) {
+                rc = -1;
+            }
+        }
+        else if(node->type == KAL_AST_TYPE_FUNCTION) {
+            if(kal_codegen(context, node->function.prototype) == NULL) {
+                fprintf(stderr, "Unable to codegen for node\n");
+                rc = -1;
+                continue;
+            }
+            kal_codegen_set_flags(context, node->function.prototype->prototype.name,
+                kal_codegen_function_flags(context, node));
+            queue.nodes[queue.count++] = node;
+        }
+    }
+    kal_codegen_reset(context);
+
+    if(worker_count == 0) {
+        worker_count = kal_compile_worker_count();
+    }
+    if(worker_count > queue.count) {
+        worker_count = queue.count;
+    }
+
+    // Start the workers. If a thread can't be started then that worker just
+    // runs on this thread instead.
+    kal_compile_worker **workers = malloc(sizeof(kal_compile_worker*) * (worker_count > 0 ? worker_count : 1));
+    for(i=0; i<worker_count; i++) {
+        workers[i] = kal_compile_worker_create(context, &queue);
+    }
+    for(i=0; i<worker_count; i++) {
+        if(pthread_create(&workers[i]->thread, NULL, kal_compile_worker_run, workers[i]) != 0) {
+            kal_compile_worker_run(workers[i]);
+            workers[i]->thread = pthread_self();
+        }
+    }
+
+    // Link each worker's module into the target in order.
+    for(i=0; i<worker_count; i++) {
+        kal_compile_worker *worker = workers[i];
+        if(!pthread_equal(worker->thread, pthread_self())) {
+            pthread_join(worker->thread, NULL);
+        }
+        if(worker->rc != 0) {
+            rc = -1;
+        }
+
+        LLVMModuleRef module = NULL;
+        if(LLVMParseBitcodeInContext2(context->llvm, worker->bitcode, &module) != 0) {
+            fprintf(stderr, "Unable to read compiled functions\n");
+            rc = -1;
+        }
+        else if(LLVMLinkModules2(context->module, module) != 0) {
+            fprintf(stderr, "Unable to link compiled functions\n");
+            rc = -1;
+        }
+        LLVMDisposeMemoryBuffer(worker->bitcode);
+        free(worker);
+    }
+
+    free(workers);
+    free(queue.nodes);
+    pthread_mutex_destroy(&queue.mutex);
+
+    return rc;
+}
+
+// Retrieves the default number of worker threads.
+//
+// Returns the number of online processors, or 1 if it can't be determined.
+unsigned int kal_compile_worker_count()
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return (count > 0 ? (unsigned int)count : 1);
+}
@@ -0,0 +1,48 @@
+#ifndef _compile_h
+#define _compile_h
+
+#include <llvm-c/Core.h>
+#include <llvm-c/TargetMachine.h>
+#include "ast.h"
+#include "context.h"
+
+
+//==============================================================================
+//
+// Definitions
+//
+//==============================================================================
+
+// The smallest number of function definitions that is worth spreading across
+// worker threads. Smaller batches are cheaper to compile in place.
+#define KAL_COMPILE_PARALLEL_MIN 64
+
+
+//==============================================================================
+//
+// Functions
+//
+//==============================================================================
+
+LLVMPassManagerRef kal_compile_pass_manager_create(kal_context *context,
+    LLVMModuleRef module);
+
+LLVMPassManagerRef kal_compile_module_pass_manager_create(kal_context *context,
+    LLVMTargetMachineRef machine);
+
+void kal_compile_optimize_module(kal_context *context, LLVMModuleRef module,
+    LLVMTargetMachineRef machine);
+
+LLVMCodeGenOptLevel kal_compile_codegen_level(kal_context *context);
+
+int kal_compile_parse_opt_level(const char *flag, unsigned int *opt_level,
+    unsigned int *size_level);
+
+int kal_compile_parse_fast_math(const char *flag, uint8_t *fast_math);
+
+int kal_compile_parallel(kal_context *context, kal_ast_node **nodes,
+    unsigned int count, unsigned int worker_count);
+
+unsigned int kal_compile_worker_count();
+
+#endif
@@ -0,0 +1,62 @@
+#include <stdlib.h>
+
+#include "context.h"
+
+
+//==============================================================================
+//
+// Functions
+//
+//==============================================================================
+
+// Creates a compilation context with its own LLVM context, module, builder
+// and arena.
+//
+// module_name - The name of the module that code is generated into.
+//
+// Returns a new context.
+kal_context *kal_context_create(const char *module_name)
+{
+    kal_context *context = kal_context_create_in(LLVMContextCreate(), module_name);
+    context->owns_llvm = true;
+    return context;
+}
+
+// Creates a compilation context that generates code into an existing LLVM
+// context. The LLVM context is not disposed when the context is freed.
+//
+// llvm        - The LLVM context to use.
+// module_name - The name of the module that code is generated into.
+//
+// Returns a new context.
+kal_context *kal_context_create_in(LLVMContextRef llvm, const char *module_name)
+{
+    kal_context *context = calloc(1, sizeof(kal_context));
+    context->llvm = llvm;
+    context->module = LLVMModuleCreateWithNameInContext(module_name, context->llvm);
+    context->builder = LLVMCreateBuilderInContext(context->llvm);
+    context->arena = kal_ast_arena_create();
+    context->opt_level = KAL_CONTEXT_OPT_LEVEL;
+    context->function = KAL_SYMBOL_NONE;
+    return context;
+}
+
+// Frees a context. If ownership of the module was handed off (for example to
+// an execution engine) then the module should be set to NULL first.
+//
+// context - The context to free.
+void kal_context_free(kal_context *context)
+{
+    if(!context) return;
+
+    if(context->module) LLVMDisposeModule(context->module);
+    LLVMDisposeBuilder(context->builder);
+    if(context->owns_llvm) LLVMContextDispose(context->llvm);
+    kal_ast_arena_free(context->arena);
+    free(context->named_values);
+    free(context->tail_args);
+    free(context->functions);
+    free(context->function_flags);
+    kal_target_free(context->target);
+    free(context);
+}
@@ -0,0 +1,129 @@
+#ifndef _context_h
+#define _context_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <llvm-c/Core.h>
+#include "ast.h"
+#include "target.h"
+
+//==============================================================================
+//
+// Definitions
+//
+//==============================================================================
+
+// The optimization level contexts start at.
+#define KAL_CONTEXT_OPT_LEVEL 2
+
+
+//==============================================================================
+//
+// Typedefs
+//
+//==============================================================================
+
+// What is known about a function's effects.
+//
+// KAL_FUNCTION_PURE       - Only does arithmetic and calls pure functions,
+//                           so repeated calls can be merged or memoized.
+// KAL_FUNCTION_READNONE   - Pure and doesn't touch memory either, which
+//                           memoized functions do.
+// KAL_FUNCTION_WILLRETURN - Always returns since it can't recurse, directly
+//                           or through anything it calls.
+typedef enum kal_function_flag_e {
+    KAL_FUNCTION_PURE = 1,
+    KAL_FUNCTION_READNONE = 2,
+    KAL_FUNCTION_WILLRETURN = 4,
+    KAL_FUNCTION_ALL = 7
+} kal_function_flag_e;
+
+// Relaxed floating point rules that generated code may follow.
+//
+// KAL_FAST_MATH_NNAN     - Values are assumed never to be NaN.
+// KAL_FAST_MATH_NINF     - Values are assumed never to be infinite.
+// KAL_FAST_MATH_CONTRACT - A multiply feeding an add or subtract may be
+//                          fused into one FMA with a single rounding.
+// KAL_FAST_MATH_REASSOC  - Arithmetic may be reassociated, which also
+//                          ignores the sign of zero.
+typedef enum kal_fast_math_e {
+    KAL_FAST_MATH_NNAN = 1,
+    KAL_FAST_MATH_NINF = 2,
+    KAL_FAST_MATH_CONTRACT = 4,
+    KAL_FAST_MATH_REASSOC = 8,
+    KAL_FAST_MATH_ALL = 15
+} kal_fast_math_e;
+
+// Used to hold references to arguments and local variables by name.
+// Variables that can be assigned live in stack slots, in which case `slot`
+// is set and `value` is the slot's alloca.
+typedef struct kal_named_value {
+    kal_symbol name;
+    LLVMValueRef value;
+    bool slot;
+} kal_named_value;
+
+// Holds all of the state for a single compilation session. Sessions share
+// nothing except the symbol table so separate contexts can be used on
+// separate threads at the same time.
+//
+// The module can be handed off and replaced between items. The parameter
+// count of every function declared so far is kept in `functions`, indexed by
+// symbol (0 means unknown, otherwise the count plus one), so that later
+// modules can call functions defined in earlier ones. `function_flags` holds
+// what is known about each one's effects as kal_function_flag_e values. With
+// `memo` set every pure function is memoized rather than only the ones
+// defined with `def memo`. `fast_math` holds the kal_fast_math_e rules that
+// every function may follow, on top of all of them for `def fast`. With
+// `profile` set every function counts its calls and the cycles spent in it.
+//
+// `opt_level` (0 to 3) and `size_level` (0 for speed, 1 for -Os and 2 for
+// -Oz) choose the passes that generated code goes through. Functions are
+// tuned for `target`, which the context owns, or left to whatever target
+// machine compiles them if it is NULL.
+//
+// While a function is generated, `function` is its name, `function_fast_math`
+// is the rules it follows and `tail` says whether the expression being
+// generated is in tail position. Self calls in tail position jump back to
+// `tail_block`, whose phis in `tail_args` stand in for the function's
+// arguments.
+typedef struct kal_context {
+    LLVMContextRef llvm;
+    bool owns_llvm;
+    LLVMModuleRef module;
+    LLVMBuilderRef builder;
+    kal_ast_arena *arena;
+    kal_named_value *named_values;
+    unsigned int named_value_count;
+    unsigned int named_value_capacity;
+    unsigned int *functions;
+    unsigned int function_capacity;
+    uint8_t *function_flags;
+    bool memo;
+    uint8_t fast_math;
+    bool profile;
+    unsigned int opt_level;
+    unsigned int size_level;
+    kal_target *target;
+    kal_symbol function;
+    uint8_t function_fast_math;
+    bool tail;
+    LLVMBasicBlockRef tail_block;
+    LLVMValueRef *tail_args;
+} kal_context;
+
+
+//==============================================================================
+//
+// Functions
+//
+//==============================================================================
+
+kal_context *kal_context_create(const char *module_name);
+
+kal_context *kal_context_create_in(LLVMContextRef llvm,
+    const char *module_name);
+
+void kal_context_free(kal_context *context);
+
+#endif
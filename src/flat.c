@@ -0,0 +1,265 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "flat.h"
+
+
+//==============================================================================
+//
+// Definitions
+//
+//==============================================================================
+
+// Grows an array so that it can hold at least one more element.
+#define KAL_AST_FLAT_GROW(ARRAY, COUNT, CAPACITY) do {\
+    if((COUNT) == (CAPACITY)) {\
+        (CAPACITY) = ((CAPACITY) == 0 ? 64 : (CAPACITY) * 2);\
+        (ARRAY) = realloc((ARRAY), sizeof(*(ARRAY)) * (CAPACITY));\
+    }\
+} while(0)
+
+
+//==============================================================================
+//
+// Functions
+//
+//==============================================================================
+
+//--------------------------------------
+// Lifecycle
+//--------------------------------------
+
+// Creates an empty flat AST.
+//
+// Returns a new flat AST.
+kal_ast_flat *kal_ast_flat_create()
+{
+    kal_ast_flat *flat = calloc(1, sizeof(kal_ast_flat));
+    return flat;
+}
+
+// Frees a flat AST. Since every node lives in the same few arrays this does
+// not need to walk the nodes at all.
+//
+// flat - The flat AST to free.
+void kal_ast_flat_free(kal_ast_flat *flat)
+{
+    if(!flat) return;
+
+    free(flat->nodes);
+    free(flat->numbers);
+    free(flat->operands);
+    free(flat->items);
+    free(flat);
+}
+
+
+//--------------------------------------
+// Encoding
+//--------------------------------------
+
+// Reserves the next node in a flat AST.
+//
+// flat - The flat AST.
+// type - The type of node.
+//
+// Returns the index of the new node.
+static uint32_t kal_ast_flat_add_node(kal_ast_flat *flat, kal_ast_node_type_e type)
+{
+    KAL_AST_FLAT_GROW(flat->nodes, flat->node_count, flat->node_capacity);
+    kal_ast_flat_node *node = &flat->nodes[flat->node_count];
+    memset(node, 0, sizeof(*node));
+    node->type = type;
+    return flat->node_count++;
+}
+
+// Appends a value to the shared operand array.
+//
+// flat  - The flat AST.
+// value - The node index or symbol to append.
+static void kal_ast_flat_add_operand(kal_ast_flat *flat, uint32_t value)
+{
+    KAL_AST_FLAT_GROW(flat->operands, flat->operand_count, flat->operand_capacity);
+    flat->operands[flat->operand_count++] = value;
+}
+
+// Recursively encodes a tree node and its children.
+//
+// flat - The flat AST to append to.
+// node - The tree node to encode.
+//
+// Returns the index of the encoded node.
+static uint32_t kal_ast_flat_encode(kal_ast_flat *flat, kal_ast_node *node)
+{
+    unsigned int i;
+    uint32_t index;
+
+    switch(node->type) {
+        case KAL_AST_TYPE_NUMBER: {
+            KAL_AST_FLAT_GROW(flat->numbers, flat->number_count, flat->number_capacity);
+            flat->numbers[flat->number_count] = node->number.value;
+            index = kal_ast_flat_add_node(flat, node->type);
+            flat->nodes[index].a = flat->number_count++;
+            return index;
+        }
+        case KAL_AST_TYPE_VARIABLE: {
+            index = kal_ast_flat_add_node(flat, node->type);
+            flat->nodes[index].a = node->variable.name;
+            return index;
+        }
+        case KAL_AST_TYPE_BINARY_EXPR: {
+            uint32_t lhs = kal_ast_flat_encode(flat, node->binary_expr.lhs);
+            uint32_t rhs = kal_ast_flat_encode(flat, node->binary_expr.rhs);
+            index = kal_ast_flat_add_node(flat, node->type);
+            flat->nodes[index].operator = node->binary_expr.operator;
+            flat->nodes[index].a = lhs;
+            flat->nodes[index].b = rhs;
+            return index;
+        }
+        case KAL_AST_TYPE_CALL: {
+            // Arguments are encoded first, then their indices are copied into
+            // the operand array in one contiguous run.
+            uint32_t *args = malloc(sizeof(uint32_t) * node->call.arg_count);
+            for(i=0; i<node->call.arg_count; i++) {
+                args[i] = kal_ast_flat_encode(flat, node->call.args[i]);
+            }
+            index = kal_ast_flat_add_node(flat, node->type);
+            flat->nodes[index].a = node->call.name;
+            flat->nodes[index].b = flat->operand_count;
+            flat->nodes[index].c = node->call.arg_count;
+            for(i=0; i<node->call.arg_count; i++) {
+                kal_ast_flat_add_operand(flat, args[i]);
+            }
+            free(args);
+            return index;
+        }
+        case KAL_AST_TYPE_PROTOTYPE: {
+            index = kal_ast_flat_add_node(flat, node->type);
+            flat->nodes[index].a = node->prototype.name;
+            flat->nodes[index].b = flat->operand_count;
+            flat->nodes[index].c = node->prototype.arg_count;
+            flat->nodes[index].flags = node->prototype.pure;
+            for(i=0; i<node->prototype.arg_count; i++) {
+                kal_ast_flat_add_operand(flat, node->prototype.args[i]);
+            }
+            return index;
+        }
+        case KAL_AST_TYPE_FUNCTION: {
+            index = kal_ast_flat_add_node(flat, node->type);
+            uint32_t prototype = kal_ast_flat_encode(flat, node->function.prototype);
+            kal_ast_flat_encode(flat, node->function.body);
+            flat->nodes[index].a = prototype;
+            flat->nodes[index].b = flat->node_count - 1;
+            flat->nodes[index].c = node->function.fast;
+            flat->nodes[index].flags = node->function.memo;
+            return index;
+        }
+        case KAL_AST_TYPE_IF_EXPR: {
+            index = kal_ast_flat_add_node(flat, node->type);
+            kal_ast_flat_encode(flat, node->if_expr.condition);
+            flat->nodes[index].a = flat->node_count - 1;
+            kal_ast_flat_encode(flat, node->if_expr.true_expr);
+            flat->nodes[index].b = flat->node_count - 1;
+            kal_ast_flat_encode(flat, node->if_expr.false_expr);
+            flat->nodes[index].c = flat->node_count - 1;
+            return index;
+        }
+        case KAL_AST_TYPE_FOR_EXPR: {
+            // Child ranges are only known once they are encoded so the
+            // operands are filled in afterward.
+            index = kal_ast_flat_add_node(flat, node->type);
+            uint32_t offset = flat->operand_count;
+            for(i=0; i<4; i++) {
+                kal_ast_flat_add_operand(flat, 0);
+            }
+            flat->nodes[index].a = node->for_expr.name;
+            flat->nodes[index].b = offset;
+            kal_ast_flat_encode(flat, node->for_expr.start);
+            flat->operands[offset] = flat->node_count - 1;
+            kal_ast_flat_encode(flat, node->for_expr.condition);
+            flat->operands[offset + 1] = flat->node_count - 1;
+            if(node->for_expr.step != NULL) {
+                kal_ast_flat_encode(flat, node->for_expr.step);
+            }
+            flat->operands[offset + 2] = flat->node_count - 1;
+            kal_ast_flat_encode(flat, node->for_expr.body);
+            flat->operands[offset + 3] = flat->node_count - 1;
+            return index;
+        }
+        case KAL_AST_TYPE_VAR_EXPR: {
+            index = kal_ast_flat_add_node(flat, node->type);
+            uint32_t offset = flat->operand_count;
+            for(i=0; i<node->var_expr.var_count * 2 + 1; i++) {
+                kal_ast_flat_add_operand(flat, 0);
+            }
+            flat->nodes[index].a = node->var_expr.var_count;
+            flat->nodes[index].b = offset;
+            for(i=0; i<node->var_expr.var_count; i++) {
+                if(node->var_expr.inits[i] != NULL) {
+                    kal_ast_flat_encode(flat, node->var_expr.inits[i]);
+                }
+                flat->operands[offset + i * 2] = node->var_expr.names[i];
+                flat->operands[offset + i * 2 + 1] = flat->node_count - 1;
+            }
+            kal_ast_flat_encode(flat, node->var_expr.body);
+            flat->operands[offset + node->var_expr.var_count * 2] = flat->node_count - 1;
+            return index;
+        }
+        case KAL_AST_TYPE_ASSIGN: {
+            uint32_t value = kal_ast_flat_encode(flat, node->assign.value);
+            index = kal_ast_flat_add_node(flat, node->type);
+            flat->nodes[index].a = node->assign.name;
+            flat->nodes[index].b = value;
+            return index;
+        }
+    }
+
+    return 0;
+}
+
+// Encodes a tree as a new top-level item at the end of a flat AST. The tree
+// is not modified and can be freed afterward.
+//
+// flat - The flat AST to append to.
+// node - The root of the tree to encode.
+//
+// Returns the index of the new item.
+uint32_t kal_ast_flat_append(kal_ast_flat *flat, kal_ast_node *node)
+{
+    KAL_AST_FLAT_GROW(flat->items, flat->item_count, flat->item_capacity);
+    flat->items[flat->item_count] = flat->node_count;
+    kal_ast_flat_encode(flat, node);
+    return flat->item_count++;
+}
+
+
+//--------------------------------------
+// Utility
+//--------------------------------------
+
+// Retrieves the index of the last node of a top-level item.
+//
+// flat - The flat AST.
+// item - The item index.
+//
+// Returns a node index.
+uint32_t kal_ast_flat_item_end(kal_ast_flat *flat, uint32_t item)
+{
+    if(item + 1 < flat->item_count) {
+        return flat->items[item + 1] - 1;
+    }
+    return flat->node_count - 1;
+}
+
+// Calculates the number of bytes used by the nodes, literals and operands.
+//
+// flat - The flat AST.
+//
+// Returns the number of bytes in use.
+size_t kal_ast_flat_size(kal_ast_flat *flat)
+{
+    return sizeof(kal_ast_flat_node) * flat->node_count +
+        sizeof(double) * flat->number_count +
+        sizeof(uint32_t) * flat->operand_count +
+        sizeof(uint32_t) * flat->item_count;
+}
@@ -0,0 +1,83 @@
+#ifndef _flat_h
+#define _flat_h
+
+#include <stdint.h>
+
+#include "ast.h"
+
+//==============================================================================
+//
+// Definitions
+//
+//==============================================================================
+
+// Represents a single node in a flat AST. The meaning of the operands
+// depends on the node type:
+//
+//   NUMBER      - a: index into `numbers`.
+//   VARIABLE    - a: symbol.
+//   BINARY_EXPR - a: lhs index, b: rhs index.
+//   CALL        - a: symbol, b: offset into `operands`, c: argument count.
+//   PROTOTYPE   - a: symbol, b: offset into `operands`, c: argument count,
+//                 flags: 1 if it is declared `extern pure`.
+//   FUNCTION    - a: prototype index, b: index of the last body node,
+//                 c: 1 if the definition is `def fast`, flags: 1 if it is
+//                 `def memo`.
+//   IF_EXPR     - a, b, c: index of the last node of the condition, true
+//                 and false expressions.
+//   FOR_EXPR    - a: symbol, b: offset into `operands` of the index of the
+//                 last node of the start, condition, step and body. The
+//                 step range is empty if there is no step.
+//   VAR_EXPR    - a: variable count, b: offset into `operands` of a symbol
+//                 and the index of the last node of the initializer for
+//                 each variable, followed by the index of the last body
+//                 node. An initializer range is empty if there is none.
+//   ASSIGN      - a: symbol, b: value index.
+//
+// Expressions are stored after their children so they can be generated in a
+// single forward pass. Functions, if, for and var expressions need to set
+// up blocks or scopes before their children are generated so they are
+// stored before them and record where each child range ends instead.
+typedef struct kal_ast_flat_node {
+    uint8_t type;
+    uint8_t operator;
+    uint8_t flags;
+    uint32_t a;
+    uint32_t b;
+    uint32_t c;
+} kal_ast_flat_node;
+
+// Represents one or more top-level items encoded as contiguous arrays.
+typedef struct kal_ast_flat {
+    kal_ast_flat_node *nodes;
+    uint32_t node_count;
+    uint32_t node_capacity;
+    double *numbers;
+    uint32_t number_count;
+    uint32_t number_capacity;
+    uint32_t *operands;
+    uint32_t operand_count;
+    uint32_t operand_capacity;
+    uint32_t *items;
+    uint32_t item_count;
+    uint32_t item_capacity;
+} kal_ast_flat;
+
+
+//==============================================================================
+//
+// Functions
+//
+//==============================================================================
+
+kal_ast_flat *kal_ast_flat_create();
+
+void kal_ast_flat_free(kal_ast_flat *flat);
+
+uint32_t kal_ast_flat_append(kal_ast_flat *flat, kal_ast_node *node);
+
+uint32_t kal_ast_flat_item_end(kal_ast_flat *flat, uint32_t item);
+
+size_t kal_ast_flat_size(kal_ast_flat *flat);
+
+#endif
@@ -0,0 +1,263 @@
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "fold.h"
+
+
+//==============================================================================
+//
+// Functions
+//
+//==============================================================================
+
+//--------------------------------------
+// Utility
+//--------------------------------------
+
+// Counts the nodes in a tree.
+//
+// node - The root of the tree.
+//
+// Returns the number of nodes.
+unsigned int kal_ast_node_count(kal_ast_node *node)
+{
+    unsigned int i, count = 1;
+
+    switch(node->type) {
+        case KAL_AST_TYPE_BINARY_EXPR: {
+            return count + kal_ast_node_count(node->binary_expr.lhs) +
+                kal_ast_node_count(node->binary_expr.rhs);
+        }
+        case KAL_AST_TYPE_CALL: {
+            for(i=0; i<node->call.arg_count; i++) {
+                count += kal_ast_node_count(node->call.args[i]);
+            }
+            return count;
+        }
+        case KAL_AST_TYPE_FUNCTION: {
+            return count + kal_ast_node_count(node->function.prototype) +
+                kal_ast_node_count(node->function.body);
+        }
+        case KAL_AST_TYPE_IF_EXPR: {
+            return count + kal_ast_node_count(node->if_expr.condition) +
+                kal_ast_node_count(node->if_expr.true_expr) +
+                kal_ast_node_count(node->if_expr.false_expr);
+        }
+        case KAL_AST_TYPE_FOR_EXPR: {
+            count += kal_ast_node_count(node->for_expr.start) +
+                kal_ast_node_count(node->for_expr.condition) +
+                kal_ast_node_count(node->for_expr.body);
+            if(node->for_expr.step != NULL) {
+                count += kal_ast_node_count(node->for_expr.step);
+            }
+            return count;
+        }
+        case KAL_AST_TYPE_VAR_EXPR: {
+            for(i=0; i<node->var_expr.var_count; i++) {
+                if(node->var_expr.inits[i] != NULL) {
+                    count += kal_ast_node_count(node->var_expr.inits[i]);
+                }
+            }
+            return count + kal_ast_node_count(node->var_expr.body);
+        }
+        case KAL_AST_TYPE_ASSIGN: {
+            return count + kal_ast_node_count(node->assign.value);
+        }
+        default: {
+            return count;
+        }
+    }
+}
+
+// Frees a subtree that folding removed. Arena nodes are left for the arena.
+//
+// arena - The arena the tree was allocated from or NULL for the heap.
+// node  - The subtree to free.
+static void kal_ast_fold_discard(kal_ast_arena *arena, kal_ast_node *node)
+{
+    if(arena == NULL) {
+        kal_ast_node_free(node);
+    }
+}
+
+// Replaces a node with one of its children. The child is moved into the
+// node itself so that whatever points at the node doesn't need updating.
+//
+// arena - The arena the tree was allocated from or NULL for the heap.
+// node  - The node to replace.
+// child - The child to move into its place.
+static void kal_ast_fold_replace(kal_ast_arena *arena, kal_ast_node *node,
+                                 kal_ast_node *child)
+{
+    kal_ast_node copy = *child;
+    if(arena == NULL) {
+        free(child);
+    }
+    *node = copy;
+}
+
+
+//--------------------------------------
+// Folding
+//--------------------------------------
+
+static void kal_ast_fold_node(kal_ast_arena *arena, kal_ast_node *node);
+
+// Folds a binary expression whose operands are both numbers into a number
+// and applies identities that leave the other operand unchanged: x+0, 0+x,
+// x-0, x*1, 1*x and x/1. Numbers are doubles so nothing involving x*0 or
+// x-x is touched. The only results that differ from evaluating the
+// expression are x+0 and 0+x when x is -0, which give -0 instead of 0.
+//
+// arena - The arena the tree was allocated from or NULL for the heap.
+// node  - The binary expression.
+static void kal_ast_fold_binary_expr(kal_ast_arena *arena, kal_ast_node *node)
+{
+    kal_ast_fold_node(arena, node->binary_expr.lhs);
+    kal_ast_fold_node(arena, node->binary_expr.rhs);
+
+    kal_ast_node *lhs = node->binary_expr.lhs;
+    kal_ast_node *rhs = node->binary_expr.rhs;
+    kal_ast_binop_e operator = node->binary_expr.operator;
+
+    // Evaluate constant operations.
+    if(lhs->type == KAL_AST_TYPE_NUMBER && rhs->type == KAL_AST_TYPE_NUMBER) {
+        double value;
+        switch(operator) {
+            case KAL_BINOP_PLUS: value = lhs->number.value + rhs->number.value; break;
+            case KAL_BINOP_MINUS: value = lhs->number.value - rhs->number.value; break;
+            case KAL_BINOP_MUL: value = lhs->number.value * rhs->number.value; break;
+            case KAL_BINOP_DIV: value = lhs->number.value / rhs->number.value; break;
+            case KAL_BINOP_LT: value = (lhs->number.value < rhs->number.value); break;
+            case KAL_BINOP_LE: value = (lhs->number.value <= rhs->number.value); break;
+            case KAL_BINOP_GT: value = (lhs->number.value > rhs->number.value); break;
+            case KAL_BINOP_GE: value = (lhs->number.value >= rhs->number.value); break;
+            case KAL_BINOP_EQ: value = (lhs->number.value == rhs->number.value); break;
+            case KAL_BINOP_NE: value = (lhs->number.value != rhs->number.value); break;
+            default: return;
+        }
+        kal_ast_fold_discard(arena, lhs);
+        kal_ast_fold_discard(arena, rhs);
+        node->type = KAL_AST_TYPE_NUMBER;
+        node->number.value = value;
+        return;
+    }
+
+    // Drop identity operands.
+    if(rhs->type == KAL_AST_TYPE_NUMBER) {
+        double value = rhs->number.value;
+        if(((operator == KAL_BINOP_PLUS || operator == KAL_BINOP_MINUS) && value == 0) ||
+           ((operator == KAL_BINOP_MUL || operator == KAL_BINOP_DIV) && value == 1))
+        {
+            kal_ast_fold_discard(arena, rhs);
+            kal_ast_fold_replace(arena, node, lhs);
+        }
+    }
+    else if(lhs->type == KAL_AST_TYPE_NUMBER) {
+        double value = lhs->number.value;
+        if((operator == KAL_BINOP_PLUS && value == 0) ||
+           (operator == KAL_BINOP_MUL && value == 1))
+        {
+            kal_ast_fold_discard(arena, lhs);
+            kal_ast_fold_replace(arena, node, rhs);
+        }
+    }
+}
+
+// Replaces an if expression that has a constant condition with the branch
+// that would be taken. As in codegen, NaN counts as false.
+//
+// arena - The arena the tree was allocated from or NULL for the heap.
+// node  - The if expression.
+static void kal_ast_fold_if_expr(kal_ast_arena *arena, kal_ast_node *node)
+{
+    kal_ast_node *condition = node->if_expr.condition;
+    kal_ast_fold_node(arena, condition);
+
+    if(condition->type != KAL_AST_TYPE_NUMBER) {
+        kal_ast_fold_node(arena, node->if_expr.true_expr);
+        kal_ast_fold_node(arena, node->if_expr.false_expr);
+        return;
+    }
+
+    double value = condition->number.value;
+    bool taken = (value < 0 || value > 0);
+    kal_ast_node *branch = (taken ? node->if_expr.true_expr : node->if_expr.false_expr);
+    kal_ast_fold_discard(arena, condition);
+    kal_ast_fold_discard(arena, (taken ? node->if_expr.false_expr : node->if_expr.true_expr));
+
+    kal_ast_fold_node(arena, branch);
+    kal_ast_fold_replace(arena, node, branch);
+}
+
+// Folds a node and everything beneath it.
+//
+// arena - The arena the tree was allocated from or NULL for the heap.
+// node  - The node to fold.
+static void kal_ast_fold_node(kal_ast_arena *arena, kal_ast_node *node)
+{
+    unsigned int i;
+
+    switch(node->type) {
+        case KAL_AST_TYPE_BINARY_EXPR: {
+            kal_ast_fold_binary_expr(arena, node);
+            break;
+        }
+        case KAL_AST_TYPE_CALL: {
+            for(i=0; i<node->call.arg_count; i++) {
+                kal_ast_fold_node(arena, node->call.args[i]);
+            }
+            break;
+        }
+        case KAL_AST_TYPE_FUNCTION: {
+            kal_ast_fold_node(arena, node->function.body);
+            break;
+        }
+        case KAL_AST_TYPE_IF_EXPR: {
+            kal_ast_fold_if_expr(arena, node);
+            break;
+        }
+        case KAL_AST_TYPE_FOR_EXPR: {
+            kal_ast_fold_node(arena, node->for_expr.start);
+            kal_ast_fold_node(arena, node->for_expr.condition);
+            if(node->for_expr.step != NULL) {
+                kal_ast_fold_node(arena, node->for_expr.step);
+            }
+            kal_ast_fold_node(arena, node->for_expr.body);
+            break;
+        }
+        case KAL_AST_TYPE_VAR_EXPR: {
+            for(i=0; i<node->var_expr.var_count; i++) {
+                if(node->var_expr.inits[i] != NULL) {
+                    kal_ast_fold_node(arena, node->var_expr.inits[i]);
+                }
+            }
+            kal_ast_fold_node(arena, node->var_expr.body);
+            break;
+        }
+        case KAL_AST_TYPE_ASSIGN: {
+            kal_ast_fold_node(arena, node->assign.value);
+            break;
+        }
+        default: break;
+    }
+}
+
+// Folds constant subexpressions and identities in a parsed item before it
+// is generated. The tree is rewritten in place so the root node stays the
+// same. Removed nodes are freed if the tree is on the heap.
+//
+// arena - The arena the tree was allocated from or NULL for the heap.
+// node  - The item to fold.
+// stats - Node counts to add to. May be NULL.
+void kal_ast_fold(kal_ast_arena *arena, kal_ast_node *node,
+                  kal_ast_fold_stats *stats)
+{
+    if(stats != NULL) {
+        stats->nodes_before += kal_ast_node_count(node);
+    }
+    kal_ast_fold_node(arena, node);
+    if(stats != NULL) {
+        stats->nodes_after += kal_ast_node_count(node);
+    }
+}
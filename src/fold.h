@@ -0,0 +1,31 @@
+#ifndef _fold_h
+#define _fold_h
+
+#include "ast.h"
+
+//==============================================================================
+//
+// Typedefs
+//
+//==============================================================================
+
+// Counts the nodes seen by the fold pass so callers can see how much work it
+// removes before codegen. Both counts accumulate across calls.
+typedef struct kal_ast_fold_stats {
+    unsigned int nodes_before;
+    unsigned int nodes_after;
+} kal_ast_fold_stats;
+
+
+//==============================================================================
+//
+// Functions
+//
+//==============================================================================
+
+void kal_ast_fold(kal_ast_arena *arena, kal_ast_node *node,
+    kal_ast_fold_stats *stats);
+
+unsigned int kal_ast_node_count(kal_ast_node *node);
+
+#endif
@@ -0,0 +1,1786 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <llvm-c/Core.h>
+#include <llvm-c/Error.h>
+#include <llvm-c/Target.h>
+#include <llvm-c/TargetMachine.h>
+#include <llvm-c/BitReader.h>
+#include <llvm-c/BitWriter.h>
+#include <llvm-c/Object.h>
+#include <llvm-c/Transforms/PassManagerBuilder.h>
+
+#include "jit.h"
+#include "codegen.h"
+#include "compile.h"
+
+
+//==============================================================================
+//
+// Definitions
+//
+//==============================================================================
+
+// The suffix given to the body of each definition. The unsuffixed name is
+// the lazy stub that callers go through. Identifiers can't contain a '.' so
+// this can never clash with a user-defined function.
+#define KAL_JIT_IMPL_SUFFIX ".impl"
+
+// The name of the function that wraps a top-level expression.
+#define KAL_JIT_EXPR_NAME "expr.anon"
+
+// The suffix given to the fully optimized copy of a hot function.
+#define KAL_JIT_OPT_SUFFIX ".opt"
+
+// The suffix shared by the result table and counters of a memoized
+// function.
+#define KAL_JIT_MEMO_SUFFIX ".memo"
+
+// Part of every object cache key. Bump this whenever codegen or the
+// optimization passes change what a definition compiles to.
+#define KAL_JIT_CACHE_VERSION 2
+
+// The code generation level the JIT compiles at, which is LLVM's default.
+#define KAL_JIT_CACHE_OPT_LEVEL LLVMCodeGenLevelDefault
+
+
+//==============================================================================
+//
+// Typedefs
+//
+//==============================================================================
+
+// A range of rows of a batch that one thread evaluates.
+typedef struct kal_jit_batch_task {
+    kal_jit_batch_fn fn;
+    const double *const *columns;
+    uint64_t start;
+    uint64_t end;
+    double *out;
+    pthread_t thread;
+} kal_jit_batch_task;
+
+// A definition from an imported library that hasn't been compiled yet.
+// `module` is the module its body is read into, or NULL if it couldn't be.
+typedef struct kal_jit_library_function {
+    kal_jit *jit;
+    kal_jit_library *library;
+    char *name;
+    LLVMModuleRef module;
+} kal_jit_library_function;
+
+
+//==============================================================================
+//
+// Functions
+//
+//==============================================================================
+
+//--------------------------------------
+// Errors
+//--------------------------------------
+
+// Prints an ORC error and releases it.
+//
+// err - The error.
+//
+// Returns -1.
+int kal_jit_report(LLVMErrorRef err)
+{
+    char *msg = LLVMGetErrorMessage(err);
+    fprintf(stderr, "%s\n", msg);
+    LLVMDisposeErrorMessage(msg);
+    return -1;
+}
+
+// Called in place of a function whose lazy compile failed. Every function
+// takes and returns doubles so returning NaN keeps the caller running.
+//
+// Returns NaN.
+double kal_jit_call_through_error()
+{
+    fprintf(stderr, "Unable to compile function on first call\n");
+    return NAN;
+}
+
+
+//--------------------------------------
+// Optimization
+//--------------------------------------
+
+// Creates a target machine for the host. Functions that are generated for
+// another target say so in their attributes, which take precedence.
+//
+// level - The code generation optimization level.
+//
+// Returns a new target machine.
+LLVMTargetMachineRef kal_jit_create_target_machine(LLVMCodeGenOptLevel level)
+{
+    kal_target *host = kal_target_create(KAL_TARGET_HOST, NULL);
+    LLVMTargetMachineRef machine = kal_target_create_machine(host, level,
+        LLVMRelocDefault, LLVMCodeModelJITDefault);
+    kal_target_free(host);
+    return machine;
+}
+
+// Runs the passes for the context's optimization level over a module that
+// is about to be compiled.
+//
+// data   - The JIT.
+// module - The module.
+//
+// Returns NULL on success.
+LLVMErrorRef kal_jit_optimize_module(void *data, LLVMModuleRef module)
+{
+    kal_jit *jit = data;
+    jit->compiled_count++;
+
+    // The first tier is compiled as is.
+    if(jit->mode == KAL_JIT_TIERED) {
+        return NULL;
+    }
+
+    LLVMPassManagerRef pass_manager = kal_compile_pass_manager_create(jit->context, module);
+    LLVMValueRef func;
+    for(func = LLVMGetFirstFunction(module); func != NULL; func = LLVMGetNextFunction(func)) {
+        if(LLVMCountBasicBlocks(func) > 0) {
+            LLVMRunFunctionPassManager(pass_manager, func);
+        }
+    }
+    LLVMFinalizeFunctionPassManager(pass_manager);
+    LLVMDisposePassManager(pass_manager);
+
+    // Each definition is in a module of its own and calls others through
+    // their stubs, so the module passes work within a single function.
+    if(jit->context->opt_level > 0) {
+        if(jit->machine == NULL) {
+            jit->machine = kal_jit_create_target_machine(KAL_JIT_CACHE_OPT_LEVEL);
+        }
+        kal_compile_optimize_module(jit->context, module, jit->machine);
+    }
+
+    return NULL;
+}
+
+// IR transform layer hook. Modules only reach this layer once one of their
+// symbols is needed, so optimization is deferred along with compilation.
+//
+// data           - The JIT.
+// module         - The module being materialized.
+// responsibility - Unused.
+//
+// Returns NULL on success.
+LLVMErrorRef kal_jit_optimize(void *data, LLVMOrcThreadSafeModuleRef *module,
+                              LLVMOrcMaterializationResponsibilityRef responsibility)
+{
+    (void)responsibility;
+    return LLVMOrcThreadSafeModuleWithModuleDo(*module, kal_jit_optimize_module, data);
+}
+
+
+//--------------------------------------
+// Tiering
+//--------------------------------------
+
+// Called from first-tier code when a function reaches the call threshold.
+// Queues the function for recompilation and returns straight away.
+//
+// jit  - The JIT.
+// tier - The hot function.
+void kal_jit_tier_hot(kal_jit *jit, kal_jit_tier *tier)
+{
+    pthread_mutex_lock(&jit->tier_mutex);
+    if(jit->tier_queue_count == jit->tier_queue_capacity) {
+        jit->tier_queue_capacity = (jit->tier_queue_capacity == 0 ? 16 : jit->tier_queue_capacity * 2);
+        jit->tier_queue = realloc(jit->tier_queue, sizeof(kal_jit_tier*) * jit->tier_queue_capacity);
+    }
+    jit->tier_queue[jit->tier_queue_count++] = tier;
+    pthread_cond_signal(&jit->tier_ready);
+    pthread_mutex_unlock(&jit->tier_mutex);
+}
+
+// Saves a clean copy of a freshly generated function for recompiling later
+// and then adds a tier check in front of its body. The check jumps to the
+// optimized code once it exists. Until then it counts calls atomically and
+// reports the function as hot from the one call that reaches the threshold.
+//
+// jit  - The JIT.
+// func - The function, which must be the only definition in its module.
+// name - The function's name.
+void kal_jit_tier_instrument(kal_jit *jit, LLVMValueRef func, const char *name)
+{
+    unsigned int i;
+    LLVMContextRef llvm = jit->context->llvm;
+    LLVMBuilderRef builder = jit->context->builder;
+    LLVMTypeRef int64 = LLVMInt64TypeInContext(llvm);
+
+    kal_jit_tier *tier = calloc(1, sizeof(kal_jit_tier));
+    tier->name = malloc(strlen(name) + strlen(KAL_JIT_OPT_SUFFIX) + 1);
+    strcpy(tier->name, name);
+    strcat(tier->name, KAL_JIT_OPT_SUFFIX);
+    LLVMSetValueName(func, tier->name);
+    tier->bitcode = LLVMWriteBitcodeToMemoryBuffer(jit->context->module);
+
+    if(jit->tier_count == jit->tier_capacity) {
+        jit->tier_capacity = (jit->tier_capacity == 0 ? 16 : jit->tier_capacity * 2);
+        jit->tiers = realloc(jit->tiers, sizeof(kal_jit_tier*) * jit->tier_capacity);
+    }
+    jit->tiers[jit->tier_count++] = tier;
+
+    // Build the check in new blocks ahead of the original entry block.
+    LLVMBasicBlockRef entry = LLVMGetEntryBasicBlock(func);
+    LLVMBasicBlockRef check_block = LLVMInsertBasicBlockInContext(llvm, entry, "tier");
+    LLVMBasicBlockRef jump_block = LLVMInsertBasicBlockInContext(llvm, entry, "tier.jump");
+    LLVMBasicBlockRef count_block = LLVMInsertBasicBlockInContext(llvm, entry, "tier.count");
+    LLVMBasicBlockRef hot_block = LLVMInsertBasicBlockInContext(llvm, entry, "tier.hot");
+
+    // Jump to the optimized code if it's ready.
+    LLVMTypeRef func_ptr_type = LLVMTypeOf(func);
+    LLVMPositionBuilderAtEnd(builder, check_block);
+    LLVMValueRef code_ptr = LLVMConstIntToPtr(LLVMConstInt(int64, (uintptr_t)&tier->code, 0),
+        LLVMPointerType(func_ptr_type, 0));
+    LLVMValueRef code = LLVMBuildLoad(builder, code_ptr, "code");
+    LLVMSetOrdering(code, LLVMAtomicOrderingMonotonic);
+    LLVMSetAlignment(code, sizeof(void*));
+    LLVMBuildCondBr(builder, LLVMBuildIsNotNull(builder, code, "ready"), jump_block, count_block);
+
+    LLVMPositionBuilderAtEnd(builder, jump_block);
+    unsigned int param_count = LLVMCountParams(func);
+    LLVMValueRef *params = malloc(sizeof(LLVMValueRef) * (param_count > 0 ? param_count : 1));
+    for(i=0; i<param_count; i++) {
+        params[i] = LLVMGetParam(func, i);
+    }
+    LLVMValueRef result = LLVMBuildCall(builder, code, params, param_count, "");
+    LLVMSetTailCall(result, true);
+    LLVMBuildRet(builder, result);
+    free(params);
+
+    // Otherwise count the call.
+    LLVMPositionBuilderAtEnd(builder, count_block);
+    LLVMValueRef calls_ptr = LLVMConstIntToPtr(LLVMConstInt(int64, (uintptr_t)&tier->calls, 0),
+        LLVMPointerType(int64, 0));
+    LLVMValueRef calls = LLVMBuildAtomicRMW(builder, LLVMAtomicRMWBinOpAdd, calls_ptr,
+        LLVMConstInt(int64, 1, 0), LLVMAtomicOrderingMonotonic, false);
+    LLVMValueRef is_hot = LLVMBuildICmp(builder, LLVMIntEQ, calls,
+        LLVMConstInt(int64, jit->tier_threshold - 1, 0), "hot");
+    LLVMBuildCondBr(builder, is_hot, hot_block, entry);
+
+    // Report it once when it becomes hot.
+    LLVMPositionBuilderAtEnd(builder, hot_block);
+    LLVMTypeRef hot_params[] = {int64, int64};
+    LLVMTypeRef hot_type = LLVMFunctionType(LLVMVoidTypeInContext(llvm), hot_params, 2, 0);
+    LLVMValueRef hot_func = LLVMConstIntToPtr(LLVMConstInt(int64, (uintptr_t)kal_jit_tier_hot, 0),
+        LLVMPointerType(hot_type, 0));
+    LLVMValueRef hot_args[] = {
+        LLVMConstInt(int64, (uintptr_t)jit, 0),
+        LLVMConstInt(int64, (uintptr_t)tier, 0)
+    };
+    LLVMBuildCall(builder, hot_func, hot_args, 2, "");
+    LLVMBuildBr(builder, entry);
+
+    // The check writes memory and calls out, so the body is no longer pure.
+    kal_codegen_remove_attributes(func);
+}
+
+// Recompiles a hot function from its saved bitcode with the full O3
+// pipeline, links the object into the JIT and points the first tier at it.
+// This runs on the recompile thread in its own LLVM context.
+//
+// jit  - The JIT.
+// tier - The hot function.
+//
+// Returns 0 if successful, otherwise returns -1.
+int kal_jit_tier_compile(kal_jit *jit, kal_jit_tier *tier)
+{
+    LLVMErrorRef err;
+    char *msg = NULL;
+    int rc = 0;
+
+    LLVMContextRef llvm = LLVMContextCreate();
+    LLVMModuleRef module = NULL;
+    if(LLVMParseBitcodeInContext2(llvm, tier->bitcode, &module) != 0) {
+        fprintf(stderr, "Unable to read %s for recompiling\n", tier->name);
+        LLVMContextDispose(llvm);
+        return -1;
+    }
+
+    char *triple = LLVMGetTargetMachineTriple(jit->tier_machine);
+    LLVMTargetDataRef data_layout = LLVMCreateTargetDataLayout(jit->tier_machine);
+    LLVMSetTarget(module, triple);
+    LLVMSetModuleDataLayout(module, data_layout);
+    LLVMDisposeMessage(triple);
+    LLVMDisposeTargetData(data_layout);
+
+    // Globals such as memo tables already exist in the first tier, so the
+    // optimized copy uses those rather than defining its own.
+    LLVMValueRef global;
+    for(global = LLVMGetFirstGlobal(module); global != NULL; global = LLVMGetNextGlobal(global)) {
+        if(!LLVMIsDeclaration(global)) {
+            LLVMSetLinkage(global, LLVMAvailableExternallyLinkage);
+        }
+    }
+
+    LLVMPassManagerBuilderRef pass_manager_builder = LLVMPassManagerBuilderCreate();
+    LLVMPassManagerBuilderSetOptLevel(pass_manager_builder, 3);
+    LLVMPassManagerRef function_passes = LLVMCreateFunctionPassManagerForModule(module);
+    LLVMPassManagerRef module_passes = LLVMCreatePassManager();
+    LLVMPassManagerBuilderPopulateFunctionPassManager(pass_manager_builder, function_passes);
+    LLVMPassManagerBuilderPopulateModulePassManager(pass_manager_builder, module_passes);
+
+    LLVMValueRef func;
+    LLVMInitializeFunctionPassManager(function_passes);
+    for(func = LLVMGetFirstFunction(module); func != NULL; func = LLVMGetNextFunction(func)) {
+        if(LLVMCountBasicBlocks(func) > 0) {
+            LLVMRunFunctionPassManager(function_passes, func);
+        }
+    }
+    LLVMFinalizeFunctionPassManager(function_passes);
+    LLVMRunPassManager(module_passes, module);
+
+    LLVMDisposePassManager(function_passes);
+    LLVMDisposePassManager(module_passes);
+    LLVMPassManagerBuilderDispose(pass_manager_builder);
+
+    // Emit and link the optimized code.
+    LLVMMemoryBufferRef object = NULL;
+    if(LLVMTargetMachineEmitToMemoryBuffer(jit->tier_machine, module, LLVMObjectFile, &msg, &object) != 0) {
+        fprintf(stderr, "%s\n", msg);
+        LLVMDisposeMessage(msg);
+        rc = -1;
+    }
+    LLVMDisposeModule(module);
+    LLVMContextDispose(llvm);
+    if(rc != 0) {
+        return rc;
+    }
+
+    LLVMOrcExecutorAddress address;
+    if((err = LLVMOrcLLJITAddObjectFile(jit->lljit, jit->dylib, object)) != NULL) {
+        return kal_jit_report(err);
+    }
+    if((err = LLVMOrcLLJITLookup(jit->lljit, &address, tier->name)) != NULL) {
+        return kal_jit_report(err);
+    }
+
+    __atomic_store_n(&tier->code, (void*)(uintptr_t)address, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// The recompile thread. Takes hot functions off the queue until the JIT is
+// freed.
+//
+// data - The JIT.
+//
+// Returns NULL.
+void *kal_jit_tier_run(void *data)
+{
+    kal_jit *jit = data;
+
+    pthread_mutex_lock(&jit->tier_mutex);
+    while(true) {
+        while(jit->tier_queue_count == 0 && !jit->tier_stopping) {
+            pthread_cond_wait(&jit->tier_ready, &jit->tier_mutex);
+        }
+        if(jit->tier_stopping) {
+            break;
+        }
+
+        kal_jit_tier *tier = jit->tier_queue[--jit->tier_queue_count];
+        jit->tier_active++;
+        pthread_mutex_unlock(&jit->tier_mutex);
+
+        int rc = kal_jit_tier_compile(jit, tier);
+
+        pthread_mutex_lock(&jit->tier_mutex);
+        jit->tier_active--;
+        if(rc == 0) {
+            jit->promoted_count++;
+        }
+        if(jit->tier_queue_count == 0 && jit->tier_active == 0) {
+            pthread_cond_broadcast(&jit->tier_idle);
+        }
+    }
+    pthread_mutex_unlock(&jit->tier_mutex);
+
+    return NULL;
+}
+
+// Blocks until every function reported as hot so far has been recompiled.
+//
+// jit - The JIT.
+void kal_jit_wait(kal_jit *jit)
+{
+    if(jit->mode != KAL_JIT_TIERED) {
+        return;
+    }
+
+    pthread_mutex_lock(&jit->tier_mutex);
+    while(jit->tier_queue_count > 0 || jit->tier_active > 0) {
+        pthread_cond_wait(&jit->tier_idle, &jit->tier_mutex);
+    }
+    pthread_mutex_unlock(&jit->tier_mutex);
+}
+
+
+//--------------------------------------
+// Lifecycle
+//--------------------------------------
+
+static LLVMErrorRef kal_jit_link_object(void *data, LLVMMemoryBufferRef *object);
+
+// Creates a lazy JIT along with the compilation context that definitions are
+// generated in. Functions from the host process, such as libm, can be called
+// as externs.
+//
+// Returns a new JIT or NULL if it could not be created.
+kal_jit *kal_jit_create(kal_jit_mode_e mode)
+{
+    LLVMErrorRef err;
+
+    LLVMInitializeNativeTarget();
+    LLVMInitializeNativeAsmPrinter();
+
+    kal_jit *jit = calloc(1, sizeof(kal_jit));
+    jit->mode = mode;
+    pthread_mutex_init(&jit->profile_mutex, NULL);
+
+    // The tiered engine does its first compile with fast instruction
+    // selection and keeps a second target machine for hot functions.
+    LLVMOrcLLJITBuilderRef builder = NULL;
+    if(mode == KAL_JIT_TIERED) {
+        builder = LLVMOrcCreateLLJITBuilder();
+        LLVMOrcLLJITBuilderSetJITTargetMachineBuilder(builder,
+            LLVMOrcJITTargetMachineBuilderCreateFromTargetMachine(
+                kal_jit_create_target_machine(LLVMCodeGenLevelNone)));
+        jit->tier_machine = kal_jit_create_target_machine(LLVMCodeGenLevelAggressive);
+    }
+    if((err = LLVMOrcCreateLLJIT(&jit->lljit, builder)) != NULL) {
+        kal_jit_report(err);
+        jit->lljit = NULL;
+        kal_jit_free(jit);
+        return NULL;
+    }
+    jit->dylib = LLVMOrcLLJITGetMainJITDylib(jit->lljit);
+
+    // Resolve externs against the host process.
+    LLVMOrcDefinitionGeneratorRef generator;
+    err = LLVMOrcCreateDynamicLibrarySearchGeneratorForProcess(&generator,
+        LLVMOrcLLJITGetGlobalPrefix(jit->lljit), NULL, NULL);
+    if(err != NULL) {
+        kal_jit_report(err);
+        kal_jit_free(jit);
+        return NULL;
+    }
+    LLVMOrcJITDylibAddGenerator(jit->dylib, generator);
+
+    // Set up the stubs that compile a function the first time it is called.
+    const char *triple = LLVMOrcLLJITGetTripleString(jit->lljit);
+    err = LLVMOrcCreateLocalLazyCallThroughManager(triple,
+        LLVMOrcLLJITGetExecutionSession(jit->lljit),
+        (LLVMOrcJITTargetAddress)(uintptr_t)kal_jit_call_through_error,
+        &jit->call_through);
+    if(err != NULL) {
+        kal_jit_report(err);
+        kal_jit_free(jit);
+        return NULL;
+    }
+    jit->stubs = LLVMOrcCreateLocalIndirectStubsManager(triple);
+
+    LLVMOrcIRTransformLayerSetTransform(LLVMOrcLLJITGetIRTransformLayer(jit->lljit),
+        kal_jit_optimize, jit);
+    LLVMOrcObjectTransformLayerSetTransform(LLVMOrcLLJITGetObjTransformLayer(jit->lljit),
+        kal_jit_link_object, jit);
+
+    jit->thread_safe_context = LLVMOrcCreateNewThreadSafeContext();
+    jit->context = kal_context_create_in(
+        LLVMOrcThreadSafeContextGetContext(jit->thread_safe_context), "kal");
+    kal_jit_set_target(jit, kal_target_create(KAL_TARGET_HOST, NULL));
+
+    if(mode == KAL_JIT_TIERED) {
+        jit->tier_threshold = KAL_JIT_TIER_THRESHOLD;
+        pthread_mutex_init(&jit->tier_mutex, NULL);
+        pthread_cond_init(&jit->tier_ready, NULL);
+        pthread_cond_init(&jit->tier_idle, NULL);
+        pthread_create(&jit->tier_thread, NULL, kal_jit_tier_run, jit);
+    }
+
+    return jit;
+}
+
+// Frees a JIT and everything it has compiled.
+//
+// jit - The JIT to free.
+void kal_jit_free(kal_jit *jit)
+{
+    unsigned int i;
+    if(!jit) return;
+
+    // Stop the recompile thread before tearing down the code it links into.
+    if(jit->mode == KAL_JIT_TIERED && jit->context != NULL) {
+        pthread_mutex_lock(&jit->tier_mutex);
+        jit->tier_stopping = true;
+        pthread_cond_broadcast(&jit->tier_ready);
+        pthread_mutex_unlock(&jit->tier_mutex);
+        pthread_join(jit->tier_thread, NULL);
+        pthread_mutex_destroy(&jit->tier_mutex);
+        pthread_cond_destroy(&jit->tier_ready);
+        pthread_cond_destroy(&jit->tier_idle);
+    }
+
+    // The stubs and call-through manager go first. Releasing them after the
+    // session they resolve through corrupts the heap.
+    if(jit->stubs) LLVMOrcDisposeIndirectStubsManager(jit->stubs);
+    if(jit->call_through) LLVMOrcDisposeLazyCallThroughManager(jit->call_through);
+    if(jit->lljit) {
+        LLVMErrorRef err = LLVMOrcDisposeLLJIT(jit->lljit);
+        if(err != NULL) {
+            kal_jit_report(err);
+        }
+    }
+    kal_context_free(jit->context);
+    if(jit->thread_safe_context) LLVMOrcDisposeThreadSafeContext(jit->thread_safe_context);
+    if(jit->tier_machine) LLVMDisposeTargetMachine(jit->tier_machine);
+    if(jit->machine) LLVMDisposeTargetMachine(jit->machine);
+    for(i=0; i<jit->cache_pending_count; i++) {
+        free(jit->cache_pending[i].symbol);
+        free(jit->cache_pending[i].path);
+    }
+    free(jit->cache_pending);
+    free(jit->cache_path);
+    for(i=0; i<jit->library_count; i++) {
+        munmap(jit->libraries[i]->data, jit->libraries[i]->size);
+        LLVMOrcDisposeThreadSafeModule(jit->libraries[i]->lock_module);
+        LLVMOrcDisposeThreadSafeContext(jit->libraries[i]->thread_safe_context);
+        free(jit->libraries[i]->path);
+        free(jit->libraries[i]);
+    }
+    free(jit->libraries);
+    free(jit->profiled);
+    pthread_mutex_destroy(&jit->profile_mutex);
+    for(i=0; i<jit->tier_count; i++) {
+        LLVMDisposeMemoryBuffer(jit->tiers[i]->bitcode);
+        free(jit->tiers[i]->name);
+        free(jit->tiers[i]);
+    }
+    free(jit->tiers);
+    free(jit->tier_queue);
+    free(jit);
+}
+
+// Changes the CPU that definitions are generated for, which starts as the
+// host. Batches are as wide as the target's vectors. Definitions that have
+// already been added keep the target they were added with.
+//
+// jit    - The JIT.
+// target - The target. The JIT takes ownership of it.
+void kal_jit_set_target(kal_jit *jit, kal_target *target)
+{
+    kal_target_free(jit->context->target);
+    jit->context->target = target;
+    jit->batch_lanes = kal_target_batch_lanes(target);
+}
+
+
+//--------------------------------------
+// Object Cache
+//--------------------------------------
+
+// Adds bytes to an FNV-1a hash.
+//
+// hash   - The hash to update.
+// data   - The bytes to add.
+// length - The number of bytes.
+static void kal_jit_hash(uint64_t *hash, const void *data, size_t length)
+{
+    size_t i;
+    const unsigned char *bytes = data;
+    for(i=0; i<length; i++) {
+        *hash = (*hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+}
+
+// Adds a string and its terminator to a hash.
+//
+// hash - The hash to update.
+// str  - The string to add.
+static void kal_jit_hash_string(uint64_t *hash, const char *str)
+{
+    kal_jit_hash(hash, str, strlen(str) + 1);
+}
+
+// Adds a variable name to a hash. Arguments are hashed by position so that
+// renaming them doesn't change the key and other names are hashed as they
+// are. A local that shadows an argument is hashed by the argument's
+// position too, which still ties every use to the right variable.
+//
+// hash      - The hash to update.
+// name      - The variable name.
+// prototype - The prototype of the function the name is used in.
+static void kal_jit_hash_name(uint64_t *hash, kal_symbol name,
+                              kal_ast_node *prototype)
+{
+    unsigned int i;
+    uint32_t index = UINT32_MAX;
+    for(i=prototype->prototype.arg_count; i>0; i--) {
+        if(prototype->prototype.args[i-1] == name) {
+            index = i-1;
+            break;
+        }
+    }
+    kal_jit_hash(hash, &index, sizeof(index));
+    if(index == UINT32_MAX) {
+        kal_jit_hash_string(hash, kal_symbol_name(name));
+    }
+}
+
+// Adds an expression to a hash. Variables are hashed with
+// kal_jit_hash_name(). What is known about each called function's effects
+// is included since it changes the code for the call.
+//
+// hash      - The hash to update.
+// context   - The context the expression is compiled in.
+// node      - The expression.
+// prototype - The prototype of the function the expression is in.
+static void kal_jit_hash_node(uint64_t *hash, kal_context *context,
+                              kal_ast_node *node, kal_ast_node *prototype)
+{
+    unsigned int i;
+    uint8_t type = node->type;
+    kal_jit_hash(hash, &type, sizeof(type));
+
+    switch(node->type) {
+        case KAL_AST_TYPE_NUMBER: {
+            kal_jit_hash(hash, &node->number.value, sizeof(node->number.value));
+            break;
+        }
+        case KAL_AST_TYPE_VARIABLE: {
+            kal_jit_hash_name(hash, node->variable.name, prototype);
+            break;
+        }
+        case KAL_AST_TYPE_BINARY_EXPR: {
+            uint8_t operator = node->binary_expr.operator;
+            kal_jit_hash(hash, &operator, sizeof(operator));
+            kal_jit_hash_node(hash, context, node->binary_expr.lhs, prototype);
+            kal_jit_hash_node(hash, context, node->binary_expr.rhs, prototype);
+            break;
+        }
+        case KAL_AST_TYPE_CALL: {
+            uint32_t arg_count = node->call.arg_count;
+            uint8_t flags = 0;
+            if(node->call.name != prototype->prototype.name && node->call.name < context->function_capacity) {
+                flags = context->function_flags[node->call.name];
+            }
+            kal_jit_hash_string(hash, kal_symbol_name(node->call.name));
+            kal_jit_hash(hash, &arg_count, sizeof(arg_count));
+            kal_jit_hash(hash, &flags, sizeof(flags));
+            for(i=0; i<node->call.arg_count; i++) {
+                kal_jit_hash_node(hash, context, node->call.args[i], prototype);
+            }
+            break;
+        }
+        case KAL_AST_TYPE_IF_EXPR: {
+            kal_jit_hash_node(hash, context, node->if_expr.condition, prototype);
+            kal_jit_hash_node(hash, context, node->if_expr.true_expr, prototype);
+            kal_jit_hash_node(hash, context, node->if_expr.false_expr, prototype);
+            break;
+        }
+        case KAL_AST_TYPE_FOR_EXPR: {
+            uint8_t has_step = (node->for_expr.step != NULL);
+            kal_jit_hash_name(hash, node->for_expr.name, prototype);
+            kal_jit_hash(hash, &has_step, sizeof(has_step));
+            kal_jit_hash_node(hash, context, node->for_expr.start, prototype);
+            kal_jit_hash_node(hash, context, node->for_expr.condition, prototype);
+            if(has_step) {
+                kal_jit_hash_node(hash, context, node->for_expr.step, prototype);
+            }
+            kal_jit_hash_node(hash, context, node->for_expr.body, prototype);
+            break;
+        }
+        case KAL_AST_TYPE_VAR_EXPR: {
+            uint32_t var_count = node->var_expr.var_count;
+            kal_jit_hash(hash, &var_count, sizeof(var_count));
+            for(i=0; i<var_count; i++) {
+                uint8_t has_init = (node->var_expr.inits[i] != NULL);
+                kal_jit_hash_name(hash, node->var_expr.names[i], prototype);
+                kal_jit_hash(hash, &has_init, sizeof(has_init));
+                if(has_init) {
+                    kal_jit_hash_node(hash, context, node->var_expr.inits[i], prototype);
+                }
+            }
+            kal_jit_hash_node(hash, context, node->var_expr.body, prototype);
+            break;
+        }
+        case KAL_AST_TYPE_ASSIGN: {
+            kal_jit_hash_name(hash, node->assign.name, prototype);
+            kal_jit_hash_node(hash, context, node->assign.value, prototype);
+            break;
+        }
+        default: break;
+    }
+}
+
+// Builds the path of the cache file for a definition. The key covers the
+// definition's AST, whether it is memoized or profiled, its fast-math rules,
+// the target and the optimization level along with the seed set up by
+// kal_jit_set_cache().
+//
+// jit  - The JIT.
+// node - The function node.
+//
+// Returns a new string that the caller must free.
+char *kal_jit_cache_file(kal_jit *jit, kal_ast_node *node)
+{
+    kal_ast_node *prototype = node->function.prototype;
+    uint32_t arg_count = prototype->prototype.arg_count;
+
+    uint32_t levels[] = {jit->context->opt_level, jit->context->size_level};
+    uint8_t memo = kal_codegen_memoizes(jit->context, node);
+    uint8_t profile = jit->context->profile;
+    uint8_t fast_math = kal_codegen_fast_math(jit->context, node);
+    uint64_t hash = jit->cache_seed;
+    kal_jit_hash(&hash, levels, sizeof(levels));
+    kal_jit_hash(&hash, &memo, sizeof(memo));
+    kal_jit_hash(&hash, &profile, sizeof(profile));
+    kal_jit_hash(&hash, &fast_math, sizeof(fast_math));
+    kal_jit_hash_string(&hash, jit->context->target->cpu);
+    kal_jit_hash_string(&hash, jit->context->target->features);
+    kal_jit_hash_string(&hash, kal_symbol_name(prototype->prototype.name));
+    kal_jit_hash(&hash, &arg_count, sizeof(arg_count));
+    kal_jit_hash_node(&hash, jit->context, node->function.body, prototype);
+
+    size_t length = strlen(jit->cache_path) + 32;
+    char *path = malloc(length);
+    snprintf(path, length, "%s/%016llx.o", jit->cache_path, (unsigned long long)hash);
+    return path;
+}
+
+// Writes an object to the cache. The object goes to a temporary file first
+// so that other processes never load a partial one. Failing to write only
+// costs the next run a compile so it isn't an error.
+//
+// object - The object.
+// path   - The cache file.
+void kal_jit_cache_write(LLVMMemoryBufferRef object, const char *path)
+{
+    size_t length = strlen(path) + 32;
+    char *tmp_path = malloc(length);
+    snprintf(tmp_path, length, "%s.%ld.tmp", path, (long)getpid());
+
+    FILE *file = fopen(tmp_path, "wb");
+    size_t size = LLVMGetBufferSize(object);
+    if(file == NULL || fwrite(LLVMGetBufferStart(object), 1, size, file) != size ||
+       fclose(file) != 0 || rename(tmp_path, path) != 0)
+    {
+        fprintf(stderr, "Unable to write cache file: %s\n", path);
+        remove(tmp_path);
+    }
+    free(tmp_path);
+}
+
+// Saves a definition that is waiting to be cached as soon as it is
+// compiled. Every object the JIT links is passed here by
+// kal_jit_link_object(). Objects are matched to definitions by their body's
+// symbol.
+//
+// jit    - The JIT.
+// object - The object about to be linked. It is left unchanged.
+void kal_jit_cache_save(kal_jit *jit, LLVMMemoryBufferRef object)
+{
+    unsigned int i;
+    char *msg = NULL;
+
+    if(jit->cache_pending_count == 0) {
+        return;
+    }
+    LLVMBinaryRef binary = LLVMCreateBinary(object, NULL, &msg);
+    if(binary == NULL) {
+        LLVMDisposeMessage(msg);
+        return;
+    }
+
+    char prefix = LLVMOrcLLJITGetGlobalPrefix(jit->lljit);
+    LLVMSymbolIteratorRef symbol = LLVMObjectFileCopySymbolIterator(binary);
+    bool found = false;
+    while(!found && !LLVMObjectFileIsSymbolIteratorAtEnd(binary, symbol)) {
+        const char *name = LLVMGetSymbolName(symbol);
+        if(prefix != '\0' && name[0] == prefix) {
+            name++;
+        }
+        for(i=0; i<jit->cache_pending_count; i++) {
+            kal_jit_cache_entry *entry = &jit->cache_pending[i];
+            if(strcmp(entry->symbol, name) == 0) {
+                kal_jit_cache_write(object, entry->path);
+                free(entry->symbol);
+                free(entry->path);
+                *entry = jit->cache_pending[--jit->cache_pending_count];
+                found = true;
+                break;
+            }
+        }
+        LLVMMoveToNextSymbol(symbol);
+    }
+    LLVMDisposeSymbolIterator(symbol);
+    LLVMDisposeBinary(binary);
+}
+
+// Turns on the object cache. Definitions that are compiled are saved as
+// objects under the given directory, and a later JIT using the same
+// directory links the saved object instead of generating code for any
+// definition it has seen before. Compilation stays lazy either way. Only
+// the lazy engine supports the cache since the tiered engine builds process
+// addresses into its code.
+//
+// jit  - The JIT.
+// path - The cache directory. It is created if it doesn't exist.
+//
+// Returns 0 if successful, otherwise returns -1.
+int kal_jit_set_cache(kal_jit *jit, const char *path)
+{
+    if(jit->mode != KAL_JIT_LAZY) {
+        fprintf(stderr, "The object cache needs the lazy engine\n");
+        return -1;
+    }
+    if(mkdir(path, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Unable to create cache directory: %s\n", path);
+        return -1;
+    }
+
+    free(jit->cache_path);
+    jit->cache_path = malloc(strlen(path) + 1);
+    strcpy(jit->cache_path, path);
+
+    // Everything except the definition itself goes into the seed. The JIT
+    // generates code for the host CPU at LLVM's default level.
+    char *cpu = LLVMGetHostCPUName();
+    char *features = LLVMGetHostCPUFeatures();
+    uint32_t version = KAL_JIT_CACHE_VERSION;
+    uint32_t level = KAL_JIT_CACHE_OPT_LEVEL;
+    jit->cache_seed = 0xcbf29ce484222325ULL;
+    kal_jit_hash(&jit->cache_seed, &version, sizeof(version));
+    kal_jit_hash(&jit->cache_seed, &level, sizeof(level));
+    kal_jit_hash_string(&jit->cache_seed, LLVMOrcLLJITGetTripleString(jit->lljit));
+    kal_jit_hash_string(&jit->cache_seed, cpu);
+    kal_jit_hash_string(&jit->cache_seed, features);
+    LLVMDisposeMessage(cpu);
+    LLVMDisposeMessage(features);
+
+    return 0;
+}
+
+// Adds a definition's saved object to the JIT if there is one.
+//
+// jit  - The JIT.
+// node - The function node.
+// path - The cache file for the definition.
+//
+// Returns 0 if the object was loaded, 1 if it isn't in the cache and -1 on
+// error.
+int kal_jit_cache_load(kal_jit *jit, kal_ast_node *node, const char *path)
+{
+    LLVMErrorRef err;
+    char *msg = NULL;
+    kal_ast_node *prototype = node->function.prototype;
+    kal_symbol name = prototype->prototype.name;
+    kal_context *context = jit->context;
+
+    LLVMMemoryBufferRef object = NULL;
+    if(LLVMCreateMemoryBufferWithContentsOfFile(path, &object, &msg) != 0) {
+        LLVMDisposeMessage(msg);
+        return 1;
+    }
+
+    // Codegen is skipped so check and record the arity here instead.
+    if(name < context->function_capacity && context->functions[name] != 0 &&
+       context->functions[name] != prototype->prototype.arg_count + 1)
+    {
+        fprintf(stderr, "Existing function exists with different parameter count\n");
+        LLVMDisposeMemoryBuffer(object);
+        return -1;
+    }
+    kal_codegen_add_function(context, name, prototype->prototype.arg_count);
+    kal_codegen_set_flags(context, name, kal_codegen_function_flags(context, node));
+
+    if((err = LLVMOrcLLJITAddObjectFile(jit->lljit, jit->dylib, object)) != NULL) {
+        return kal_jit_report(err);
+    }
+
+    jit->cache_hits++;
+    if(jit->dump) {
+        fprintf(stderr, "Loaded %s from %s\n", kal_symbol_name(name), path);
+    }
+    return 0;
+}
+
+// Remembers that a definition's object should be saved once it is compiled.
+//
+// jit    - The JIT.
+// symbol - The name of the definition's body.
+// path   - The cache file for the definition. The JIT takes ownership.
+void kal_jit_cache_defer(kal_jit *jit, const char *symbol, char *path)
+{
+    if(jit->cache_pending_count == jit->cache_pending_capacity) {
+        jit->cache_pending_capacity = (jit->cache_pending_capacity == 0 ? 16 : jit->cache_pending_capacity * 2);
+        jit->cache_pending = realloc(jit->cache_pending, sizeof(kal_jit_cache_entry) * jit->cache_pending_capacity);
+    }
+
+    kal_jit_cache_entry *entry = &jit->cache_pending[jit->cache_pending_count++];
+    entry->symbol = malloc(strlen(symbol) + 1);
+    strcpy(entry->symbol, symbol);
+    entry->path = path;
+    jit->cache_misses++;
+}
+
+
+//--------------------------------------
+// Modules
+//--------------------------------------
+
+// Hands the context's current module to the JIT and starts a new one. The
+// JIT takes ownership of the module even if adding it fails.
+//
+// jit     - The JIT.
+// tracker - The resource tracker to add the module under or NULL to add it
+//           to the main dylib for good.
+//
+// Returns 0 if successful, otherwise returns -1.
+int kal_jit_add_module(kal_jit *jit, LLVMOrcResourceTrackerRef tracker)
+{
+    LLVMErrorRef err;
+    kal_context *context = jit->context;
+
+    LLVMOrcThreadSafeModuleRef module = LLVMOrcCreateNewThreadSafeModule(
+        context->module, jit->thread_safe_context);
+    context->module = LLVMModuleCreateWithNameInContext("kal", context->llvm);
+
+    if(tracker != NULL) {
+        err = LLVMOrcLLJITAddLLVMIRModuleWithRT(jit->lljit, tracker, module);
+    }
+    else {
+        err = LLVMOrcLLJITAddLLVMIRModule(jit->lljit, jit->dylib, module);
+    }
+    if(err != NULL) {
+        return kal_jit_report(err);
+    }
+
+    return 0;
+}
+
+// Defines a lazy stub under a function's name that compiles the function's
+// suffixed body the first time it is called.
+//
+// jit  - The JIT.
+// name - The function name.
+//
+// Returns 0 if successful, otherwise returns -1.
+int kal_jit_add_stub(kal_jit *jit, const char *name)
+{
+    LLVMErrorRef err;
+
+    char *impl_name = malloc(strlen(name) + strlen(KAL_JIT_IMPL_SUFFIX) + 1);
+    strcpy(impl_name, name);
+    strcat(impl_name, KAL_JIT_IMPL_SUFFIX);
+
+    LLVMOrcCSymbolAliasMapPair alias;
+    alias.Name = LLVMOrcLLJITMangleAndIntern(jit->lljit, name);
+    alias.Entry.Name = LLVMOrcLLJITMangleAndIntern(jit->lljit, impl_name);
+    alias.Entry.Flags.GenericFlags = LLVMJITSymbolGenericFlagsExported | LLVMJITSymbolGenericFlagsCallable;
+    alias.Entry.Flags.TargetFlags = 0;
+    free(impl_name);
+
+    LLVMOrcMaterializationUnitRef stub = LLVMOrcLazyReexports(jit->call_through,
+        jit->stubs, jit->dylib, &alias, 1);
+    if((err = LLVMOrcJITDylibDefine(jit->dylib, stub)) != NULL) {
+        LLVMOrcDisposeMaterializationUnit(stub);
+        return kal_jit_report(err);
+    }
+
+    return 0;
+}
+
+// Adds the batch function for a definition that has just been added. It
+// goes in a module of its own so that it is only compiled if it is used.
+//
+// jit  - The JIT.
+// node - The function node.
+//
+// Returns 0 if successful, otherwise returns -1.
+int kal_jit_add_batch(kal_jit *jit, kal_ast_node *node)
+{
+    if(kal_codegen_batch(jit->context, node, jit->batch_lanes) == NULL) {
+        fprintf(stderr, "Unable to codegen batch for %s\n",
+            kal_symbol_name(node->function.prototype->prototype.name));
+        return -1;
+    }
+    return kal_jit_add_module(jit, NULL);
+}
+
+// Adds a definition or extern to the JIT. The body of a definition is added
+// under a suffixed name and the function's own name becomes a lazy stub that
+// compiles the body the first time it is called. Externs are only recorded
+// and are resolved when something that calls them is compiled. With the
+// object cache on, a body that has been compiled before is loaded from the
+// cache and the stub only links it in. The definition's batch function is
+// always generated from the node.
+//
+// jit  - The JIT.
+// node - A function or prototype node.
+//
+// Returns 0 if successful, otherwise returns -1.
+int kal_jit_add(kal_jit *jit, kal_ast_node *node)
+{
+    int rc;
+    char *cache_file = NULL;
+
+    if(jit->cache_path != NULL && node->type == KAL_AST_TYPE_FUNCTION) {
+        cache_file = kal_jit_cache_file(jit, node);
+        if((rc = kal_jit_cache_load(jit, node, cache_file)) != 1) {
+            free(cache_file);
+            if(rc != 0 || kal_jit_add_stub(jit, kal_symbol_name(node->function.prototype->prototype.name)) != 0) {
+                return -1;
+            }
+            return kal_jit_add_batch(jit, node);
+        }
+    }
+
+    LLVMValueRef func = kal_codegen(jit->context, node);
+    if(func == NULL) {
+        fprintf(stderr, "Unable to codegen for node\n");
+        free(cache_file);
+        return -1;
+    }
+    if(jit->dump) {
+        LLVMDumpValue(func);
+    }
+    if(node->type != KAL_AST_TYPE_FUNCTION) {
+        return 0;
+    }
+
+    // Rename the body so the stub can take its name.
+    const char *name = kal_symbol_name(node->function.prototype->prototype.name);
+    char *impl_name = malloc(strlen(name) + strlen(KAL_JIT_IMPL_SUFFIX) + 1);
+    strcpy(impl_name, name);
+    strcat(impl_name, KAL_JIT_IMPL_SUFFIX);
+
+    if(jit->mode == KAL_JIT_TIERED) {
+        kal_jit_tier_instrument(jit, func, name);
+    }
+    LLVMSetValueName(func, impl_name);
+    if(cache_file != NULL) {
+        kal_jit_cache_defer(jit, impl_name, cache_file);
+    }
+    free(impl_name);
+
+    if(kal_jit_add_module(jit, NULL) != 0 || kal_jit_add_stub(jit, name) != 0) {
+        return -1;
+    }
+
+    return kal_jit_add_batch(jit, node);
+}
+
+// Compiles and runs a top-level expression. Only the expression itself and
+// the functions it actually calls are compiled. The expression's code is
+// released once it has run.
+//
+// jit    - The JIT.
+// node   - The expression.
+// result - Where the value of the expression is stored.
+//
+// Returns 0 if successful, otherwise returns -1.
+int kal_jit_eval(kal_jit *jit, kal_ast_node *node, double *result)
+{
+    LLVMErrorRef err;
+    kal_ast_arena *arena = jit->context->arena;
+
+    kal_ast_node *prototype = kal_ast_prototype_create(arena, kal_symbol_intern(KAL_JIT_EXPR_NAME), NULL, 0);
+    kal_ast_node *function = kal_ast_function_create(arena, prototype, node);
+
+    LLVMValueRef func = kal_codegen(jit->context, function);
+    if(func == NULL) {
+        fprintf(stderr, "Unable to codegen for node\n");
+        return -1;
+    }
+    if(jit->dump) {
+        LLVMDumpValue(func);
+    }
+
+    LLVMOrcResourceTrackerRef tracker = LLVMOrcJITDylibCreateResourceTracker(jit->dylib);
+    if(kal_jit_add_module(jit, tracker) != 0) {
+        LLVMOrcReleaseResourceTracker(tracker);
+        return -1;
+    }
+
+    int rc = 0;
+    LLVMOrcExecutorAddress address;
+    if((err = LLVMOrcLLJITLookup(jit->lljit, &address, KAL_JIT_EXPR_NAME)) != NULL) {
+        rc = kal_jit_report(err);
+    }
+    else {
+        double (*fp)() = (double (*)())(uintptr_t)address;
+        *result = fp();
+    }
+
+    if((err = LLVMOrcResourceTrackerRemove(tracker)) != NULL) {
+        kal_jit_report(err);
+    }
+    LLVMOrcReleaseResourceTracker(tracker);
+
+    return rc;
+}
+
+
+//--------------------------------------
+// Memoization
+//--------------------------------------
+
+// Reads the counters of a memoized function. Looking them up compiles the
+// function if it hasn't been called yet.
+//
+// jit    - The JIT.
+// name   - The function name.
+// hits   - Where the number of calls answered from the table is stored.
+// misses - Where the number of calls that ran the body is stored.
+//
+// Returns 0 if successful or -1 if the function isn't memoized.
+int kal_jit_memo_stats(kal_jit *jit, const char *name, uint64_t *hits,
+                       uint64_t *misses)
+{
+    LLVMOrcExecutorAddress hits_address, misses_address;
+
+    size_t length = strlen(name) + strlen(KAL_JIT_MEMO_SUFFIX) + 16;
+    char *global_name = malloc(length);
+    snprintf(global_name, length, "%s%s.hits", name, KAL_JIT_MEMO_SUFFIX);
+    LLVMErrorRef err = LLVMOrcLLJITLookup(jit->lljit, &hits_address, global_name);
+    if(err == NULL) {
+        snprintf(global_name, length, "%s%s.misses", name, KAL_JIT_MEMO_SUFFIX);
+        err = LLVMOrcLLJITLookup(jit->lljit, &misses_address, global_name);
+    }
+    free(global_name);
+    if(err != NULL) {
+        LLVMConsumeError(err);
+        return -1;
+    }
+
+    *hits = __atomic_load_n((uint64_t*)(uintptr_t)hits_address, __ATOMIC_RELAXED);
+    *misses = __atomic_load_n((uint64_t*)(uintptr_t)misses_address, __ATOMIC_RELAXED);
+    return 0;
+}
+
+
+//--------------------------------------
+// Profiling
+//--------------------------------------
+
+// Records the profiled functions that an object defines counters for. This
+// can run on several threads at once.
+//
+// jit    - The JIT.
+// object - The object about to be linked.
+static void kal_jit_profile_record(kal_jit *jit, LLVMMemoryBufferRef object)
+{
+    unsigned int i;
+    char *msg = NULL;
+    size_t suffix_length = strlen(KAL_CODEGEN_PROFILE_SUFFIX);
+
+    LLVMBinaryRef binary = LLVMCreateBinary(object, NULL, &msg);
+    if(binary == NULL) {
+        LLVMDisposeMessage(msg);
+        return;
+    }
+
+    char prefix = LLVMOrcLLJITGetGlobalPrefix(jit->lljit);
+    LLVMSymbolIteratorRef symbol = LLVMObjectFileCopySymbolIterator(binary);
+    while(!LLVMObjectFileIsSymbolIteratorAtEnd(binary, symbol)) {
+        const char *name = LLVMGetSymbolName(symbol);
+        if(prefix != '\0' && name[0] == prefix) {
+            name++;
+        }
+        size_t length = strlen(name);
+        LLVMMoveToNextSymbol(symbol);
+
+        // Top-level expressions are thrown away once they have run.
+        if(length <= suffix_length || strcmp(&name[length - suffix_length], KAL_CODEGEN_PROFILE_SUFFIX) != 0) {
+            continue;
+        }
+        length -= suffix_length;
+        if(length == strlen(KAL_JIT_EXPR_NAME) && strncmp(name, KAL_JIT_EXPR_NAME, length) == 0) {
+            continue;
+        }
+
+        // The optimized copy of a hot function links against the first
+        // tier's counters, so names can come up more than once.
+        kal_symbol function = kal_symbol_intern_n(name, length);
+        if(function == KAL_SYMBOL_NONE) {
+            continue;
+        }
+        pthread_mutex_lock(&jit->profile_mutex);
+        for(i=0; i<jit->profiled_count && jit->profiled[i] != function; i++);
+        if(i == jit->profiled_count) {
+            if(jit->profiled_count == jit->profiled_capacity) {
+                jit->profiled_capacity = (jit->profiled_capacity == 0 ? 16 : jit->profiled_capacity * 2);
+                jit->profiled = realloc(jit->profiled, sizeof(kal_symbol) * jit->profiled_capacity);
+            }
+            jit->profiled[jit->profiled_count++] = function;
+        }
+        pthread_mutex_unlock(&jit->profile_mutex);
+    }
+    LLVMDisposeSymbolIterator(symbol);
+    LLVMDisposeBinary(binary);
+}
+
+// Object transform layer hook. Every object the JIT links passes through
+// here, whether it was just compiled, loaded from the cache or read from a
+// library, so this is where cached definitions are saved and profiled
+// functions are recorded.
+//
+// data   - The JIT.
+// object - The object about to be linked. It is left unchanged.
+//
+// Returns NULL.
+static LLVMErrorRef kal_jit_link_object(void *data, LLVMMemoryBufferRef *object)
+{
+    kal_jit *jit = data;
+    if(jit->context->profile) {
+        kal_jit_profile_record(jit, *object);
+    }
+    if(jit->cache_path != NULL) {
+        kal_jit_cache_save(jit, *object);
+    }
+    return NULL;
+}
+
+// Reads the counters of a profiled function. Looking them up compiles the
+// function if it hasn't been called yet.
+//
+// jit    - The JIT.
+// name   - The function name.
+// calls  - Where the number of calls is stored.
+// cycles - Where the cycles spent in the outermost calls are stored.
+//
+// Returns 0 if successful or -1 if the function isn't profiled.
+int kal_jit_profile_stats(kal_jit *jit, const char *name, uint64_t *calls,
+                          uint64_t *cycles)
+{
+    LLVMOrcExecutorAddress address;
+
+    size_t length = strlen(name) + strlen(KAL_CODEGEN_PROFILE_SUFFIX) + 1;
+    char *global_name = malloc(length);
+    snprintf(global_name, length, "%s%s", name, KAL_CODEGEN_PROFILE_SUFFIX);
+    LLVMErrorRef err = LLVMOrcLLJITLookup(jit->lljit, &address, global_name);
+    free(global_name);
+    if(err != NULL) {
+        LLVMConsumeError(err);
+        return -1;
+    }
+
+    // The counters are { calls, cycles, depth }.
+    uint64_t *counters = (uint64_t*)(uintptr_t)address;
+    *calls = __atomic_load_n(&counters[0], __ATOMIC_RELAXED);
+    *cycles = __atomic_load_n(&counters[1], __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Orders profile entries from the most cycles to the fewest.
+//
+// a - The first entry.
+// b - The second entry.
+//
+// Returns the order of the entries.
+static int kal_jit_profile_compare(const void *a, const void *b)
+{
+    const kal_jit_profile *lhs = a;
+    const kal_jit_profile *rhs = b;
+    if(lhs->cycles != rhs->cycles) {
+        return (lhs->cycles > rhs->cycles ? -1 : 1);
+    }
+    return (lhs->calls > rhs->calls ? -1 : (lhs->calls < rhs->calls ? 1 : 0));
+}
+
+// Writes a table of every profiled function that has been called, hottest
+// first. Cycles are inclusive so a function's count also covers the
+// functions it calls, and are only exact when each function runs on one
+// thread at a time, which the table notes. Only functions whose code has
+// already been linked are read, so nothing is compiled or loaded to write
+// the table.
+//
+// jit  - The JIT.
+// file - The file to write to.
+void kal_jit_profile_dump(kal_jit *jit, FILE *file)
+{
+    unsigned int i, count = 0;
+
+    pthread_mutex_lock(&jit->profile_mutex);
+    unsigned int profiled_count = jit->profiled_count;
+    kal_symbol *profiled = malloc(sizeof(kal_symbol) * (profiled_count + 1));
+    memcpy(profiled, jit->profiled, sizeof(kal_symbol) * profiled_count);
+    pthread_mutex_unlock(&jit->profile_mutex);
+
+    kal_jit_profile *entries = malloc(sizeof(kal_jit_profile) * (profiled_count + 1));
+    for(i=0; i<profiled_count; i++) {
+        kal_jit_profile *entry = &entries[count];
+        if(kal_jit_profile_stats(jit, kal_symbol_name(profiled[i]), &entry->calls, &entry->cycles) == 0 &&
+           entry->calls > 0)
+        {
+            entry->name = kal_symbol_name(profiled[i]);
+            count++;
+        }
+    }
+    free(profiled);
+    qsort(entries, count, sizeof(kal_jit_profile), kal_jit_profile_compare);
+
+    fprintf(file, "%-24s %12s %16s %12s\n", "Function", "Calls", "Cycles", "Cycles/Call");
+    for(i=0; i<count; i++) {
+        fprintf(file, "%-24s %12llu %16llu %12.1f\n", entries[i].name,
+            (unsigned long long)entries[i].calls, (unsigned long long)entries[i].cycles,
+            (double)entries[i].cycles / entries[i].calls);
+    }
+    fprintf(file, "Cycles miss calls that overlap one on another thread.\n");
+    free(entries);
+}
+
+//--------------------------------------
+// Batch Evaluation
+//--------------------------------------
+
+// Looks up the batch function of a definition. Looking it up compiles it
+// but the definition itself is still compiled on its first call.
+//
+// jit  - The JIT.
+// name - The function name.
+//
+// Returns the batch function or NULL if there is no such definition.
+kal_jit_batch_fn kal_jit_batch(kal_jit *jit, const char *name)
+{
+    LLVMOrcExecutorAddress address;
+
+    char *batch_name = malloc(strlen(name) + strlen(KAL_CODEGEN_BATCH_SUFFIX) + 1);
+    strcpy(batch_name, name);
+    strcat(batch_name, KAL_CODEGEN_BATCH_SUFFIX);
+    LLVMErrorRef err = LLVMOrcLLJITLookup(jit->lljit, &address, batch_name);
+    free(batch_name);
+    if(err != NULL) {
+        LLVMConsumeError(err);
+        return NULL;
+    }
+
+    return (kal_jit_batch_fn)(uintptr_t)address;
+}
+
+// Evaluates one thread's share of a batch.
+//
+// data - The batch task.
+//
+// Returns NULL.
+void *kal_jit_batch_run(void *data)
+{
+    kal_jit_batch_task *task = data;
+    task->fn(task->columns, task->start, task->end, task->out);
+    return NULL;
+}
+
+// Evaluates a definition over every row of a batch. Large batches are split
+// across a thread per core, each with at least KAL_JIT_BATCH_PARALLEL_MIN
+// rows, so externs that the definition calls may run concurrently.
+//
+// fn      - The batch function from kal_jit_batch().
+// columns - One column of n arguments for each parameter.
+// n       - The number of rows.
+// out     - Where the n results are stored.
+void kal_jit_eval_batch(kal_jit_batch_fn fn, const double *const *columns,
+                        size_t n, double *out)
+{
+    unsigned int i;
+
+    size_t thread_count = kal_compile_worker_count();
+    if(thread_count > n / KAL_JIT_BATCH_PARALLEL_MIN) {
+        thread_count = n / KAL_JIT_BATCH_PARALLEL_MIN;
+    }
+    if(thread_count <= 1) {
+        fn(columns, 0, n, out);
+        return;
+    }
+
+    // Keep each share a whole number of vectors so that only the last one
+    // has rows left over. This thread takes the first share.
+    size_t share = (n / thread_count + 7) & ~(size_t)7;
+    kal_jit_batch_task *tasks = calloc(thread_count, sizeof(kal_jit_batch_task));
+    for(i=0; i<thread_count; i++) {
+        tasks[i].fn = fn;
+        tasks[i].columns = columns;
+        tasks[i].start = (i * share < n ? i * share : n);
+        tasks[i].end = (i == thread_count - 1 || (i + 1) * share > n ? n : (i + 1) * share);
+        tasks[i].out = out;
+    }
+    for(i=1; i<thread_count; i++) {
+        if(pthread_create(&tasks[i].thread, NULL, kal_jit_batch_run, &tasks[i]) != 0) {
+            kal_jit_batch_run(&tasks[i]);
+            tasks[i].thread = pthread_self();
+        }
+    }
+    kal_jit_batch_run(&tasks[0]);
+    for(i=1; i<thread_count; i++) {
+        if(!pthread_equal(tasks[i].thread, pthread_self())) {
+            pthread_join(tasks[i].thread, NULL);
+        }
+    }
+    free(tasks);
+}
+
+
+//--------------------------------------
+// Libraries
+//--------------------------------------
+
+// Checks whether a global is one of a function's memo or profile globals.
+//
+// function - The function name.
+// name     - The global's name.
+//
+// Returns true if the global belongs to the function.
+static bool kal_jit_is_function_global(const char *function, const char *name)
+{
+    size_t length = strlen(function);
+    return strncmp(name, function, length) == 0 &&
+        (strncmp(&name[length], KAL_JIT_MEMO_SUFFIX, strlen(KAL_JIT_MEMO_SUFFIX)) == 0 ||
+         strcmp(&name[length], KAL_CODEGEN_PROFILE_SUFFIX) == 0);
+}
+
+// Prints errors from reading a library instead of exiting, which is what
+// LLVM does by default. Anything less than an error is ignored.
+//
+// info - The diagnostic.
+// data - Unused.
+void kal_jit_library_diagnose(LLVMDiagnosticInfoRef info, void *data)
+{
+    (void)data;
+    if(LLVMGetDiagInfoSeverity(info) != LLVMDSError) {
+        return;
+    }
+    char *msg = LLVMGetDiagInfoDescription(info);
+    fprintf(stderr, "%s\n", msg);
+    LLVMDisposeMessage(msg);
+}
+
+// Reads a library's module straight from its mapping. Only the module's
+// declarations are read. Each function body is read when it is first used.
+//
+// library - The library.
+// llvm    - The context to read the module into.
+//
+// Returns a new module or NULL if the library isn't valid bitcode.
+LLVMModuleRef kal_jit_library_read(kal_jit_library *library, LLVMContextRef llvm)
+{
+    LLVMModuleRef module = NULL;
+
+    // The module owns the buffer but the buffer doesn't own the mapping.
+    LLVMMemoryBufferRef buffer = LLVMCreateMemoryBufferWithMemoryRange(
+        library->data, library->size, library->path, 0);
+    if(LLVMGetBitcodeModuleInContext2(llvm, buffer, &module) != 0) {
+        fprintf(stderr, "Unable to read library: %s\n", library->path);
+        return NULL;
+    }
+
+    return module;
+}
+
+// Reads a library definition's body into a fresh copy of the library's
+// module. Every other definition becomes a declaration that calls back
+// through its own stub. This runs with the library's context locked.
+//
+// data        - The definition. Its module is set here.
+// lock_module - The library's lock module, which gives the context.
+//
+// Returns NULL.
+static LLVMErrorRef kal_jit_library_load(void *data, LLVMModuleRef lock_module)
+{
+    size_t length;
+    kal_jit_library_function *function = data;
+    kal_jit_library *library = function->library;
+
+    LLVMModuleRef module = kal_jit_library_read(library, LLVMGetModuleContext(lock_module));
+    LLVMValueRef func = (module != NULL ? LLVMGetNamedFunction(module, function->name) : NULL);
+    if(func == NULL || LLVMIsDeclaration(func)) {
+        fprintf(stderr, "Unable to load %s from %s\n", function->name, library->path);
+        if(module != NULL) {
+            LLVMDisposeModule(module);
+        }
+        return NULL;
+    }
+
+    // Running a function pass manager reads in the body, even with no passes.
+    LLVMPassManagerRef pass_manager = LLVMCreateFunctionPassManagerForModule(module);
+    LLVMRunFunctionPassManager(pass_manager, func);
+    LLVMDisposePassManager(pass_manager);
+
+    LLVMValueRef other, next;
+    for(other = LLVMGetFirstFunction(module); other != NULL; other = next) {
+        next = LLVMGetNextFunction(other);
+        if(other == func || LLVMIsDeclaration(other)) {
+            continue;
+        }
+
+        const char *name = LLVMGetValueName2(other, &length);
+        char *other_name = malloc(length + 1);
+        memcpy(other_name, name, length + 1);
+
+        LLVMValueRef declaration = LLVMAddFunction(module, "", LLVMGlobalGetValueType(other));
+        LLVMReplaceAllUsesWith(other, declaration);
+        LLVMDeleteFunction(other);
+        LLVMSetValueName2(declaration, other_name, length);
+        free(other_name);
+    }
+
+    // Keep only the function's own memo and profile globals.
+    LLVMValueRef global;
+    for(global = LLVMGetFirstGlobal(module); global != NULL; global = next) {
+        next = LLVMGetNextGlobal(global);
+        if(!kal_jit_is_function_global(function->name, LLVMGetValueName(global)) &&
+           LLVMGetFirstUse(global) == NULL)
+        {
+            LLVMDeleteGlobal(global);
+        }
+    }
+
+    char *impl_name = malloc(strlen(function->name) + strlen(KAL_JIT_IMPL_SUFFIX) + 1);
+    strcpy(impl_name, function->name);
+    strcat(impl_name, KAL_JIT_IMPL_SUFFIX);
+    LLVMSetValueName(func, impl_name);
+    free(impl_name);
+
+    function->module = module;
+    return NULL;
+}
+
+// Materializes a library definition on its first call. The body is read
+// with kal_jit_library_load() and then compiled like any other definition.
+// ORC runs this on whichever thread calls the definition first.
+//
+// data           - The definition. It is freed here.
+// responsibility - The body's symbol.
+void kal_jit_library_materialize(void *data,
+                                 LLVMOrcMaterializationResponsibilityRef responsibility)
+{
+    kal_jit_library_function *function = data;
+    kal_jit_library *library = function->library;
+    kal_jit *jit = function->jit;
+
+    LLVMErrorRef err = LLVMOrcThreadSafeModuleWithModuleDo(library->lock_module,
+        kal_jit_library_load, function);
+    if(err != NULL) {
+        kal_jit_report(err);
+    }
+    LLVMModuleRef module = function->module;
+    if(module == NULL) {
+        LLVMOrcMaterializationResponsibilityFailMaterialization(responsibility);
+        LLVMOrcDisposeMaterializationResponsibility(responsibility);
+        free(function->name);
+        free(function);
+        return;
+    }
+
+    __atomic_add_fetch(&jit->library_loads, 1, __ATOMIC_RELAXED);
+    if(jit->dump) {
+        fprintf(stderr, "Loaded %s from %s\n", function->name, library->path);
+    }
+    free(function->name);
+    free(function);
+
+    LLVMOrcThreadSafeModuleRef thread_safe_module = LLVMOrcCreateNewThreadSafeModule(
+        module, library->thread_safe_context);
+    LLVMOrcIRTransformLayerEmit(LLVMOrcLLJITGetIRTransformLayer(jit->lljit),
+        responsibility, thread_safe_module);
+}
+
+// Called if a library definition is replaced before it is ever used.
+//
+// data   - The definition.
+// dylib  - Unused.
+// symbol - Unused.
+void kal_jit_library_discard(void *data, LLVMOrcJITDylibRef dylib,
+                             LLVMOrcSymbolStringPoolEntryRef symbol)
+{
+    (void)data;
+    (void)dylib;
+    (void)symbol;
+}
+
+// Frees a library definition that was never materialized.
+//
+// data - The definition.
+void kal_jit_library_destroy(void *data)
+{
+    kal_jit_library_function *function = data;
+    free(function->name);
+    free(function);
+}
+
+// Works out what is known about a library definition's effects from the
+// attributes it was compiled with.
+//
+// func - The definition.
+//
+// Returns the definition's kal_function_flag_e flags.
+static uint8_t kal_jit_library_flags(LLVMValueRef func)
+{
+    unsigned int i;
+    uint8_t flags = 0;
+    const char *names[] = {"nounwind", "readnone", "willreturn"};
+    uint8_t provided[] = {KAL_FUNCTION_PURE, KAL_FUNCTION_READNONE, KAL_FUNCTION_WILLRETURN};
+
+    for(i=0; i<sizeof(names)/sizeof(*names); i++) {
+        unsigned int kind = LLVMGetEnumAttributeKindForName(names[i], strlen(names[i]));
+        if(LLVMGetEnumAttributeAtIndex(func, LLVMAttributeFunctionIndex, kind) != NULL) {
+            flags |= provided[i];
+        }
+    }
+    return ((flags & KAL_FUNCTION_PURE) != 0 ? flags : 0);
+}
+
+// Adds a library definition to the JIT. Its body and memo and profile
+// globals, if it has any, are provided on demand by a materialization unit and its name
+// becomes a lazy stub like any other definition.
+//
+// jit     - The JIT.
+// library - The library.
+// func    - The definition in the library's declarations-only module.
+//
+// Returns 0 if successful, otherwise returns -1.
+int kal_jit_library_add(kal_jit *jit, kal_jit_library *library, LLVMValueRef func)
+{
+    LLVMErrorRef err;
+    size_t length;
+    kal_context *context = jit->context;
+
+    const char *name = LLVMGetValueName2(func, &length);
+    kal_symbol symbol = kal_symbol_intern(name);
+    if(symbol == KAL_SYMBOL_NONE) {
+        return -1;
+    }
+    unsigned int arg_count = LLVMCountParams(func);
+    if(symbol < context->function_capacity && context->functions[symbol] != 0 &&
+       context->functions[symbol] != arg_count + 1)
+    {
+        fprintf(stderr, "Existing function exists with different parameter count\n");
+        return -1;
+    }
+    kal_codegen_add_function(context, symbol, arg_count);
+    kal_codegen_set_flags(context, symbol, kal_jit_library_flags(func));
+
+    kal_jit_library_function *function = malloc(sizeof(kal_jit_library_function));
+    function->jit = jit;
+    function->library = library;
+    function->name = malloc(length + 1);
+    memcpy(function->name, name, length + 1);
+    function->module = NULL;
+
+    char *impl_name = malloc(length + strlen(KAL_JIT_IMPL_SUFFIX) + 1);
+    strcpy(impl_name, name);
+    strcat(impl_name, KAL_JIT_IMPL_SUFFIX);
+
+    LLVMOrcCSymbolFlagsMapPair symbols[5];
+    unsigned int symbol_count = 1;
+    symbols[0].Name = LLVMOrcLLJITMangleAndIntern(jit->lljit, impl_name);
+    symbols[0].Flags.GenericFlags = LLVMJITSymbolGenericFlagsExported | LLVMJITSymbolGenericFlagsCallable;
+    symbols[0].Flags.TargetFlags = 0;
+
+    LLVMValueRef global;
+    for(global = LLVMGetFirstGlobal(LLVMGetGlobalParent(func)); global != NULL && symbol_count < 5;
+        global = LLVMGetNextGlobal(global))
+    {
+        if(!LLVMIsDeclaration(global) && kal_jit_is_function_global(name, LLVMGetValueName(global))) {
+            symbols[symbol_count].Name = LLVMOrcLLJITMangleAndIntern(jit->lljit, LLVMGetValueName(global));
+            symbols[symbol_count].Flags.GenericFlags = LLVMJITSymbolGenericFlagsExported;
+            symbols[symbol_count].Flags.TargetFlags = 0;
+            symbol_count++;
+        }
+    }
+
+    LLVMOrcMaterializationUnitRef unit = LLVMOrcCreateCustomMaterializationUnit(impl_name,
+        function, symbols, symbol_count, NULL, kal_jit_library_materialize, kal_jit_library_discard,
+        kal_jit_library_destroy);
+    free(impl_name);
+
+    if((err = LLVMOrcJITDylibDefine(jit->dylib, unit)) != NULL) {
+        LLVMOrcDisposeMaterializationUnit(unit);
+        return kal_jit_report(err);
+    }
+
+    return kal_jit_add_stub(jit, function->name);
+}
+
+// Imports a bitcode library of precompiled definitions, such as one written
+// by `kaleidoscope -c lib.k -o lib.bc`. The file is mapped into memory and
+// only its declarations are read up front. Each definition's body is read
+// from the mapping and compiled the first time the definition is called.
+// Externs in the library resolve like any other extern.
+//
+// jit  - The JIT.
+// path - The bitcode file.
+//
+// Returns 0 if successful, otherwise returns -1.
+int kal_jit_import(kal_jit *jit, const char *path)
+{
+    struct stat info;
+    int rc = 0;
+
+    int fd = open(path, O_RDONLY);
+    if(fd == -1 || fstat(fd, &info) != 0 || info.st_size == 0) {
+        fprintf(stderr, "Unable to read library: %s\n", path);
+        if(fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    void *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) {
+        fprintf(stderr, "Unable to map library: %s\n", path);
+        return -1;
+    }
+
+    // The library stays mapped until the JIT is freed.
+    kal_jit_library *library = calloc(1, sizeof(kal_jit_library));
+    library->path = malloc(strlen(path) + 1);
+    strcpy(library->path, path);
+    library->data = data;
+    library->size = info.st_size;
+    library->thread_safe_context = LLVMOrcCreateNewThreadSafeContext();
+    LLVMContextSetDiagnosticHandler(LLVMOrcThreadSafeContextGetContext(library->thread_safe_context),
+        kal_jit_library_diagnose, NULL);
+    library->lock_module = LLVMOrcCreateNewThreadSafeModule(LLVMModuleCreateWithNameInContext("lock",
+        LLVMOrcThreadSafeContextGetContext(library->thread_safe_context)), library->thread_safe_context);
+    if(jit->library_count == jit->library_capacity) {
+        jit->library_capacity = (jit->library_capacity == 0 ? 4 : jit->library_capacity * 2);
+        jit->libraries = realloc(jit->libraries, sizeof(kal_jit_library*) * jit->library_capacity);
+    }
+    jit->libraries[jit->library_count++] = library;
+
+    // List the definitions from a copy of the module that is thrown away.
+    LLVMContextRef llvm = LLVMContextCreate();
+    LLVMContextSetDiagnosticHandler(llvm, kal_jit_library_diagnose, NULL);
+    LLVMModuleRef module = kal_jit_library_read(library, llvm);
+    if(module == NULL) {
+        LLVMContextDispose(llvm);
+        return -1;
+    }
+
+    LLVMValueRef func;
+    for(func = LLVMGetFirstFunction(module); func != NULL && rc == 0; func = LLVMGetNextFunction(func)) {
+        size_t length;
+        const char *name = LLVMGetValueName2(func, &length);
+        if(!LLVMIsDeclaration(func) && LLVMGetLinkage(func) == LLVMExternalLinkage &&
+           length > 0 && strchr(name, '.') == NULL)
+        {
+            rc = kal_jit_library_add(jit, library, func);
+        }
+    }
+    LLVMDisposeModule(module);
+    LLVMContextDispose(llvm);
+
+    return rc;
+}
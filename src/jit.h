@@ -0,0 +1,190 @@
+#ifndef _jit_h
+#define _jit_h
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <llvm-c/Core.h>
+#include <llvm-c/TargetMachine.h>
+#include <llvm-c/Orc.h>
+#include <llvm-c/LLJIT.h>
+#include "ast.h"
+#include "context.h"
+
+
+//==============================================================================
+//
+// Definitions
+//
+//==============================================================================
+
+// The number of calls after which the tiered engine recompiles a function at
+// full optimization.
+#define KAL_JIT_TIER_THRESHOLD 1000
+
+// The smallest number of rows that each thread evaluating a batch is given.
+// Smaller batches run on the calling thread.
+#define KAL_JIT_BATCH_PARALLEL_MIN 65536
+
+
+//==============================================================================
+//
+// Typedefs
+//
+//==============================================================================
+
+// How the JIT compiles definitions.
+//
+// KAL_JIT_LAZY   - Optimize and compile each function on its first call.
+// KAL_JIT_TIERED - Compile each function at O0 on its first call and then
+//                  recompile it at O3 in the background once it is hot.
+typedef enum kal_jit_mode_e {
+    KAL_JIT_LAZY,
+    KAL_JIT_TIERED
+} kal_jit_mode_e;
+
+// Evaluates a definition for rows `start` up to `end` of a batch. There is
+// one column of arguments for each parameter and row i's result is stored
+// in out[i].
+typedef void (*kal_jit_batch_fn)(const double *const *columns, uint64_t start,
+    uint64_t end, double *out);
+
+// Tracks a single function in the tiered engine. The first-tier code bumps
+// `calls` and checks `code` on every call through fixed addresses, so a
+// record never moves once it is created.
+typedef struct kal_jit_tier {
+    char *name;
+    LLVMMemoryBufferRef bitcode;
+    void *code;
+    uint64_t calls;
+} kal_jit_tier;
+
+// A profiled function's counters as read by kal_jit_profile_stats().
+// `cycles` only covers the outermost calls of a recursive function and
+// misses calls that overlap one on another thread.
+typedef struct kal_jit_profile {
+    const char *name;
+    uint64_t calls;
+    uint64_t cycles;
+} kal_jit_profile;
+
+// A definition whose object will be saved to the cache once it has been
+// compiled.
+typedef struct kal_jit_cache_entry {
+    char *symbol;
+    char *path;
+} kal_jit_cache_entry;
+
+// A precompiled bitcode library. The file is mapped into memory once and
+// each definition's body is read from the mapping the first time the
+// definition is called. Definitions can be called for the first time on
+// several threads at once, so bodies are read into the library's context
+// while holding its lock through `lock_module`, an empty module that is
+// only used for that.
+typedef struct kal_jit_library {
+    char *path;
+    void *data;
+    size_t size;
+    LLVMOrcThreadSafeContextRef thread_safe_context;
+    LLVMOrcThreadSafeModuleRef lock_module;
+} kal_jit_library;
+
+// A lazily compiling engine built on LLVM's ORC JIT. Every definition is
+// added as IR behind a compile-on-first-call stub so machine code is only
+// generated for functions that actually run. In tiered mode a background
+// thread recompiles hot functions from a saved copy of their bitcode. With
+// an object cache set, compiled definitions are kept on disk across runs.
+// Imported bitcode libraries are compiled lazily in the same way, and
+// `library_loads`, which is updated atomically, counts the definitions read
+// from them. Each definition also gets a batch function that runs it over
+// columns of arguments `batch_lanes` rows at a time. Code is generated for the
+// context's target, which is the host unless kal_jit_set_target() changes it.
+// When the context profiles, kal_jit_profile_dump() shows where time went.
+// It only reads the functions in `profiled`, which are recorded as their
+// code is linked, so that it never compiles anything itself.
+typedef struct kal_jit {
+    kal_jit_mode_e mode;
+    kal_context *context;
+    LLVMOrcThreadSafeContextRef thread_safe_context;
+    LLVMOrcLLJITRef lljit;
+    LLVMOrcJITDylibRef dylib;
+    LLVMOrcLazyCallThroughManagerRef call_through;
+    LLVMOrcIndirectStubsManagerRef stubs;
+    LLVMTargetMachineRef machine;
+    unsigned int compiled_count;
+    unsigned int batch_lanes;
+    bool dump;
+
+    char *cache_path;
+    uint64_t cache_seed;
+    kal_jit_cache_entry *cache_pending;
+    unsigned int cache_pending_count;
+    unsigned int cache_pending_capacity;
+    unsigned int cache_hits;
+    unsigned int cache_misses;
+
+    kal_jit_library **libraries;
+    unsigned int library_count;
+    unsigned int library_capacity;
+    unsigned int library_loads;
+
+    uint64_t tier_threshold;
+    kal_jit_tier **tiers;
+    unsigned int tier_count;
+    unsigned int tier_capacity;
+    kal_jit_tier **tier_queue;
+    unsigned int tier_queue_count;
+    unsigned int tier_queue_capacity;
+    unsigned int tier_active;
+    unsigned int promoted_count;
+    bool tier_stopping;
+    LLVMTargetMachineRef tier_machine;
+    pthread_t tier_thread;
+    pthread_mutex_t tier_mutex;
+    pthread_cond_t tier_ready;
+    pthread_cond_t tier_idle;
+
+    kal_symbol *profiled;
+    unsigned int profiled_count;
+    unsigned int profiled_capacity;
+    pthread_mutex_t profile_mutex;
+} kal_jit;
+
+
+//==============================================================================
+//
+// Functions
+//
+//==============================================================================
+
+kal_jit *kal_jit_create(kal_jit_mode_e mode);
+
+void kal_jit_free(kal_jit *jit);
+
+void kal_jit_set_target(kal_jit *jit, kal_target *target);
+
+int kal_jit_add(kal_jit *jit, kal_ast_node *node);
+
+int kal_jit_eval(kal_jit *jit, kal_ast_node *node, double *result);
+
+void kal_jit_wait(kal_jit *jit);
+
+int kal_jit_set_cache(kal_jit *jit, const char *path);
+
+int kal_jit_import(kal_jit *jit, const char *path);
+
+int kal_jit_memo_stats(kal_jit *jit, const char *name, uint64_t *hits,
+    uint64_t *misses);
+
+int kal_jit_profile_stats(kal_jit *jit, const char *name, uint64_t *calls,
+    uint64_t *cycles);
+
+void kal_jit_profile_dump(kal_jit *jit, FILE *file);
+
+kal_jit_batch_fn kal_jit_batch(kal_jit *jit, const char *name);
+
+void kal_jit_eval_batch(kal_jit_batch_fn fn, const double *const *columns,
+    size_t n, double *out);
+
+#endif
@@ -1,13 +1,346 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
+#include <unistd.h>
 #include <llvm-c/ExecutionEngine.h>
 #include <llvm-c/Target.h>
-#include <llvm-c/Transforms/Scalar.h>
 
 #include "ast.h"
 #include "parser.h"
 #include "codegen.h"
+#include "compile.h"
+#include "aot.h"
+#include "fold.h"
+#include "jit.h"
+#include "vm.h"
+
+//==============================================================================
+//
+// Typedefs
+//
+//==============================================================================
+
+// Holds everything needed to evaluate top-level items.
+typedef struct kal_repl {
+    kal_context *context;
+    kal_jit *jit;
+    kal_vm *vm;
+    LLVMExecutionEngineRef engine;
+    LLVMPassManagerRef pass_manager;
+    LLVMPassManagerRef module_pass_manager;
+    kal_ast_fold_stats fold_stats;
+    bool dump;
+} kal_repl;
+
+
+//==============================================================================
+//
+// Evaluation
+//
+//==============================================================================
+
+// Folds constants in a parsed item and adds its node counts to the REPL's
+// totals. In dump mode the counts are shown for each item that shrinks.
+//
+// repl - The REPL state.
+// node - The item to fold.
+void fold(kal_repl *repl, kal_ast_node *node)
+{
+    kal_ast_fold_stats stats = {0, 0};
+    kal_ast_fold(repl->context->arena, node, &stats);
+    repl->fold_stats.nodes_before += stats.nodes_before;
+    repl->fold_stats.nodes_after += stats.nodes_after;
+
+    if(repl->dump && stats.nodes_after < stats.nodes_before) {
+        fprintf(stderr, "Folded %u nodes to %u\n", stats.nodes_before, stats.nodes_after);
+    }
+}
+
+// Prints the fold pass totals since the last report and resets them.
+// Nothing is printed if no items were seen.
+//
+// repl - The REPL state.
+// name - What was loaded.
+void fold_report(kal_repl *repl, const char *name)
+{
+    if(repl->fold_stats.nodes_before == 0) {
+        return;
+    }
+    fprintf(stderr, "Folded %s from %u nodes to %u\n", name,
+        repl->fold_stats.nodes_before, repl->fold_stats.nodes_after);
+    repl->fold_stats.nodes_before = 0;
+    repl->fold_stats.nodes_after = 0;
+}
+
+// Starts a new module for the execution engine. The engine compiles a
+// module the first time something in it runs and never looks at it again,
+// so anything generated after that has to go into a new module. Functions
+// in earlier modules are declared again as they are called.
+//
+// repl - The REPL state.
+void next_module(kal_repl *repl)
+{
+    kal_context *context = repl->context;
+    context->module = LLVMModuleCreateWithNameInContext("kal", context->llvm);
+    LLVMAddModule(repl->engine, context->module);
+
+    LLVMDisposePassManager(repl->pass_manager);
+    repl->pass_manager = kal_compile_pass_manager_create(context, context->module);
+}
+
+// Generates code for a top-level item and runs it if it is an expression.
+//
+// repl - The REPL state.
+// node - The item to evaluate.
+//
+// Returns 0 if successful, otherwise returns -1.
+int eval(kal_repl *repl, kal_ast_node *node)
+{
+    kal_ast_arena *arena = repl->context->arena;
+    bool is_top_level = (node->type != KAL_AST_TYPE_FUNCTION && node->type != KAL_AST_TYPE_PROTOTYPE);
+
+    fold(repl, node);
+
+    // The VM interprets bytecode without going through LLVM at all.
+    if(repl->vm != NULL) {
+        repl->vm->dump = repl->dump;
+        if(is_top_level) {
+            double result;
+            if(kal_vm_eval(repl->vm, node, &result) != 0) {
+                return -1;
+            }
+            fprintf(stderr, "Evaluted to %f\n", result);
+            return 0;
+        }
+        return kal_vm_add(repl->vm, node);
+    }
+
+    // The lazy engine compiles functions when they're first called.
+    if(repl->jit != NULL) {
+        repl->jit->dump = repl->dump;
+        if(is_top_level) {
+            double result;
+            if(kal_jit_eval(repl->jit, node, &result) != 0) {
+                return -1;
+            }
+            fprintf(stderr, "Evaluted to %f\n", result);
+            return 0;
+        }
+        return kal_jit_add(repl->jit, node);
+    }
+
+    // Wrap in an anonymous function if it's a top-level expression.
+    if(is_top_level) {
+        kal_ast_node *prototype = kal_ast_prototype_create(arena, kal_symbol_intern(""), NULL, 0);
+        node = kal_ast_function_create(arena, prototype, node);
+    }
+
+    // Generate node.
+    LLVMValueRef value = kal_codegen(repl->context, node);
+    if(value == NULL) {
+        fprintf(stderr, "Unable to codegen for node\n");
+        return -1;
+    }
+
+    // Dump IR.
+    if(repl->dump) {
+        LLVMDumpValue(value);
+    }
+
+    // Optimize and run it if it's a top level expression. The module passes
+    // see every definition since the last expression and can inline them
+    // into it. They also drop unnamed functions, so the wrapper is given a
+    // name that LLVM makes unique.
+    if(is_top_level) {
+        LLVMSetValueName(value, "expr.anon");
+        LLVMRunFunctionPassManager(repl->pass_manager, value);
+        LLVMRunPassManager(repl->module_pass_manager, repl->context->module);
+        void *fp = LLVMGetPointerToGlobal(repl->engine, value);
+        double (*FP)() = (double (*)())(intptr_t)fp;
+        fprintf(stderr, "Evaluted to %f\n", FP());
+        next_module(repl);
+    }
+    // If this is a function then optimize it.
+    else if(node->type == KAL_AST_TYPE_FUNCTION) {
+        LLVMRunFunctionPassManager(repl->pass_manager, value);
+    }
+
+    return 0;
+}
+
+// Evaluates an item as soon as it is read from a streaming parse session and
+// then releases it.
+//
+// node - The item to evaluate.
+// data - The REPL state.
+void eval_streamed(kal_ast_node *node, void *data)
+{
+    kal_repl *repl = data;
+    eval(repl, node);
+    kal_ast_arena_reset(repl->context->arena);
+}
+
+// Reads stdin in fixed size chunks and evaluates items as they complete.
+// This is used when input is piped in so that definitions can span lines
+// and the input never has to be held in memory all at once.
+//
+// repl - The REPL state.
+//
+// Returns 0 if successful, otherwise returns -1.
+int eval_stream(kal_repl *repl)
+{
+    char buffer[65536];
+    size_t length;
+    int rc = 0;
+
+    kal_parse_session *session = kal_parse_session_create(repl->context->arena, eval_streamed, repl);
+    while((length = fread(buffer, 1, sizeof(buffer), stdin)) > 0) {
+        if(kal_parse_session_feed(session, buffer, length) != 0) {
+            rc = -1;
+        }
+    }
+    if(kal_parse_session_finish(session) != 0) {
+        rc = -1;
+    }
+    kal_parse_session_free(session);
+
+    return rc;
+}
+
+
+//==============================================================================
+//
+// Ahead-of-Time Compilation
+//
+//==============================================================================
+
+// Copies a path with its extension replaced.
+//
+// path      - The path.
+// extension - The new extension, including the dot.
+//
+// Returns a new string that the caller must free.
+char *replace_extension(const char *path, const char *extension)
+{
+    const char *dot = strrchr(path, '.');
+    const char *slash = strrchr(path, '/');
+    size_t length = (dot != NULL && (slash == NULL || dot > slash) ? (size_t)(dot - path) : strlen(path));
+
+    char *result = malloc(length + strlen(extension) + 1);
+    memcpy(result, path, length);
+    strcpy(result + length, extension);
+    return result;
+}
+
+// Compiles files to a native object or shared library instead of running
+// them. An output ending in .bc is written as a bitcode library for the
+// lazy engine to import instead. A C header declaring every definition is
+// written next to the output.
+//
+// files        - The source files.
+// file_count   - The number of files.
+// output       - The file to write or NULL to name it after the first input.
+// shared       - Whether to build a shared library instead of an object.
+// opt_level    - The optimization level.
+// size_level   - The size level.
+// memo         - Whether to memoize every pure function.
+// fast_math    - The kal_fast_math_e rules every function may follow.
+// target       - The CPU to tune for or NULL to run on any CPU of the
+//                host's architecture. The build takes ownership of it.
+// multiversion - Whether to add versions of every function for newer CPUs,
+//                one of which is picked when the output is loaded.
+// profile      - Whether every function counts its calls and cycles.
+//
+// Returns 0 if successful, otherwise returns 1.
+int build(char **files, int file_count, const char *output, bool shared,
+          unsigned int opt_level, unsigned int size_level, bool memo,
+          uint8_t fast_math, kal_target *target, bool multiversion,
+          bool profile)
+{
+    int i;
+    unsigned int j, count;
+    kal_ast_node **nodes;
+    int rc = 0;
+
+    if(file_count == 0) {
+        fprintf(stderr, "No input files\n");
+        kal_target_free(target);
+        return 1;
+    }
+
+    kal_context *context = kal_context_create("kal");
+    context->opt_level = opt_level;
+    context->size_level = size_level;
+    context->memo = memo;
+    context->fast_math = fast_math;
+    context->profile = profile;
+    context->target = target;
+    kal_context **versions = NULL;
+    if(multiversion && (versions = kal_aot_versions_create(context)) == NULL) {
+        rc = -1;
+    }
+    for(i=0; i<file_count && rc == 0; i++) {
+        kal_ast_arena_reset(context->arena);
+        if(kal_parse_file(files[i], context->arena, &nodes, &count) != 0) {
+            fprintf(stderr, "Unable to parse %s\n", files[i]);
+            rc = -1;
+            break;
+        }
+        for(j=0; j<count; j++) {
+            kal_ast_fold(context->arena, nodes[j], NULL);
+        }
+        rc = kal_aot_compile(context, nodes, count);
+        if(rc == 0 && versions != NULL) {
+            rc = kal_aot_versions_compile(versions, nodes, count);
+        }
+        free(nodes);
+    }
+    if(rc == 0 && versions != NULL) {
+        rc = kal_aot_versions_link(context, versions);
+    }
+    kal_aot_versions_free(versions);
+    if(rc == 0) {
+        rc = kal_aot_optimize(context);
+    }
+
+    char *output_path = NULL;
+    if(output == NULL) {
+        output_path = replace_extension(files[0], (shared ? ".so" : ".o"));
+        output = output_path;
+    }
+    char *header_path = replace_extension(output, ".h");
+
+    // Shared libraries are linked from a temporary object.
+    size_t length = strlen(output);
+    bool bitcode = (!shared && length > 3 && strcmp(output + length - 3, ".bc") == 0);
+    char *object_path = (shared ? replace_extension(output, ".tmp.o") : NULL);
+    if(rc == 0 && bitcode && multiversion) {
+        fprintf(stderr, "Multiversioned output can't be written as bitcode\n");
+        rc = -1;
+    }
+    else if(rc == 0 && bitcode) {
+        rc = kal_aot_emit_bitcode(context, output);
+    }
+    else if(rc == 0) {
+        rc = kal_aot_emit_object(context, (shared ? object_path : output));
+    }
+    if(rc == 0 && shared) {
+        rc = kal_aot_link_shared(object_path, output);
+        remove(object_path);
+    }
+    if(rc == 0) {
+        rc = kal_aot_emit_header(context, header_path);
+    }
+
+    free(object_path);
+    free(header_path);
+    free(output_path);
+    kal_context_free(context);
+
+    return (rc == 0 ? 0 : 1);
+}
+
 
 //==============================================================================
 //
@@ -17,33 +350,247 @@
 
 int main(int argc, char **argv)
 {
-    LLVMModuleRef module = LLVMModuleCreateWithName("kal");
-    LLVMBuilderRef builder = LLVMCreateBuilder();
-    LLVMExecutionEngineRef engine;
-    
-    LLVMInitializeNativeTarget();
-    LLVMLinkInJIT();
-
-    // Create execution engine.
-    char *msg;
-    if(LLVMCreateExecutionEngineForModule(&engine, module, &msg) == 1) {
-        fprintf(stderr, "%s\n", msg);
-        LLVMDisposeMessage(msg);
+    int i;
+    unsigned int j;
+    kal_context *context = NULL;
+    LLVMModuleRef module = NULL;
+    LLVMExecutionEngineRef engine = NULL;
+    LLVMPassManagerRef pass_manager = NULL;
+    LLVMPassManagerRef module_pass_manager = NULL;
+    kal_jit *jit = NULL;
+    kal_vm *vm = NULL;
+
+    // Parse options. Anything that isn't an option is a file to load.
+    const char *engine_name = "jit";
+    const char *cache_path = NULL;
+    const char *output = NULL;
+    bool compile_only = false;
+    unsigned int opt_level = KAL_CONTEXT_OPT_LEVEL;
+    unsigned int size_level = 0;
+    bool shared = false;
+    bool memo = false;
+    uint8_t fast_math = 0;
+    const char *cpu = NULL;
+    const char *cpu_features = NULL;
+    bool multiversion = false;
+    bool profile = false;
+    char **files = malloc(sizeof(char*) * argc);
+    int file_count = 0;
+    char **imports = malloc(sizeof(char*) * argc);
+    int import_count = 0;
+    for(i=1; i<argc; i++) {
+        if(strcmp(argv[i], "-engine") == 0 && i+1 < argc) {
+            engine_name = argv[++i];
+        }
+        else if(strcmp(argv[i], "-cache") == 0 && i+1 < argc) {
+            cache_path = argv[++i];
+        }
+        else if(strcmp(argv[i], "-import") == 0 && i+1 < argc) {
+            imports[import_count++] = argv[++i];
+        }
+        else if(strcmp(argv[i], "-c") == 0) {
+            compile_only = true;
+        }
+        else if(strcmp(argv[i], "-shared") == 0) {
+            compile_only = true;
+            shared = true;
+        }
+        else if(strcmp(argv[i], "-o") == 0 && i+1 < argc) {
+            output = argv[++i];
+        }
+        else if(strcmp(argv[i], "-memo") == 0) {
+            memo = true;
+        }
+        else if(strncmp(argv[i], "-ffast-math", 11) == 0) {
+            if(kal_compile_parse_fast_math(argv[i], &fast_math) != 0) {
+                fprintf(stderr, "Unknown fast-math option: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if(strcmp(argv[i], "-profile") == 0) {
+            profile = true;
+        }
+        else if(strcmp(argv[i], "-multiversion") == 0) {
+            compile_only = true;
+            multiversion = true;
+        }
+        else if(strncmp(argv[i], "-mcpu=", 6) == 0) {
+            cpu = argv[i] + 6;
+        }
+        else if(strncmp(argv[i], "-mattr=", 7) == 0) {
+            cpu_features = argv[i] + 7;
+        }
+        else if(strncmp(argv[i], "-O", 2) == 0) {
+            if(kal_compile_parse_opt_level(argv[i], &opt_level, &size_level) != 0) {
+                fprintf(stderr, "Unknown optimization level: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else {
+            files[file_count++] = argv[i];
+        }
+    }
+
+    // Build files ahead of time without starting an engine.
+    if(compile_only) {
+        if(multiversion && (cpu != NULL || cpu_features != NULL)) {
+            fprintf(stderr, "Multiversioned output picks its own CPUs, so -mcpu and -mattr can't be used with it\n");
+            return 1;
+        }
+        kal_target *target = NULL;
+        if(cpu != NULL || cpu_features != NULL) {
+            target = kal_target_create(cpu, cpu_features);
+        }
+        int rc = build(files, file_count, output, shared, opt_level, size_level, memo,
+            fast_math, target, multiversion, profile);
+        free(files);
+        free(imports);
+        return rc;
+    }
+
+    // The lazy and tiered engines own their own context.
+    if(strcmp(engine_name, "lazy") == 0 || strcmp(engine_name, "tiered") == 0) {
+        jit = kal_jit_create(strcmp(engine_name, "lazy") == 0 ? KAL_JIT_LAZY : KAL_JIT_TIERED);
+        if(jit == NULL) {
+            return 1;
+        }
+        context = jit->context;
+        context->opt_level = opt_level;
+        context->size_level = size_level;
+        context->memo = memo;
+        context->fast_math = fast_math;
+        context->profile = profile;
+        kal_jit_set_target(jit, kal_target_create(cpu, cpu_features));
+        kal_target_report(context->target, stderr);
+        if(cache_path != NULL && kal_jit_set_cache(jit, cache_path) != 0) {
+            return 1;
+        }
+        for(i=0; i<import_count; i++) {
+            if(kal_jit_import(jit, imports[i]) != 0) {
+                return 1;
+            }
+        }
+    }
+    // The VM only uses the context for its arena.
+    else if(strcmp(engine_name, "vm") == 0) {
+        context = kal_context_create("kal");
+        vm = kal_vm_create();
+    }
+    else if(strcmp(engine_name, "jit") == 0) {
+        context = kal_context_create("kal");
+        context->opt_level = opt_level;
+        context->size_level = size_level;
+        context->memo = memo;
+        context->fast_math = fast_math;
+        context->target = kal_target_create(cpu, cpu_features);
+        kal_target_report(context->target, stderr);
+        module = context->module;
+
+        LLVMInitializeNativeTarget();
+        LLVMLinkInJIT();
+
+        // Create execution engine.
+        char *msg;
+        if(LLVMCreateExecutionEngineForModule(&engine, module, &msg) == 1) {
+            fprintf(stderr, "%s\n", msg);
+            LLVMDisposeMessage(msg);
+            return 1;
+        }
+
+        // Setup optimizations.
+        pass_manager = kal_compile_pass_manager_create(context, module);
+        module_pass_manager = kal_compile_module_pass_manager_create(context,
+            LLVMGetExecutionEngineTargetMachine(engine));
+    }
+    else {
+        fprintf(stderr, "Unknown engine: %s\n", engine_name);
+        return 1;
+    }
+    if(cache_path != NULL && jit == NULL) {
+        fprintf(stderr, "The object cache needs the lazy engine\n");
+        return 1;
+    }
+    if(import_count > 0 && jit == NULL) {
+        fprintf(stderr, "Importing libraries needs the lazy or tiered engine\n");
+        return 1;
+    }
+    if(profile && jit == NULL) {
+        fprintf(stderr, "Profiling needs the lazy or tiered engine\n");
         return 1;
     }
-    
-    // Setup optimizations.
-    LLVMPassManagerRef pass_manager =  LLVMCreateFunctionPassManagerForModule(module);
-    LLVMAddTargetData(LLVMGetExecutionEngineTargetData(engine), pass_manager);
-    LLVMAddPromoteMemoryToRegisterPass(pass_manager);
-    LLVMAddInstructionCombiningPass(pass_manager);
-    LLVMAddReassociatePass(pass_manager);
-    LLVMAddGVNPass(pass_manager);
-    LLVMAddCFGSimplificationPass(pass_manager);
-    LLVMInitializeFunctionPassManager(pass_manager);
+
+    // Each input is parsed into the context's arena, which is reset between
+    // inputs.
+    kal_ast_arena *arena = context->arena;
+    kal_ast_node **nodes = NULL;
+    unsigned int count = 0;
+
+    kal_repl repl;
+    repl.context = context;
+    repl.jit = jit;
+    repl.vm = vm;
+    repl.engine = engine;
+    repl.pass_manager = pass_manager;
+    repl.module_pass_manager = module_pass_manager;
+    repl.fold_stats.nodes_before = 0;
+    repl.fold_stats.nodes_after = 0;
+    repl.dump = false;
+
+    // Load any files given on the command line in a single parse each. Large
+    // files have their definitions compiled across all cores first and then
+    // their top-level expressions are run in order. The lazy engine defers
+    // compilation anyway so it loads files item by item.
+    for(i=0; i<file_count; i++) {
+        kal_ast_arena_reset(arena);
+        if(kal_parse_file(files[i], arena, &nodes, &count) != 0) {
+            fprintf(stderr, "Unable to parse %s\n", files[i]);
+            return 1;
+        }
+
+        unsigned int function_count = 0;
+        for(j=0; j<count; j++) {
+            if(nodes[j]->type == KAL_AST_TYPE_FUNCTION) {
+                function_count++;
+            }
+        }
+
+        if(jit == NULL && vm == NULL && function_count >= KAL_COMPILE_PARALLEL_MIN) {
+            for(j=0; j<count; j++) {
+                if(nodes[j]->type == KAL_AST_TYPE_FUNCTION) {
+                    fold(&repl, nodes[j]);
+                }
+            }
+            kal_compile_parallel(context, nodes, count, 0);
+            for(j=0; j<count; j++) {
+                if(nodes[j]->type != KAL_AST_TYPE_FUNCTION && nodes[j]->type != KAL_AST_TYPE_PROTOTYPE) {
+                    eval(&repl, nodes[j]);
+                }
+            }
+        }
+        else {
+            for(j=0; j<count; j++) {
+                eval(&repl, nodes[j]);
+            }
+        }
+        free(nodes);
+        fold_report(&repl, files[i]);
+    }
+
+    // Stream piped input instead of reading it line by line.
+    bool interactive = isatty(fileno(stdin));
+    if(!interactive) {
+        eval_stream(&repl);
+        fold_report(&repl, "stdin");
+        if(profile) {
+            kal_jit_profile_dump(jit, stderr);
+        }
+    }
 
     // Main REPL loop.
-    while(1) {
+    repl.dump = true;
+    while(interactive) {
+        kal_ast_arena_reset(arena);
+
         // Show prompt.
         fprintf(stderr, "ready > ");
 
@@ -60,54 +607,55 @@ int main(int argc, char **argv)
         if(strcmp(input, "quit\n") == 0) {
             break;
         }
+
+        // Show where time has gone so far.
+        if(strcmp(input, ":profile\n") == 0) {
+            if(profile) {
+                kal_jit_profile_dump(jit, stderr);
+            }
+            else {
+                fprintf(stderr, "Profiling is off, start with -profile to turn it on\n");
+            }
+            free(input);
+            continue;
+        }
         
         // Parse
-        kal_ast_node *node = NULL;
-        int rc = kal_parse(input, &node);
+        int rc = kal_parse_program(input, strlen(input), arena, &nodes, &count);
+        free(input);
         if(rc != 0) {
             fprintf(stderr, "Parse error\n");
             continue;
         }
         
-        // Wrap in an anonymous function if it's a top-level expression.
-        bool is_top_level = (node->type != KAL_AST_TYPE_FUNCTION && node->type != KAL_AST_TYPE_PROTOTYPE);
-        if(is_top_level) {
-            kal_ast_node *prototype = kal_ast_prototype_create("", NULL, 0);
-            node = kal_ast_function_create(prototype, node);
-        }
-
-        // Generate node.
-        LLVMValueRef value = kal_codegen(node, module, builder);
-        if(value == NULL) {
-            fprintf(stderr, "Unable to codegen for node\n");
-            continue;
-        }
-
-        // Dump IR.
-        LLVMDumpValue(value);
-
-        // Run it if it's a top level expression.
-        if(is_top_level) {
-            void *fp = LLVMGetPointerToGlobal(engine, value);
-            double (*FP)() = (double (*)())(intptr_t)fp;
-            fprintf(stderr, "Evaluted to %f\n", FP());
-        }
-        // If this is a function then optimize it.
-        else if(node->type == KAL_AST_TYPE_FUNCTION) {
-            LLVMRunFunctionPassManager(pass_manager, value);
+        // Evaluate each item on the line.
+        for(j=0; j<count; j++) {
+            eval(&repl, nodes[j]);
         }
-        
-        // Clean up.
-        kal_ast_node_free(node);
+        free(nodes);
     }
     
-    // Dump entire module.
-    LLVMDumpModule(module);
+    free(files);
+    free(imports);
 
-	LLVMDisposePassManager(pass_manager);
-    LLVMDisposeBuilder(builder);
-    LLVMDisposeModule(module);
+    if(jit != NULL) {
+        kal_jit_free(jit);
+        return 0;
+    }
+    if(vm != NULL) {
+        kal_vm_free(vm);
+        kal_context_free(context);
+        return 0;
+    }
+
+    // Dump the module that hasn't run yet.
+    LLVMDumpModule(context->module);
+
+	LLVMDisposePassManager(repl.pass_manager);
+    LLVMDisposePassManager(module_pass_manager);
+    LLVMDisposeExecutionEngine(engine);
+    context->module = NULL;
+    kal_context_free(context);
 
     return 0;
 }
-
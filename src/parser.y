@@ -1,28 +1,87 @@
 %{
     #include "stdio.h"
+    #include <stdlib.h>
+    #include <string.h>
+    #include <stdbool.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
     #include "ast.h"
     #include "parser.h"
     #include "lexer.h"
-    kal_ast_node *root;
     extern int yylex();
-    void yyerror(void *scanner, const char *s) { printf("ERROR: %s\n", s); }
+    void yyerror(void *scanner, kal_parse_state *state, const char *s) { printf("ERROR: %s\n", s); }
+    void kal_parse_state_add(kal_parse_state *state, kal_ast_node *node);
+    static int kal_parse_scanner(yyscan_t scanner, kal_ast_arena *arena, kal_ast_node ***nodes, unsigned int *count);
 %}
 
 %debug
 %pure-parser
+%define api.push-pull both
 %lex-param {void *scanner}
-%parse-param {void *scanner}
+%parse-param {void *scanner} {kal_parse_state *state}
+
+%code top {
+    #define _POSIX_C_SOURCE 200809L
+    #define _DEFAULT_SOURCE
+}
+
+%code requires {
+    #include "ast.h"
+
+    // Called with each top-level item as soon as it has been parsed.
+    typedef void (*kal_parse_callback)(kal_ast_node *node, void *data);
+
+    // Holds the top-level items collected during a parse. If a callback is
+    // set then items are passed to it instead of being collected.
+    typedef struct kal_parse_state {
+        kal_ast_arena *arena;
+        kal_ast_node **items;
+        unsigned int item_count;
+        unsigned int item_capacity;
+        kal_parse_callback callback;
+        void *data;
+    } kal_parse_state;
+}
 
 %code provides {
     int kal_parse(char *text, kal_ast_node **node);
-}
 
-%code top {
-    void free_args(void **args, int count);
+    int kal_parse_arena(char *text, kal_ast_arena *arena, kal_ast_node **node);
+
+    int kal_parse_program(const char *text, size_t length, kal_ast_arena *arena,
+        kal_ast_node ***nodes, unsigned int *count);
+
+    int kal_parse_file(const char *path, kal_ast_arena *arena,
+        kal_ast_node ***nodes, unsigned int *count);
+
+    // A persistent scanner and push parser that accepts input in chunks.
+    // `skipping` is set while the rest of a broken item is being thrown
+    // away, which can carry on into later chunks.
+    typedef struct kal_parse_session {
+        void *scanner;
+        yypstate *parser;
+        kal_parse_state state;
+        char *pending;
+        size_t pending_length;
+        size_t pending_capacity;
+        bool skipping;
+    } kal_parse_session;
+
+    kal_parse_session *kal_parse_session_create(kal_ast_arena *arena,
+        kal_parse_callback callback, void *data);
+
+    int kal_parse_session_feed(kal_parse_session *session, const char *text,
+        size_t length);
+
+    int kal_parse_session_finish(kal_parse_session *session);
+
+    void kal_parse_session_free(kal_parse_session *session);
 }
 
 %union {
-    char *string;
+    kal_symbol symbol;
     double number;
     kal_ast_node *node;
     struct {
@@ -30,67 +89,127 @@
         int count;
     } call_args;
     struct {
-        char **args;
+        kal_symbol *args;
         int count;
     } proto_args;
+    struct {
+        kal_symbol *names;
+        kal_ast_node **inits;
+        int count;
+    } var_decls;
+    struct {
+        bool memo;
+        bool fast;
+    } def_options;
     int token;
 }
 
-%token <string> TIDENTIFIER
+%token <symbol> TIDENTIFIER
 %token <number> TNUMBER
 %token <token> TCEQ TCNE TCLT TCLE TCGT TCGE TEQUAL
-%token <token> TLPAREN TRPAREN TLBRACE TRBRACE TCOMMA TDOT
+%token <token> TLPAREN TRPAREN TLBRACE TRBRACE TCOMMA TDOT TSEMICOLON
 %token <token> TPLUS TMINUS TMUL TDIV
-%token <token> TEXTERN TDEF
-%token <token> TIF TTHEN TELSE
+%token <token> TEXTERN TDEF TMEMO TFAST TPURE
+%token <token> TIF TTHEN TELSE TFOR TIN TVAR
 
-%type <node> expr ident number call prototype extern_func function if_expr
+%type <node> expr ident number call prototype extern_func function if_expr for_expr var_expr top_item
 %type <call_args> call_args
 %type <proto_args> proto_args
+%type <var_decls> var_decls
+%type <def_options> def_options
 
+// Loop and var bodies extend as far to the right as they can and
+// assignments take everything to their right. Comparisons bind less
+// tightly than arithmetic, as in C.
+%right TIN
+%right TEQUAL
+%left TCEQ TCNE
+%left TCLT TCLE TCGT TCGE
 %left TPLUS TMINUS
 %left TMUL TDIV
 %left TELSE
 
 %start program
 
+// Top-level items may follow each other directly, as in the reference
+// Kaleidoscope. The one ambiguity is resolved by shifting, so `f (2)` is a
+// call rather than `f` followed by `(2)`; use `;` to separate them instead.
+%expect 1
+
 %%
 
 program : /* empty */
-        | extern_func { root = $1; }
-        | function    { root = $1; }
-        | expr        { root = $1; }
+        | program top_item   { kal_parse_state_add(state, $2); }
+        | program TSEMICOLON
+;
+
+top_item : extern_func
+         | function
+         | expr
 ;
 
-ident   : TIDENTIFIER { $$ = kal_ast_variable_create($1); free($1); };
+ident   : TIDENTIFIER { $$ = kal_ast_variable_create(state->arena, $1); };
+
+number  : TNUMBER { $$ = kal_ast_number_create(state->arena, $1);};
 
-number  : TNUMBER { $$ = kal_ast_number_create($1);};
+function : TDEF def_options prototype expr {
+                $$ = kal_ast_function_create(state->arena, $3, $4);
+                $$->function.memo = $2.memo;
+                $$->function.fast = $2.fast;
+            }
+;
 
-function : TDEF prototype expr   { $$ = kal_ast_function_create($2, $3); };
+def_options : /* empty */            { $$.memo = false; $$.fast = false; }
+            | def_options TMEMO      { $$ = $1; $$.memo = true; }
+            | def_options TFAST      { $$ = $1; $$.fast = true; }
+;
 
-call  : TIDENTIFIER TLPAREN call_args TRPAREN { $$ = kal_ast_call_create($1, $3.args, $3.count); free($1); free($3.args); };
+call  : TIDENTIFIER TLPAREN call_args TRPAREN { $$ = kal_ast_call_create(state->arena, $1, $3.args, $3.count); free($3.args); };
 
 call_args : /* empty */     { $$.count = 0; $$.args = NULL; }
           | expr            { $$.count = 1; $$.args = malloc(sizeof(kal_ast_node*)); $$.args[0] = $1; }
           | call_args TCOMMA expr  { $1.count++; $1.args = realloc($1.args, sizeof(kal_ast_node*) * $1.count); $1.args[$1.count-1] = $3; $$ = $1; }
 ;
 
-prototype : TIDENTIFIER TLPAREN proto_args TRPAREN { $$ = kal_ast_prototype_create($1, $3.args, $3.count); free($1); free_args((void**)$3.args, $3.count); };
+prototype : TIDENTIFIER TLPAREN proto_args TRPAREN { $$ = kal_ast_prototype_create(state->arena, $1, $3.args, $3.count); free($3.args); };
 
 proto_args : /* empty */     { $$.count = 0; $$.args = NULL; }
-           | TIDENTIFIER     { $$.count = 1; $$.args = malloc(sizeof(char*)); $$.args[0] = strdup($1); }
-           | proto_args TCOMMA TIDENTIFIER  { $1.count++; $1.args = realloc($1.args, sizeof(char*) * $1.count); $1.args[$1.count-1] = strdup($3); $$ = $1; }
+           | TIDENTIFIER     { $$.count = 1; $$.args = malloc(sizeof(kal_symbol)); $$.args[0] = $1; }
+           | proto_args TCOMMA TIDENTIFIER  { $1.count++; $1.args = realloc($1.args, sizeof(kal_symbol) * $1.count); $1.args[$1.count-1] = $3; $$ = $1; }
+;
+
+extern_func : TEXTERN prototype  { $$ = $2; }
+            | TEXTERN TPURE prototype  { $$ = $3; $$->prototype.pure = true; }
 ;
 
-extern_func : TEXTERN prototype  { $$ = $2; };
+if_expr : TIF expr TTHEN expr TELSE expr { $$ = kal_ast_if_expr_create(state->arena, $2, $4, $6); };
 
-if_expr : TIF expr TTHEN expr TELSE expr { $$ = kal_ast_if_expr_create($2, $4, $6); };
+for_expr : TFOR TIDENTIFIER TEQUAL expr TCOMMA expr TIN expr  { $$ = kal_ast_for_expr_create(state->arena, $2, $4, $6, NULL, $8); }
+         | TFOR TIDENTIFIER TEQUAL expr TCOMMA expr TCOMMA expr TIN expr  { $$ = kal_ast_for_expr_create(state->arena, $2, $4, $6, $8, $10); }
+;
+
+var_expr : TVAR var_decls TIN expr  { $$ = kal_ast_var_expr_create(state->arena, $2.names, $2.inits, $2.count, $4); free($2.names); free($2.inits); };
+
+var_decls : TIDENTIFIER  { $$.count = 1; $$.names = malloc(sizeof(kal_symbol)); $$.inits = malloc(sizeof(kal_ast_node*)); $$.names[0] = $1; $$.inits[0] = NULL; }
+          | TIDENTIFIER TEQUAL expr  { $$.count = 1; $$.names = malloc(sizeof(kal_symbol)); $$.inits = malloc(sizeof(kal_ast_node*)); $$.names[0] = $1; $$.inits[0] = $3; }
+          | var_decls TCOMMA TIDENTIFIER  { $1.count++; $1.names = realloc($1.names, sizeof(kal_symbol) * $1.count); $1.inits = realloc($1.inits, sizeof(kal_ast_node*) * $1.count); $1.names[$1.count-1] = $3; $1.inits[$1.count-1] = NULL; $$ = $1; }
+          | var_decls TCOMMA TIDENTIFIER TEQUAL expr  { $1.count++; $1.names = realloc($1.names, sizeof(kal_symbol) * $1.count); $1.inits = realloc($1.inits, sizeof(kal_ast_node*) * $1.count); $1.names[$1.count-1] = $3; $1.inits[$1.count-1] = $5; $$ = $1; }
+;
 
-expr    : expr TPLUS expr   { $$ = kal_ast_binary_expr_create(KAL_BINOP_PLUS, $1, $3); }
-        | expr TMINUS expr  { $$ = kal_ast_binary_expr_create(KAL_BINOP_MINUS, $1, $3); }
-        | expr TMUL expr    { $$ = kal_ast_binary_expr_create(KAL_BINOP_MUL, $1, $3); }
-        | expr TDIV expr    { $$ = kal_ast_binary_expr_create(KAL_BINOP_DIV, $1, $3); }
+expr    : expr TPLUS expr   { $$ = kal_ast_binary_expr_create(state->arena, KAL_BINOP_PLUS, $1, $3); }
+        | expr TMINUS expr  { $$ = kal_ast_binary_expr_create(state->arena, KAL_BINOP_MINUS, $1, $3); }
+        | expr TMUL expr    { $$ = kal_ast_binary_expr_create(state->arena, KAL_BINOP_MUL, $1, $3); }
+        | expr TDIV expr    { $$ = kal_ast_binary_expr_create(state->arena, KAL_BINOP_DIV, $1, $3); }
+        | expr TCLT expr    { $$ = kal_ast_binary_expr_create(state->arena, KAL_BINOP_LT, $1, $3); }
+        | expr TCLE expr    { $$ = kal_ast_binary_expr_create(state->arena, KAL_BINOP_LE, $1, $3); }
+        | expr TCGT expr    { $$ = kal_ast_binary_expr_create(state->arena, KAL_BINOP_GT, $1, $3); }
+        | expr TCGE expr    { $$ = kal_ast_binary_expr_create(state->arena, KAL_BINOP_GE, $1, $3); }
+        | expr TCEQ expr    { $$ = kal_ast_binary_expr_create(state->arena, KAL_BINOP_EQ, $1, $3); }
+        | expr TCNE expr    { $$ = kal_ast_binary_expr_create(state->arena, KAL_BINOP_NE, $1, $3); }
+        | TIDENTIFIER TEQUAL expr  { $$ = kal_ast_assign_create(state->arena, $1, $3); }
         | if_expr
+        | for_expr
+        | var_expr
         | number
         | ident
         | call
@@ -106,7 +225,9 @@ expr    : expr TPLUS expr   { $$ = kal_ast_binary_expr_create(KAL_BINOP_PLUS, $1
 //
 //==============================================================================
 
-// Parses a string that contains Kaleidoscope program text.
+// Parses a string that contains a single top-level Kaleidoscope item. The
+// resulting nodes are allocated on the heap and must be freed with
+// kal_ast_node_free().
 //
 // text - The text containing the kaleidoscope program.
 // node - The pointer to where the root AST node should be returned.
@@ -114,37 +235,331 @@ expr    : expr TPLUS expr   { $$ = kal_ast_binary_expr_create(KAL_BINOP_PLUS, $1
 // Returns 0 if successful, otherwise returns -1.
 int kal_parse(char *text, kal_ast_node **node)
 {
-    // yydebug = 1;
+    return kal_parse_arena(text, NULL, node);
+}
+
+// Parses a string that contains a single top-level Kaleidoscope item into an
+// arena. The resulting nodes are released all at once by resetting or freeing
+// the arena. Empty input succeeds and returns a NULL node.
+//
+// text  - The text containing the kaleidoscope program.
+// arena - The arena to allocate nodes from or NULL to use the heap.
+// node  - The pointer to where the root AST node should be returned.
+//
+// Returns 0 if successful, otherwise returns -1.
+int kal_parse_arena(char *text, kal_ast_arena *arena, kal_ast_node **node)
+{
+    unsigned int i;
+    kal_ast_node **nodes = NULL;
+    unsigned int count = 0;
     
-    // Parse using Bison.
+    int rc = kal_parse_program(text, strlen(text), arena, &nodes, &count);
+    if(rc != 0) {
+        return -1;
+    }
+    
+    // Only a single item is allowed.
+    if(count > 1) {
+        if(arena == NULL) {
+            for(i=0; i<count; i++) {
+                kal_ast_node_free(nodes[i]);
+            }
+        }
+        free(nodes);
+        return -1;
+    }
+    
+    *node = (count == 1 ? nodes[0] : NULL);
+    free(nodes);
+    return 0;
+}
+
+// Parses a buffer that contains any number of top-level Kaleidoscope items
+// using a single scanner and parser. The buffer does not need to be
+// NUL-terminated.
+//
+// text   - The text containing the kaleidoscope program.
+// length - The number of bytes of text.
+// arena  - The arena to allocate nodes from or NULL to use the heap.
+// nodes  - The pointer to where the array of items should be returned. The
+//          array must be released with free().
+// count  - The pointer to where the number of items should be returned.
+//
+// Returns 0 if successful, otherwise returns -1.
+int kal_parse_program(const char *text, size_t length, kal_ast_arena *arena,
+                      kal_ast_node ***nodes, unsigned int *count)
+{
     yyscan_t scanner;
     yylex_init(&scanner);
-    YY_BUFFER_STATE buffer = yy_scan_string(text, scanner);
-    int rc = yyparse(scanner);
+    YY_BUFFER_STATE buffer = yy_scan_bytes(text, length, scanner);
+    int rc = kal_parse_scanner(scanner, arena, nodes, count);
     yy_delete_buffer(buffer, scanner);
     yylex_destroy(scanner);
+    return rc;
+}
+
+// Parses every top-level item from a scanner that has already been given its
+// input.
+//
+// scanner - The scanner.
+// arena   - The arena to allocate nodes from or NULL to use the heap.
+// nodes   - The pointer to where the array of items should be returned. The
+//           array must be released with free().
+// count   - The pointer to where the number of items should be returned.
+//
+// Returns 0 if successful, otherwise returns -1.
+static int kal_parse_scanner(yyscan_t scanner, kal_ast_arena *arena,
+                             kal_ast_node ***nodes, unsigned int *count)
+{
+    unsigned int i;
+    kal_parse_state state;
+    memset(&state, 0, sizeof(state));
+    state.arena = arena;
+    
+    // yydebug = 1;
     
-    // If parse was successful, return root node.
+    // Parse using Bison.
+    int rc = yyparse(scanner, &state);
+    
+    // If parse was successful, return the items.
     if(rc == 0) {
-        *node = root;
+        *nodes = state.items;
+        *count = state.item_count;
         return 0;
     }
-    // Otherwise return error.
+    // Otherwise clean up and return error.
     else {
+        if(arena == NULL) {
+            for(i=0; i<state.item_count; i++) {
+                kal_ast_node_free(state.items[i]);
+            }
+        }
+        free(state.items);
         return -1;
     }
 }
 
-// Frees an array and all the elements of the array.
+// Parses a file that contains any number of top-level Kaleidoscope items. The
+// file is memory mapped and scanned in place rather than copied into a
+// separate buffer first. Flex needs two NULs after the text, so the file is
+// mapped over zeroed memory that is two bytes longer; that way they are
+// there even when the file ends on a page boundary. The mapping is private
+// since the scanner marks the end of each token in the text as it goes.
 //
-// args - The array to free.
-// count - The number of elements in the array.
-void free_args(void **args, int count)
+// path  - The path to the file.
+// arena - The arena to allocate nodes from or NULL to use the heap.
+// nodes - The pointer to where the array of items should be returned. The
+//         array must be released with free().
+// count - The pointer to where the number of items should be returned.
+//
+// Returns 0 if successful, otherwise returns -1.
+int kal_parse_file(const char *path, kal_ast_arena *arena,
+                   kal_ast_node ***nodes, unsigned int *count)
 {
-    int i;
-    for(i=0; i<count; i++) {
-        free(args[i]);
+    int fd = open(path, O_RDONLY);
+    if(fd == -1) {
+        return -1;
+    }
+    
+    struct stat info;
+    if(fstat(fd, &info) == -1) {
+        close(fd);
+        return -1;
+    }
+    
+    // Empty files can't be mapped but are a valid (empty) program.
+    if(info.st_size == 0) {
+        close(fd);
+        *nodes = NULL;
+        *count = 0;
+        return 0;
+    }
+    
+    size_t length = info.st_size;
+    char *text = mmap(NULL, length + 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(text == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    if(mmap(text, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(text, length + 2);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    
+    yyscan_t scanner;
+    yylex_init(&scanner);
+    YY_BUFFER_STATE buffer = yy_scan_buffer(text, length + 2, scanner);
+    int rc = kal_parse_scanner(scanner, arena, nodes, count);
+    yy_delete_buffer(buffer, scanner);
+    yylex_destroy(scanner);
+    munmap(text, length + 2);
+    return rc;
+}
+
+// Appends a top-level item to the parse state or passes it to the state's
+// callback.
+//
+// state - The parse state.
+// node  - The item to append.
+void kal_parse_state_add(kal_parse_state *state, kal_ast_node *node)
+{
+    if(state->callback != NULL) {
+        state->callback(node, state->data);
+        return;
+    }
+    
+    if(state->item_count == state->item_capacity) {
+        state->item_capacity = (state->item_capacity == 0 ? 16 : state->item_capacity * 2);
+        state->items = realloc(state->items, sizeof(kal_ast_node*) * state->item_capacity);
     }
+    state->items[state->item_count++] = node;
+}
+
 
-    free(args);
+//--------------------------------------
+// Session
+//--------------------------------------
+
+// Creates a parse session. Input is fed to the session in chunks of any size
+// and each top-level item is passed to the callback as soon as the parser
+// has seen enough of the input to know the item is complete. Items may span
+// any number of chunks.
+//
+// Items are complete once the next token has been read, so an interactive
+// caller should end items with `;`. The parser holds no other nodes while the
+// callback runs, so the callback may reset the arena once it is done with
+// the item. Items parsed onto the heap are owned by the callback.
+//
+// arena    - The arena to allocate nodes from or NULL to use the heap.
+// callback - The function to call with each top-level item.
+// data     - The value to pass through to the callback.
+//
+// Returns a new session.
+kal_parse_session *kal_parse_session_create(kal_ast_arena *arena,
+                                            kal_parse_callback callback,
+                                            void *data)
+{
+    kal_parse_session *session = calloc(1, sizeof(kal_parse_session));
+    session->state.arena = arena;
+    session->state.callback = callback;
+    session->state.data = data;
+    yylex_init(&session->scanner);
+    session->parser = yypstate_new();
+    return session;
 }
+
+// Scans a range of complete tokens and pushes them to the parser. After a
+// syntax error the parser starts over and the rest of the broken item, up to
+// the next `;` or the end of input, is skipped so that the items after it
+// are still parsed. Skipping carries on into the next range if the `;`
+// hasn't been seen yet, so it doesn't matter how the input was split.
+//
+// session - The session.
+// text    - The text to scan. It must not end in the middle of a token.
+// length  - The number of bytes of text.
+// end     - Whether to push the end of input after the tokens.
+//
+// Returns 0 if successful, otherwise returns -1.
+static int kal_parse_session_push(kal_parse_session *session, const char *text,
+                                  size_t length, bool end)
+{
+    int token, status = YYPUSH_MORE, rc = 0;
+    YYSTYPE value;
+    
+    if(length > 0) {
+        YY_BUFFER_STATE buffer = yy_scan_bytes(text, length, session->scanner);
+        while((token = yylex(&value, session->scanner)) != 0) {
+            if(session->skipping) {
+                session->skipping = (token != TSEMICOLON);
+                continue;
+            }
+            status = yypush_parse(session->parser, token, &value, session->scanner, &session->state);
+            if(status != YYPUSH_MORE) {
+                yypstate_delete(session->parser);
+                session->parser = yypstate_new();
+                session->skipping = (token != TSEMICOLON);
+                status = YYPUSH_MORE;
+                rc = -1;
+            }
+        }
+        yy_delete_buffer(buffer, session->scanner);
+    }
+    
+    // Start over with a fresh parser at the end of input.
+    if(end) {
+        session->skipping = false;
+        status = yypush_parse(session->parser, 0, NULL, session->scanner, &session->state);
+        yypstate_delete(session->parser);
+        session->parser = yypstate_new();
+        if(status != 0) {
+            rc = -1;
+        }
+    }
+    
+    return rc;
+}
+
+// Feeds a chunk of input to a session. Whole tokens are scanned and pushed to
+// the parser right away; only a trailing token that may continue into the
+// next chunk is held back.
+//
+// session - The session.
+// text    - The chunk of input.
+// length  - The number of bytes in the chunk.
+//
+// Returns 0 if successful, otherwise returns -1 on a syntax error. Items
+// after the broken one are still parsed and the session can continue to be
+// used after an error.
+int kal_parse_session_feed(kal_parse_session *session, const char *text,
+                           size_t length)
+{
+    // Append the chunk to whatever was held back from the previous chunk.
+    if(session->pending_length + length > session->pending_capacity) {
+        session->pending_capacity = session->pending_length + length;
+        session->pending = realloc(session->pending, session->pending_capacity);
+    }
+    memcpy(session->pending + session->pending_length, text, length);
+    session->pending_length += length;
+    
+    // Tokens can't contain whitespace and `;` is never part of a longer token
+    // so everything up to the last of either can be scanned now.
+    size_t cut = session->pending_length;
+    while(cut > 0 && strchr(" \t\n;", session->pending[cut - 1]) == NULL) {
+        cut--;
+    }
+    
+    int rc = kal_parse_session_push(session, session->pending, cut, false);
+    
+    session->pending_length -= cut;
+    memmove(session->pending, session->pending + cut, session->pending_length);
+    
+    return rc;
+}
+
+// Signals the end of input to a session, which completes the final item. The
+// session can be fed new input afterward.
+//
+// session - The session.
+//
+// Returns 0 if successful, otherwise returns -1.
+int kal_parse_session_finish(kal_parse_session *session)
+{
+    int rc = kal_parse_session_push(session, session->pending, session->pending_length, true);
+    session->pending_length = 0;
+    return rc;
+}
+
+// Frees a parse session.
+//
+// session - The session to free.
+void kal_parse_session_free(kal_parse_session *session)
+{
+    if(!session) return;
+    
+    yypstate_delete(session->parser);
+    yylex_destroy(session->scanner);
+    free(session->pending);
+    free(session);
+}
\ No newline at end of file
@@ -0,0 +1,140 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "symbol.h"
+#include "uthash.h"
+
+
+//==============================================================================
+//
+// Definitions
+//
+//==============================================================================
+
+// The number of entries in each page of the reverse lookup.
+#define KAL_SYMBOL_PAGE_SIZE 1024
+
+// The maximum number of pages in the reverse lookup.
+#define KAL_SYMBOL_PAGE_COUNT 16384
+
+
+//==============================================================================
+//
+// Typedefs
+//
+//==============================================================================
+
+// Holds a single interned name. The name is stored inline after the entry.
+typedef struct kal_symbol_entry {
+    kal_symbol symbol;
+    size_t len;
+    UT_hash_handle hh;
+    char name[];
+} kal_symbol_entry;
+
+
+//==============================================================================
+//
+// Variables
+//
+//==============================================================================
+
+// The lookup from name to symbol.
+kal_symbol_entry *symbols = NULL;
+
+// The lookup from symbol to name. Entries are stored in fixed size pages that
+// never move so names can be read without taking the lock.
+kal_symbol_entry **symbol_pages[KAL_SYMBOL_PAGE_COUNT];
+
+// The number of interned names. It is only written under the lock and is
+// published with release ordering after the entry it covers, so readers that
+// load it with acquire ordering can see every entry below it.
+unsigned int symbol_count = 0;
+
+// Serializes interning so that contexts on different threads can share the
+// table.
+pthread_mutex_t symbol_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+//==============================================================================
+//
+// Functions
+//
+//==============================================================================
+
+// Interns a NUL-terminated name.
+//
+// name - The name to intern.
+//
+// Returns the symbol for the name or KAL_SYMBOL_NONE if the table is full.
+kal_symbol kal_symbol_intern(const char *name)
+{
+    return kal_symbol_intern_n(name, strlen(name));
+}
+
+// Interns a name of a given length. The name does not need to be
+// NUL-terminated so it can point directly into a scanner buffer; it is only
+// copied the first time it is seen.
+//
+// name - The name to intern.
+// len  - The number of bytes in the name.
+//
+// Returns the symbol for the name or KAL_SYMBOL_NONE if the table is full.
+kal_symbol kal_symbol_intern_n(const char *name, size_t len)
+{
+    pthread_mutex_lock(&symbol_mutex);
+
+    // Return the existing symbol if the name has been seen before.
+    kal_symbol_entry *entry = NULL;
+    HASH_FIND(hh, symbols, name, len, entry);
+    if(entry != NULL) {
+        pthread_mutex_unlock(&symbol_mutex);
+        return entry->symbol;
+    }
+
+    // Add a page to the reverse lookup if needed.
+    if(symbol_count == KAL_SYMBOL_PAGE_COUNT * KAL_SYMBOL_PAGE_SIZE) {
+        pthread_mutex_unlock(&symbol_mutex);
+        fprintf(stderr, "Too many symbols\n");
+        return KAL_SYMBOL_NONE;
+    }
+    unsigned int page = symbol_count / KAL_SYMBOL_PAGE_SIZE;
+    if(symbol_pages[page] == NULL) {
+        symbol_pages[page] = malloc(sizeof(kal_symbol_entry*) * KAL_SYMBOL_PAGE_SIZE);
+    }
+
+    // Copy the name into a new entry.
+    entry = malloc(sizeof(kal_symbol_entry) + len + 1);
+    entry->symbol = symbol_count;
+    entry->len = len;
+    memcpy(entry->name, name, len);
+    entry->name[len] = '\0';
+
+    symbol_pages[page][symbol_count % KAL_SYMBOL_PAGE_SIZE] = entry;
+    HASH_ADD_KEYPTR(hh, symbols, entry->name, entry->len, entry);
+    __atomic_store_n(&symbol_count, symbol_count + 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&symbol_mutex);
+    return entry->symbol;
+}
+
+// Retrieves the name for a symbol.
+//
+// symbol - The symbol.
+//
+// Returns the interned name or NULL if the symbol does not exist.
+const char *kal_symbol_name(kal_symbol symbol)
+{
+    if(symbol >= __atomic_load_n(&symbol_count, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return symbol_pages[symbol / KAL_SYMBOL_PAGE_SIZE][symbol % KAL_SYMBOL_PAGE_SIZE]->name;
+}
+
+// Returns the number of symbols that have been interned.
+unsigned int kal_symbol_count()
+{
+    return __atomic_load_n(&symbol_count, __ATOMIC_ACQUIRE);
+}
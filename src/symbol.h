@@ -0,0 +1,35 @@
+#ifndef _symbol_h
+#define _symbol_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+//==============================================================================
+//
+// Definitions
+//
+//==============================================================================
+
+// A stable identifier for an interned name. Two names are equal if and only
+// if their symbols are equal.
+typedef uint32_t kal_symbol;
+
+// A symbol that no name is ever interned as.
+#define KAL_SYMBOL_NONE UINT32_MAX
+
+
+//==============================================================================
+//
+// Functions
+//
+//==============================================================================
+
+kal_symbol kal_symbol_intern(const char *name);
+
+kal_symbol kal_symbol_intern_n(const char *name, size_t len);
+
+const char *kal_symbol_name(kal_symbol symbol);
+
+unsigned int kal_symbol_count();
+
+#endif
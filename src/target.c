@@ -0,0 +1,218 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "target.h"
+
+
+//==============================================================================
+//
+// Functions
+//
+//==============================================================================
+
+//--------------------------------------
+// Lifecycle
+//--------------------------------------
+
+// Creates a target for a CPU. The "host" CPU, which is also used when no
+// CPU is given, is the machine the compiler is running on and starts with
+// the features detected on it. Any other CPU starts with the features LLVM
+// knows it has.
+//
+// cpu      - The LLVM processor name or NULL for the host.
+// features - Changes to the CPU's features such as "+avx2,-avx512f". May be
+//            NULL.
+//
+// Returns a new target.
+kal_target *kal_target_create(const char *cpu, const char *features)
+{
+    kal_target *target = calloc(1, sizeof(kal_target));
+    if(features == NULL) {
+        features = "";
+    }
+
+    if(cpu == NULL || strcmp(cpu, KAL_TARGET_HOST) == 0) {
+        char *host_cpu = LLVMGetHostCPUName();
+        char *host_features = LLVMGetHostCPUFeatures();
+        target->cpu = malloc(strlen(host_cpu) + 1);
+        strcpy(target->cpu, host_cpu);
+        target->features = malloc(strlen(host_features) + strlen(features) + 2);
+        strcpy(target->features, host_features);
+        if(host_features[0] != '\0' && features[0] != '\0') {
+            strcat(target->features, ",");
+        }
+        strcat(target->features, features);
+        LLVMDisposeMessage(host_cpu);
+        LLVMDisposeMessage(host_features);
+    }
+    else {
+        target->cpu = malloc(strlen(cpu) + 1);
+        strcpy(target->cpu, cpu);
+        target->features = malloc(strlen(features) + 1);
+        strcpy(target->features, features);
+    }
+
+    return target;
+}
+
+// Creates a copy of a target.
+//
+// target - The target to copy. May be NULL.
+//
+// Returns a new target or NULL if there was nothing to copy.
+kal_target *kal_target_copy(kal_target *target)
+{
+    if(target == NULL) {
+        return NULL;
+    }
+    return kal_target_create(target->cpu, target->features);
+}
+
+// Frees a target.
+//
+// target - The target to free.
+void kal_target_free(kal_target *target)
+{
+    if(!target) return;
+    free(target->cpu);
+    free(target->features);
+    free(target);
+}
+
+
+//--------------------------------------
+// Features
+//--------------------------------------
+
+// Finds the last change the feature list makes to a feature.
+//
+// target - The target.
+// name   - The feature name without a sign, such as "avx2".
+//
+// Returns 1 if it is turned on, -1 if it is turned off and 0 if the list
+// doesn't mention it.
+static int kal_target_feature(kal_target *target, const char *name)
+{
+    int state = 0;
+    size_t length = strlen(name);
+    const char *entry = target->features;
+
+    while(entry[0] != '\0') {
+        size_t entry_length = strcspn(entry, ",");
+        if(entry_length == length + 1 && strncmp(entry + 1, name, length) == 0) {
+            state = (entry[0] == '-' ? -1 : 1);
+        }
+        entry += entry_length;
+        if(entry[0] == ',') {
+            entry++;
+        }
+    }
+
+    return state;
+}
+
+// Checks whether the feature list turns on a feature. Features that a named
+// CPU has without them being listed aren't known here.
+//
+// target - The target.
+// name   - The feature name without a sign, such as "avx2".
+//
+// Returns true if the feature is on.
+bool kal_target_has_feature(kal_target *target, const char *name)
+{
+    return kal_target_feature(target, name) > 0;
+}
+
+// Works out how many rows a batch should run at once. This is a whole
+// vector register of doubles.
+//
+// target - The target.
+//
+// Returns 8 for targets with AVX-512 and 4 otherwise.
+unsigned int kal_target_batch_lanes(kal_target *target)
+{
+    return (kal_target_has_feature(target, "avx512f") ? 8 : 4);
+}
+
+
+//--------------------------------------
+// Code Generation
+//--------------------------------------
+
+// Adds the attributes that make the backend generate a function for the
+// target whatever target machine the function is compiled with.
+//
+// target - The target or NULL to leave it to the target machine.
+// llvm   - The LLVM context.
+// func   - The function.
+void kal_target_add_attributes(kal_target *target, LLVMContextRef llvm,
+                               LLVMValueRef func)
+{
+    if(target == NULL) {
+        return;
+    }
+
+    LLVMAddAttributeAtIndex(func, LLVMAttributeFunctionIndex,
+        LLVMCreateStringAttribute(llvm, "target-cpu", 10, target->cpu, strlen(target->cpu)));
+    if(target->features[0] != '\0') {
+        LLVMAddAttributeAtIndex(func, LLVMAttributeFunctionIndex,
+            LLVMCreateStringAttribute(llvm, "target-features", 15, target->features, strlen(target->features)));
+    }
+}
+
+// Creates a target machine for the host's architecture.
+//
+// target     - The target or NULL for the architecture's generic CPU.
+// level      - The code generation optimization level.
+// reloc      - The relocation model.
+// code_model - The code model.
+//
+// Returns a new target machine or NULL if the host isn't supported.
+LLVMTargetMachineRef kal_target_create_machine(kal_target *target,
+                                               LLVMCodeGenOptLevel level,
+                                               LLVMRelocMode reloc,
+                                               LLVMCodeModel code_model)
+{
+    char *msg = NULL;
+    LLVMTargetRef llvm_target;
+
+    char *triple = LLVMGetDefaultTargetTriple();
+    if(LLVMGetTargetFromTriple(triple, &llvm_target, &msg) != 0) {
+        fprintf(stderr, "%s\n", msg);
+        LLVMDisposeMessage(msg);
+        LLVMDisposeMessage(triple);
+        return NULL;
+    }
+
+    LLVMTargetMachineRef machine = LLVMCreateTargetMachine(llvm_target, triple,
+        (target != NULL ? target->cpu : ""), (target != NULL ? target->features : ""),
+        level, reloc, code_model);
+    LLVMDisposeMessage(triple);
+
+    return machine;
+}
+
+
+//--------------------------------------
+// Reporting
+//--------------------------------------
+
+// Writes a line saying which CPU code is generated for, the vector features
+// the feature list turns on or off and how wide batches are.
+//
+// target - The target.
+// file   - The file to write to.
+void kal_target_report(kal_target *target, FILE *file)
+{
+    unsigned int i;
+    const char *names[] = {"avx", "avx2", "fma", "avx512f"};
+
+    fprintf(file, "Target: %s", target->cpu);
+    for(i=0; i<sizeof(names)/sizeof(*names); i++) {
+        int state = kal_target_feature(target, names[i]);
+        if(state != 0) {
+            fprintf(file, " %c%s", (state > 0 ? '+' : '-'), names[i]);
+        }
+    }
+    fprintf(file, ", %u batch lanes\n", kal_target_batch_lanes(target));
+}
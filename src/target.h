@@ -0,0 +1,59 @@
+#ifndef _target_h
+#define _target_h
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <llvm-c/Core.h>
+#include <llvm-c/TargetMachine.h>
+
+//==============================================================================
+//
+// Definitions
+//
+//==============================================================================
+
+// The CPU name that stands for the machine the compiler is running on.
+#define KAL_TARGET_HOST "host"
+
+
+//==============================================================================
+//
+// Typedefs
+//
+//==============================================================================
+
+// The CPU that code is generated for. `cpu` is an LLVM processor name such
+// as "skylake-avx512" and `features` is a comma separated list of changes to
+// that processor's features such as "+avx2,-avx512f". Later entries in the
+// list win over earlier ones.
+typedef struct kal_target {
+    char *cpu;
+    char *features;
+} kal_target;
+
+
+//==============================================================================
+//
+// Functions
+//
+//==============================================================================
+
+kal_target *kal_target_create(const char *cpu, const char *features);
+
+kal_target *kal_target_copy(kal_target *target);
+
+void kal_target_free(kal_target *target);
+
+bool kal_target_has_feature(kal_target *target, const char *name);
+
+unsigned int kal_target_batch_lanes(kal_target *target);
+
+void kal_target_add_attributes(kal_target *target, LLVMContextRef llvm,
+    LLVMValueRef func);
+
+LLVMTargetMachineRef kal_target_create_machine(kal_target *target,
+    LLVMCodeGenOptLevel level, LLVMRelocMode reloc, LLVMCodeModel code_model);
+
+void kal_target_report(kal_target *target, FILE *file);
+
+#endif
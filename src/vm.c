@@ -0,0 +1,941 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dlfcn.h>
+
+#include "vm.h"
+
+
+//==============================================================================
+//
+// Typedefs
+//
+//==============================================================================
+
+// A local variable and the register that holds it.
+typedef struct kal_vm_local {
+    kal_symbol name;
+    unsigned int reg;
+} kal_vm_local;
+
+// Holds the state used while compiling a single function. Arguments live in
+// the first registers and temporaries are allocated above them like a stack.
+// Local variables take the next free register when they come into scope.
+typedef struct kal_vm_compiler {
+    kal_vm *vm;
+    kal_vm_function *function;
+    kal_symbol *args;
+    unsigned int arg_count;
+    kal_vm_local *locals;
+    unsigned int local_count;
+    unsigned int local_capacity;
+    unsigned int top;
+} kal_vm_compiler;
+
+
+//==============================================================================
+//
+// Globals
+//
+//==============================================================================
+
+// The instruction names used when dumping bytecode.
+static const char *kal_vm_opcode_names[] = {
+    "LOADK", "MOVE", "ADD", "SUB", "MUL", "DIV", "LT", "LE", "EQ", "NE",
+    "JMP", "JMPF", "CALL", "RET"
+};
+
+
+//==============================================================================
+//
+// Functions
+//
+//==============================================================================
+
+int kal_vm_compile_expr(kal_vm_compiler *compiler, kal_ast_node *node);
+
+//--------------------------------------
+// Lifecycle
+//--------------------------------------
+
+// Creates a virtual machine with an empty function table.
+//
+// Returns a new VM.
+kal_vm *kal_vm_create()
+{
+    kal_vm *vm = calloc(1, sizeof(kal_vm));
+    vm->stack = malloc(sizeof(double) * KAL_VM_STACK_SIZE);
+    vm->libm = dlopen(KAL_VM_LIBM, RTLD_LAZY);
+    return vm;
+}
+
+// Frees a function and its bytecode.
+//
+// function - The function to free.
+void kal_vm_function_free(kal_vm_function *function)
+{
+    if(!function) return;
+    free(function->code);
+    free(function->constants);
+    free(function);
+}
+
+// Frees a virtual machine and every function in it.
+//
+// vm - The VM to free.
+void kal_vm_free(kal_vm *vm)
+{
+    unsigned int i;
+    if(!vm) return;
+
+    for(i=0; i<vm->function_count; i++) {
+        kal_vm_function_free(vm->functions[i]);
+    }
+    free(vm->functions);
+    free(vm->function_index);
+    free(vm->stack);
+    if(vm->libm != NULL) {
+        dlclose(vm->libm);
+    }
+    free(vm);
+}
+
+
+//--------------------------------------
+// Function Table
+//--------------------------------------
+
+// Retrieves a function by name.
+//
+// vm   - The VM.
+// name - The symbol for the function name.
+//
+// Returns the function or NULL if it hasn't been declared.
+kal_vm_function *kal_vm_get_function(kal_vm *vm, kal_symbol name)
+{
+    if(name >= vm->function_index_capacity || vm->function_index[name] == 0) {
+        return NULL;
+    }
+    return vm->functions[vm->function_index[name] - 1];
+}
+
+// Retrieves the index of a function in the function table.
+//
+// vm   - The VM.
+// name - The symbol for the function name.
+//
+// Returns the index of the function.
+uint32_t kal_vm_get_function_index(kal_vm *vm, kal_symbol name)
+{
+    return vm->function_index[name] - 1;
+}
+
+// Declares a function or verifies an existing declaration.
+//
+// vm        - The VM.
+// name      - The symbol for the function name.
+// arg_count - The number of arguments.
+//
+// Returns the function or NULL if the declaration conflicts.
+kal_vm_function *kal_vm_declare(kal_vm *vm, kal_symbol name,
+                                unsigned int arg_count)
+{
+    kal_vm_function *function = kal_vm_get_function(vm, name);
+    if(function != NULL) {
+        if(function->arg_count != arg_count) {
+            fprintf(stderr, "Existing function exists with different parameter count\n");
+            return NULL;
+        }
+        return function;
+    }
+
+    if(name >= vm->function_index_capacity) {
+        unsigned int capacity = (vm->function_index_capacity == 0 ? 64 : vm->function_index_capacity);
+        while(capacity <= name) {
+            capacity *= 2;
+        }
+        vm->function_index = realloc(vm->function_index, sizeof(uint32_t) * capacity);
+        memset(&vm->function_index[vm->function_index_capacity], 0,
+            sizeof(uint32_t) * (capacity - vm->function_index_capacity));
+        vm->function_index_capacity = capacity;
+    }
+    if(vm->function_count == vm->function_capacity) {
+        vm->function_capacity = (vm->function_capacity == 0 ? 16 : vm->function_capacity * 2);
+        vm->functions = realloc(vm->functions, sizeof(kal_vm_function*) * vm->function_capacity);
+    }
+
+    function = calloc(1, sizeof(kal_vm_function));
+    function->name = name;
+    function->arg_count = arg_count;
+    vm->functions[vm->function_count++] = function;
+    vm->function_index[name] = vm->function_count;
+
+    return function;
+}
+
+
+//--------------------------------------
+// Compiler
+//--------------------------------------
+
+// Appends an instruction to the function being compiled.
+//
+// compiler - The compiler.
+// op       - The opcode.
+// a        - The first register operand.
+// b        - The second register operand.
+// c        - The third register operand.
+// k        - The constant, jump target or function index.
+//
+// Returns the index of the instruction.
+unsigned int kal_vm_emit(kal_vm_compiler *compiler, kal_vm_opcode_e op,
+                         unsigned int a, unsigned int b, unsigned int c,
+                         uint32_t k)
+{
+    kal_vm_function *function = compiler->function;
+    if(function->code_count == function->code_capacity) {
+        function->code_capacity = (function->code_capacity == 0 ? 16 : function->code_capacity * 2);
+        function->code = realloc(function->code, sizeof(kal_vm_instr) * function->code_capacity);
+    }
+
+    kal_vm_instr *instr = &function->code[function->code_count];
+    instr->op = op;
+    instr->a = a;
+    instr->b = b;
+    instr->c = c;
+    instr->k = k;
+    return function->code_count++;
+}
+
+// Allocates the next free register.
+//
+// compiler - The compiler.
+//
+// Returns the register or -1 if the function has run out.
+int kal_vm_alloc_register(kal_vm_compiler *compiler)
+{
+    if(compiler->top >= KAL_VM_MAX_REGISTERS) {
+        fprintf(stderr, "Expression is too complex\n");
+        return -1;
+    }
+
+    int reg = compiler->top++;
+    if(compiler->top > compiler->function->register_count) {
+        compiler->function->register_count = compiler->top;
+    }
+    return reg;
+}
+
+// Loads a constant into a new register.
+//
+// compiler - The compiler.
+// value    - The constant.
+//
+// Returns the register holding the value or -1 on error.
+int kal_vm_load_constant(kal_vm_compiler *compiler, double value)
+{
+    kal_vm_function *function = compiler->function;
+    if(function->constant_count == function->constant_capacity) {
+        function->constant_capacity = (function->constant_capacity == 0 ? 8 : function->constant_capacity * 2);
+        function->constants = realloc(function->constants, sizeof(double) * function->constant_capacity);
+    }
+    function->constants[function->constant_count] = value;
+
+    int reg = kal_vm_alloc_register(compiler);
+    if(reg == -1) {
+        return -1;
+    }
+    kal_vm_emit(compiler, KAL_VM_LOADK, reg, 0, 0, function->constant_count++);
+    return reg;
+}
+
+// Compiles a number into a constant load.
+//
+// compiler - The compiler.
+// node     - The number node.
+//
+// Returns the register holding the value or -1 on error.
+int kal_vm_compile_number(kal_vm_compiler *compiler, kal_ast_node *node)
+{
+    return kal_vm_load_constant(compiler, node->number.value);
+}
+
+// Brings a local variable into scope in a register.
+//
+// compiler - The compiler.
+// name     - The variable name.
+// reg      - The register holding the variable.
+void kal_vm_add_local(kal_vm_compiler *compiler, kal_symbol name,
+                      unsigned int reg)
+{
+    if(compiler->local_count == compiler->local_capacity) {
+        compiler->local_capacity = (compiler->local_capacity == 0 ? 8 : compiler->local_capacity * 2);
+        compiler->locals = realloc(compiler->locals, sizeof(kal_vm_local) * compiler->local_capacity);
+    }
+    compiler->locals[compiler->local_count].name = name;
+    compiler->locals[compiler->local_count].reg = reg;
+    compiler->local_count++;
+}
+
+// Finds the register that holds a variable. Locals shadow arguments and the
+// most recent local or last argument with a given name wins, as it does in
+// codegen.
+//
+// compiler - The compiler.
+// name     - The variable name.
+//
+// Returns the register or -1 if there is no such variable.
+int kal_vm_lookup(kal_vm_compiler *compiler, kal_symbol name)
+{
+    unsigned int i;
+    for(i=compiler->local_count; i>0; i--) {
+        if(compiler->locals[i-1].name == name) {
+            return compiler->locals[i-1].reg;
+        }
+    }
+    for(i=compiler->arg_count; i>0; i--) {
+        if(compiler->args[i-1] == name) {
+            return i-1;
+        }
+    }
+    return -1;
+}
+
+// Checks whether an expression assigns to any variable.
+//
+// node - The expression.
+//
+// Returns true if there is an assignment anywhere in the expression.
+static bool kal_vm_has_assign(kal_ast_node *node)
+{
+    unsigned int i;
+
+    switch(node->type) {
+        case KAL_AST_TYPE_ASSIGN: {
+            return true;
+        }
+        case KAL_AST_TYPE_BINARY_EXPR: {
+            return kal_vm_has_assign(node->binary_expr.lhs) ||
+                kal_vm_has_assign(node->binary_expr.rhs);
+        }
+        case KAL_AST_TYPE_CALL: {
+            for(i=0; i<node->call.arg_count; i++) {
+                if(kal_vm_has_assign(node->call.args[i])) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        case KAL_AST_TYPE_IF_EXPR: {
+            return kal_vm_has_assign(node->if_expr.condition) ||
+                kal_vm_has_assign(node->if_expr.true_expr) ||
+                kal_vm_has_assign(node->if_expr.false_expr);
+        }
+        case KAL_AST_TYPE_FOR_EXPR: {
+            return kal_vm_has_assign(node->for_expr.start) ||
+                kal_vm_has_assign(node->for_expr.condition) ||
+                (node->for_expr.step != NULL && kal_vm_has_assign(node->for_expr.step)) ||
+                kal_vm_has_assign(node->for_expr.body);
+        }
+        case KAL_AST_TYPE_VAR_EXPR: {
+            for(i=0; i<node->var_expr.var_count; i++) {
+                if(node->var_expr.inits[i] != NULL && kal_vm_has_assign(node->var_expr.inits[i])) {
+                    return true;
+                }
+            }
+            return kal_vm_has_assign(node->var_expr.body);
+        }
+        default: {
+            return false;
+        }
+    }
+}
+
+// Resolves a variable to the register that holds it.
+//
+// compiler - The compiler.
+// node     - The variable node.
+//
+// Returns the register holding the value or -1 on error.
+int kal_vm_compile_variable(kal_vm_compiler *compiler, kal_ast_node *node)
+{
+    int reg = kal_vm_lookup(compiler, node->variable.name);
+    if(reg == -1) {
+        fprintf(stderr, "Unknown variable: %s\n", kal_symbol_name(node->variable.name));
+    }
+    return reg;
+}
+
+// Compiles a binary expression. The result reuses the first register that
+// the operands allocated. A left operand that is a variable is copied first
+// if the right operand assigns to anything. Greater-than comparisons are
+// less-than comparisons with the operands swapped.
+//
+// compiler - The compiler.
+// node     - The binary expression node.
+//
+// Returns the register holding the value or -1 on error.
+int kal_vm_compile_binary_expr(kal_vm_compiler *compiler, kal_ast_node *node)
+{
+    bool swap = false;
+    unsigned int top = compiler->top;
+    int lhs = kal_vm_compile_expr(compiler, node->binary_expr.lhs);
+    if(lhs == -1) {
+        return -1;
+    }
+
+    // Keep the left operand's value if the right operand could change the
+    // variable that holds it.
+    if((unsigned int)lhs < top && kal_vm_has_assign(node->binary_expr.rhs)) {
+        int copy = kal_vm_alloc_register(compiler);
+        if(copy == -1) {
+            return -1;
+        }
+        kal_vm_emit(compiler, KAL_VM_MOVE, copy, lhs, 0, 0);
+        lhs = copy;
+    }
+
+    int rhs = kal_vm_compile_expr(compiler, node->binary_expr.rhs);
+    if(rhs == -1) {
+        return -1;
+    }
+
+    kal_vm_opcode_e op;
+    switch(node->binary_expr.operator) {
+        case KAL_BINOP_PLUS: op = KAL_VM_ADD; break;
+        case KAL_BINOP_MINUS: op = KAL_VM_SUB; break;
+        case KAL_BINOP_MUL: op = KAL_VM_MUL; break;
+        case KAL_BINOP_DIV: op = KAL_VM_DIV; break;
+        case KAL_BINOP_LT: op = KAL_VM_LT; break;
+        case KAL_BINOP_LE: op = KAL_VM_LE; break;
+        case KAL_BINOP_GT: op = KAL_VM_LT; swap = true; break;
+        case KAL_BINOP_GE: op = KAL_VM_LE; swap = true; break;
+        case KAL_BINOP_EQ: op = KAL_VM_EQ; break;
+        case KAL_BINOP_NE: op = KAL_VM_NE; break;
+        default: return -1;
+    }
+
+    compiler->top = top;
+    int reg = kal_vm_alloc_register(compiler);
+    if(reg == -1) {
+        return -1;
+    }
+    kal_vm_emit(compiler, op, reg, (swap ? rhs : lhs), (swap ? lhs : rhs), 0);
+    return reg;
+}
+
+// Compiles a call. Arguments are evaluated into consecutive registers which
+// become the first registers of the callee's frame.
+//
+// compiler - The compiler.
+// node     - The call node.
+//
+// Returns the register holding the value or -1 on error.
+int kal_vm_compile_call(kal_vm_compiler *compiler, kal_ast_node *node)
+{
+    unsigned int i;
+
+    kal_vm_function *callee = kal_vm_get_function(compiler->vm, node->call.name);
+    if(callee == NULL) {
+        fprintf(stderr, "Unknown function: %s\n", kal_symbol_name(node->call.name));
+        return -1;
+    }
+    if(callee->arg_count != node->call.arg_count) {
+        fprintf(stderr, "Incorrect number of arguments: %s\n", kal_symbol_name(node->call.name));
+        return -1;
+    }
+
+    unsigned int base = compiler->top;
+    for(i=0; i<node->call.arg_count; i++) {
+        compiler->top = base + i;
+        int reg = kal_vm_compile_expr(compiler, node->call.args[i]);
+        if(reg == -1) {
+            return -1;
+        }
+
+        compiler->top = base + i;
+        if(kal_vm_alloc_register(compiler) == -1) {
+            return -1;
+        }
+        if((unsigned int)reg != base + i) {
+            kal_vm_emit(compiler, KAL_VM_MOVE, base + i, reg, 0, 0);
+        }
+    }
+
+    compiler->top = base;
+    if(kal_vm_alloc_register(compiler) == -1) {
+        return -1;
+    }
+    kal_vm_emit(compiler, KAL_VM_CALL, base, node->call.arg_count, 0,
+        kal_vm_get_function_index(compiler->vm, node->call.name));
+    return base;
+}
+
+// Compiles an if expression. Both branches leave their value in the same
+// register.
+//
+// compiler - The compiler.
+// node     - The if expression node.
+//
+// Returns the register holding the value or -1 on error.
+int kal_vm_compile_if_expr(kal_vm_compiler *compiler, kal_ast_node *node)
+{
+    int reg = kal_vm_alloc_register(compiler);
+    int condition = (reg == -1 ? -1 : kal_vm_compile_expr(compiler, node->if_expr.condition));
+    if(condition == -1) {
+        return -1;
+    }
+    unsigned int jump_false = kal_vm_emit(compiler, KAL_VM_JMPF, 0, condition, 0, 0);
+
+    compiler->top = reg + 1;
+    int true_value = kal_vm_compile_expr(compiler, node->if_expr.true_expr);
+    if(true_value == -1) {
+        return -1;
+    }
+    if(true_value != reg) {
+        kal_vm_emit(compiler, KAL_VM_MOVE, reg, true_value, 0, 0);
+    }
+    unsigned int jump_end = kal_vm_emit(compiler, KAL_VM_JMP, 0, 0, 0, 0);
+
+    compiler->function->code[jump_false].k = compiler->function->code_count;
+    compiler->top = reg + 1;
+    int false_value = kal_vm_compile_expr(compiler, node->if_expr.false_expr);
+    if(false_value == -1) {
+        return -1;
+    }
+    if(false_value != reg) {
+        kal_vm_emit(compiler, KAL_VM_MOVE, reg, false_value, 0, 0);
+    }
+
+    compiler->function->code[jump_end].k = compiler->function->code_count;
+    compiler->top = reg + 1;
+    return reg;
+}
+
+// Compiles a for expression. The loop variable gets its own register which
+// also holds the result of 0 once the loop is done.
+//
+// compiler - The compiler.
+// node     - The for expression node.
+//
+// Returns the register holding the value or -1 on error.
+int kal_vm_compile_for_expr(kal_vm_compiler *compiler, kal_ast_node *node)
+{
+    unsigned int local_count = compiler->local_count;
+    int reg = kal_vm_alloc_register(compiler);
+    int start = (reg == -1 ? -1 : kal_vm_compile_expr(compiler, node->for_expr.start));
+    if(start == -1) {
+        return -1;
+    }
+    if(start != reg) {
+        kal_vm_emit(compiler, KAL_VM_MOVE, reg, start, 0, 0);
+    }
+    kal_vm_add_local(compiler, node->for_expr.name, reg);
+
+    // Check the condition before each pass.
+    unsigned int loop_start = compiler->function->code_count;
+    compiler->top = reg + 1;
+    int condition = kal_vm_compile_expr(compiler, node->for_expr.condition);
+    if(condition == -1) {
+        return -1;
+    }
+    unsigned int jump_end = kal_vm_emit(compiler, KAL_VM_JMPF, 0, condition, 0, 0);
+
+    // Run the body and step the variable.
+    compiler->top = reg + 1;
+    if(kal_vm_compile_expr(compiler, node->for_expr.body) == -1) {
+        return -1;
+    }
+    compiler->top = reg + 1;
+    int step = (node->for_expr.step != NULL ?
+        kal_vm_compile_expr(compiler, node->for_expr.step) :
+        kal_vm_load_constant(compiler, 1));
+    if(step == -1) {
+        return -1;
+    }
+    kal_vm_emit(compiler, KAL_VM_ADD, reg, reg, step, 0);
+    kal_vm_emit(compiler, KAL_VM_JMP, 0, 0, 0, loop_start);
+
+    compiler->function->code[jump_end].k = compiler->function->code_count;
+    compiler->local_count = local_count;
+    compiler->top = reg;
+    return kal_vm_load_constant(compiler, 0);
+}
+
+// Compiles a var expression. Each variable gets the next register and the
+// body's value is moved into a register below them so they can be freed.
+//
+// compiler - The compiler.
+// node     - The var expression node.
+//
+// Returns the register holding the value or -1 on error.
+int kal_vm_compile_var_expr(kal_vm_compiler *compiler, kal_ast_node *node)
+{
+    unsigned int i;
+    unsigned int local_count = compiler->local_count;
+
+    int result = kal_vm_alloc_register(compiler);
+    if(result == -1) {
+        return -1;
+    }
+    for(i=0; i<node->var_expr.var_count; i++) {
+        int reg = kal_vm_alloc_register(compiler);
+        if(reg == -1) {
+            return -1;
+        }
+
+        int value = (node->var_expr.inits[i] != NULL ?
+            kal_vm_compile_expr(compiler, node->var_expr.inits[i]) :
+            kal_vm_load_constant(compiler, 0));
+        if(value == -1) {
+            return -1;
+        }
+        if(value != reg) {
+            kal_vm_emit(compiler, KAL_VM_MOVE, reg, value, 0, 0);
+        }
+        compiler->top = reg + 1;
+        kal_vm_add_local(compiler, node->var_expr.names[i], reg);
+    }
+
+    int body = kal_vm_compile_expr(compiler, node->var_expr.body);
+    if(body == -1) {
+        return -1;
+    }
+    kal_vm_emit(compiler, KAL_VM_MOVE, result, body, 0, 0);
+
+    compiler->local_count = local_count;
+    compiler->top = result + 1;
+    return result;
+}
+
+// Compiles an assignment by moving the value into the variable's register.
+//
+// compiler - The compiler.
+// node     - The assignment node.
+//
+// Returns the register holding the value or -1 on error.
+int kal_vm_compile_assign(kal_vm_compiler *compiler, kal_ast_node *node)
+{
+    int value = kal_vm_compile_expr(compiler, node->assign.value);
+    if(value == -1) {
+        return -1;
+    }
+
+    int reg = kal_vm_lookup(compiler, node->assign.name);
+    if(reg == -1) {
+        fprintf(stderr, "Unknown variable: %s\n", kal_symbol_name(node->assign.name));
+        return -1;
+    }
+    if(value != reg) {
+        kal_vm_emit(compiler, KAL_VM_MOVE, reg, value, 0, 0);
+    }
+    return value;
+}
+
+// Compiles an expression.
+//
+// compiler - The compiler.
+// node     - The expression node.
+//
+// Returns the register holding the value or -1 on error.
+int kal_vm_compile_expr(kal_vm_compiler *compiler, kal_ast_node *node)
+{
+    switch(node->type) {
+        case KAL_AST_TYPE_NUMBER: return kal_vm_compile_number(compiler, node);
+        case KAL_AST_TYPE_VARIABLE: return kal_vm_compile_variable(compiler, node);
+        case KAL_AST_TYPE_BINARY_EXPR: return kal_vm_compile_binary_expr(compiler, node);
+        case KAL_AST_TYPE_CALL: return kal_vm_compile_call(compiler, node);
+        case KAL_AST_TYPE_IF_EXPR: return kal_vm_compile_if_expr(compiler, node);
+        case KAL_AST_TYPE_FOR_EXPR: return kal_vm_compile_for_expr(compiler, node);
+        case KAL_AST_TYPE_VAR_EXPR: return kal_vm_compile_var_expr(compiler, node);
+        case KAL_AST_TYPE_ASSIGN: return kal_vm_compile_assign(compiler, node);
+        default: return -1;
+    }
+}
+
+// Compiles a function body into a function's bytecode.
+//
+// vm       - The VM.
+// function - The function to compile into.
+// args     - The argument names.
+// body     - The body expression.
+//
+// Returns 0 if successful, otherwise returns -1.
+int kal_vm_compile_function(kal_vm *vm, kal_vm_function *function,
+                            kal_symbol *args, kal_ast_node *body)
+{
+    kal_vm_compiler compiler;
+    compiler.vm = vm;
+    compiler.function = function;
+    compiler.args = args;
+    compiler.arg_count = function->arg_count;
+    compiler.locals = NULL;
+    compiler.local_count = 0;
+    compiler.local_capacity = 0;
+    compiler.top = function->arg_count;
+    function->register_count = (function->arg_count > 0 ? function->arg_count : 1);
+
+    int reg = kal_vm_compile_expr(&compiler, body);
+    free(compiler.locals);
+    if(reg == -1) {
+        function->code_count = 0;
+        function->constant_count = 0;
+        return -1;
+    }
+    kal_vm_emit(&compiler, KAL_VM_RET, 0, reg, 0, 0);
+    return 0;
+}
+
+
+//--------------------------------------
+// Interpreter
+//--------------------------------------
+
+// Calls an extern through the host process. The symbol is looked up the
+// first time the extern is called, falling back to the math library when
+// the process doesn't already have it.
+//
+// vm       - The VM.
+// function - The extern.
+// args     - The arguments.
+// result   - Where the return value is stored.
+//
+// Returns 0 if successful, otherwise returns -1.
+int kal_vm_call_native(kal_vm *vm, kal_vm_function *function, double *args,
+                       double *result)
+{
+    if(function->native == NULL) {
+        function->native = dlsym(RTLD_DEFAULT, kal_symbol_name(function->name));
+        if(function->native == NULL && vm->libm != NULL) {
+            function->native = dlsym(vm->libm, kal_symbol_name(function->name));
+        }
+        if(function->native == NULL) {
+            fprintf(stderr, "Unknown extern: %s\n", kal_symbol_name(function->name));
+            return -1;
+        }
+    }
+
+    void *fp = function->native;
+    switch(function->arg_count) {
+        case 0: *result = ((double (*)())fp)(); break;
+        case 1: *result = ((double (*)(double))fp)(args[0]); break;
+        case 2: *result = ((double (*)(double, double))fp)(args[0], args[1]); break;
+        case 3: *result = ((double (*)(double, double, double))fp)(args[0], args[1], args[2]); break;
+        case 4: *result = ((double (*)(double, double, double, double))fp)(args[0], args[1], args[2], args[3]); break;
+        case 5: *result = ((double (*)(double, double, double, double, double))fp)(args[0], args[1], args[2], args[3], args[4]); break;
+        case 6: *result = ((double (*)(double, double, double, double, double, double))fp)(args[0], args[1], args[2], args[3], args[4], args[5]); break;
+        default: {
+            fprintf(stderr, "Too many arguments for extern: %s\n", kal_symbol_name(function->name));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Runs a function's bytecode. Dispatch uses a computed goto per instruction
+// so each handler jumps straight to the next one.
+//
+// vm       - The VM.
+// function - The function to run.
+// regs     - The function's registers, with the arguments already in place.
+// result   - Where the return value is stored.
+//
+// Returns 0 if successful, otherwise returns -1.
+int kal_vm_execute(kal_vm *vm, kal_vm_function *function, double *regs,
+                   double *result)
+{
+    static void *labels[] = {
+        &&op_loadk, &&op_move, &&op_add, &&op_sub, &&op_mul, &&op_div,
+        &&op_lt, &&op_le, &&op_eq, &&op_ne, &&op_jmp, &&op_jmpf, &&op_call,
+        &&op_ret
+    };
+
+    kal_vm_instr *code = function->code;
+    kal_vm_instr *ip = code;
+    double *constants = function->constants;
+
+    #define KAL_VM_DISPATCH() goto *labels[ip->op]
+    #define KAL_VM_NEXT() ip++; KAL_VM_DISPATCH()
+
+    KAL_VM_DISPATCH();
+
+op_loadk:
+    regs[ip->a] = constants[ip->k];
+    KAL_VM_NEXT();
+
+op_move:
+    regs[ip->a] = regs[ip->b];
+    KAL_VM_NEXT();
+
+op_add:
+    regs[ip->a] = regs[ip->b] + regs[ip->c];
+    KAL_VM_NEXT();
+
+op_sub:
+    regs[ip->a] = regs[ip->b] - regs[ip->c];
+    KAL_VM_NEXT();
+
+op_mul:
+    regs[ip->a] = regs[ip->b] * regs[ip->c];
+    KAL_VM_NEXT();
+
+op_div:
+    regs[ip->a] = regs[ip->b] / regs[ip->c];
+    KAL_VM_NEXT();
+
+op_lt:
+    regs[ip->a] = (regs[ip->b] < regs[ip->c]);
+    KAL_VM_NEXT();
+
+op_le:
+    regs[ip->a] = (regs[ip->b] <= regs[ip->c]);
+    KAL_VM_NEXT();
+
+op_eq:
+    regs[ip->a] = (regs[ip->b] == regs[ip->c]);
+    KAL_VM_NEXT();
+
+op_ne:
+    regs[ip->a] = (regs[ip->b] != regs[ip->c]);
+    KAL_VM_NEXT();
+
+op_jmp:
+    ip = code + ip->k;
+    KAL_VM_DISPATCH();
+
+op_jmpf:
+    // Matches codegen's ordered not-equal test so NaN is false.
+    if(!(regs[ip->b] < 0 || regs[ip->b] > 0)) {
+        ip = code + ip->k;
+        KAL_VM_DISPATCH();
+    }
+    KAL_VM_NEXT();
+
+op_call: {
+    kal_vm_function *callee = vm->functions[ip->k];
+    double *frame = regs + ip->a;
+    if(callee->code_count > 0) {
+        if(frame + callee->register_count > vm->stack + KAL_VM_STACK_SIZE) {
+            fprintf(stderr, "Stack overflow\n");
+            return -1;
+        }
+        if(kal_vm_execute(vm, callee, frame, frame) != 0) {
+            return -1;
+        }
+    }
+    else if(kal_vm_call_native(vm, callee, frame, frame) != 0) {
+        return -1;
+    }
+    KAL_VM_NEXT();
+}
+
+op_ret:
+    *result = regs[ip->b];
+    return 0;
+
+    #undef KAL_VM_DISPATCH
+    #undef KAL_VM_NEXT
+}
+
+
+//--------------------------------------
+// Evaluation
+//--------------------------------------
+
+// Adds a definition or extern to the VM. Definitions are compiled to
+// bytecode straight away.
+//
+// vm   - The VM.
+// node - A function or prototype node.
+//
+// Returns 0 if successful, otherwise returns -1.
+int kal_vm_add(kal_vm *vm, kal_ast_node *node)
+{
+    kal_ast_node *prototype = (node->type == KAL_AST_TYPE_FUNCTION ? node->function.prototype : node);
+    if(prototype->type != KAL_AST_TYPE_PROTOTYPE) {
+        return -1;
+    }
+
+    kal_vm_function *function = kal_vm_declare(vm, prototype->prototype.name,
+        prototype->prototype.arg_count);
+    if(function == NULL) {
+        return -1;
+    }
+    if(node->type == KAL_AST_TYPE_PROTOTYPE) {
+        return 0;
+    }
+
+    if(function->code_count > 0) {
+        fprintf(stderr, "Existing function exists with a body\n");
+        return -1;
+    }
+    if(kal_vm_compile_function(vm, function, prototype->prototype.args, node->function.body) != 0) {
+        return -1;
+    }
+
+    if(vm->dump) {
+        kal_vm_function_dump(function, stderr);
+    }
+    return 0;
+}
+
+// Compiles and runs a top-level expression. The expression's bytecode is
+// discarded once it has run.
+//
+// vm     - The VM.
+// node   - The expression.
+// result - Where the value of the expression is stored.
+//
+// Returns 0 if successful, otherwise returns -1.
+int kal_vm_eval(kal_vm *vm, kal_ast_node *node, double *result)
+{
+    kal_vm_function function;
+    memset(&function, 0, sizeof(function));
+    function.name = kal_symbol_intern("");
+
+    int rc = kal_vm_compile_function(vm, &function, NULL, node);
+    if(rc == 0) {
+        if(vm->dump) {
+            kal_vm_function_dump(&function, stderr);
+        }
+        rc = kal_vm_execute(vm, &function, vm->stack, result);
+    }
+
+    free(function.code);
+    free(function.constants);
+    return rc;
+}
+
+
+//--------------------------------------
+// Debugging
+//--------------------------------------
+
+// Writes a readable listing of a function's bytecode.
+//
+// function - The function.
+// file     - The file to write to.
+void kal_vm_function_dump(kal_vm_function *function, FILE *file)
+{
+    unsigned int i;
+
+    fprintf(file, "%s: %u args, %u registers\n", kal_symbol_name(function->name),
+        function->arg_count, function->register_count);
+    for(i=0; i<function->code_count; i++) {
+        kal_vm_instr *instr = &function->code[i];
+        fprintf(file, "  %04u %-5s ", i, kal_vm_opcode_names[instr->op]);
+        switch(instr->op) {
+            case KAL_VM_LOADK: fprintf(file, "r%u, %g\n", instr->a, function->constants[instr->k]); break;
+            case KAL_VM_MOVE: fprintf(file, "r%u, r%u\n", instr->a, instr->b); break;
+            case KAL_VM_JMP: fprintf(file, "%u\n", instr->k); break;
+            case KAL_VM_JMPF: fprintf(file, "r%u, %u\n", instr->b, instr->k); break;
+            case KAL_VM_CALL: fprintf(file, "r%u, %u, #%u\n", instr->a, instr->b, instr->k); break;
+            case KAL_VM_RET: fprintf(file, "r%u\n", instr->b); break;
+            default: fprintf(file, "r%u, r%u, r%u\n", instr->a, instr->b, instr->c); break;
+        }
+    }
+}
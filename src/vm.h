@@ -0,0 +1,123 @@
+#ifndef _vm_h
+#define _vm_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "ast.h"
+
+
+//==============================================================================
+//
+// Definitions
+//
+//==============================================================================
+
+// The most registers a single function can use. Registers are addressed by a
+// single byte in each instruction.
+#define KAL_VM_MAX_REGISTERS 256
+
+// The number of registers shared by every frame on the call stack.
+#define KAL_VM_STACK_SIZE 65536
+
+// The most arguments that can be passed to a native extern.
+#define KAL_VM_MAX_NATIVE_ARGS 6
+
+// The math library that externs are also looked up in. The host process only
+// has it loaded if something in it happened to use libm.
+#define KAL_VM_LIBM "libm.so.6"
+
+// The instructions understood by the interpreter.
+//
+// LOADK a k     - r[a] = constants[k]
+// MOVE  a b     - r[a] = r[b]
+// ADD   a b c   - r[a] = r[b] + r[c] (likewise SUB, MUL and DIV)
+// LT    a b c   - r[a] = 1 if r[b] < r[c], otherwise 0 (likewise LE, EQ
+//                 and NE). Greater-than comparisons swap their operands.
+// JMP   k       - Continue at instruction k.
+// JMPF  b k     - Continue at instruction k if r[b] is zero.
+// CALL  a b k   - Call function k with the b arguments in r[a] onwards and
+//                 store the result in r[a]. The callee's registers start at
+//                 r[a] so the arguments are already in place.
+// RET   b       - Return r[b].
+typedef enum kal_vm_opcode_e {
+    KAL_VM_LOADK,
+    KAL_VM_MOVE,
+    KAL_VM_ADD,
+    KAL_VM_SUB,
+    KAL_VM_MUL,
+    KAL_VM_DIV,
+    KAL_VM_LT,
+    KAL_VM_LE,
+    KAL_VM_EQ,
+    KAL_VM_NE,
+    KAL_VM_JMP,
+    KAL_VM_JMPF,
+    KAL_VM_CALL,
+    KAL_VM_RET,
+} kal_vm_opcode_e;
+
+
+//==============================================================================
+//
+// Typedefs
+//
+//==============================================================================
+
+// A single 8 byte instruction.
+typedef struct kal_vm_instr {
+    uint8_t op;
+    uint8_t a;
+    uint8_t b;
+    uint8_t c;
+    uint32_t k;
+} kal_vm_instr;
+
+// A function's bytecode and constants. Externs have no code and are called
+// through a native function pointer that is looked up on first use.
+typedef struct kal_vm_function {
+    kal_symbol name;
+    unsigned int arg_count;
+    unsigned int register_count;
+    kal_vm_instr *code;
+    unsigned int code_count;
+    unsigned int code_capacity;
+    double *constants;
+    unsigned int constant_count;
+    unsigned int constant_capacity;
+    void *native;
+} kal_vm_function;
+
+// An interpreter for bytecode compiled straight from the AST. Functions are
+// found by index at run time and by symbol at compile time.
+typedef struct kal_vm {
+    kal_vm_function **functions;
+    unsigned int function_count;
+    unsigned int function_capacity;
+    uint32_t *function_index;
+    unsigned int function_index_capacity;
+    double *stack;
+    void *libm;
+    bool dump;
+} kal_vm;
+
+
+//==============================================================================
+//
+// Functions
+//
+//==============================================================================
+
+kal_vm *kal_vm_create();
+
+void kal_vm_free(kal_vm *vm);
+
+int kal_vm_add(kal_vm *vm, kal_ast_node *node);
+
+int kal_vm_eval(kal_vm *vm, kal_ast_node *node, double *result);
+
+kal_vm_function *kal_vm_get_function(kal_vm *vm, kal_symbol name);
+
+void kal_vm_function_dump(kal_vm_function *function, FILE *file);
+
+#endif
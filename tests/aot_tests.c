@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <ast.h>
+#include <parser.h>
+#include <aot.h>
+#include "minunit.h"
+
+
+//==============================================================================
+//
+// Helpers
+//
+//==============================================================================
+
+// Parses and compiles a program into a new context.
+kal_context *aot_compile(const char *source) {
+    unsigned int count;
+    kal_ast_node **nodes;
+    kal_context *context = kal_context_create("kal");
+    if(kal_parse_program(source, strlen(source), context->arena, &nodes, &count) != 0 ||
+       kal_aot_compile(context, nodes, count) != 0)
+    {
+        kal_context_free(context);
+        return NULL;
+    }
+    free(nodes);
+    return context;
+}
+
+// Reads a whole file into a new string.
+char *read_file(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if(file == NULL) return NULL;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *data = calloc(1, size + 1);
+    if(fread(data, 1, size, file) != (size_t)size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    return data;
+}
+
+
+//==============================================================================
+//
+// Test Cases
+//
+//==============================================================================
+
+//--------------------------------------
+// Output
+//--------------------------------------
+
+int test_kal_aot_emit_header() {
+    char path[] = "/tmp/kal_aot_XXXXXX";
+    mu_assert(mkdtemp(path) != NULL, "");
+    char header_path[64];
+    snprintf(header_path, sizeof(header_path), "%s/2d-lib.h", path);
+
+    kal_context *context = aot_compile("extern cos(x); def add(x, y) x + y; def one() 1; add(1, 2)");
+    mu_assert(context != NULL, "");
+    mu_assert(kal_aot_emit_header(context, header_path) == 0, "");
+
+    char *header = read_file(header_path);
+    mu_assert(header != NULL, "");
+    mu_assert(strstr(header, "#ifndef _2D_LIB_H\n") != NULL, "");
+    mu_assert(strstr(header, "double add(double x, double y);\n") != NULL, "");
+    mu_assert(strstr(header, "double one(void);\n") != NULL, "");
+    mu_assert(strstr(header, "cos") == NULL, "");
+    free(header);
+
+    unlink(header_path);
+    rmdir(path);
+    kal_context_free(context);
+    return 0;
+}
+
+int test_kal_aot_link_shared() {
+    char path[] = "/tmp/kal_aot_XXXXXX";
+    mu_assert(mkdtemp(path) != NULL, "");
+    char object_path[64], library_path[64];
+    snprintf(object_path, sizeof(object_path), "%s/lib.o", path);
+    snprintf(library_path, sizeof(library_path), "%s/lib.so", path);
+
+    kal_context *context = aot_compile("extern cos(x); def add(x, y) x + y; def twice(x) add(x, x) + cos(0);");
+    mu_assert(context != NULL, "");
+    mu_assert(kal_aot_emit_object(context, object_path) == 0, "");
+    mu_assert(access(object_path, R_OK) == 0, "");
+    mu_assert(kal_aot_link_shared(object_path, library_path) == 0, "");
+
+    // The library runs without the JIT.
+    void *library = dlopen(library_path, RTLD_NOW | RTLD_LOCAL);
+    mu_assert(library != NULL, "");
+    double (*twice)(double) = (double (*)(double))dlsym(library, "twice");
+    mu_assert(twice != NULL, "");
+    mu_assert(twice(3) == 7, "");
+    dlclose(library);
+
+    unlink(object_path);
+    unlink(library_path);
+    rmdir(path);
+    kal_context_free(context);
+    return 0;
+}
+
+//--------------------------------------
+// Multiversioning
+//--------------------------------------
+
+int test_kal_aot_multiversion() {
+    char path[] = "/tmp/kal_aot_XXXXXX";
+    mu_assert(mkdtemp(path) != NULL, "");
+    char object_path[64], library_path[64], header_path[64];
+    snprintf(object_path, sizeof(object_path), "%s/lib.o", path);
+    snprintf(library_path, sizeof(library_path), "%s/lib.so", path);
+    snprintf(header_path, sizeof(header_path), "%s/lib.h", path);
+
+    unsigned int count;
+    kal_ast_node **nodes;
+    const char *source = "extern cos(x); def add(x, y) x + y; def twice(x) add(x, x) + cos(0);";
+    kal_context *context = kal_context_create("kal");
+    context->target = kal_target_create("skylake-avx512", NULL);
+    mu_assert(kal_parse_program(source, strlen(source), context->arena, &nodes, &count) == 0, "");
+    kal_context **versions = kal_aot_versions_create(context);
+    mu_assert(versions != NULL, "");
+
+    // The baseline has to run anywhere so it ignores the requested CPU.
+    mu_assert(strcmp(context->target->cpu, "x86-64") == 0, "");
+    mu_assert(strcmp(context->target->features, "") == 0, "");
+    mu_assert(kal_aot_compile(context, nodes, count) == 0, "");
+    mu_assert(kal_aot_versions_compile(versions, nodes, count) == 0, "");
+    mu_assert(kal_aot_versions_link(context, versions) == 0, "");
+    kal_aot_versions_free(versions);
+    free(nodes);
+
+    // Each exported function is an ifunc over internal versions.
+    mu_assert(LLVMGetNamedGlobalIFunc(context->module, "twice", 5) != NULL, "");
+    mu_assert(LLVMGetNamedFunction(context->module, "twice") == NULL, "");
+    LLVMValueRef avx2 = LLVMGetNamedFunction(context->module, "twice.avx2");
+    mu_assert(avx2 != NULL, "");
+    mu_assert(LLVMGetLinkage(avx2) == LLVMInternalLinkage, "");
+    LLVMValueRef baseline = LLVMGetNamedFunction(context->module, "twice.default");
+    mu_assert(baseline != NULL, "");
+    mu_assert(LLVMGetLinkage(baseline) == LLVMInternalLinkage, "");
+    mu_assert(LLVMGetNamedFunction(context->module, "cos.avx2") == NULL, "");
+
+    mu_assert(kal_aot_emit_header(context, header_path) == 0, "");
+    char *header = read_file(header_path);
+    mu_assert(header != NULL, "");
+    mu_assert(strstr(header, "double twice(double x);\n") != NULL, "");
+    mu_assert(strstr(header, "avx2") == NULL, "");
+    free(header);
+
+    // Whichever version the resolver picks gives the same answer.
+    mu_assert(kal_aot_emit_object(context, object_path) == 0, "");
+    mu_assert(kal_aot_link_shared(object_path, library_path) == 0, "");
+    void *library = dlopen(library_path, RTLD_NOW | RTLD_LOCAL);
+    mu_assert(library != NULL, "");
+    double (*twice)(double) = (double (*)(double))dlsym(library, "twice");
+    mu_assert(twice != NULL, "");
+    mu_assert(twice(3) == 7, "");
+    dlclose(library);
+
+    unlink(object_path);
+    unlink(library_path);
+    unlink(header_path);
+    rmdir(path);
+    kal_context_free(context);
+    return 0;
+}
+
+
+
+//==============================================================================
+//
+// Setup
+//
+//==============================================================================
+
+int all_tests() {
+    mu_run_test(test_kal_aot_emit_header);
+    mu_run_test(test_kal_aot_link_shared);
+    mu_run_test(test_kal_aot_multiversion);
+    return 0;
+}
+
+RUN_TESTS()
@@ -15,7 +15,7 @@
 //--------------------------------------
 
 int test_kal_ast_number_create() {
-    kal_ast_node *node = kal_ast_number_create(10);
+    kal_ast_node *node = kal_ast_number_create(NULL, 10);
     mu_assert(node->type == KAL_AST_TYPE_NUMBER, "");
     mu_assert(node->number.value == 10, "");
     kal_ast_node_free(node);
@@ -28,9 +28,9 @@ int test_kal_ast_number_create() {
 //--------------------------------------
 
 int test_kal_ast_variable_create() {
-    kal_ast_node *node = kal_ast_variable_create("foo");
+    kal_ast_node *node = kal_ast_variable_create(NULL, kal_symbol_intern("foo"));
     mu_assert(node->type == KAL_AST_TYPE_VARIABLE, "");
-    mu_assert(strcmp(node->variable.name, "foo") == 0, "");
+    mu_assert(node->variable.name == kal_symbol_intern("foo"), "");
     kal_ast_node_free(node);
     return 0;
 }
@@ -41,9 +41,9 @@ int test_kal_ast_variable_create() {
 //--------------------------------------
 
 int test_kal_ast_binary_expr_create() {
-    kal_ast_node *number = kal_ast_number_create(20);
-    kal_ast_node *variable = kal_ast_variable_create("bar");
-    kal_ast_node *node = kal_ast_binary_expr_create(KAL_BINOP_PLUS, number, variable);
+    kal_ast_node *number = kal_ast_number_create(NULL, 20);
+    kal_ast_node *variable = kal_ast_variable_create(NULL, kal_symbol_intern("bar"));
+    kal_ast_node *node = kal_ast_binary_expr_create(NULL, KAL_BINOP_PLUS, number, variable);
     mu_assert(node->type == KAL_AST_TYPE_BINARY_EXPR, "");
     mu_assert(node->binary_expr.operator == KAL_BINOP_PLUS, "");
     mu_assert(node->binary_expr.lhs == number, "");
@@ -59,11 +59,11 @@ int test_kal_ast_binary_expr_create() {
 
 int test_kal_ast_call_create() {
     kal_ast_node *args[2];
-    args[0] = kal_ast_number_create(100);
-    args[1] = kal_ast_number_create(200);
-    kal_ast_node *node = kal_ast_call_create("baz", args, 2);
+    args[0] = kal_ast_number_create(NULL, 100);
+    args[1] = kal_ast_number_create(NULL, 200);
+    kal_ast_node *node = kal_ast_call_create(NULL, kal_symbol_intern("baz"), args, 2);
     mu_assert(node->type == KAL_AST_TYPE_CALL, "");
-    mu_assert(strcmp(node->call.name, "baz") == 0, "");
+    mu_assert(node->call.name == kal_symbol_intern("baz"), "");
     mu_assert(node->call.args[0] == args[0], "");
     mu_assert(node->call.args[1] == args[1], "");
     mu_assert(node->call.arg_count == 2, "");
@@ -77,14 +77,14 @@ int test_kal_ast_call_create() {
 //--------------------------------------
 
 int test_kal_ast_prototype_create() {
-    char *args[2];
-    args[0] = "foo";
-    args[1] = "bar";
-    kal_ast_node *node = kal_ast_prototype_create("baz", args, 2);
+    kal_symbol args[2];
+    args[0] = kal_symbol_intern("foo");
+    args[1] = kal_symbol_intern("bar");
+    kal_ast_node *node = kal_ast_prototype_create(NULL, kal_symbol_intern("baz"), args, 2);
     mu_assert(node->type == KAL_AST_TYPE_PROTOTYPE, "");
-    mu_assert(strcmp(node->prototype.name, "baz") == 0, "");
-    mu_assert(strcmp(node->prototype.args[0], "foo") == 0, "");
-    mu_assert(strcmp(node->prototype.args[1], "bar") == 0, "");
+    mu_assert(node->prototype.name == kal_symbol_intern("baz"), "");
+    mu_assert(node->prototype.args[0] == kal_symbol_intern("foo"), "");
+    mu_assert(node->prototype.args[1] == kal_symbol_intern("bar"), "");
     mu_assert(node->prototype.arg_count == 2, "");
     kal_ast_node_free(node);
     return 0;
@@ -96,9 +96,9 @@ int test_kal_ast_prototype_create() {
 //--------------------------------------
 
 int test_kal_ast_function_create() {
-    kal_ast_node *prototype = kal_ast_prototype_create("baz", NULL, 0);
-    kal_ast_node *body = kal_ast_variable_create("foo");
-    kal_ast_node *node = kal_ast_function_create(prototype, body);
+    kal_ast_node *prototype = kal_ast_prototype_create(NULL, kal_symbol_intern("baz"), NULL, 0);
+    kal_ast_node *body = kal_ast_variable_create(NULL, kal_symbol_intern("foo"));
+    kal_ast_node *node = kal_ast_function_create(NULL, prototype, body);
     mu_assert(node->type == KAL_AST_TYPE_FUNCTION, "");
     mu_assert(node->function.prototype == prototype, "");
     mu_assert(node->function.body == body, "");
@@ -112,10 +112,10 @@ int test_kal_ast_function_create() {
 //--------------------------------------
 
 int test_kal_ast_if_expr_create() {
-    kal_ast_node *condition = kal_ast_number_create(1);
-    kal_ast_node *true_expr = kal_ast_number_create(2);
-    kal_ast_node *false_expr = kal_ast_number_create(3);
-    kal_ast_node *node = kal_ast_if_expr_create(condition, true_expr, false_expr);
+    kal_ast_node *condition = kal_ast_number_create(NULL, 1);
+    kal_ast_node *true_expr = kal_ast_number_create(NULL, 2);
+    kal_ast_node *false_expr = kal_ast_number_create(NULL, 3);
+    kal_ast_node *node = kal_ast_if_expr_create(NULL, condition, true_expr, false_expr);
     mu_assert(node->type == KAL_AST_TYPE_IF_EXPR, "");
     mu_assert(node->if_expr.condition == condition, "");
     mu_assert(node->if_expr.true_expr == true_expr, "");
@@ -125,6 +125,91 @@ int test_kal_ast_if_expr_create() {
 }
 
 
+//--------------------------------------
+// For Expression AST
+//--------------------------------------
+
+int test_kal_ast_for_expr_create() {
+    kal_ast_node *start = kal_ast_number_create(NULL, 1);
+    kal_ast_node *condition = kal_ast_variable_create(NULL, kal_symbol_intern("i"));
+    kal_ast_node *body = kal_ast_number_create(NULL, 3);
+    kal_ast_node *node = kal_ast_for_expr_create(NULL, kal_symbol_intern("i"), start, condition, NULL, body);
+    mu_assert(node->type == KAL_AST_TYPE_FOR_EXPR, "");
+    mu_assert(node->for_expr.name == kal_symbol_intern("i"), "");
+    mu_assert(node->for_expr.start == start, "");
+    mu_assert(node->for_expr.condition == condition, "");
+    mu_assert(node->for_expr.step == NULL, "");
+    mu_assert(node->for_expr.body == body, "");
+    kal_ast_node_free(node);
+    return 0;
+}
+
+
+//--------------------------------------
+// Var Expression AST
+//--------------------------------------
+
+int test_kal_ast_var_expr_create() {
+    kal_symbol names[2];
+    names[0] = kal_symbol_intern("a");
+    names[1] = kal_symbol_intern("b");
+    kal_ast_node *inits[2];
+    inits[0] = kal_ast_number_create(NULL, 1);
+    inits[1] = NULL;
+    kal_ast_node *body = kal_ast_assign_create(NULL, kal_symbol_intern("b"),
+        kal_ast_variable_create(NULL, kal_symbol_intern("a")));
+    kal_ast_node *node = kal_ast_var_expr_create(NULL, names, inits, 2, body);
+    mu_assert(node->type == KAL_AST_TYPE_VAR_EXPR, "");
+    mu_assert(node->var_expr.var_count == 2, "");
+    mu_assert(node->var_expr.names != names, "");
+    mu_assert(node->var_expr.names[1] == kal_symbol_intern("b"), "");
+    mu_assert(node->var_expr.inits[0] == inits[0], "");
+    mu_assert(node->var_expr.inits[1] == NULL, "");
+    mu_assert(body->type == KAL_AST_TYPE_ASSIGN, "");
+    mu_assert(body->assign.name == kal_symbol_intern("b"), "");
+    mu_assert(body->assign.value->type == KAL_AST_TYPE_VARIABLE, "");
+    kal_ast_node_free(node);
+    return 0;
+}
+
+
+//--------------------------------------
+// Arena
+//--------------------------------------
+
+int test_kal_ast_arena_create() {
+    kal_ast_arena *arena = kal_ast_arena_create();
+    kal_symbol args[1];
+    args[0] = kal_symbol_intern("foo");
+    kal_ast_node *prototype = kal_ast_prototype_create(arena, kal_symbol_intern("baz"), args, 1);
+    kal_ast_node *body = kal_ast_variable_create(arena, kal_symbol_intern("foo"));
+    kal_ast_node *node = kal_ast_function_create(arena, prototype, body);
+    mu_assert(node->type == KAL_AST_TYPE_FUNCTION, "");
+    mu_assert(node->function.prototype->prototype.name == kal_symbol_intern("baz"), "");
+    mu_assert(node->function.prototype->prototype.args[0] == kal_symbol_intern("foo"), "");
+    mu_assert(node->function.body->variable.name == kal_symbol_intern("foo"), "");
+    mu_assert(arena->allocations == 4, "%zu", arena->allocations);
+    mu_assert(arena->blocks == 1, "%zu", arena->blocks);
+    kal_ast_arena_free(arena);
+    return 0;
+}
+
+int test_kal_ast_arena_reset() {
+    kal_ast_arena *arena = kal_ast_arena_create();
+    kal_ast_arena_alloc(arena, 100000);
+    kal_ast_arena_alloc(arena, 10);
+    mu_assert(arena->blocks == 2, "%zu", arena->blocks);
+    kal_ast_arena_reset(arena);
+    mu_assert(arena->allocations == 0, "");
+    kal_ast_arena_alloc(arena, 100000);
+    kal_ast_arena_alloc(arena, 10);
+    mu_assert(arena->allocations == 2, "%zu", arena->allocations);
+    mu_assert(arena->blocks == 0, "%zu", arena->blocks);
+    kal_ast_arena_free(arena);
+    return 0;
+}
+
+
 //==============================================================================
 //
 // Setup
@@ -139,6 +224,10 @@ int all_tests() {
     mu_run_test(test_kal_ast_prototype_create);
     mu_run_test(test_kal_ast_function_create);
     mu_run_test(test_kal_ast_if_expr_create);
+    mu_run_test(test_kal_ast_for_expr_create);
+    mu_run_test(test_kal_ast_var_expr_create);
+    mu_run_test(test_kal_ast_arena_create);
+    mu_run_test(test_kal_ast_arena_reset);
     return 0;
 }
 
@@ -1,8 +1,11 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ast.h>
+#include <parser.h>
 #include <codegen.h>
 #include <llvm-c/Core.h>
+#include <llvm-c/Analysis.h>
 #include "minunit.h"
 
 
@@ -17,11 +20,13 @@
 //--------------------------------------
 
 int test_kal_codegen_number() {
-    kal_ast_node *node = kal_ast_number_create(10);
-    LLVMValueRef value = kal_codegen(node, NULL, NULL);
+    kal_context *context = kal_context_create("kal");
+    kal_ast_node *node = kal_ast_number_create(NULL, 10);
+    LLVMValueRef value = kal_codegen(context, node);
     LLVMTypeRef type = LLVMTypeOf(value);
     mu_assert(LLVMGetTypeKind(type) == LLVMDoubleTypeKind, "");
     mu_assert(LLVMIsConstant(value), "");
+    kal_context_free(context);
     kal_ast_node_free(node);
     return 0;
 }
@@ -32,16 +37,14 @@ int test_kal_codegen_number() {
 //--------------------------------------
 
 int test_kal_codegen_binary_expr() {
-    LLVMModuleRef module = LLVMModuleCreateWithName("kal");
-    LLVMBuilderRef builder = LLVMCreateBuilder();
-    kal_ast_node *lhs = kal_ast_number_create(20);
-    kal_ast_node *rhs = kal_ast_number_create(30);
-    kal_ast_node *node = kal_ast_binary_expr_create(KAL_BINOP_PLUS, lhs, rhs);
-    LLVMValueRef value = kal_codegen(node, module, builder);
+    kal_context *context = kal_context_create("kal");
+    kal_ast_node *lhs = kal_ast_number_create(NULL, 20);
+    kal_ast_node *rhs = kal_ast_number_create(NULL, 30);
+    kal_ast_node *node = kal_ast_binary_expr_create(NULL, KAL_BINOP_PLUS, lhs, rhs);
+    LLVMValueRef value = kal_codegen(context, node);
     mu_assert(LLVMGetTypeKind(LLVMTypeOf(value)) == LLVMDoubleTypeKind, "");
     mu_assert(LLVMIsConstant(value), "");
-    LLVMDisposeBuilder(builder);
-    LLVMDisposeModule(module);
+    kal_context_free(context);
     kal_ast_node_free(node);
     return 0;
 }
@@ -54,36 +57,34 @@ int test_kal_codegen_binary_expr() {
 int test_kal_codegen_prototype() {
     kal_named_value *val;
     unsigned int arg_count = 3;
-    char **args = malloc(sizeof(char*) * arg_count);
-    args[0] = "foo";
-    args[1] = "bar";
-    args[2] = "baz";
+    kal_symbol *args = malloc(sizeof(kal_symbol) * arg_count);
+    args[0] = kal_symbol_intern("foo");
+    args[1] = kal_symbol_intern("bar");
+    args[2] = kal_symbol_intern("baz");
     
-    LLVMModuleRef module = LLVMModuleCreateWithName("kal");
-    LLVMBuilderRef builder = LLVMCreateBuilder();
-    kal_ast_node *node = kal_ast_prototype_create("my_func", args, 3);
+    kal_context *context = kal_context_create("kal");
+    kal_ast_node *node = kal_ast_prototype_create(NULL, kal_symbol_intern("my_func"), args, 3);
 
-    kal_codegen_reset();
-    LLVMValueRef value = kal_codegen(node, module, builder);
+    kal_codegen_reset(context);
+    LLVMValueRef value = kal_codegen(context, node);
 
     mu_assert(value != NULL, "");
-    mu_assert(LLVMGetNamedFunction(module, "my_func") == value, "");
+    mu_assert(LLVMGetNamedFunction(context->module, "my_func") == value, "");
     mu_assert(LLVMCountParams(value) == 3, "");
 
-    val = kal_codegen_named_value("foo");
+    val = kal_codegen_named_value(context, kal_symbol_intern("foo"));
     mu_assert(val->value == LLVMGetParam(value, 0), "");
     mu_assert(LLVMGetTypeKind(LLVMTypeOf(LLVMGetParam(value, 0))) == LLVMDoubleTypeKind, "");
 
-    val = kal_codegen_named_value("bar");
+    val = kal_codegen_named_value(context, kal_symbol_intern("bar"));
     mu_assert(val->value == LLVMGetParam(value, 1), "");
     mu_assert(LLVMGetTypeKind(LLVMTypeOf(LLVMGetParam(value, 1))) == LLVMDoubleTypeKind, "");
 
-    val = kal_codegen_named_value("baz");
+    val = kal_codegen_named_value(context, kal_symbol_intern("baz"));
     mu_assert(val->value == LLVMGetParam(value, 2), "");
     mu_assert(LLVMGetTypeKind(LLVMTypeOf(LLVMGetParam(value, 2))) == LLVMDoubleTypeKind, "");
 
-    LLVMDisposeBuilder(builder);
-    LLVMDisposeModule(module);
+    kal_context_free(context);
     kal_ast_node_free(node);
     return 0;
 }
@@ -96,34 +97,602 @@ int test_kal_codegen_prototype() {
 int test_kal_codegen_function() {
     kal_named_value *val;
     unsigned int arg_count = 1;
-    char **args = malloc(sizeof(char*) * arg_count);
-    args[0] = "foo";
+    kal_symbol *args = malloc(sizeof(kal_symbol) * arg_count);
+    args[0] = kal_symbol_intern("foo");
     
-    LLVMModuleRef module = LLVMModuleCreateWithName("kal");
-    LLVMBuilderRef builder = LLVMCreateBuilder();
-    kal_ast_node *prototype = kal_ast_prototype_create("my_func", args, arg_count);
-    kal_ast_node *lhs = kal_ast_variable_create("foo");
-    kal_ast_node *rhs = kal_ast_number_create(20);
-    kal_ast_node *body = kal_ast_binary_expr_create(KAL_BINOP_PLUS, lhs, rhs);
-    kal_ast_node *node = kal_ast_function_create(prototype, body);
+    kal_context *context = kal_context_create("kal");
+    kal_ast_node *prototype = kal_ast_prototype_create(NULL, kal_symbol_intern("my_func"), args, arg_count);
+    kal_ast_node *lhs = kal_ast_variable_create(NULL, kal_symbol_intern("foo"));
+    kal_ast_node *rhs = kal_ast_number_create(NULL, 20);
+    kal_ast_node *body = kal_ast_binary_expr_create(NULL, KAL_BINOP_PLUS, lhs, rhs);
+    kal_ast_node *node = kal_ast_function_create(NULL, prototype, body);
 
-    kal_codegen_reset();
-    LLVMValueRef value = kal_codegen(node, module, builder);
+    kal_codegen_reset(context);
+    LLVMValueRef value = kal_codegen(context, node);
 
     mu_assert(value != NULL, "");
-    mu_assert(LLVMGetNamedFunction(module, "my_func") == value, "");
+    mu_assert(LLVMGetNamedFunction(context->module, "my_func") == value, "");
     mu_assert(LLVMCountParams(value) == 1, "");
 
-    val = kal_codegen_named_value("foo");
+    val = kal_codegen_named_value(context, kal_symbol_intern("foo"));
     mu_assert(val->value == LLVMGetParam(value, 0), "");
     mu_assert(LLVMGetTypeKind(LLVMTypeOf(LLVMGetParam(value, 0))) == LLVMDoubleTypeKind, "");
 
-    LLVMDisposeBuilder(builder);
-    LLVMDisposeModule(module);
+    kal_context_free(context);
     kal_ast_node_free(node);
     return 0;
 }
 
+// Counts the calls in a function.
+unsigned int call_count(LLVMValueRef func) {
+    unsigned int count = 0;
+    LLVMBasicBlockRef block;
+    LLVMValueRef instruction;
+    for(block = LLVMGetFirstBasicBlock(func); block != NULL; block = LLVMGetNextBasicBlock(block)) {
+        for(instruction = LLVMGetFirstInstruction(block); instruction != NULL; instruction = LLVMGetNextInstruction(instruction)) {
+            if(LLVMGetInstructionOpcode(instruction) == LLVMCall) {
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+int test_kal_codegen_function_tail_call() {
+    unsigned int i, count;
+    kal_ast_node **nodes;
+    const char *source =
+        "def count(n, acc) if n then count(n - 1, acc + 1) else acc;"
+        "def both(n) if n then both(n - 1) else both(n + 1);"
+        "def fib(n) if n - 1 then (if n - 2 then fib(n - 1) + fib(n - 2) else 1) else 1;";
+
+    kal_context *context = kal_context_create("kal");
+    mu_assert(kal_parse_program(source, strlen(source), context->arena, &nodes, &count) == 0, "");
+    for(i=0; i<count; i++) {
+        mu_assert(kal_codegen(context, nodes[i]) != NULL, "");
+    }
+    mu_assert(LLVMVerifyModule(context->module, LLVMReturnStatusAction, NULL) == 0, "");
+
+    // Self tail calls become loops.
+    mu_assert(call_count(LLVMGetNamedFunction(context->module, "count")) == 0, "");
+    mu_assert(call_count(LLVMGetNamedFunction(context->module, "both")) == 0, "");
+
+    // Calls that aren't in tail position are left alone.
+    mu_assert(call_count(LLVMGetNamedFunction(context->module, "fib")) == 2, "");
+
+    free(nodes);
+    kal_context_free(context);
+    return 0;
+}
+
+
+int test_kal_codegen_function_memo() {
+    unsigned int i, count;
+    kal_ast_node **nodes;
+    const char *source =
+        "extern sin(x);"
+        "def sq(x) x * x;"
+        "def memo dist(x, y) sq(x) + sq(y);"
+        "def memo wave(x) sin(x) * 2;"
+        "def plain(x) sq(x) + 1;";
+
+    kal_context *context = kal_context_create("kal");
+    mu_assert(kal_parse_program(source, strlen(source), context->arena, &nodes, &count) == 0, "");
+    for(i=0; i<count; i++) {
+        mu_assert(kal_codegen(context, nodes[i]) != NULL, "");
+    }
+    mu_assert(LLVMVerifyModule(context->module, LLVMReturnStatusAction, NULL) == 0, "");
+
+    // Pure functions that ask for it get a table and counters.
+    mu_assert(LLVMGetNamedGlobal(context->module, "dist.memo") != NULL, "");
+    mu_assert(LLVMGetNamedGlobal(context->module, "dist.memo.hits") != NULL, "");
+    mu_assert(LLVMGetNamedGlobal(context->module, "dist.memo.misses") != NULL, "");
+    mu_assert(context->function_flags[kal_symbol_intern("dist")] & KAL_FUNCTION_PURE, "");
+
+    // Calling an extern makes a function impure.
+    mu_assert(LLVMGetNamedGlobal(context->module, "wave.memo") == NULL, "");
+    mu_assert(context->function_flags[kal_symbol_intern("wave")] == 0, "");
+    mu_assert(context->function_flags[kal_symbol_intern("sin")] == 0, "");
+    mu_assert(LLVMGetNamedGlobal(context->module, "plain.memo") == NULL, "");
+
+    // Memoizing everything picks up every pure function with arguments.
+    context->memo = true;
+    mu_assert(kal_codegen_memoizes(context, nodes[4]), "");
+    mu_assert(!kal_codegen_memoizes(context, nodes[3]), "");
+
+    free(nodes);
+    kal_context_free(context);
+    return 0;
+}
+
+int test_kal_codegen_function_profile() {
+    unsigned int i, count;
+    kal_ast_node **nodes;
+    const char *source =
+        "def count(n, acc) if n then count(n - 1, acc + 1) else acc;"
+        "def memo fib(n) if n then (if n - 1 then fib(n - 1) + fib(n - 2) else 1) else 0;";
+
+    kal_context *context = kal_context_create("kal");
+    mu_assert(kal_parse_program(source, strlen(source), context->arena, &nodes, &count) == 0, "");
+    mu_assert(kal_codegen(context, nodes[0]) != NULL, "");
+    mu_assert(LLVMGetNamedGlobal(context->module, "count.profile") == NULL, "");
+
+    // Profiling off costs nothing, on it reads the cycle counter on entry
+    // and before every return.
+    context->profile = true;
+    LLVMDeleteFunction(LLVMGetNamedFunction(context->module, "count"));
+    for(i=0; i<count; i++) {
+        mu_assert(kal_codegen(context, nodes[i]) != NULL, "");
+    }
+    mu_assert(LLVMVerifyModule(context->module, LLVMReturnStatusAction, NULL) == 0, "");
+    mu_assert(LLVMGetNamedGlobal(context->module, "count.profile") != NULL, "");
+    mu_assert(LLVMGetNamedGlobal(context->module, "fib.profile") != NULL, "");
+    mu_assert(call_count(LLVMGetNamedFunction(context->module, "count")) == 2, "");
+
+    // Memo hits return early and are timed too.
+    mu_assert(call_count(LLVMGetNamedFunction(context->module, "fib")) == 2 + 3, "");
+
+    free(nodes);
+    kal_context_free(context);
+    return 0;
+}
+
+
+// Checks whether a function has an attribute.
+int has_attribute(LLVMValueRef func, const char *name) {
+    unsigned int kind = LLVMGetEnumAttributeKindForName(name, strlen(name));
+    return LLVMGetEnumAttributeAtIndex(func, LLVMAttributeFunctionIndex, kind) != NULL;
+}
+
+int test_kal_codegen_function_effects() {
+    unsigned int i, count;
+    kal_ast_node **nodes;
+    const char *source =
+        "extern pure sqrt(x);"
+        "extern putchard(x);"
+        "def sq(x) x * x;"
+        "def hyp(x, y) sqrt(sq(x) + sq(y));"
+        "def down(x) if x then down(x - 1) else 0;"
+        "def noisy(x) putchard(sq(x));"
+        "def memo cached(x) sq(x) + 1;"
+        "extern pure liar(x);"
+        "def liar(x) putchard(x);"
+        "def twice(x) liar(x) + liar(x);";
+
+    kal_context *context = kal_context_create("kal");
+    mu_assert(kal_parse_program(source, strlen(source), context->arena, &nodes, &count) == 0, "");
+    for(i=0; i<count; i++) {
+        mu_assert(kal_codegen(context, nodes[i]) != NULL, "");
+    }
+    mu_assert(LLVMVerifyModule(context->module, LLVMReturnStatusAction, NULL) == 0, "");
+
+    uint8_t *flags = context->function_flags;
+    mu_assert(flags[kal_symbol_intern("sqrt")] == KAL_FUNCTION_ALL, "");
+    mu_assert(flags[kal_symbol_intern("putchard")] == 0, "");
+    mu_assert(flags[kal_symbol_intern("sq")] == KAL_FUNCTION_ALL, "");
+    mu_assert(flags[kal_symbol_intern("hyp")] == KAL_FUNCTION_ALL, "");
+    mu_assert(flags[kal_symbol_intern("noisy")] == 0, "");
+
+    // Recursion might not end and memo tables are memory.
+    mu_assert(flags[kal_symbol_intern("down")] == (KAL_FUNCTION_PURE | KAL_FUNCTION_READNONE), "");
+    mu_assert(flags[kal_symbol_intern("cached")] == (KAL_FUNCTION_PURE | KAL_FUNCTION_WILLRETURN), "");
+
+    LLVMValueRef sqrt = LLVMGetNamedFunction(context->module, "sqrt");
+    mu_assert(has_attribute(sqrt, "readnone") && has_attribute(sqrt, "nounwind") && has_attribute(sqrt, "willreturn"), "");
+    LLVMValueRef down = LLVMGetNamedFunction(context->module, "down");
+    mu_assert(has_attribute(down, "readnone") && !has_attribute(down, "willreturn"), "");
+    LLVMValueRef cached = LLVMGetNamedFunction(context->module, "cached");
+    mu_assert(has_attribute(cached, "nounwind") && !has_attribute(cached, "readnone"), "");
+    LLVMValueRef noisy = LLVMGetNamedFunction(context->module, "noisy");
+    mu_assert(!has_attribute(noisy, "nounwind"), "");
+
+    // A definition's body wins over an `extern pure` that promised too much.
+    LLVMValueRef liar = LLVMGetNamedFunction(context->module, "liar");
+    mu_assert(flags[kal_symbol_intern("liar")] == 0, "");
+    mu_assert(!has_attribute(liar, "readnone") && !has_attribute(liar, "nounwind") && !has_attribute(liar, "willreturn"), "");
+    mu_assert(flags[kal_symbol_intern("twice")] == 0, "");
+
+    free(nodes);
+    kal_context_free(context);
+    return 0;
+}
+
+
+//--------------------------------------
+// Batch
+//--------------------------------------
+
+// Counts the instructions with an opcode in a function.
+unsigned int opcode_count(LLVMValueRef func, LLVMOpcode opcode) {
+    unsigned int count = 0;
+    LLVMBasicBlockRef block;
+    LLVMValueRef instruction;
+    for(block = LLVMGetFirstBasicBlock(func); block != NULL; block = LLVMGetNextBasicBlock(block)) {
+        for(instruction = LLVMGetFirstInstruction(block); instruction != NULL; instruction = LLVMGetNextInstruction(instruction)) {
+            if(LLVMGetInstructionOpcode(instruction) == opcode) {
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+int test_kal_codegen_batch() {
+    unsigned int i, count;
+    kal_ast_node **nodes;
+    const char *source =
+        "def sq(x) x * x;"
+        "def clamp(x, y) if x - y then x * 2 else y + 1;"
+        "def hyp(x, y) if x then sq(x) + sq(y) else 0;";
+
+    kal_context *context = kal_context_create("kal");
+    mu_assert(kal_parse_program(source, strlen(source), context->arena, &nodes, &count) == 0, "");
+    for(i=0; i<count; i++) {
+        mu_assert(kal_codegen(context, nodes[i]) != NULL, "");
+    }
+
+    // Branches without calls become a select over whole vectors.
+    LLVMValueRef clamp = kal_codegen_batch(context, nodes[1], 8);
+    mu_assert(clamp != NULL, "");
+    mu_assert(LLVMGetNamedFunction(context->module, "clamp.batch") == clamp, "");
+    mu_assert(LLVMCountParams(clamp) == 4, "");
+    mu_assert(opcode_count(clamp, LLVMSelect) == 1, "");
+    mu_assert(opcode_count(clamp, LLVMFMul) == 1, "");
+    char *ir = LLVMPrintValueToString(clamp);
+    mu_assert(strstr(ir, "load <8 x double>") != NULL, "");
+    mu_assert(strstr(ir, "store <8 x double>") != NULL, "");
+    LLVMDisposeMessage(ir);
+
+    // Branches with calls are run lane by lane. The only other call is the
+    // one for leftover rows.
+    LLVMValueRef hyp = kal_codegen_batch(context, nodes[2], 4);
+    mu_assert(hyp != NULL, "");
+    mu_assert(opcode_count(hyp, LLVMSelect) == 0, "");
+    mu_assert(call_count(hyp) == 4 * 2 + 1, "");
+    mu_assert(LLVMVerifyModule(context->module, LLVMReturnStatusAction, NULL) == 0, "");
+
+    free(nodes);
+    kal_context_free(context);
+    return 0;
+}
+
+
+//--------------------------------------
+// If Expression
+//--------------------------------------
+
+int test_kal_codegen_if_expr_select() {
+    unsigned int i, count;
+    kal_ast_node **nodes;
+    const char *source =
+        "extern g(x);"
+        "def abs(x) if x < 0 then 0 - x else x;"
+        "def clip(x, lo, hi) if x < lo then lo else if x > hi then hi else x;"
+        "def call(x) if x >= 0 then g(x) else x;";
+
+    // The tree and flat ASTs lower the same way.
+    for(i=0; i<2; i++) {
+        kal_context *context = kal_context_create("kal");
+        mu_assert(kal_parse_program(source, strlen(source), context->arena, &nodes, &count) == 0, "");
+        kal_ast_flat *flat = kal_ast_flat_create();
+        unsigned int j;
+        for(j=0; j<count; j++) {
+            if(i == 0) {
+                mu_assert(kal_codegen(context, nodes[j]) != NULL, "");
+            }
+            else {
+                mu_assert(kal_codegen_flat(context, flat, kal_ast_flat_append(flat, nodes[j])) != NULL, "");
+            }
+        }
+
+        // Cheap branches are selected between without branching.
+        LLVMValueRef abs = LLVMGetNamedFunction(context->module, "abs");
+        mu_assert(LLVMCountBasicBlocks(abs) == 1, "");
+        mu_assert(opcode_count(abs, LLVMSelect) == 1, "");
+        mu_assert(opcode_count(abs, LLVMFCmp) == 2, "");
+        LLVMValueRef clip = LLVMGetNamedFunction(context->module, "clip");
+        mu_assert(LLVMCountBasicBlocks(clip) == 1, "");
+        mu_assert(opcode_count(clip, LLVMSelect) == 2, "");
+
+        // Calls are only made on the branch that needs them.
+        LLVMValueRef call = LLVMGetNamedFunction(context->module, "call");
+        mu_assert(LLVMCountBasicBlocks(call) == 4, "");
+        mu_assert(opcode_count(call, LLVMSelect) == 0, "");
+        mu_assert(LLVMVerifyModule(context->module, LLVMReturnStatusAction, NULL) == 0, "");
+
+        kal_ast_flat_free(flat);
+        free(nodes);
+        kal_context_free(context);
+    }
+    return 0;
+}
+
+
+//--------------------------------------
+// Fast Math
+//--------------------------------------
+
+// Checks whether a function has a string attribute.
+int has_string_attribute(LLVMValueRef func, const char *name) {
+    return LLVMGetStringAttributeAtIndex(func, LLVMAttributeFunctionIndex, name, strlen(name)) != NULL;
+}
+
+int test_kal_codegen_fast_math() {
+    unsigned int i, count;
+    kal_ast_node **nodes;
+    const char *source =
+        "def poly(x) (x * 2 + 3) * x - 1;"
+        "def fast mad(x, y, z) z - x * y;";
+
+    // Only `def fast` functions are relaxed by default.
+    kal_context *context = kal_context_create("kal");
+    mu_assert(kal_parse_program(source, strlen(source), context->arena, &nodes, &count) == 0, "");
+    for(i=0; i<count; i++) {
+        mu_assert(kal_codegen(context, nodes[i]) != NULL, "");
+    }
+    LLVMValueRef poly = LLVMGetNamedFunction(context->module, "poly");
+    mu_assert(call_count(poly) == 0 && opcode_count(poly, LLVMFMul) == 2, "");
+    mu_assert(!has_string_attribute(poly, "no-nans-fp-math"), "");
+    LLVMValueRef mad = LLVMGetNamedFunction(context->module, "mad");
+    mu_assert(call_count(mad) == 1 && opcode_count(mad, LLVMFMul) == 0, "");
+    mu_assert(has_string_attribute(mad, "no-nans-fp-math") && has_string_attribute(mad, "unsafe-fp-math"), "");
+    mu_assert(LLVMVerifyModule(context->module, LLVMReturnStatusAction, NULL) == 0, "");
+    free(nodes);
+    kal_context_free(context);
+
+    // Contraction alone fuses without the other attributes, in batches too.
+    context = kal_context_create("kal");
+    context->fast_math = KAL_FAST_MATH_CONTRACT;
+    mu_assert(kal_parse_program(source, strlen(source), context->arena, &nodes, &count) == 0, "");
+    for(i=0; i<count; i++) {
+        mu_assert(kal_codegen(context, nodes[i]) != NULL, "");
+    }
+    poly = LLVMGetNamedFunction(context->module, "poly");
+    mu_assert(call_count(poly) == 2 && opcode_count(poly, LLVMFMul) == 0, "");
+    mu_assert(!has_string_attribute(poly, "no-nans-fp-math"), "");
+    LLVMValueRef batch = kal_codegen_batch(context, nodes[0], 4);
+    mu_assert(batch != NULL, "");
+    char *ir = LLVMPrintValueToString(batch);
+    mu_assert(strstr(ir, "@llvm.fmuladd.v4f64") != NULL, "");
+    LLVMDisposeMessage(ir);
+    mu_assert(LLVMVerifyModule(context->module, LLVMReturnStatusAction, NULL) == 0, "");
+    free(nodes);
+    kal_context_free(context);
+    return 0;
+}
+
+
+//--------------------------------------
+// Target
+//--------------------------------------
+
+int test_kal_codegen_target() {
+    unsigned int i, count;
+    kal_ast_node **nodes;
+    const char *source = "extern cos(x); def f(x) cos(x) * 2;";
+
+    kal_context *context = kal_context_create("kal");
+    context->target = kal_target_create("skylake", "+avx2,-avx512f");
+    mu_assert(kal_parse_program(source, strlen(source), context->arena, &nodes, &count) == 0, "");
+    for(i=0; i<count; i++) {
+        mu_assert(kal_codegen(context, nodes[i]) != NULL, "");
+    }
+
+    // Only definitions are tuned. Externs are compiled elsewhere.
+    LLVMValueRef f = LLVMGetNamedFunction(context->module, "f");
+    LLVMAttributeRef cpu = LLVMGetStringAttributeAtIndex(f, LLVMAttributeFunctionIndex, "target-cpu", 10);
+    mu_assert(cpu != NULL, "");
+    unsigned int length;
+    mu_assert(strcmp(LLVMGetStringAttributeValue(cpu, &length), "skylake") == 0, "");
+    mu_assert(has_string_attribute(f, "target-features"), "");
+    mu_assert(!has_string_attribute(LLVMGetNamedFunction(context->module, "cos"), "target-cpu"), "");
+
+    LLVMValueRef batch = kal_codegen_batch(context, nodes[1], 4);
+    mu_assert(has_string_attribute(batch, "target-cpu"), "");
+    free(nodes);
+    kal_context_free(context);
+
+    // Without a target the target machine decides.
+    context = kal_context_create("kal");
+    mu_assert(kal_parse_program(source, strlen(source), context->arena, &nodes, &count) == 0, "");
+    for(i=0; i<count; i++) {
+        mu_assert(kal_codegen(context, nodes[i]) != NULL, "");
+    }
+    mu_assert(!has_string_attribute(LLVMGetNamedFunction(context->module, "f"), "target-cpu"), "");
+    free(nodes);
+    kal_context_free(context);
+    return 0;
+}
+
+
+//--------------------------------------
+// Flat AST
+//--------------------------------------
+
+int test_kal_codegen_flat() {
+    unsigned int arg_count = 1;
+    kal_symbol *args = malloc(sizeof(kal_symbol) * arg_count);
+    args[0] = kal_symbol_intern("foo");
+    
+    kal_context *context = kal_context_create("kal");
+    kal_ast_node *prototype = kal_ast_prototype_create(NULL, kal_symbol_intern("my_func"), args, arg_count);
+    kal_ast_node *lhs = kal_ast_variable_create(NULL, kal_symbol_intern("foo"));
+    kal_ast_node *rhs = kal_ast_number_create(NULL, 20);
+    kal_ast_node *body = kal_ast_if_expr_create(NULL, lhs,
+        kal_ast_binary_expr_create(NULL, KAL_BINOP_MUL, kal_ast_variable_create(NULL, kal_symbol_intern("foo")), rhs),
+        kal_ast_number_create(NULL, 1));
+    kal_ast_node *node = kal_ast_function_create(NULL, prototype, body);
+
+    kal_ast_flat *flat = kal_ast_flat_create();
+    uint32_t item = kal_ast_flat_append(flat, node);
+    LLVMValueRef value = kal_codegen_flat(context, flat, item);
+
+    mu_assert(value != NULL, "");
+    mu_assert(LLVMGetNamedFunction(context->module, "my_func") == value, "");
+    mu_assert(LLVMCountParams(value) == 1, "");
+    mu_assert(LLVMCountBasicBlocks(value) == 1, "");
+    mu_assert(opcode_count(value, LLVMSelect) == 1, "");
+
+    kal_ast_flat_free(flat);
+    kal_context_free(context);
+    kal_ast_node_free(node);
+    free(args);
+    return 0;
+}
+
+int test_kal_codegen_flat_loop() {
+    unsigned int i, count;
+    kal_ast_node **nodes;
+    kal_context *context = kal_context_create("kal");
+    const char *source =
+        "def sum(n) var s in (for i = 1, n + 1 - i, 1 in s = s + i) + s;"
+        "def bump(x) var a, b = 2 in (x = x + a + b) + x;";
+    mu_assert(kal_parse_program(source, strlen(source), context->arena, &nodes, &count) == 0, "");
+
+    kal_ast_flat *flat = kal_ast_flat_create();
+    for(i=0; i<count; i++) {
+        uint32_t item = kal_ast_flat_append(flat, nodes[i]);
+        mu_assert(kal_codegen_flat(context, flat, item) != NULL, "");
+    }
+
+    // The loop has a header, body and exit block.
+    LLVMValueRef sum = LLVMGetNamedFunction(context->module, "sum");
+    mu_assert(LLVMCountBasicBlocks(sum) == 4, "");
+    mu_assert(LLVMVerifyModule(context->module, LLVMReturnStatusAction, NULL) == 0, "");
+
+    kal_ast_flat_free(flat);
+    free(nodes);
+    kal_context_free(context);
+    return 0;
+}
+
+int test_kal_codegen_flat_tail_call() {
+    unsigned int i, count;
+    kal_ast_node **nodes;
+    kal_context *context = kal_context_create("kal");
+    const char *source =
+        "def count(n, acc) if n then count(n - 1, acc + 1) else acc;"
+        "def both(n) if n then both(n - 1) else both(n + 1);"
+        "def drain(n) var m = n - 1 in if m then drain(m) else 0;"
+        "def fib(n) if n - 1 then (if n - 2 then fib(n - 1) + fib(n - 2) else 1) else 1;";
+    mu_assert(kal_parse_program(source, strlen(source), context->arena, &nodes, &count) == 0, "");
+
+    kal_ast_flat *flat = kal_ast_flat_create();
+    for(i=0; i<count; i++) {
+        uint32_t item = kal_ast_flat_append(flat, nodes[i]);
+        mu_assert(kal_codegen_flat(context, flat, item) != NULL, "");
+    }
+    mu_assert(LLVMVerifyModule(context->module, LLVMReturnStatusAction, NULL) == 0, "");
+
+    // Self tail calls become loops, as they do from the tree.
+    mu_assert(call_count(LLVMGetNamedFunction(context->module, "count")) == 0, "");
+    mu_assert(call_count(LLVMGetNamedFunction(context->module, "both")) == 0, "");
+    mu_assert(call_count(LLVMGetNamedFunction(context->module, "drain")) == 0, "");
+    mu_assert(call_count(LLVMGetNamedFunction(context->module, "fib")) == 2, "");
+
+    kal_ast_flat_free(flat);
+    free(nodes);
+    kal_context_free(context);
+    return 0;
+}
+
+int test_kal_codegen_flat_memo() {
+    unsigned int i, count;
+    kal_ast_node **nodes;
+    kal_context *context = kal_context_create("kal");
+    const char *source =
+        "extern sin(x);"
+        "def sq(x) x * x;"
+        "def memo dist(x, y) sq(x) + sq(y);"
+        "def memo wave(x) sin(x) * 2;"
+        "def memo fib(n) if n then (if n - 1 then fib(n - 1) + fib(n - 2) else 1) else 0;";
+    mu_assert(kal_parse_program(source, strlen(source), context->arena, &nodes, &count) == 0, "");
+
+    kal_ast_flat *flat = kal_ast_flat_create();
+    for(i=0; i<count; i++) {
+        uint32_t item = kal_ast_flat_append(flat, nodes[i]);
+        mu_assert(kal_codegen_flat(context, flat, item) != NULL, "");
+    }
+    mu_assert(LLVMVerifyModule(context->module, LLVMReturnStatusAction, NULL) == 0, "");
+
+    // Pure memoized functions get a table and read it, so aren't readnone.
+    mu_assert(LLVMGetNamedGlobal(context->module, "dist.memo") != NULL, "");
+    mu_assert(LLVMGetNamedGlobal(context->module, "fib.memo") != NULL, "");
+    mu_assert(!has_attribute(LLVMGetNamedFunction(context->module, "fib"), "readnone"), "");
+    mu_assert(LLVMGetNamedGlobal(context->module, "sq.memo") == NULL, "");
+    mu_assert(LLVMGetNamedGlobal(context->module, "wave.memo") == NULL, "");
+
+    kal_ast_flat_free(flat);
+    free(nodes);
+    kal_context_free(context);
+    return 0;
+}
+
+int test_kal_codegen_flat_effects() {
+    unsigned int i, count;
+    kal_ast_node **nodes;
+    kal_context *context = kal_context_create("kal");
+    const char *source =
+        "extern pure sqrt(x);"
+        "extern putchard(x);"
+        "def sq(x) x * x;"
+        "def hyp(x, y) sqrt(sq(x) + sq(y));"
+        "def down(x) if x then down(x - 1) else 0;"
+        "def noisy(x) putchard(sq(x));"
+        "extern pure liar(x);"
+        "def liar(x) putchard(x);";
+    mu_assert(kal_parse_program(source, strlen(source), context->arena, &nodes, &count) == 0, "");
+
+    kal_ast_flat *flat = kal_ast_flat_create();
+    for(i=0; i<count; i++) {
+        uint32_t item = kal_ast_flat_append(flat, nodes[i]);
+        mu_assert(kal_codegen_flat(context, flat, item) != NULL, "");
+    }
+    mu_assert(LLVMVerifyModule(context->module, LLVMReturnStatusAction, NULL) == 0, "");
+
+    // Effects match what the tree path works out.
+    uint8_t *flags = context->function_flags;
+    mu_assert(flags[kal_symbol_intern("sqrt")] == KAL_FUNCTION_ALL, "");
+    mu_assert(flags[kal_symbol_intern("hyp")] == KAL_FUNCTION_ALL, "");
+    mu_assert(flags[kal_symbol_intern("down")] == (KAL_FUNCTION_PURE | KAL_FUNCTION_READNONE), "");
+    mu_assert(flags[kal_symbol_intern("noisy")] == 0, "");
+    mu_assert(flags[kal_symbol_intern("liar")] == 0, "");
+    mu_assert(has_attribute(LLVMGetNamedFunction(context->module, "sqrt"), "readnone"), "");
+    mu_assert(has_attribute(LLVMGetNamedFunction(context->module, "hyp"), "readnone"), "");
+    mu_assert(!has_attribute(LLVMGetNamedFunction(context->module, "noisy"), "nounwind"), "");
+    mu_assert(!has_attribute(LLVMGetNamedFunction(context->module, "liar"), "readnone"), "");
+
+    kal_ast_flat_free(flat);
+    free(nodes);
+    kal_context_free(context);
+    return 0;
+}
+
+
+//--------------------------------------
+// Context
+//--------------------------------------
+
+int test_kal_codegen_separate_contexts() {
+    kal_context *context1 = kal_context_create("kal1");
+    kal_context *context2 = kal_context_create("kal2");
+    kal_symbol args[1];
+    args[0] = kal_symbol_intern("foo");
+    kal_ast_node *node = kal_ast_prototype_create(NULL, kal_symbol_intern("my_func"), args, 1);
+
+    LLVMValueRef value1 = kal_codegen(context1, node);
+    LLVMValueRef value2 = kal_codegen(context2, node);
+    mu_assert(value1 != value2, "");
+    mu_assert(LLVMGetTypeContext(LLVMTypeOf(value1)) == context1->llvm, "");
+    mu_assert(LLVMGetTypeContext(LLVMTypeOf(value2)) == context2->llvm, "");
+    mu_assert(kal_codegen_named_value(context1, args[0])->value == LLVMGetParam(value1, 0), "");
+    mu_assert(kal_codegen_named_value(context2, args[0])->value == LLVMGetParam(value2, 0), "");
+
+    kal_context_free(context1);
+    kal_context_free(context2);
+    kal_ast_node_free(node);
+    return 0;
+}
 
 
 //==============================================================================
@@ -137,6 +706,20 @@ int all_tests() {
     mu_run_test(test_kal_codegen_binary_expr);
     mu_run_test(test_kal_codegen_prototype);
     mu_run_test(test_kal_codegen_function);
+    mu_run_test(test_kal_codegen_function_tail_call);
+    mu_run_test(test_kal_codegen_function_memo);
+    mu_run_test(test_kal_codegen_function_profile);
+    mu_run_test(test_kal_codegen_function_effects);
+    mu_run_test(test_kal_codegen_batch);
+    mu_run_test(test_kal_codegen_if_expr_select);
+    mu_run_test(test_kal_codegen_fast_math);
+    mu_run_test(test_kal_codegen_target);
+    mu_run_test(test_kal_codegen_flat);
+    mu_run_test(test_kal_codegen_flat_loop);
+    mu_run_test(test_kal_codegen_flat_tail_call);
+    mu_run_test(test_kal_codegen_flat_memo);
+    mu_run_test(test_kal_codegen_flat_effects);
+    mu_run_test(test_kal_codegen_separate_contexts);
     return 0;
 }
 
@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ast.h>
+#include <parser.h>
+#include <compile.h>
+#include <llvm-c/Core.h>
+#include <llvm-c/Analysis.h>
+#include "minunit.h"
+
+
+//==============================================================================
+//
+// Test Cases
+//
+//==============================================================================
+
+//--------------------------------------
+// Parallel Compilation
+//--------------------------------------
+
+int test_kal_compile_parallel() {
+    unsigned int i, count;
+    kal_ast_node **nodes;
+    char buffer[128];
+    char source[16384] = "extern sin(x);";
+
+    // Each function calls the one before it so calls cross workers.
+    strcat(source, "def f0(x) sin(x);");
+    for(i=1; i<100; i++) {
+        snprintf(buffer, sizeof(buffer), "def f%d(x) f%d(x) + %d; ", i, i-1, i);
+        strcat(source, buffer);
+    }
+    strcat(source, "f99(1)");
+
+    kal_context *context = kal_context_create("kal");
+    mu_assert(kal_parse_program(source, strlen(source), context->arena, &nodes, &count) == 0, "");
+    mu_assert(count == 102, "");
+
+    mu_assert(kal_compile_parallel(context, nodes, count, 4) == 0, "");
+    for(i=0; i<100; i++) {
+        snprintf(buffer, sizeof(buffer), "f%d", i);
+        LLVMValueRef func = LLVMGetNamedFunction(context->module, buffer);
+        mu_assert(func != NULL, "%s", buffer);
+        mu_assert(LLVMCountBasicBlocks(func) > 0, "%s", buffer);
+    }
+    mu_assert(LLVMCountBasicBlocks(LLVMGetNamedFunction(context->module, "sin")) == 0, "");
+    mu_assert(LLVMVerifyModule(context->module, LLVMReturnStatusAction, NULL) == 0, "");
+
+    free(nodes);
+    kal_context_free(context);
+    return 0;
+}
+
+int test_kal_compile_parallel_redefinition() {
+    unsigned int count;
+    kal_ast_node **nodes;
+    const char *source = "def foo(x) x+1; def bar(x) foo(x)*2;";
+
+    kal_context *context = kal_context_create("kal");
+    mu_assert(kal_parse_program(source, strlen(source), context->arena, &nodes, &count) == 0, "");
+    mu_assert(kal_compile_parallel(context, nodes, count, 2) == 0, "");
+    free(nodes);
+
+    // Redefining an existing function is an error but the rest still links.
+    source = "def foo(x) x+2; def baz(x) bar(x);";
+    mu_assert(kal_parse_program(source, strlen(source), context->arena, &nodes, &count) == 0, "");
+    mu_assert(kal_compile_parallel(context, nodes, count, 2) == -1, "");
+    mu_assert(LLVMCountBasicBlocks(LLVMGetNamedFunction(context->module, "baz")) > 0, "");
+    mu_assert(LLVMVerifyModule(context->module, LLVMReturnStatusAction, NULL) == 0, "");
+
+    free(nodes);
+    kal_context_free(context);
+    return 0;
+}
+
+int test_kal_compile_parallel_new_module() {
+    unsigned int i, count;
+    kal_ast_node **nodes;
+    char buffer[128];
+    char source[4096] = "def g(x) sin(x) + wave(x);";
+    const char *earlier = "extern sin(x); def wave(x) sin(x) * 2;";
+
+    kal_context *context = kal_context_create("kal");
+    mu_assert(kal_parse_program(earlier, strlen(earlier), context->arena, &nodes, &count) == 0, "");
+    mu_assert(kal_compile_parallel(context, nodes, count, 2) == 0, "");
+    free(nodes);
+
+    // Running an expression moves on to a new module, so the extern and the
+    // impure definition are only known to the context.
+    LLVMDisposeModule(context->module);
+    context->module = LLVMModuleCreateWithNameInContext("kal", context->llvm);
+
+    for(i=0; i<KAL_COMPILE_PARALLEL_MIN; i++) {
+        snprintf(buffer, sizeof(buffer), "def f%d(x) g(x) + %d; ", i, i);
+        strcat(source, buffer);
+    }
+    mu_assert(kal_parse_program(source, strlen(source), context->arena, &nodes, &count) == 0, "");
+    mu_assert(kal_compile_parallel(context, nodes, count, 4) == 0, "");
+    mu_assert(LLVMCountBasicBlocks(LLVMGetNamedFunction(context->module, "g")) > 0, "");
+    mu_assert(LLVMCountBasicBlocks(LLVMGetNamedFunction(context->module, "wave")) == 0, "");
+    mu_assert(LLVMVerifyModule(context->module, LLVMReturnStatusAction, NULL) == 0, "");
+
+    free(nodes);
+    kal_context_free(context);
+    return 0;
+}
+
+
+//--------------------------------------
+// Optimization
+//--------------------------------------
+
+// Counts the calls left in a function.
+unsigned int call_count(LLVMValueRef func) {
+    unsigned int count = 0;
+    LLVMBasicBlockRef block;
+    LLVMValueRef instruction;
+    for(block = LLVMGetFirstBasicBlock(func); block != NULL; block = LLVMGetNextBasicBlock(block)) {
+        for(instruction = LLVMGetFirstInstruction(block); instruction != NULL; instruction = LLVMGetNextInstruction(instruction)) {
+            if(LLVMGetInstructionOpcode(instruction) == LLVMCall) {
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+int test_kal_compile_optimize_module() {
+    unsigned int count, level;
+    kal_ast_node **nodes;
+    const char *source = "def sq(x) x * x; def norm(x, y) sq(x) + sq(y);";
+
+    for(level=0; level<=3; level++) {
+        kal_context *context = kal_context_create("kal");
+        context->opt_level = level;
+        mu_assert(kal_parse_program(source, strlen(source), context->arena, &nodes, &count) == 0, "");
+        mu_assert(kal_compile_parallel(context, nodes, count, 1) == 0, "");
+        kal_compile_optimize_module(context, context->module, NULL);
+
+        // Small helpers are inlined at every level but -O0.
+        LLVMValueRef norm = LLVMGetNamedFunction(context->module, "norm");
+        mu_assert(call_count(norm) == (level == 0 ? 2 : 0), "level %u", level);
+        mu_assert(LLVMVerifyModule(context->module, LLVMReturnStatusAction, NULL) == 0, "");
+
+        free(nodes);
+        kal_context_free(context);
+    }
+    return 0;
+}
+
+int test_kal_compile_promotes_locals() {
+    unsigned int count, level;
+    kal_ast_node **nodes;
+    LLVMBasicBlockRef block;
+    LLVMValueRef instruction;
+    const char *source = "def sum(n) var s in (for i = 1, n + 1 - i in s = s + i) + s;";
+
+    for(level=0; level<=1; level++) {
+        kal_context *context = kal_context_create("kal");
+        context->opt_level = level;
+        mu_assert(kal_parse_program(source, strlen(source), context->arena, &nodes, &count) == 0, "");
+        mu_assert(kal_compile_parallel(context, nodes, count, 1) == 0, "");
+
+        // Locals are stack slots until mem2reg turns them into registers.
+        unsigned int alloca_count = 0;
+        LLVMValueRef sum = LLVMGetNamedFunction(context->module, "sum");
+        for(block = LLVMGetFirstBasicBlock(sum); block != NULL; block = LLVMGetNextBasicBlock(block)) {
+            for(instruction = LLVMGetFirstInstruction(block); instruction != NULL; instruction = LLVMGetNextInstruction(instruction)) {
+                if(LLVMGetInstructionOpcode(instruction) == LLVMAlloca) {
+                    alloca_count++;
+                }
+            }
+        }
+        mu_assert(alloca_count == (level == 0 ? 2 : 0), "level %u", level);
+        mu_assert(LLVMVerifyModule(context->module, LLVMReturnStatusAction, NULL) == 0, "");
+
+        free(nodes);
+        kal_context_free(context);
+    }
+    return 0;
+}
+
+int test_kal_compile_merges_pure_calls() {
+    unsigned int count, level;
+    kal_ast_node **nodes;
+    const char *source =
+        "extern pure sqrt(x);"
+        "extern putchard(x);"
+        "def sq(x) x * x;"
+        "def hyp(x, y) sqrt(sq(x) + sq(y)) + sqrt(sq(x) + sq(y));"
+        "def noisy(x) putchard(x) + putchard(x);";
+
+    for(level=0; level<=2; level+=2) {
+        kal_context *context = kal_context_create("kal");
+        context->opt_level = level;
+        mu_assert(kal_parse_program(source, strlen(source), context->arena, &nodes, &count) == 0, "");
+        mu_assert(kal_compile_parallel(context, nodes, count, 1) == 0, "");
+
+        // Repeated calls to pure functions are merged but calls with side
+        // effects are all kept.
+        LLVMValueRef hyp = LLVMGetNamedFunction(context->module, "hyp");
+        LLVMValueRef noisy = LLVMGetNamedFunction(context->module, "noisy");
+        mu_assert(call_count(hyp) == (level == 0 ? 6 : 3), "level %u", level);
+        mu_assert(call_count(noisy) == 2, "level %u", level);
+
+        free(nodes);
+        kal_context_free(context);
+    }
+    return 0;
+}
+
+int test_kal_compile_parse_opt_level() {
+    unsigned int opt_level = 9, size_level = 9;
+    mu_assert(kal_compile_parse_opt_level("-O0", &opt_level, &size_level) == 0, "");
+    mu_assert(opt_level == 0 && size_level == 0, "");
+    mu_assert(kal_compile_parse_opt_level("-O3", &opt_level, &size_level) == 0, "");
+    mu_assert(opt_level == 3 && size_level == 0, "");
+    mu_assert(kal_compile_parse_opt_level("-Os", &opt_level, &size_level) == 0, "");
+    mu_assert(opt_level == 2 && size_level == 1, "");
+    mu_assert(kal_compile_parse_opt_level("-Oz", &opt_level, &size_level) == 0, "");
+    mu_assert(opt_level == 2 && size_level == 2, "");
+    mu_assert(kal_compile_parse_opt_level("-O4", &opt_level, &size_level) == -1, "");
+    mu_assert(kal_compile_parse_opt_level("-O", &opt_level, &size_level) == -1, "");
+    mu_assert(kal_compile_parse_opt_level("-O22", &opt_level, &size_level) == -1, "");
+    return 0;
+}
+
+int test_kal_compile_parse_fast_math() {
+    uint8_t fast_math = 0;
+    mu_assert(kal_compile_parse_fast_math("-ffast-math", &fast_math) == 0, "");
+    mu_assert(fast_math == KAL_FAST_MATH_ALL, "");
+    mu_assert(kal_compile_parse_fast_math("-ffast-math=contract", &fast_math) == 0, "");
+    mu_assert(fast_math == KAL_FAST_MATH_CONTRACT, "");
+    mu_assert(kal_compile_parse_fast_math("-ffast-math=nnan,ninf,reassoc", &fast_math) == 0, "");
+    mu_assert(fast_math == (KAL_FAST_MATH_NNAN | KAL_FAST_MATH_NINF | KAL_FAST_MATH_REASSOC), "");
+    mu_assert(kal_compile_parse_fast_math("-ffast-math=", &fast_math) == -1, "");
+    mu_assert(kal_compile_parse_fast_math("-ffast-math=nnan,", &fast_math) == -1, "");
+    mu_assert(kal_compile_parse_fast_math("-ffast-math=arcp", &fast_math) == -1, "");
+    mu_assert(kal_compile_parse_fast_math("-ffast-mathx", &fast_math) == -1, "");
+    return 0;
+}
+
+
+//==============================================================================
+//
+// Setup
+//
+//==============================================================================
+
+int all_tests() {
+    mu_run_test(test_kal_compile_parallel);
+    mu_run_test(test_kal_compile_parallel_redefinition);
+    mu_run_test(test_kal_compile_parallel_new_module);
+    mu_run_test(test_kal_compile_optimize_module);
+    mu_run_test(test_kal_compile_promotes_locals);
+    mu_run_test(test_kal_compile_merges_pure_calls);
+    mu_run_test(test_kal_compile_parse_opt_level);
+    mu_run_test(test_kal_compile_parse_fast_math);
+    return 0;
+}
+
+RUN_TESTS()
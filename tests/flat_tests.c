@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <string.h>
+#include <ast.h>
+#include <flat.h>
+#include "minunit.h"
+
+
+//==============================================================================
+//
+// Test Cases
+//
+//==============================================================================
+
+//--------------------------------------
+// Expressions
+//--------------------------------------
+
+int test_kal_ast_flat_append_expr() {
+    kal_ast_node *lhs = kal_ast_number_create(NULL, 20);
+    kal_ast_node *rhs = kal_ast_variable_create(NULL, kal_symbol_intern("foo"));
+    kal_ast_node *node = kal_ast_binary_expr_create(NULL, KAL_BINOP_MUL, lhs, rhs);
+
+    kal_ast_flat *flat = kal_ast_flat_create();
+    mu_assert(kal_ast_flat_append(flat, node) == 0, "");
+    mu_assert(flat->item_count == 1, "");
+    mu_assert(flat->node_count == 3, "");
+
+    // Children come before their parent.
+    mu_assert(flat->nodes[0].type == KAL_AST_TYPE_NUMBER, "");
+    mu_assert(flat->numbers[flat->nodes[0].a] == 20, "");
+    mu_assert(flat->nodes[1].type == KAL_AST_TYPE_VARIABLE, "");
+    mu_assert(flat->nodes[1].a == kal_symbol_intern("foo"), "");
+    mu_assert(flat->nodes[2].type == KAL_AST_TYPE_BINARY_EXPR, "");
+    mu_assert(flat->nodes[2].operator == KAL_BINOP_MUL, "");
+    mu_assert(flat->nodes[2].a == 0, "");
+    mu_assert(flat->nodes[2].b == 1, "");
+    mu_assert(kal_ast_flat_item_end(flat, 0) == 2, "");
+
+    kal_ast_flat_free(flat);
+    kal_ast_node_free(node);
+    return 0;
+}
+
+
+//--------------------------------------
+// Function
+//--------------------------------------
+
+int test_kal_ast_flat_append_function() {
+    kal_symbol args[1];
+    args[0] = kal_symbol_intern("foo");
+    kal_ast_node *args2[1];
+    args2[0] = kal_ast_variable_create(NULL, kal_symbol_intern("foo"));
+    kal_ast_node *prototype = kal_ast_prototype_create(NULL, kal_symbol_intern("baz"), args, 1);
+    kal_ast_node *body = kal_ast_if_expr_create(NULL,
+        kal_ast_variable_create(NULL, kal_symbol_intern("foo")),
+        kal_ast_call_create(NULL, kal_symbol_intern("baz"), args2, 1),
+        kal_ast_number_create(NULL, 1));
+    kal_ast_node *node = kal_ast_function_create(NULL, prototype, body);
+    node->function.memo = true;
+
+    kal_ast_node *number = kal_ast_number_create(NULL, 5);
+    kal_ast_flat *flat = kal_ast_flat_create();
+    kal_ast_flat_append(flat, number);
+    mu_assert(kal_ast_flat_append(flat, node) == 1, "");
+    mu_assert(flat->items[1] == 1, "");
+
+    // Function and if expression come before their children.
+    mu_assert(flat->nodes[1].type == KAL_AST_TYPE_FUNCTION, "");
+    mu_assert(flat->nodes[1].a == 2, "");
+    mu_assert(flat->nodes[1].b == 7, "");
+    mu_assert(flat->nodes[1].flags == 1, "");
+    mu_assert(flat->nodes[2].type == KAL_AST_TYPE_PROTOTYPE, "");
+    mu_assert(flat->nodes[2].c == 1, "");
+    mu_assert(flat->nodes[2].flags == 0, "");
+    mu_assert(flat->operands[flat->nodes[2].b] == kal_symbol_intern("foo"), "");
+    mu_assert(flat->nodes[3].type == KAL_AST_TYPE_IF_EXPR, "");
+    mu_assert(flat->nodes[3].a == 4, "");
+    mu_assert(flat->nodes[3].b == 6, "");
+    mu_assert(flat->nodes[3].c == 7, "");
+    mu_assert(flat->nodes[6].type == KAL_AST_TYPE_CALL, "");
+    mu_assert(flat->operands[flat->nodes[6].b] == 5, "");
+    mu_assert(kal_ast_flat_item_end(flat, 1) == 7, "");
+
+    // Pure externs are flagged.
+    kal_ast_node *pure = kal_ast_prototype_create(NULL, kal_symbol_intern("bar"), args, 1);
+    pure->prototype.pure = true;
+    mu_assert(kal_ast_flat_append(flat, pure) == 2, "");
+    mu_assert(flat->nodes[flat->items[2]].type == KAL_AST_TYPE_PROTOTYPE, "");
+    mu_assert(flat->nodes[flat->items[2]].flags == 1, "");
+
+    kal_ast_flat_free(flat);
+    kal_ast_node_free(pure);
+    kal_ast_node_free(number);
+    kal_ast_node_free(node);
+    return 0;
+}
+
+
+//==============================================================================
+//
+// Setup
+//
+//==============================================================================
+
+int all_tests() {
+    mu_run_test(test_kal_ast_flat_append_expr);
+    mu_run_test(test_kal_ast_flat_append_function);
+    return 0;
+}
+
+RUN_TESTS()
@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ast.h>
+#include <parser.h>
+#include <fold.h>
+#include "minunit.h"
+
+
+//==============================================================================
+//
+// Test Cases
+//
+//==============================================================================
+
+//--------------------------------------
+// Constants
+//--------------------------------------
+
+int test_kal_ast_fold_binary_expr() {
+    kal_ast_node *node = NULL;
+    kal_ast_fold_stats stats = {0, 0};
+    kal_parse("(1 + 2) * 3 - 8 / 4", &node);
+    kal_ast_fold(NULL, node, &stats);
+    mu_assert(node->type == KAL_AST_TYPE_NUMBER, "");
+    mu_assert(node->number.value == 7, "");
+    mu_assert(stats.nodes_before == 9, "");
+    mu_assert(stats.nodes_after == 1, "");
+    kal_ast_node_free(node);
+    return 0;
+}
+
+int test_kal_ast_fold_comparison() {
+    kal_ast_node *node = NULL;
+    kal_parse("(1 < 2) + (2 <= 2) * 2 + (3 > 4) * 4 + (1 >= 2) * 8 + (2 == 2) * 16 + (1 != 1) * 32", &node);
+    kal_ast_fold(NULL, node, NULL);
+    mu_assert(node->type == KAL_AST_TYPE_NUMBER, "");
+    mu_assert(node->number.value == 19, "");
+    kal_ast_node_free(node);
+
+    // NaN is only unequal.
+    kal_parse("(0 / 0 == 0 / 0) + (0 / 0 < 1) * 2 + (0 / 0 != 0 / 0) * 4", &node);
+    kal_ast_fold(NULL, node, NULL);
+    mu_assert(node->type == KAL_AST_TYPE_NUMBER, "");
+    mu_assert(node->number.value == 4, "");
+    kal_ast_node_free(node);
+    return 0;
+}
+
+int test_kal_ast_fold_if_expr() {
+    kal_ast_node *node = NULL;
+    kal_parse("if 2 - 2 then foo(1) else bar(3 * 4)", &node);
+    kal_ast_fold(NULL, node, NULL);
+    mu_assert(node->type == KAL_AST_TYPE_CALL, "");
+    mu_assert(node->call.name == kal_symbol_intern("bar"), "");
+    mu_assert(node->call.args[0]->type == KAL_AST_TYPE_NUMBER, "");
+    mu_assert(node->call.args[0]->number.value == 12, "");
+    kal_ast_node_free(node);
+
+    // NaN is false.
+    kal_parse("if 0 / 0 then 1 else 2", &node);
+    kal_ast_fold(NULL, node, NULL);
+    mu_assert(node->type == KAL_AST_TYPE_NUMBER, "");
+    mu_assert(node->number.value == 2, "");
+    kal_ast_node_free(node);
+    return 0;
+}
+
+
+//--------------------------------------
+// Identities
+//--------------------------------------
+
+int test_kal_ast_fold_identities() {
+    kal_ast_node *node = NULL;
+    kal_ast_fold_stats stats = {0, 0};
+    kal_parse("def f(x, y) (x * (3 - 2) + 0) / 1 - 0 + 1 * (0 + y * 0)", &node);
+    kal_ast_fold(NULL, node, &stats);
+
+    // y * 0 is kept since y could be infinite or NaN.
+    kal_ast_node *body = node->function.body;
+    mu_assert(body->type == KAL_AST_TYPE_BINARY_EXPR, "");
+    mu_assert(body->binary_expr.operator == KAL_BINOP_PLUS, "");
+    mu_assert(body->binary_expr.lhs->type == KAL_AST_TYPE_VARIABLE, "");
+    mu_assert(body->binary_expr.lhs->variable.name == kal_symbol_intern("x"), "");
+    mu_assert(body->binary_expr.rhs->type == KAL_AST_TYPE_BINARY_EXPR, "");
+    mu_assert(body->binary_expr.rhs->binary_expr.operator == KAL_BINOP_MUL, "");
+    mu_assert(stats.nodes_before == 21, "");
+    mu_assert(stats.nodes_after == 7, "");
+    kal_ast_node_free(node);
+    return 0;
+}
+
+int test_kal_ast_fold_arena() {
+    unsigned int count;
+    kal_ast_node **nodes;
+    kal_ast_arena *arena = kal_ast_arena_create();
+    const char *source = "def f(x) x - 1 * 0; f(if 1 then 2 * 3 else x)";
+    mu_assert(kal_parse_program(source, strlen(source), arena, &nodes, &count) == 0, "");
+    kal_ast_fold(arena, nodes[0], NULL);
+    kal_ast_fold(arena, nodes[1], NULL);
+    mu_assert(nodes[0]->function.body->type == KAL_AST_TYPE_VARIABLE, "");
+    mu_assert(nodes[1]->call.args[0]->type == KAL_AST_TYPE_NUMBER, "");
+    mu_assert(nodes[1]->call.args[0]->number.value == 6, "");
+    free(nodes);
+    kal_ast_arena_free(arena);
+    return 0;
+}
+
+
+//==============================================================================
+//
+// Setup
+//
+//==============================================================================
+
+int all_tests() {
+    mu_run_test(test_kal_ast_fold_binary_expr);
+    mu_run_test(test_kal_ast_fold_comparison);
+    mu_run_test(test_kal_ast_fold_if_expr);
+    mu_run_test(test_kal_ast_fold_identities);
+    mu_run_test(test_kal_ast_fold_arena);
+    return 0;
+}
+
+RUN_TESTS()
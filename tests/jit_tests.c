@@ -0,0 +1,554 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <ast.h>
+#include <parser.h>
+#include <jit.h>
+#include <aot.h>
+#include "minunit.h"
+
+
+//==============================================================================
+//
+// Helpers
+//
+//==============================================================================
+
+// Parses a program and adds its definitions to the JIT. The value of the
+// last top-level expression is stored in result.
+int jit_run(kal_jit *jit, const char *source, double *result) {
+    unsigned int i, count;
+    kal_ast_node **nodes;
+    int rc = kal_parse_program(source, strlen(source), jit->context->arena, &nodes, &count);
+    for(i=0; rc == 0 && i<count; i++) {
+        if(nodes[i]->type == KAL_AST_TYPE_FUNCTION || nodes[i]->type == KAL_AST_TYPE_PROTOTYPE) {
+            rc = kal_jit_add(jit, nodes[i]);
+        }
+        else {
+            rc = kal_jit_eval(jit, nodes[i], result);
+        }
+    }
+    free(nodes);
+    return rc;
+}
+
+// Deletes a cache directory and the files in it.
+void remove_dir(const char *path) {
+    char file[1024];
+    struct dirent *entry;
+    DIR *dir = opendir(path);
+    while(dir != NULL && (entry = readdir(dir)) != NULL) {
+        if(entry->d_name[0] != '.') {
+            snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+            unlink(file);
+        }
+    }
+    if(dir != NULL) closedir(dir);
+    rmdir(path);
+}
+
+
+//==============================================================================
+//
+// Test Cases
+//
+//==============================================================================
+
+//--------------------------------------
+// Lazy Compilation
+//--------------------------------------
+
+int test_kal_jit_eval() {
+    double result = 0;
+    kal_jit *jit = kal_jit_create(KAL_JIT_LAZY);
+    mu_assert(jit != NULL, "");
+    mu_assert(jit_run(jit, "def add(x, y) x + y; add(2, 3)", &result) == 0, "");
+    mu_assert(result == 5, "");
+
+    // Expressions can be run more than once.
+    mu_assert(jit_run(jit, "add(10, 3)", &result) == 0, "");
+    mu_assert(result == 13, "");
+    kal_jit_free(jit);
+    return 0;
+}
+
+int test_kal_jit_compiles_on_first_call() {
+    double result = 0;
+    kal_jit *jit = kal_jit_create(KAL_JIT_LAZY);
+    mu_assert(jit_run(jit, "def b(x) x + 1; def a(x) b(x) * 2; def unused(x) x * 3;", &result) == 0, "");
+    mu_assert(jit->compiled_count == 0, "");
+
+    // Only the expression, a and b are compiled.
+    mu_assert(jit_run(jit, "a(4)", &result) == 0, "");
+    mu_assert(result == 10, "");
+    mu_assert(jit->compiled_count == 3, "");
+
+    // Calling a again compiles just the new expression.
+    mu_assert(jit_run(jit, "a(1)", &result) == 0, "");
+    mu_assert(result == 4, "");
+    mu_assert(jit->compiled_count == 4, "");
+    kal_jit_free(jit);
+    return 0;
+}
+
+int test_kal_jit_recursion_and_externs() {
+    double result = 0;
+    kal_jit *jit = kal_jit_create(KAL_JIT_LAZY);
+    mu_assert(jit_run(jit, "extern cos(x); def fib(x) if x then (if x - 1 then fib(x-1) + fib(x-2) else 1) else 0; fib(10) + cos(0)", &result) == 0, "");
+    mu_assert(result == 56, "");
+    kal_jit_free(jit);
+    return 0;
+}
+
+int test_kal_jit_tail_call() {
+    double result = 0;
+
+    // A million self tail calls don't grow the stack even without the
+    // optimizer.
+    kal_jit *jit = kal_jit_create(KAL_JIT_LAZY);
+    jit->context->opt_level = 0;
+    mu_assert(jit_run(jit, "def count(n, acc) if n then count(n - 1, acc + 1) else acc; count(1000000, 0)", &result) == 0, "");
+    mu_assert(result == 1000000, "");
+    kal_jit_free(jit);
+    return 0;
+}
+
+int test_kal_jit_redefinition() {
+    double result = 0;
+    kal_jit *jit = kal_jit_create(KAL_JIT_LAZY);
+    mu_assert(jit_run(jit, "def foo(x) x;", &result) == 0, "");
+    mu_assert(jit_run(jit, "def foo(x) x + 1;", &result) == -1, "");
+    mu_assert(jit_run(jit, "def foo(x, y) x;", &result) == -1, "");
+    mu_assert(jit_run(jit, "foo(7)", &result) == 0, "");
+    mu_assert(result == 7, "");
+    kal_jit_free(jit);
+    return 0;
+}
+
+int test_kal_jit_comparisons() {
+    double result = 0;
+    kal_jit *jit = kal_jit_create(KAL_JIT_LAZY);
+    mu_assert(jit_run(jit, "def abs(x) if x < 0 then 0 - x else x;", &result) == 0, "");
+    mu_assert(jit_run(jit, "def clip(x, lo, hi) if x < lo then lo else if x > hi then hi else x;", &result) == 0, "");
+    mu_assert(jit_run(jit, "def cmp(x, y) (x < y) + (x <= y) * 2 + (x > y) * 4 + (x >= y) * 8 + (x == y) * 16 + (x != y) * 32;", &result) == 0, "");
+    mu_assert(jit_run(jit, "abs(0 - 3) + abs(4)", &result) == 0, "");
+    mu_assert(result == 7, "");
+    mu_assert(jit_run(jit, "clip(0 - 5, 0, 10) + clip(5, 0, 10) * 10 + clip(50, 0, 10) * 100", &result) == 0, "");
+    mu_assert(result == 1050, "");
+    mu_assert(jit_run(jit, "cmp(1, 2)", &result) == 0, "");
+    mu_assert(result == 1 + 2 + 32, "");
+    mu_assert(jit_run(jit, "cmp(2, 2)", &result) == 0, "");
+    mu_assert(result == 2 + 8 + 16, "");
+
+    // NaN is only unequal.
+    mu_assert(jit_run(jit, "cmp(0 / 0, 1)", &result) == 0, "");
+    mu_assert(result == 32, "");
+    kal_jit_free(jit);
+    return 0;
+}
+
+int test_kal_jit_loops() {
+    double result = 0;
+    unsigned int level;
+
+    for(level=0; level<=2; level+=2) {
+        kal_jit *jit = kal_jit_create(KAL_JIT_LAZY);
+        jit->context->opt_level = level;
+        mu_assert(jit_run(jit, "def sum(n) var s in (for i = 1, n + 1 - i in s = s + i) + s; sum(100)", &result) == 0, "");
+        mu_assert(result == 5050, "");
+        mu_assert(jit_run(jit, "def count(n) var c = 0 in (for i = 0, n - i, 2 in for j = 0, 3 - j in c = c + 1) + c; count(10)", &result) == 0, "");
+        mu_assert(result == 15, "");
+        mu_assert(jit_run(jit, "def bump(x) x + (x = x + 1) + x; bump(3)", &result) == 0, "");
+        mu_assert(result == 11, "");
+
+        // A local can shadow an argument and loops work with tail calls.
+        mu_assert(jit_run(jit, "def twice(x) var x = x * 2 in x + 1; twice(5)", &result) == 0, "");
+        mu_assert(result == 11, "");
+        mu_assert(jit_run(jit, "def down(n, acc) if n then (var t = acc in down(n - 1, t + sum(3))) else acc; down(4, 0)", &result) == 0, "");
+        mu_assert(result == 24, "");
+        mu_assert(jit_run(jit, "def bad(x) y = x;", &result) == -1, "");
+        kal_jit_free(jit);
+    }
+    return 0;
+}
+
+int test_kal_jit_fast_math() {
+    double result = 0;
+    unsigned int level;
+
+    for(level=0; level<=2; level+=2) {
+        kal_jit *jit = kal_jit_create(KAL_JIT_LAZY);
+        jit->context->opt_level = level;
+        mu_assert(jit_run(jit, "def err(x) x * 10 - 1; def fast poly(x) ((x * 2 + 3) * x - 1) * x + 5;", &result) == 0, "");
+        mu_assert(jit_run(jit, "poly(2) + poly(0 - 3)", &result) == 0, "");
+        mu_assert(result == 31 + -19, "");
+
+        // Strict functions round the multiply before subtracting. Fused ones
+        // may not, depending on whether the host has FMA.
+        mu_assert(jit_run(jit, "err(1 / 10)", &result) == 0, "");
+        mu_assert(result == 0, "");
+        jit->context->fast_math = KAL_FAST_MATH_CONTRACT;
+        mu_assert(jit_run(jit, "def fused(x) x * 10 - 1; fused(1 / 10)", &result) == 0, "");
+        mu_assert(result == 0 || result == fma(0.1, 10, -1), "");
+        kal_jit_free(jit);
+    }
+    return 0;
+}
+
+int test_kal_jit_memo() {
+    double result = 0;
+    uint64_t hits = 0, misses = 0;
+    kal_jit *jit = kal_jit_create(KAL_JIT_LAZY);
+    mu_assert(jit_run(jit, "def memo fib(n) if n then (if n - 1 then fib(n - 1) + fib(n - 2) else 1) else 0;", &result) == 0, "");
+    mu_assert(jit_run(jit, "def slow(n) if n then (if n - 1 then slow(n - 1) + slow(n - 2) else 1) else 0;", &result) == 0, "");
+
+    // Each value is only computed once so this finishes straight away.
+    mu_assert(jit_run(jit, "fib(90)", &result) == 0, "");
+    mu_assert(result == 2880067194370816120.0, "");
+    mu_assert(kal_jit_memo_stats(jit, "fib", &hits, &misses) == 0, "");
+    mu_assert(misses == 91, "");
+    mu_assert(hits == 88, "");
+
+    mu_assert(jit_run(jit, "fib(90)", &result) == 0, "");
+    mu_assert(kal_jit_memo_stats(jit, "fib", &hits, &misses) == 0, "");
+    mu_assert(misses == 91, "");
+    mu_assert(hits == 89, "");
+
+    // Functions without memo aren't memoized.
+    mu_assert(jit_run(jit, "slow(10)", &result) == 0, "");
+    mu_assert(result == 55, "");
+    mu_assert(kal_jit_memo_stats(jit, "slow", &hits, &misses) == -1, "");
+    kal_jit_free(jit);
+    return 0;
+}
+
+int test_kal_jit_profile() {
+    double result = 0;
+    uint64_t calls = 0, cycles = 0;
+    kal_jit *jit = kal_jit_create(KAL_JIT_LAZY);
+    mu_assert(jit_run(jit, "def plain(n) n + 1;", &result) == 0, "");
+    jit->context->profile = true;
+    mu_assert(jit_run(jit, "extern cos(x);"
+        "def fib(n) if n then (if n - 1 then fib(n - 1) + fib(n - 2) else 1) else 0;"
+        "def memo mfib(n) if n then (if n - 1 then mfib(n - 1) + mfib(n - 2) else 1) else 0;"
+        "def count(n, acc) if n then count(n - 1, acc + 1) else acc;"
+        "def idle(n) n;"
+        "def e(n) n + 1;", &result) == 0, "");
+
+    // Every call is counted but only the outermost ones are timed.
+    mu_assert(jit_run(jit, "fib(10)", &result) == 0, "");
+    mu_assert(result == 55, "");
+    mu_assert(kal_jit_profile_stats(jit, "fib", &calls, &cycles) == 0, "");
+    mu_assert(calls == 177, "");
+    mu_assert(cycles > 0, "");
+
+    // Memo hits are calls too.
+    mu_assert(jit_run(jit, "mfib(90)", &result) == 0, "");
+    mu_assert(kal_jit_profile_stats(jit, "mfib", &calls, &cycles) == 0, "");
+    mu_assert(calls == 91 + 88, "");
+
+    // Self tail calls are loops.
+    mu_assert(jit_run(jit, "count(100, 0)", &result) == 0, "");
+    mu_assert(result == 100, "");
+    mu_assert(kal_jit_profile_stats(jit, "count", &calls, &cycles) == 0, "");
+    mu_assert(calls == 1, "");
+
+    // Only the expression wrapper itself is left out, not names like it.
+    mu_assert(jit_run(jit, "e(1)", &result) == 0, "");
+
+    // Counting writes memory so repeated pure calls can't be merged.
+    mu_assert(jit_run(jit, "def sq(x) x * x; def twice(x) sq(x) + sq(x); twice(2)", &result) == 0, "");
+    mu_assert(result == 8, "");
+    mu_assert(kal_jit_profile_stats(jit, "sq", &calls, &cycles) == 0, "");
+    mu_assert(calls == 2, "");
+
+    mu_assert(kal_jit_profile_stats(jit, "plain", &calls, &cycles) == -1, "");
+    mu_assert(kal_jit_profile_stats(jit, "cos", &calls, &cycles) == -1, "");
+
+    // The dump lists called functions, hottest first, without compiling the
+    // ones that were never called.
+    char buffer[1024];
+    FILE *file = tmpfile();
+    unsigned int compiled_count = jit->compiled_count;
+    kal_jit_profile_dump(jit, file);
+    mu_assert(jit->compiled_count == compiled_count, "");
+    rewind(file);
+    size_t length = fread(buffer, 1, sizeof(buffer) - 1, file);
+    buffer[length] = '\0';
+    fclose(file);
+    mu_assert(strstr(buffer, "\nfib ") != NULL, "");
+    mu_assert(strstr(buffer, "\nmfib ") != NULL, "");
+    mu_assert(strstr(buffer, "\ncount ") != NULL, "");
+    mu_assert(strstr(buffer, "another thread") != NULL, "");
+    mu_assert(strstr(buffer, "\ne ") != NULL, "");
+    mu_assert(strstr(buffer, "idle") == NULL, "");
+    mu_assert(strstr(buffer, "plain") == NULL, "");
+    kal_jit_free(jit);
+    return 0;
+}
+
+
+//--------------------------------------
+// Batch Evaluation
+//--------------------------------------
+
+int test_kal_jit_eval_batch() {
+    size_t i;
+    double result = 0;
+    kal_jit *jit = kal_jit_create(KAL_JIT_LAZY);
+    mu_assert(jit->batch_lanes == 4 || jit->batch_lanes == 8, "");
+    mu_assert(jit_run(jit, "def sq(x) x * x;", &result) == 0, "");
+    mu_assert(jit_run(jit, "def f(x, y) if x then x * y + 1 else (sq(y) - 2);", &result) == 0, "");
+    mu_assert(jit_run(jit, "def sum(n) if n then n + sum(n - 1) else 0;", &result) == 0, "");
+    mu_assert(kal_jit_batch(jit, "nope") == NULL, "");
+
+    // An odd number of rows leaves some over for the scalar loop.
+    size_t n = 4 * KAL_JIT_BATCH_PARALLEL_MIN + 3;
+    double *x = malloc(sizeof(double) * n);
+    double *y = malloc(sizeof(double) * n);
+    double *out = malloc(sizeof(double) * n);
+    for(i=0; i<n; i++) {
+        x[i] = (double)(i % 3);
+        y[i] = (double)i * 0.5;
+    }
+    const double *columns[] = {x, y};
+
+    kal_jit_batch_fn f = kal_jit_batch(jit, "f");
+    mu_assert(f != NULL, "");
+    kal_jit_eval_batch(f, columns, n, out);
+    for(i=0; i<n; i++) {
+        double expected = (x[i] != 0 ? x[i] * y[i] + 1 : y[i] * y[i] - 2);
+        mu_assert(out[i] == expected, "");
+    }
+
+    // Only the rows asked for are written.
+    kal_jit_batch_fn sum = kal_jit_batch(jit, "sum");
+    mu_assert(sum != NULL, "");
+    out[7] = -1;
+    sum(columns, 1, 7, out);
+    for(i=1; i<7; i++) {
+        mu_assert(out[i] == x[i] * (x[i] + 1) / 2, "");
+    }
+    mu_assert(out[7] == -1, "");
+
+    // Loops and assignments to arguments run a lane at a time.
+    mu_assert(jit_run(jit, "def acc(x, y) (for i = 0, y - i in x = x + i) + x;", &result) == 0, "");
+    kal_jit_batch_fn acc = kal_jit_batch(jit, "acc");
+    mu_assert(acc != NULL, "");
+    for(i=0; i<20; i++) {
+        y[i] = (double)i;
+    }
+    acc(columns, 0, 20, out);
+    for(i=0; i<20; i++) {
+        mu_assert(out[i] == x[i] + y[i] * (y[i] - 1) / 2, "");
+    }
+
+    free(x);
+    free(y);
+    free(out);
+    kal_jit_free(jit);
+    return 0;
+}
+
+int test_kal_jit_set_target() {
+    size_t i;
+    double result = 0;
+    double x[11], y[11], out[11];
+    kal_jit *jit = kal_jit_create(KAL_JIT_LAZY);
+    mu_assert(jit->batch_lanes == kal_target_batch_lanes(jit->context->target), "");
+
+    // Code for a baseline CPU runs anywhere and batches use 256-bit vectors.
+    kal_jit_set_target(jit, kal_target_create("x86-64", NULL));
+    mu_assert(jit->batch_lanes == 4, "");
+    mu_assert(jit_run(jit, "def f(x, y) x * y + 1; f(3, 4)", &result) == 0, "");
+    mu_assert(result == 13, "");
+    for(i=0; i<11; i++) {
+        x[i] = (double)i;
+        y[i] = 2;
+    }
+    const double *columns[] = {x, y};
+    kal_jit_batch_fn f = kal_jit_batch(jit, "f");
+    mu_assert(f != NULL, "");
+    kal_jit_eval_batch(f, columns, 11, out);
+    for(i=0; i<11; i++) {
+        mu_assert(out[i] == x[i] * 2 + 1, "");
+    }
+    kal_jit_free(jit);
+    return 0;
+}
+
+
+//--------------------------------------
+// Tiered Compilation
+//--------------------------------------
+
+int test_kal_jit_tiered() {
+    double result = 0;
+    kal_jit *jit = kal_jit_create(KAL_JIT_TIERED);
+    jit->tier_threshold = 100;
+    mu_assert(jit_run(jit, "def sum(n) if n then n + sum(n - 1) else 0;", &result) == 0, "");
+
+    // Below the threshold nothing is recompiled.
+    mu_assert(jit_run(jit, "sum(50)", &result) == 0, "");
+    mu_assert(result == 1275, "");
+    kal_jit_wait(jit);
+    mu_assert(jit->promoted_count == 0, "");
+    mu_assert(jit->tiers[0]->calls == 51, "");
+
+    // Crossing it recompiles sum in the background and calls switch over.
+    mu_assert(jit_run(jit, "sum(200)", &result) == 0, "");
+    mu_assert(result == 20100, "");
+    kal_jit_wait(jit);
+    mu_assert(jit->promoted_count == 1, "");
+    mu_assert(jit->tiers[0]->code != NULL, "");
+
+    uint64_t calls = jit->tiers[0]->calls;
+    mu_assert(jit_run(jit, "sum(300)", &result) == 0, "");
+    mu_assert(result == 45150, "");
+    mu_assert(jit->tiers[0]->calls == calls, "");
+    kal_jit_free(jit);
+    return 0;
+}
+
+
+//--------------------------------------
+// Object Cache
+//--------------------------------------
+
+int test_kal_jit_cache() {
+    double result = 0;
+    char path[] = "/tmp/kal_jit_cache_XXXXXX";
+    mu_assert(mkdtemp(path) != NULL, "");
+    const char *source = "def b(x) x + 1; def a(x) b(x) * 2; def unused(x) x * 3; a(4)";
+
+    // A cold run saves the definitions that get compiled.
+    kal_jit *jit = kal_jit_create(KAL_JIT_LAZY);
+    mu_assert(kal_jit_set_cache(jit, path) == 0, "");
+    mu_assert(jit_run(jit, source, &result) == 0, "");
+    mu_assert(result == 10, "");
+    mu_assert(jit->cache_misses == 3 && jit->cache_hits == 0, "");
+    mu_assert(jit->compiled_count == 3, "");
+    kal_jit_free(jit);
+
+    // A warm run only compiles the expression.
+    jit = kal_jit_create(KAL_JIT_LAZY);
+    mu_assert(kal_jit_set_cache(jit, path) == 0, "");
+    mu_assert(jit_run(jit, source, &result) == 0, "");
+    mu_assert(result == 10, "");
+    mu_assert(jit->cache_misses == 1 && jit->cache_hits == 2, "");
+    mu_assert(jit->compiled_count == 1, "");
+
+    // Arity still applies to loaded definitions.
+    mu_assert(jit_run(jit, "def a(x, y) x;", &result) == -1, "");
+    kal_jit_free(jit);
+
+    // Renaming an argument hits but changing the body misses.
+    jit = kal_jit_create(KAL_JIT_LAZY);
+    mu_assert(kal_jit_set_cache(jit, path) == 0, "");
+    mu_assert(jit_run(jit, "def b(y) y + 1; def a(x) b(x) * 3; a(4)", &result) == 0, "");
+    mu_assert(result == 15, "");
+    mu_assert(jit->cache_misses == 1 && jit->cache_hits == 1, "");
+    kal_jit_free(jit);
+
+    // The tiered engine can't use the cache.
+    jit = kal_jit_create(KAL_JIT_TIERED);
+    mu_assert(kal_jit_set_cache(jit, path) == -1, "");
+    kal_jit_free(jit);
+
+    remove_dir(path);
+    return 0;
+}
+
+int test_kal_jit_import() {
+    double result = 0;
+    unsigned int count;
+    kal_ast_node **nodes;
+    char path[] = "/tmp/kal_jit_import_XXXXXX";
+    mu_assert(mkdtemp(path) != NULL, "");
+    char library_path[64];
+    snprintf(library_path, sizeof(library_path), "%s/lib.bc", path);
+
+    // Precompile a library.
+    const char *source = "extern cos(x); def sq(x) x * x; def norm(x, y) sq(x) + sq(y) + cos(0); def unused(x) x * 3;"
+        "def inc(x) x + 1; def dec(x) x - 1;";
+    kal_context *context = kal_context_create("kal");
+    mu_assert(kal_parse_program(source, strlen(source), context->arena, &nodes, &count) == 0, "");
+    mu_assert(kal_aot_compile(context, nodes, count) == 0, "");
+    mu_assert(kal_aot_emit_bitcode(context, library_path) == 0, "");
+    free(nodes);
+    kal_context_free(context);
+
+    // Only the definitions that get called are read and compiled.
+    kal_jit *jit = kal_jit_create(KAL_JIT_LAZY);
+    mu_assert(kal_jit_import(jit, library_path) == 0, "");
+    mu_assert(jit->library_loads == 0, "");
+    mu_assert(jit_run(jit, "norm(3, 4)", &result) == 0, "");
+    mu_assert(result == 26, "");
+    mu_assert(jit->library_loads == 2, "");
+    mu_assert(jit->compiled_count == 3, "");
+
+    // Library definitions can be called from new ones but keep their arity.
+    mu_assert(jit_run(jit, "def twice(x) norm(x, x) * 2; twice(1)", &result) == 0, "");
+    mu_assert(result == 6, "");
+    mu_assert(jit_run(jit, "def sq(x, y) x;", &result) == -1, "");
+
+    // Batch threads can load different definitions at the same time.
+    unsigned int i;
+    size_t rows = KAL_JIT_BATCH_PARALLEL_MIN * 4;
+    double *x = malloc(sizeof(double) * rows);
+    double *out = malloc(sizeof(double) * rows);
+    for(i=0; i<rows; i++) {
+        x[i] = i;
+    }
+    const double *columns[] = {x};
+    mu_assert(jit_run(jit, "def pick(x) if x < 2 * 65536 then inc(x) else dec(x);", &result) == 0, "");
+    kal_jit_batch_fn pick = kal_jit_batch(jit, "pick");
+    mu_assert(pick != NULL, "");
+    kal_jit_eval_batch(pick, columns, rows, out);
+    for(i=0; i<rows; i++) {
+        mu_assert(out[i] == (i < 2 * 65536 ? i + 1 : (double)i - 1), "");
+    }
+    mu_assert(jit->library_loads == 4, "");
+    free(x);
+    free(out);
+    kal_jit_free(jit);
+
+    jit = kal_jit_create(KAL_JIT_LAZY);
+    mu_assert(kal_jit_import(jit, "/tmp/kal_jit_import_missing.bc") == -1, "");
+    kal_jit_free(jit);
+
+    unlink(library_path);
+    rmdir(path);
+    return 0;
+}
+
+
+//==============================================================================
+//
+// Setup
+//
+//==============================================================================
+
+int all_tests() {
+    mu_run_test(test_kal_jit_eval);
+    mu_run_test(test_kal_jit_compiles_on_first_call);
+    mu_run_test(test_kal_jit_recursion_and_externs);
+    mu_run_test(test_kal_jit_tail_call);
+    mu_run_test(test_kal_jit_comparisons);
+    mu_run_test(test_kal_jit_loops);
+    mu_run_test(test_kal_jit_redefinition);
+    mu_run_test(test_kal_jit_fast_math);
+    mu_run_test(test_kal_jit_memo);
+    mu_run_test(test_kal_jit_profile);
+    mu_run_test(test_kal_jit_eval_batch);
+    mu_run_test(test_kal_jit_set_target);
+    mu_run_test(test_kal_jit_tiered);
+    mu_run_test(test_kal_jit_cache);
+    mu_run_test(test_kal_jit_import);
+    return 0;
+}
+
+RUN_TESTS()
@@ -1,5 +1,8 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <ast.h>
 #include <parser.h>
 #include "minunit.h"
@@ -28,7 +31,7 @@ int test_parse_variable() {
     kal_ast_node *node = NULL;
     kal_parse("my_var2", &node);
     mu_assert(node->type == KAL_AST_TYPE_VARIABLE, "");
-    mu_assert(strcmp(node->variable.name, "my_var2") == 0, "");
+    mu_assert(node->variable.name == kal_symbol_intern("my_var2"), "");
     kal_ast_node_free(node);
     return 0;
 }
@@ -138,6 +141,23 @@ int test_parse_complex_with_parens() {
 }
 
 
+int test_parse_comparison() {
+    kal_ast_node *node = NULL;
+    int rc = kal_parse("a + 1 < b * 2 == c", &node);
+    mu_assert(rc == 0, "");
+    mu_assert(node->type == KAL_AST_TYPE_BINARY_EXPR, "");
+    mu_assert(node->binary_expr.operator == KAL_BINOP_EQ, "");
+    mu_assert(node->binary_expr.rhs->type == KAL_AST_TYPE_VARIABLE, "");
+
+    kal_ast_node *lhs = node->binary_expr.lhs;
+    mu_assert(lhs->binary_expr.operator == KAL_BINOP_LT, "");
+    mu_assert(lhs->binary_expr.lhs->binary_expr.operator == KAL_BINOP_PLUS, "");
+    mu_assert(lhs->binary_expr.rhs->binary_expr.operator == KAL_BINOP_MUL, "");
+    kal_ast_node_free(node);
+    return 0;
+}
+
+
 //--------------------------------------
 // Function Call
 //--------------------------------------
@@ -147,7 +167,7 @@ int test_parse_function_call() {
     int rc = kal_parse("my_func(12, foo+30)", &node);
     mu_assert(rc == 0, "");
     mu_assert(node->type == KAL_AST_TYPE_CALL, "");
-    mu_assert(strcmp(node->call.name, "my_func") == 0, "");
+    mu_assert(node->call.name == kal_symbol_intern("my_func"), "");
     mu_assert(node->call.arg_count == 2, "%d", node->call.arg_count);
     
     // Arg 1
@@ -157,7 +177,7 @@ int test_parse_function_call() {
     // Arg 2
     mu_assert(node->call.args[1]->type == KAL_AST_TYPE_BINARY_EXPR, "");
     mu_assert(node->call.args[1]->binary_expr.operator == KAL_BINOP_PLUS, "");
-    mu_assert(strcmp(node->call.args[1]->binary_expr.lhs->variable.name, "foo") == 0, "");
+    mu_assert(node->call.args[1]->binary_expr.lhs->variable.name == kal_symbol_intern("foo"), "");
     mu_assert(node->call.args[1]->binary_expr.rhs->number.value == 30, "");
     
     kal_ast_node_free(node);
@@ -174,10 +194,24 @@ int test_parse_extern() {
     int rc = kal_parse("extern my_func(foo, bar)", &node);
     mu_assert(rc == 0, "");
     mu_assert(node->type == KAL_AST_TYPE_PROTOTYPE, "");
-    mu_assert(strcmp(node->prototype.name, "my_func") == 0, "");
+    mu_assert(node->prototype.name == kal_symbol_intern("my_func"), "");
     mu_assert(node->prototype.arg_count == 2, "%d", node->prototype.arg_count);
-    mu_assert(strcmp(node->prototype.args[0], "foo") == 0, "");
-    mu_assert(strcmp(node->prototype.args[1], "bar") == 0, "");
+    mu_assert(node->prototype.args[0] == kal_symbol_intern("foo"), "");
+    mu_assert(node->prototype.args[1] == kal_symbol_intern("bar"), "");
+    kal_ast_node_free(node);
+    return 0;
+}
+
+int test_parse_pure_extern() {
+    kal_ast_node *node = NULL;
+    mu_assert(kal_parse("extern pure sqrt(x)", &node) == 0, "");
+    mu_assert(node->type == KAL_AST_TYPE_PROTOTYPE, "");
+    mu_assert(node->prototype.pure, "");
+    mu_assert(node->prototype.name == kal_symbol_intern("sqrt"), "");
+    kal_ast_node_free(node);
+
+    mu_assert(kal_parse("extern putchard(x)", &node) == 0, "");
+    mu_assert(!node->prototype.pure, "");
     kal_ast_node_free(node);
     return 0;
 }
@@ -194,21 +228,49 @@ int test_parse_function() {
     mu_assert(node->type == KAL_AST_TYPE_FUNCTION, "");
 
     // Prototype
-    mu_assert(strcmp(node->function.prototype->prototype.name, "my_func") == 0, "");
+    mu_assert(node->function.prototype->prototype.name == kal_symbol_intern("my_func"), "");
     mu_assert(node->function.prototype->prototype.arg_count == 2, "");
-    mu_assert(strcmp(node->function.prototype->prototype.args[0], "foo") == 0, "");
-    mu_assert(strcmp(node->function.prototype->prototype.args[1], "bar") == 0, "");
+    mu_assert(node->function.prototype->prototype.args[0] == kal_symbol_intern("foo"), "");
+    mu_assert(node->function.prototype->prototype.args[1] == kal_symbol_intern("bar"), "");
 
     // Body
     mu_assert(node->function.body->type == KAL_AST_TYPE_BINARY_EXPR, "");
     mu_assert(node->function.body->binary_expr.operator == KAL_BINOP_PLUS, "");
-    mu_assert(strcmp(node->function.body->binary_expr.lhs->variable.name, "foo") == 0, "");
-    mu_assert(strcmp(node->function.body->binary_expr.rhs->variable.name, "bar") == 0, "");
+    mu_assert(node->function.body->binary_expr.lhs->variable.name == kal_symbol_intern("foo"), "");
+    mu_assert(node->function.body->binary_expr.rhs->variable.name == kal_symbol_intern("bar"), "");
+    mu_assert(!node->function.memo, "");
     
     kal_ast_node_free(node);
     return 0;
 }
 
+int test_parse_memo_function() {
+    kal_ast_node *node = NULL;
+    int rc = kal_parse("def memo memoize(memos) memos", &node);
+    mu_assert(rc == 0, "");
+    mu_assert(node->type == KAL_AST_TYPE_FUNCTION, "");
+    mu_assert(node->function.memo, "");
+    mu_assert(node->function.prototype->prototype.name == kal_symbol_intern("memoize"), "");
+    mu_assert(node->function.body->variable.name == kal_symbol_intern("memos"), "");
+    kal_ast_node_free(node);
+    return 0;
+}
+
+int test_parse_fast_function() {
+    kal_ast_node *node = NULL;
+    int rc = kal_parse("def fast memo f(x) x", &node);
+    mu_assert(rc == 0, "");
+    mu_assert(node->function.fast && node->function.memo, "");
+    mu_assert(node->function.prototype->prototype.name == kal_symbol_intern("f"), "");
+    kal_ast_node_free(node);
+
+    rc = kal_parse("def memo f(x) x", &node);
+    mu_assert(rc == 0, "");
+    mu_assert(!node->function.fast, "");
+    kal_ast_node_free(node);
+    return 0;
+}
+
 
 //--------------------------------------
 // If Expression
@@ -228,6 +290,203 @@ int test_parse_if_expr() {
 
 
 
+//--------------------------------------
+// Loops & Variables
+//--------------------------------------
+
+int test_parse_for_expr() {
+    kal_ast_node *node = NULL;
+    int rc = kal_parse("for i = 1, 10 - i, 2 in foo(i) + 1", &node);
+    mu_assert(rc == 0, "");
+    mu_assert(node->type == KAL_AST_TYPE_FOR_EXPR, "");
+    mu_assert(node->for_expr.name == kal_symbol_intern("i"), "");
+    mu_assert(node->for_expr.start->number.value == 1, "");
+    mu_assert(node->for_expr.condition->type == KAL_AST_TYPE_BINARY_EXPR, "");
+    mu_assert(node->for_expr.step->number.value == 2, "");
+    mu_assert(node->for_expr.body->type == KAL_AST_TYPE_BINARY_EXPR, "");
+    kal_ast_node_free(node);
+
+    rc = kal_parse("for i = 0, i in 1", &node);
+    mu_assert(rc == 0, "");
+    mu_assert(node->for_expr.step == NULL, "");
+    kal_ast_node_free(node);
+    return 0;
+}
+
+int test_parse_var_expr() {
+    kal_ast_node *node = NULL;
+    int rc = kal_parse("var a = 1, b in b = a + 2", &node);
+    mu_assert(rc == 0, "");
+    mu_assert(node->type == KAL_AST_TYPE_VAR_EXPR, "");
+    mu_assert(node->var_expr.var_count == 2, "");
+    mu_assert(node->var_expr.names[0] == kal_symbol_intern("a"), "");
+    mu_assert(node->var_expr.inits[0]->number.value == 1, "");
+    mu_assert(node->var_expr.names[1] == kal_symbol_intern("b"), "");
+    mu_assert(node->var_expr.inits[1] == NULL, "");
+
+    // Assignment takes everything to its right.
+    kal_ast_node *body = node->var_expr.body;
+    mu_assert(body->type == KAL_AST_TYPE_ASSIGN, "");
+    mu_assert(body->assign.name == kal_symbol_intern("b"), "");
+    mu_assert(body->assign.value->type == KAL_AST_TYPE_BINARY_EXPR, "");
+    kal_ast_node_free(node);
+    return 0;
+}
+
+
+//--------------------------------------
+// Arena
+//--------------------------------------
+
+int test_parse_arena() {
+    kal_ast_node *node = NULL;
+    kal_ast_arena *arena = kal_ast_arena_create();
+    int rc = kal_parse_arena("def my_func(foo) foo * 2", arena, &node);
+    mu_assert(rc == 0, "");
+    mu_assert(node->type == KAL_AST_TYPE_FUNCTION, "");
+    mu_assert(node->function.prototype->prototype.args[0] == kal_symbol_intern("foo"), "");
+    mu_assert(node->function.body->binary_expr.rhs->number.value == 2, "");
+    mu_assert(arena->allocations > arena->blocks, "");
+    kal_ast_arena_free(arena);
+    return 0;
+}
+
+
+//--------------------------------------
+// Program
+//--------------------------------------
+
+int test_parse_program() {
+    unsigned int count = 0;
+    kal_ast_node **nodes = NULL;
+    char *text = "extern sin(x) def foo(x) sin(x) * 2 def bar() 3 foo(1); foo (2)";
+    int rc = kal_parse_program(text, strlen(text), NULL, &nodes, &count);
+    mu_assert(rc == 0, "");
+    mu_assert(count == 5, "%d", count);
+    mu_assert(nodes[0]->type == KAL_AST_TYPE_PROTOTYPE, "");
+    mu_assert(nodes[1]->type == KAL_AST_TYPE_FUNCTION, "");
+    mu_assert(nodes[1]->function.prototype->prototype.name == kal_symbol_intern("foo"), "");
+    mu_assert(nodes[2]->type == KAL_AST_TYPE_FUNCTION, "");
+    mu_assert(nodes[2]->function.body->number.value == 3, "");
+    mu_assert(nodes[3]->type == KAL_AST_TYPE_CALL, "");
+    mu_assert(nodes[4]->type == KAL_AST_TYPE_CALL, "");
+    mu_assert(nodes[4]->call.args[0]->number.value == 2, "");
+
+    unsigned int i;
+    for(i=0; i<count; i++) {
+        kal_ast_node_free(nodes[i]);
+    }
+    free(nodes);
+    return 0;
+}
+
+int test_parse_program_error() {
+    unsigned int count = 0;
+    kal_ast_node **nodes = NULL;
+    char *text = "def foo(x) x + 1; def bar(";
+    int rc = kal_parse_program(text, strlen(text), NULL, &nodes, &count);
+    mu_assert(rc == -1, "");
+    return 0;
+}
+
+int test_parse_multiple_items() {
+    kal_ast_node *node = NULL;
+    mu_assert(kal_parse("1; 2", &node) == -1, "");
+    mu_assert(kal_parse("", &node) == 0, "");
+    mu_assert(node == NULL, "");
+    return 0;
+}
+
+int test_parse_file() {
+    char path[] = "/tmp/kal_parse_file_XXXXXX";
+    int fd = mkstemp(path);
+    FILE *file = fdopen(fd, "w");
+    fprintf(file, "def foo(x)\n  x + 1\n\nfoo(2);\n");
+    fclose(file);
+
+    unsigned int count = 0;
+    kal_ast_node **nodes = NULL;
+    kal_ast_arena *arena = kal_ast_arena_create();
+    int rc = kal_parse_file(path, arena, &nodes, &count);
+    unlink(path);
+    mu_assert(rc == 0, "");
+    mu_assert(count == 2, "%d", count);
+    mu_assert(nodes[0]->type == KAL_AST_TYPE_FUNCTION, "");
+    mu_assert(nodes[1]->type == KAL_AST_TYPE_CALL, "");
+    free(nodes);
+
+    // The scanner reads past the end of the text, which is still mapped when
+    // the file fills its last page exactly.
+    long page_size = sysconf(_SC_PAGESIZE);
+    strcpy(path, "/tmp/kal_parse_file_XXXXXX");
+    fd = mkstemp(path);
+    file = fdopen(fd, "w");
+    fprintf(file, "%*s", (int)page_size - 6, "");
+    fprintf(file, "foo(3)");
+    fclose(file);
+    rc = kal_parse_file(path, arena, &nodes, &count);
+    unlink(path);
+    mu_assert(rc == 0, "");
+    mu_assert(count == 1, "%d", count);
+    mu_assert(nodes[0]->call.args[0]->number.value == 3, "");
+    free(nodes);
+    kal_ast_arena_free(arena);
+    return 0;
+}
+
+
+//--------------------------------------
+// Session
+//--------------------------------------
+
+void collect_item(kal_ast_node *node, void *data) {
+    kal_parse_state *items = data;
+    items->items[items->item_count++] = node;
+}
+
+int test_parse_session() {
+    kal_ast_node *nodes[8];
+    kal_parse_state items;
+    items.items = nodes;
+    items.item_count = 0;
+
+    kal_ast_arena *arena = kal_ast_arena_create();
+    kal_parse_session *session = kal_parse_session_create(arena, collect_item, &items);
+    mu_assert(kal_parse_session_feed(session, "def fo", 6) == 0, "");
+    mu_assert(kal_parse_session_feed(session, "o(x)\n  x ", 9) == 0, "");
+    mu_assert(items.item_count == 0, "");
+    mu_assert(kal_parse_session_feed(session, "+ 1; foo(", 9) == 0, "");
+    mu_assert(items.item_count == 1, "");
+    mu_assert(nodes[0]->type == KAL_AST_TYPE_FUNCTION, "");
+    mu_assert(nodes[0]->function.prototype->prototype.name == kal_symbol_intern("foo"), "");
+    mu_assert(kal_parse_session_feed(session, "2)", 2) == 0, "");
+    mu_assert(items.item_count == 1, "");
+    mu_assert(kal_parse_session_finish(session) == 0, "");
+    mu_assert(items.item_count == 2, "");
+    mu_assert(nodes[1]->type == KAL_AST_TYPE_CALL, "");
+    mu_assert(nodes[1]->call.args[0]->number.value == 2, "");
+
+    // The session can be reused after an error. The rest of the broken item
+    // is skipped even when it arrives in a later chunk.
+    mu_assert(kal_parse_session_feed(session, "def ) ", 6) == -1, "");
+    mu_assert(kal_parse_session_feed(session, "x + 1", 5) == 0, "");
+    mu_assert(kal_parse_session_feed(session, "; 3 ;", 5) == 0, "");
+    mu_assert(items.item_count == 3, "");
+    mu_assert(nodes[2]->number.value == 3, "");
+
+    // A broken item doesn't take the rest of the chunk with it.
+    const char *chunk = "def a(x) x; def ) ; def b(x) x;";
+    mu_assert(kal_parse_session_feed(session, chunk, strlen(chunk)) == -1, "");
+    mu_assert(items.item_count == 5, "");
+    mu_assert(nodes[3]->function.prototype->prototype.name == kal_symbol_intern("a"), "");
+    mu_assert(nodes[4]->function.prototype->prototype.name == kal_symbol_intern("b"), "");
+
+    kal_parse_session_free(session);
+    kal_ast_arena_free(arena);
+    return 0;
+}
+
+
 //==============================================================================
 //
 // Setup
@@ -244,10 +503,22 @@ int all_tests() {
     mu_run_test(test_parse_parens);
     mu_run_test(test_parse_complex);
     mu_run_test(test_parse_complex_with_parens);
+    mu_run_test(test_parse_comparison);
     mu_run_test(test_parse_function_call);
     mu_run_test(test_parse_extern);
+    mu_run_test(test_parse_pure_extern);
     mu_run_test(test_parse_function);
+    mu_run_test(test_parse_memo_function);
+    mu_run_test(test_parse_fast_function);
     mu_run_test(test_parse_if_expr);
+    mu_run_test(test_parse_for_expr);
+    mu_run_test(test_parse_var_expr);
+    mu_run_test(test_parse_arena);
+    mu_run_test(test_parse_program);
+    mu_run_test(test_parse_program_error);
+    mu_run_test(test_parse_multiple_items);
+    mu_run_test(test_parse_file);
+    mu_run_test(test_parse_session);
     return 0;
 }
 
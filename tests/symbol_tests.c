@@ -0,0 +1,50 @@
+#include <stdio.h>
+#include <string.h>
+#include <symbol.h>
+#include "minunit.h"
+
+
+//==============================================================================
+//
+// Test Cases
+//
+//==============================================================================
+
+//--------------------------------------
+// Intern
+//--------------------------------------
+
+int test_kal_symbol_intern() {
+    kal_symbol foo = kal_symbol_intern("foo");
+    kal_symbol bar = kal_symbol_intern("bar");
+    mu_assert(foo != bar, "");
+    mu_assert(kal_symbol_intern("foo") == foo, "");
+    mu_assert(kal_symbol_intern("bar") == bar, "");
+    mu_assert(strcmp(kal_symbol_name(foo), "foo") == 0, "");
+    mu_assert(strcmp(kal_symbol_name(bar), "bar") == 0, "");
+    return 0;
+}
+
+int test_kal_symbol_intern_n() {
+    kal_symbol sym = kal_symbol_intern_n("my_func(x)", 7);
+    mu_assert(sym == kal_symbol_intern("my_func"), "");
+    mu_assert(strcmp(kal_symbol_name(sym), "my_func") == 0, "");
+    mu_assert(kal_symbol_name(kal_symbol_count()) == NULL, "");
+    mu_assert(kal_symbol_name(KAL_SYMBOL_NONE) == NULL, "");
+    return 0;
+}
+
+
+//==============================================================================
+//
+// Setup
+//
+//==============================================================================
+
+int all_tests() {
+    mu_run_test(test_kal_symbol_intern);
+    mu_run_test(test_kal_symbol_intern_n);
+    return 0;
+}
+
+RUN_TESTS()
@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <target.h>
+#include "minunit.h"
+
+
+//==============================================================================
+//
+// Test Cases
+//
+//==============================================================================
+
+//--------------------------------------
+// Lifecycle
+//--------------------------------------
+
+int test_kal_target_create_host() {
+    kal_target *target = kal_target_create(NULL, NULL);
+    mu_assert(target->cpu[0] != '\0', "");
+    mu_assert(strcmp(target->cpu, KAL_TARGET_HOST) != 0, "");
+    mu_assert(target->features[0] == '+' || target->features[0] == '-', "");
+
+    // Changes go after the detected features so they win.
+    kal_target *generic = kal_target_create(KAL_TARGET_HOST, "-avx512f");
+    mu_assert(strcmp(generic->cpu, target->cpu) == 0, "");
+    mu_assert(strncmp(generic->features, target->features, strlen(target->features)) == 0, "");
+    mu_assert(!kal_target_has_feature(generic, "avx512f"), "");
+    mu_assert(kal_target_batch_lanes(generic) == 4, "");
+
+    kal_target *copy = kal_target_copy(generic);
+    mu_assert(strcmp(copy->cpu, generic->cpu) == 0, "");
+    mu_assert(strcmp(copy->features, generic->features) == 0, "");
+    mu_assert(kal_target_copy(NULL) == NULL, "");
+
+    kal_target_free(copy);
+    kal_target_free(generic);
+    kal_target_free(target);
+    return 0;
+}
+
+int test_kal_target_create_named() {
+    kal_target *target = kal_target_create("x86-64", NULL);
+    mu_assert(strcmp(target->cpu, "x86-64") == 0, "");
+    mu_assert(strcmp(target->features, "") == 0, "");
+    mu_assert(kal_target_batch_lanes(target) == 4, "");
+    kal_target_free(target);
+    return 0;
+}
+
+
+//--------------------------------------
+// Features
+//--------------------------------------
+
+int test_kal_target_has_feature() {
+    kal_target *target = kal_target_create("x86-64", "+avx2,+avx512fp16,-fma,+fma,+avx512f,-avx2");
+    mu_assert(kal_target_has_feature(target, "fma"), "");
+    mu_assert(kal_target_has_feature(target, "avx512f"), "");
+    mu_assert(!kal_target_has_feature(target, "avx2"), "");
+    mu_assert(!kal_target_has_feature(target, "avx512"), "");
+    mu_assert(!kal_target_has_feature(target, "sse4.2"), "");
+    mu_assert(kal_target_batch_lanes(target) == 8, "");
+    kal_target_free(target);
+    return 0;
+}
+
+
+//==============================================================================
+//
+// Setup
+//
+//==============================================================================
+
+int all_tests() {
+    mu_run_test(test_kal_target_create_host);
+    mu_run_test(test_kal_target_create_named);
+    mu_run_test(test_kal_target_has_feature);
+    return 0;
+}
+
+RUN_TESTS()
@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ast.h>
+#include <parser.h>
+#include <vm.h>
+#include "minunit.h"
+
+
+//==============================================================================
+//
+// Helpers
+//
+//==============================================================================
+
+// Parses a program and adds its definitions to the VM. The value of the
+// last top-level expression is stored in result.
+int vm_run(kal_vm *vm, kal_ast_arena *arena, const char *source, double *result) {
+    unsigned int i, count;
+    kal_ast_node **nodes;
+    int rc = kal_parse_program(source, strlen(source), arena, &nodes, &count);
+    for(i=0; rc == 0 && i<count; i++) {
+        if(nodes[i]->type == KAL_AST_TYPE_FUNCTION || nodes[i]->type == KAL_AST_TYPE_PROTOTYPE) {
+            rc = kal_vm_add(vm, nodes[i]);
+        }
+        else {
+            rc = kal_vm_eval(vm, nodes[i], result);
+        }
+    }
+    free(nodes);
+    return rc;
+}
+
+
+//==============================================================================
+//
+// Test Cases
+//
+//==============================================================================
+
+//--------------------------------------
+// Expressions
+//--------------------------------------
+
+int test_kal_vm_eval() {
+    double result = 0;
+    kal_ast_arena *arena = kal_ast_arena_create();
+    kal_vm *vm = kal_vm_create();
+    mu_assert(vm_run(vm, arena, "1 + 2 * 3 - 8 / 4", &result) == 0, "");
+    mu_assert(result == 5, "");
+    mu_assert(vm_run(vm, arena, "if 0 then 1 else if 2 then 3 else 4", &result) == 0, "");
+    mu_assert(result == 3, "");
+    mu_assert(vm_run(vm, arena, "(1 < 2) + (2 <= 2) * 2 + (3 > 4) * 4 + (1 >= 2) * 8 + (2 == 2) * 16 + (1 != 1) * 32", &result) == 0, "");
+    mu_assert(result == 19, "");
+    mu_assert(vm_run(vm, arena, "(0 / 0 == 0 / 0) + (0 / 0 > 1) * 2 + (0 / 0 != 0 / 0) * 4", &result) == 0, "");
+    mu_assert(result == 4, "");
+    kal_vm_free(vm);
+    kal_ast_arena_free(arena);
+    return 0;
+}
+
+
+//--------------------------------------
+// Loops & Variables
+//--------------------------------------
+
+int test_kal_vm_loops() {
+    double result = 0;
+    kal_ast_arena *arena = kal_ast_arena_create();
+    kal_vm *vm = kal_vm_create();
+    mu_assert(vm_run(vm, arena, "def sum(n) var s in (for i = 1, n + 1 - i in s = s + i) + s; sum(100)", &result) == 0, "");
+    mu_assert(result == 5050, "");
+    mu_assert(vm_run(vm, arena, "def count(n) var c = 0 in (for i = 0, n - i, 2 in for j = 0, 3 - j in c = c + 1) + c; count(10)", &result) == 0, "");
+    mu_assert(result == 15, "");
+
+    // The left operand is read before the right one assigns to it.
+    mu_assert(vm_run(vm, arena, "def bump(x) x + (x = x + 1) + x; bump(3)", &result) == 0, "");
+    mu_assert(result == 11, "");
+    mu_assert(vm_run(vm, arena, "var a = 1, b = a + 1 in a * 10 + b", &result) == 0, "");
+    mu_assert(result == 12, "");
+    mu_assert(vm_run(vm, arena, "var a in c = 1", &result) == -1, "");
+    kal_vm_free(vm);
+    kal_ast_arena_free(arena);
+    return 0;
+}
+
+
+//--------------------------------------
+// Functions
+//--------------------------------------
+
+int test_kal_vm_call() {
+    double result = 0;
+    kal_ast_arena *arena = kal_ast_arena_create();
+    kal_vm *vm = kal_vm_create();
+    mu_assert(vm_run(vm, arena, "def add(x, y) x + y; def mix(a, b, c) add(a * 2, add(b, c)) - a; mix(3, 4, 5)", &result) == 0, "");
+    mu_assert(result == 12, "");
+    kal_vm_function *function = kal_vm_get_function(vm, kal_symbol_intern("mix"));
+    mu_assert(function != NULL, "");
+    mu_assert(function->arg_count == 3, "");
+    kal_vm_free(vm);
+    kal_ast_arena_free(arena);
+    return 0;
+}
+
+int test_kal_vm_recursion_and_externs() {
+    double result = 0;
+    kal_ast_arena *arena = kal_ast_arena_create();
+    kal_vm *vm = kal_vm_create();
+    mu_assert(vm_run(vm, arena, "extern cos(x); def fib(x) if x then (if x - 1 then fib(x-1) + fib(x-2) else 1) else 0; fib(10) + cos(0)", &result) == 0, "");
+    mu_assert(result == 56, "");
+    kal_vm_free(vm);
+    kal_ast_arena_free(arena);
+    return 0;
+}
+
+int test_kal_vm_errors() {
+    double result = 0;
+    kal_ast_arena *arena = kal_ast_arena_create();
+    kal_vm *vm = kal_vm_create();
+    mu_assert(vm_run(vm, arena, "def foo(x) x;", &result) == 0, "");
+    mu_assert(vm_run(vm, arena, "def foo(x) x + 1;", &result) == -1, "");
+    mu_assert(vm_run(vm, arena, "def foo(x, y) x;", &result) == -1, "");
+    mu_assert(vm_run(vm, arena, "foo(1, 2)", &result) == -1, "");
+    mu_assert(vm_run(vm, arena, "bar(1)", &result) == -1, "");
+    mu_assert(vm_run(vm, arena, "def baz(x) y;", &result) == -1, "");
+    mu_assert(vm_run(vm, arena, "extern no_such_extern(x); no_such_extern(1)", &result) == -1, "");
+
+    // Unbounded recursion runs out of stack rather than crashing.
+    mu_assert(vm_run(vm, arena, "def loop(x) loop(x + 1); loop(0)", &result) == -1, "");
+    mu_assert(vm_run(vm, arena, "foo(7)", &result) == 0, "");
+    mu_assert(result == 7, "");
+    kal_vm_free(vm);
+    kal_ast_arena_free(arena);
+    return 0;
+}
+
+
+//==============================================================================
+//
+// Setup
+//
+//==============================================================================
+
+int all_tests() {
+    mu_run_test(test_kal_vm_eval);
+    mu_run_test(test_kal_vm_loops);
+    mu_run_test(test_kal_vm_call);
+    mu_run_test(test_kal_vm_recursion_and_externs);
+    mu_run_test(test_kal_vm_errors);
+    return 0;
+}
+
+RUN_TESTS()